@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <time.h>
 
 typedef uint64_t u64;
 typedef uint32_t u32;
@@ -31,3 +32,28 @@ typedef double f64;
     if (_tmp != VK_SUCCESS) printf("%d\n", _tmp);\
     ASSERT((_tmp) == VK_SUCCESS) \
 }
+
+static u32 *
+get_binary(const char *filename, u32 *size)
+{
+    FILE *file = fopen(filename, "rb");
+    
+    if (!file) {
+        printf("[ERROR] File could not be opened\n");
+        return(NULL);
+    }
+    
+    fseek(file, 0L, SEEK_END);
+    *size = ftell(file);
+    rewind(file);
+    
+    // NOTE: size % sizeof(u32) is always zero
+    u32 *buffer = (u32 *) malloc(*size);
+    fread((u8 *) buffer, *size, 1, file);
+    
+    *size /= sizeof(u32);
+    
+    fclose(file);
+    
+    return(buffer);
+}
@@ -1,10 +1,44 @@
 #include "common.h"
 #include "linmath.h"
 
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "pacer.h"
+#include "trace.h"
+
+#include "opt/spirv.h"
+#include "opt/ir.h"
+#include "opt/interp.h"
+#include "opt/profile.h"
+#include "opt/fpmode.h"
+#include "opt/peephole.h"
+#include "opt/strength.h"
+#include "opt/precision.h"
+#include "opt/cfg.h"
+#include "opt/liveness.h"
+#include "opt/licm.h"
+#include "opt/sroa.h"
+#include "opt/simplify.h"
+#include "opt/composite.h"
+#include "opt/dedup.h"
+#include "opt/pipeline.h"
+#include "opt/incremental.h"
+#include "opt/incremental_reload.h"
+#include "opt/sha256.h"
+#include "opt/cache.h"
+#include "opt/archive.h"
+
 #include <vulkan/vulkan.h>
 #include <xcb/xcb.h>
 #include <sys/inotify.h>
-#include <pthread.h>
+
+#include "memory.h"
 
 #define EVENT_SIZE (sizeof(struct inotify_event))
 #define EVENT_BUF_LEN (1024 * (EVENT_SIZE + 16))
@@ -12,10 +46,22 @@
 #define NUM_SAMPLES VK_SAMPLE_COUNT_1_BIT
 #define NUM_DESCRIPTOR_SETS 1
 #define NUM_SHADER_STAGES 2
-#define NUM_VERT_ATTRIBUTES 2
+#define NUM_VERT_BINDINGS 2
+#define NUM_VERT_ATTRIBUTES 7
 #define NUM_VIEWPORTS 1
 #define NUM_SCISSORS NUM_VIEWPORTS
 #define FENCE_TIMEOUT 100000000
+#define MAX_FRAMES_IN_FLIGHT 8
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+#define WINDOW_WIDTH 800
+#define WINDOW_HEIGHT 600
+#define FIRST_TIER_BUDGET_MSEC 10.0
+#define SHADER_CACHE_DIR ".shader_cache"
+#define SHADER_ARCHIVE "shaders/shaders.spva"
+#define VERTEX_SHADER "shaders/sample.vert.spv"
+#define INSTANCED_VERTEX_SHADER "shaders/instanced.vert.spv"
+#define MAX_INSTANCE_ALLOCATION (1ull << 30)  // smallest maxMemoryAllocationSize Vulkan allows
+#define FRAGMENT_SHADER "shaders/sample.frag.spv"
 
 struct swapchain_buffer {
     VkImage     image;
@@ -23,22 +69,48 @@ struct swapchain_buffer {
 };
 
 struct depth_buffer {
-    VkFormat       format;
-    VkImage        image;
-    VkDeviceMemory mem;
-    VkImageView    view;
+    VkFormat                 format;
+    VkImage                  image;
+    struct memory_allocation mem;
+    VkImageView              view;
 };
 
+// One slot per frame in flight, mapped for as long as the buffer lives
 struct uniform_buffer {
-    VkBuffer               buf;
-    VkDeviceMemory         mem;
-    VkDescriptorBufferInfo buffer_info;
+    VkBuffer                 buf;
+    struct memory_allocation mem;
+    VkDescriptorBufferInfo   buffer_info;
+    VkDeviceSize             stride;
+};
+
+// Per-instance vertex data, one slot of every instance per frame in flight
+struct instance {
+    mat4x4 model;
+    vec4   color;
+};
+
+struct instance_buffer {
+    VkBuffer                 buf;
+    struct memory_allocation mem;
+    VkDeviceSize             stride;
 };
 
 struct vertex_buffer {
-    VkBuffer               buf;
-    VkDeviceMemory         mem;
-    VkDescriptorBufferInfo buffer_info;
+    VkBuffer                 buf;
+    struct memory_allocation mem;
+    VkDescriptorBufferInfo   buffer_info;
+    u64                      upload;  // ticket of the vertex data
+};
+
+// Everything one frame in flight owns, reused round-robin once its fence signals
+struct frame {
+    VkCommandBuffer *command_buffers;  // per swapchain image, recorded ahead
+    VkSemaphore     image_acquired;
+    VkSemaphore     render_complete;
+    VkFence         fence;
+    u64             submitted;        // CPU time of the last submit
+    u32             traced_frame;
+    bool            queries_pending;
 };
 
 static struct {
@@ -57,6 +129,7 @@ static struct {
     struct depth_buffer               depth;
     struct uniform_buffer             uniform;
     struct vertex_buffer              vertex;
+    struct instance_buffer            per_instance;
     VkPhysicalDeviceProperties        gpu_props;
     VkPhysicalDeviceMemoryProperties  memory_properties;
     VkDescriptorSetLayout             descriptor_layout[NUM_DESCRIPTOR_SETS];
@@ -66,15 +139,24 @@ static struct {
     VkRenderPass                      render_pass;
     VkPipelineShaderStageCreateInfo   shader_stages[NUM_SHADER_STAGES];
     VkFramebuffer                    *framebuffers;
-    VkVertexInputBindingDescription   vi_binding;
+    VkVertexInputBindingDescription   vi_bindings[NUM_VERT_BINDINGS];
     VkVertexInputAttributeDescription vi_attribs[NUM_VERT_ATTRIBUTES];
     VkPipeline                        pipeline;
-    VkViewport                        viewport;
-    VkRect2D                          scissor;
     VkQueue                           graphics_queue;
     VkQueue                           present_queue;
+    VkQueue                           transfer_queue;  // the graphics queue unless --transfer-queue finds another family
     VkCommandBufferBeginInfo          cmd_buf_info;
-    VkMemoryRequirements              umem_reqs;
+    struct frame                      frames[MAX_FRAMES_IN_FLIGHT];
+    VkFence                          *image_fences;
+    struct memory_allocation         *offscreen_memory;  // headless, per offscreen image
+    struct memory_allocator           allocator;
+    bool                              commands_dirty;
+    enum present_policy               present_policy;
+    VkQueryPool                       timestamp_pool;   // two per frame in flight, around the render pass
+    u64                               timestamp_mask;
+    f64                               timestamp_period; // ns per tick
+    u64                               gpu_origin;       // the first timestamp and the CPU time it maps to
+    u64                               cpu_origin;
     
     xcb_connection_t           *connection;
     xcb_screen_t               *screen;
@@ -88,9 +170,18 @@ static struct {
     mat4x4 mvp;
     
     u8 *ubuffer_data;
+    struct instance *instance_data;
+    f32 *instance_phases;  // cos and sin of every instance's phase
+    u32 instances;         // 0 draws the single cube without instance data
+    u32 draw_batch;        // instances per draw, 0 draws them all at once
+    f32 scene_time;
     u32 current_buffer;
+    u32 current_frame;
+    u32 frames_in_flight;
+    bool headless;
     u32 swapchain_image_count;
     u32 graphics_queue_family_index;
+    u32 transfer_queue_family_index;
     u32 present_queue_family_index;
     u32 queue_family_count;
     u32 gpu_count;
@@ -100,12 +191,63 @@ static struct {
 } data;
 
 static const u32 TARGET_FRAMERATE = 60;
-static const f32 TARGET_FRAMETIME = 1000.0f / (f32) TARGET_FRAMERATE;
+
+// Frame times are reported every PACE_REPORT_SECONDS, a benchmark runs uncapped for a fixed number of frames and reports once
+#define PACE_REPORT_SECONDS 10
+static u32 benchmark_frames = 0;
+static struct frame_pacer pacer;
+
+// Headless runs render offscreen for a fixed number of frames, no window or display needed
+static const char *readback_path = NULL;
+
+// Percentiles of every traced scope come with the frame times, --trace also writes every span to a file
+static const char *trace_path = NULL;
+static struct trace trace;
 
 static bool shader_update = false;
 static pthread_mutex_t su_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// With -O a fragment shader load goes through two tiers: the cheap passes
+// within a time budget so the edit is on screen quickly, then the full
+// pipeline in the background, which only redoes the functions that changed
+static bool optimize_shaders = false;
+static struct pipeline_options first_tier_passes;
+static struct pipeline_options shader_passes;
+static struct incremental fs_cache;
+static pthread_mutex_t fs_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Fully optimized shaders by content, a hit skips both tiers
+static bool use_cache = true;
+static const char *shader_cache_dir = SHADER_CACHE_DIR;
+static struct shader_cache shader_cache;
+
+// Shaders come from the archive when there is one, until an edit on disk makes the fragment shader's copy stale
+// NOTE: atomic, optimize_worker reads it while the render thread may be setting it, locking fs_cache_mutex here would stall the frame on the running optimize
+static struct shader_archive shader_archive;
+static _Atomic bool fs_edited = false;
+
+// Hand-off of the fully optimized shader from optimize_worker to the render loop
+static struct {
+    struct timespec beg;
+    u32 generation;
+    u32 passes;
+    bool cached;
+    u32 *optimized;
+    u32 optimized_size;
+    bool first_pixel;
+    pthread_mutex_t mutex;
+} reload = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+
+// With record threads every swapchain image's draws are recorded in parallel into secondaries
+static u32 record_threads = 0;
+static bool record_every_frame = false;
+
+// Uploads go to a queue family without graphics when there is one
+static bool use_transfer_queue = false;
+
 #include "data/cube.h"
+#include "record.h"
+#include "upload.h"
 #include "vk_utils.h"
 
 static void *
@@ -117,7 +259,7 @@ in_worker(void *arg)
     struct inotify_event *event;
     s32 len;
     
-    inotify_add_watch(fd, "shaders/sample.frag.spv", IN_MODIFY);
+    inotify_add_watch(fd, FRAGMENT_SHADER, IN_MODIFY);
     
     while (true) {
         
@@ -131,6 +273,7 @@ in_worker(void *arg)
             if (event->mask & IN_MODIFY) {
                 //pthread_mutex_lock(&su_mutex);
                 printf("reloading shader\n");
+                clock_gettime(CLOCK_MONOTONIC, &reload.beg);
                 shader_update = true;
                 //pthread_mutex_unlock(&su_mutex);
             }
@@ -142,15 +285,262 @@ in_worker(void *arg)
     return(NULL);
 }
 
+// Second tier, the result is only kept if no newer edit came in meanwhile
+static void *
+optimize_worker(void *arg)
+{
+    u32 generation = (u32) (uintptr_t) arg;
+    const u32 *words;
+    u32 *file, *optimized = NULL;
+    u32 size, optimized_size = 0;
+    struct cache_key key;
+    
+    pthread_mutex_lock(&fs_cache_mutex);
+    
+    if ((words = get_shader(FRAGMENT_SHADER, !fs_edited, &size, &file)) &&
+        incremental_optimize(&fs_cache, words, size, &shader_passes, NULL)) {
+        incremental_report(&fs_cache, stdout);
+        optimized = ir_emit(&fs_cache.module, &optimized_size);
+        
+        if (use_cache) {
+            cache_key(words, size, &shader_passes, &key);
+            cache_store(&shader_cache, &key, optimized, optimized_size);
+        }
+    }
+    
+    pthread_mutex_unlock(&fs_cache_mutex);
+    
+    pthread_mutex_lock(&reload.mutex);
+    
+    if (generation == reload.generation) {
+        free(reload.optimized);
+        reload.optimized = optimized;
+        reload.optimized_size = optimized_size;
+        optimized = NULL;
+    }
+    
+    pthread_mutex_unlock(&reload.mutex);
+    
+    free(optimized);
+    free(file);
+    
+    return(NULL);
+}
+
+// Starts the second tier unless the first one came from the cache, either way older workers' results are now stale
+static void
+start_optimize_worker()
+{
+    pthread_t thread;
+    u32 generation;
+    
+    pthread_mutex_lock(&reload.mutex);
+    generation = ++reload.generation;
+    pthread_mutex_unlock(&reload.mutex);
+    
+    if (optimize_shaders && !reload.cached) {
+        pthread_create(&thread, NULL, optimize_worker, (void *) (uintptr_t) generation);
+        pthread_detach(thread);
+    }
+}
+
+static void
+reload_fragment_shader()
+{
+    fs_edited = true;
+    
+    load_fragment_shader();
+    rebuild_pipeline();
+    
+    reload.first_pixel = true;
+    
+    start_optimize_worker();
+}
+
+// Swaps in the fully optimized shader once optimize_worker has it, returns whether it did
+static bool
+swap_optimized_shader()
+{
+    u32 *fs_words;
+    u32 fs_size;
+    
+    pthread_mutex_lock(&reload.mutex);
+    fs_words = reload.optimized;
+    fs_size = reload.optimized_size;
+    reload.optimized = NULL;
+    pthread_mutex_unlock(&reload.mutex);
+    
+    if (!fs_words) {
+        return(false);
+    }
+    
+    rebuild_fragment_shader(fs_words, fs_size);
+    rebuild_pipeline();
+    free(fs_words);
+    
+    return(true);
+}
+
+// Runs both shaders on the CPU over the full viewport and prints dynamic instruction counts
+static void
+profile_shaders()
+{
+    const char *paths[NUM_SHADER_STAGES] = { VERTEX_SHADER, FRAGMENT_SHADER };
+    
+    data.width = WINDOW_WIDTH;
+    data.height = WINDOW_HEIGHT;
+    
+    init_matrices();
+    
+    for (u32 i = 0; i < NUM_SHADER_STAGES; ++i) {
+        struct ir_module m;
+        struct interp it;
+        struct profile p;
+        u32 *words;
+        u32 size;
+        
+        ASSERT(words = get_binary(paths[i], &size));
+        ASSERT(ir_parse(words, size, &m));
+        
+        printf("%s\n", paths[i]);
+        
+        if (profile_run(&m, data.width, data.height, data.mvp, sizeof(data.mvp), &it, &p)) {
+            profile_report(&m, &it, &p, stdout);
+        }
+        
+        interp_free(&it);
+        ir_free_module(&m);
+        free(words);
+    }
+}
+
 s32
-main(void)
+main(s32 argc, char **argv)
 {
+    clock_gettime(CLOCK_MONOTONIC, &reload.beg);
+    
+    pipeline_defaults(&shader_passes);
+    pipeline_enable_all(&shader_passes);
+    
+    pipeline_defaults(&first_tier_passes);
+    pipeline_enable_cheap(&first_tier_passes);
+    first_tier_passes.budget_msec = FIRST_TIER_BUDGET_MSEC;
+    
+    data.frames_in_flight = DEFAULT_FRAMES_IN_FLIGHT;
+    data.present_policy = PRESENT_FIFO;
+    
+    bool present_given = false;
+    
+    for (s32 i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--profile")) {
+            profile_shaders();
+            return(0);
+        } else if (!strcmp(argv[i], "-O")) {
+            optimize_shaders = true;
+        } else if (!strcmp(argv[i], "--tier-budget") && i + 1 < argc) {
+            first_tier_passes.budget_msec = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "--cache") && i + 1 < argc) {
+            shader_cache_dir = argv[++i];
+        } else if (!strcmp(argv[i], "--no-cache")) {
+            use_cache = false;
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            data.frames_in_flight = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--present") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            
+            present_given = true;
+            
+            if (!strcmp(mode, "fifo")) {
+                data.present_policy = PRESENT_FIFO;
+            } else if (!strcmp(mode, "mailbox")) {
+                data.present_policy = PRESENT_MAILBOX;
+            } else if (!strcmp(mode, "immediate")) {
+                data.present_policy = PRESENT_IMMEDIATE;
+            } else {
+                printf("[ERROR] --present takes fifo, mailbox or immediate\n");
+                return(1);
+            }
+        } else if (!strcmp(argv[i], "--benchmark") && i + 1 < argc) {
+            benchmark_frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--headless") && i + 1 < argc) {
+            data.headless = true;
+            benchmark_frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--readback") && i + 1 < argc) {
+            readback_path = argv[++i];
+        } else if (!strcmp(argv[i], "--instances") && i + 1 < argc) {
+            data.instances = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+            data.draw_batch = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--record-threads") && i + 1 < argc) {
+            record_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--record-every-frame")) {
+            record_every_frame = true;
+        } else if (!strcmp(argv[i], "--transfer-queue")) {
+            use_transfer_queue = true;
+        } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+            trace_path = argv[++i];
+        }
+    }
+    
+    // NOTE: a benchmark measures the renderer, not the display, so it does not wait for vsync unless asked to
+    if (benchmark_frames && !present_given) {
+        data.present_policy = PRESENT_IMMEDIATE;
+    }
+    
+    if (data.frames_in_flight < 1 || data.frames_in_flight > MAX_FRAMES_IN_FLIGHT) {
+        printf("[ERROR] --frames takes 1 to %d frames in flight\n", MAX_FRAMES_IN_FLIGHT);
+        return(1);
+    }
+    
+    if (optimize_shaders && use_cache) {
+        use_cache = cache_init(&shader_cache, shader_cache_dir, 0);
+    }
+    
+    if (archive_open(&shader_archive, SHADER_ARCHIVE)) {
+        printf("[ARCHIVE] %u shaders from %s\n", shader_archive.header->count, SHADER_ARCHIVE);
+    }
+    
+    if (record_threads > MAX_RECORD_THREADS) {
+        printf("[ERROR] --record-threads takes at most %d threads\n", MAX_RECORD_THREADS);
+        return(1);
+    }
+    
+    if (data.headless && !benchmark_frames) {
+        printf("[ERROR] --headless takes the number of frames to render\n");
+        return(1);
+    }
+    
+    if (readback_path && !data.headless) {
+        printf("[ERROR] --readback needs --headless\n");
+        return(1);
+    }
+    
     init_instance();
     enumerate_devices();
-    init_surface();
+    
+    if (data.instances > max_instances()) {
+        printf("[ERROR] --instances takes at most %u instances with %u frames in flight on this device\n", max_instances(), data.frames_in_flight);
+        return(1);
+    }
+    
+    if (data.headless) {
+        init_headless();
+    } else {
+        init_surface();
+    }
+    
     init_device();
     init_command_buffer();
-    init_swapchain();
+    upload_init();
+    
+    if (data.headless) {
+        init_offscreen_images();
+    } else {
+        init_swapchain();
+    }
+    
+    init_frames();
+    init_timestamps();
     init_depth_buffer();
     init_uniform_buffer();
     init_pipeline_layout();
@@ -158,56 +548,105 @@ main(void)
     init_shaders();
     init_framebuffers();
     init_vertex_buffer();
+    init_instance_buffer();
     init_descriptor_poolset();
     init_pipeline();
     
-    struct timespec frametime_beg;
-    struct timespec frametime_end;
+    if (record_threads) {
+        record_jobs_init(record_threads);
+    }
+    
+    reload.first_pixel = true;
+    
+    start_optimize_worker();
     
     u32 fn = 0;
     
     pthread_t in_worker_thread;
     pthread_create(&in_worker_thread, NULL, in_worker, NULL);
     
+    pacer_init(&pacer, benchmark_frames ? 0 : TARGET_FRAMERATE);
+    trace_init(&trace, trace_path);
+    
     while (true) {
-        clock_gettime(CLOCK_MONOTONIC, &frametime_beg);
-        
         mat4x4_identity(data.model);
         mat4x4_rotate_Y(data.model, data.model, (f32) fn / 100);
         mat4x4_mul(data.mvp, data.clip, data.projection);
         mat4x4_mul(data.mvp, data.mvp, data.view);
         mat4x4_mul(data.mvp, data.mvp, data.model);
         
+        data.scene_time = (f32) fn / 100;
+        
+        bool optimized = false;
+        
         if (shader_update) {
             //pthread_mutex_lock(&su_mutex);
             
-            rebuild_fragment_shader();
-            init_pipeline();
+            reload_fragment_shader();
             shader_update = false;
             
             //pthread_mutex_unlock(&su_mutex);
+        } else {
+            optimized = swap_optimized_shader();
         }
         
-        update_uniform_data(data.umem_reqs.size);
         draw_cube();
         
-        clock_gettime(CLOCK_MONOTONIC, &frametime_end);
+        if (reload.first_pixel) {
+            printf("[RELOAD] first pixel after %.2f ms", pipeline_msec(&reload.beg));
+            
+            if (reload.cached) {
+                printf(", optimized module from the cache");
+            } else if (optimize_shaders) {
+                printf(", %u cheap passes in a %.1f ms budget", reload.passes, first_tier_passes.budget_msec);
+            }
+            
+            printf("\n");
+            reload.first_pixel = false;
+        }
         
-        s64 frametime_nsec = (frametime_end.tv_nsec + frametime_end.tv_sec * 1000000000) 
-            - (frametime_beg.tv_nsec + frametime_beg.tv_sec * 1000000000);
+        if (optimized) {
+            printf("[RELOAD] optimized pipeline after %.2f ms\n", pipeline_msec(&reload.beg));
+        }
+        
+        pacer_wait(&pacer);
         
-        s64 frametime_msec = frametime_nsec / 1000000;
-        s32 frametime_delta = TARGET_FRAMETIME - frametime_msec;
+        bool finished = benchmark_frames && pacer.frames == benchmark_frames;
         
-        if (frametime_delta > 0) {
-            usleep(frametime_delta * 1000);
+        if (finished || (!benchmark_frames && pacer.frames % (TARGET_FRAMERATE * PACE_REPORT_SECONDS) == 0)) {
+            pacer_report(&pacer, stdout);
+            trace_report(&trace, stdout);
+            scene_report(stdout);
+            memory_report(&data.allocator, stdout);
+            upload_report(stdout);
+            
+            if (optimize_shaders && use_cache) {
+                cache_report(&shader_cache, stdout);
+            }
+            
+            if (record_threads) {
+                record_jobs_report(stdout);
+            }
+            
+            // NOTE: a run that is never stopped still leaves a trace behind
+            trace_flush(&trace);
+        }
+        
+        if (finished) {
+            break;
         }
         
         ++fn;
     }
     
+    // NOTE: the watcher blocks in read, a cancellation point
+    pthread_cancel(in_worker_thread);
     pthread_join(in_worker_thread, NULL);
     
+    if (readback_path) {
+        readback_image(readback_path);
+    }
+    
     destroy();
     
     return(0);
@@ -0,0 +1,406 @@
+// Device memory sub-allocation. Resources no longer get a vkAllocateMemory
+// each, every memory type has a pool of large blocks and a resource is bound
+// at an offset into one of them, so thousands of buffers need only a handful
+// of device allocations.
+//
+// Inside a block memory is handed out by a buddy allocator: nodes are powers
+// of two, a node of size 2^k starts at a multiple of 2^k, so any power of two
+// alignment up to the node size holds without padding. Freed nodes merge with
+// their buddy as long as it is free too.
+//
+// Linear resources (buffers) and optimal images must not share a page of
+// bufferImageGranularity, when the device has one they get separate pools.
+// Blocks of host visible types are mapped once for their whole lifetime.
+//
+// A resource larger than MEMORY_BLOCK_SIZE gets a block of its own, which is
+// given back to the device once the resource is freed. Regular blocks stay
+// for the next allocations.
+
+#define MEMORY_BLOCK_SIZE (64ull << 20)
+#define MEMORY_MIN_ORDER 9  // 512 byte nodes
+#define MEMORY_MAX_ORDERS 40
+#define MEMORY_NONE UINT32_MAX
+
+#define MEMORY_PUSH(arr, count, cap, item) {\
+    if ((count) == (cap)) {\
+        (cap) = (cap) ? (cap) * 2 : 8;\
+        ASSERT((arr) = realloc((arr), (cap) * sizeof(*(arr))));\
+    }\
+    (arr)[(count)++] = (item);\
+}
+
+struct memory_block {
+    VkDeviceMemory memory;          // VK_NULL_HANDLE for a released slot
+    u8 *mapped;
+    u32 order;                      // of the whole block
+    u32 heads[MEMORY_MAX_ORDERS];   // per order above MEMORY_MIN_ORDER, first free node
+    u32 *next;                      // per smallest node, free list links
+    u32 *prev;
+    u8 *free_order;                 // per smallest node, 1 + order of the free node starting there, 0 otherwise
+    VkDeviceSize used;
+    u32 allocations;
+};
+
+struct memory_pool {
+    struct memory_block *blocks;
+    u32 nblocks;
+    u32 cap;
+    VkDeviceSize requested;
+};
+
+struct memory_allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties properties;
+    VkDeviceSize granularity;
+    struct memory_pool pools[2 * VK_MAX_MEMORY_TYPES];  // per type, linear then optimal
+    u32 device_allocations;
+};
+
+struct memory_allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    u8 *mapped;  // NULL unless the type is host visible
+    u32 pool;
+    u32 block;
+    u32 order;
+};
+
+static void
+memory_init(struct memory_allocator *a, VkDevice device, VkPhysicalDeviceMemoryProperties *properties, VkDeviceSize granularity)
+{
+    memset(a, 0x00, sizeof(struct memory_allocator));
+    
+    a->device = device;
+    a->properties = *properties;
+    a->granularity = granularity;
+}
+
+static u32
+memory_order(VkDeviceSize size)
+{
+    u32 order = MEMORY_MIN_ORDER;
+    
+    while ((1ull << order) < size) {
+        order += 1;
+    }
+    
+    return(order);
+}
+
+static void
+memory_push(struct memory_block *b, u32 order, u32 node)
+{
+    u32 k = order - MEMORY_MIN_ORDER;
+    
+    b->prev[node] = MEMORY_NONE;
+    b->next[node] = b->heads[k];
+    
+    if (b->heads[k] != MEMORY_NONE) {
+        b->prev[b->heads[k]] = node;
+    }
+    
+    b->heads[k] = node;
+    b->free_order[node] = (u8) (order + 1);
+}
+
+static void
+memory_remove(struct memory_block *b, u32 order, u32 node)
+{
+    u32 k = order - MEMORY_MIN_ORDER;
+    
+    if (b->prev[node] != MEMORY_NONE) {
+        b->next[b->prev[node]] = b->next[node];
+    } else {
+        b->heads[k] = b->next[node];
+    }
+    
+    if (b->next[node] != MEMORY_NONE) {
+        b->prev[b->next[node]] = b->prev[node];
+    }
+    
+    b->free_order[node] = 0;
+}
+
+static bool
+memory_block_alloc(struct memory_block *b, u32 order, VkDeviceSize *offset)
+{
+    u32 k = order;
+    u32 node;
+    
+    while (k <= b->order && b->heads[k - MEMORY_MIN_ORDER] == MEMORY_NONE) {
+        k += 1;
+    }
+    
+    if (k > b->order) {
+        return(false);
+    }
+    
+    node = b->heads[k - MEMORY_MIN_ORDER];
+    memory_remove(b, k, node);
+    
+    // NOTE: the upper halves go back on the free lists until the node fits
+    while (k > order) {
+        k -= 1;
+        memory_push(b, k, node + (1u << (k - MEMORY_MIN_ORDER)));
+    }
+    
+    b->used += 1ull << order;
+    b->allocations += 1;
+    
+    *offset = (VkDeviceSize) node << MEMORY_MIN_ORDER;
+    
+    return(true);
+}
+
+static void
+memory_block_free(struct memory_block *b, u32 order, VkDeviceSize offset)
+{
+    u32 node = (u32) (offset >> MEMORY_MIN_ORDER);
+    
+    b->used -= 1ull << order;
+    b->allocations -= 1;
+    
+    while (order < b->order) {
+        u32 buddy = node ^ (1u << (order - MEMORY_MIN_ORDER));
+        
+        if (b->free_order[buddy] != order + 1) {
+            break;
+        }
+        
+        memory_remove(b, order, buddy);
+        node = node < buddy ? node : buddy;
+        order += 1;
+    }
+    
+    memory_push(b, order, node);
+}
+
+static void
+memory_release_block(struct memory_allocator *a, struct memory_block *b)
+{
+    if (b->mapped) {
+        vkUnmapMemory(a->device, b->memory);
+    }
+    
+    vkFreeMemory(a->device, b->memory, NULL);
+    free(b->next);
+    free(b->prev);
+    free(b->free_order);
+    
+    // NOTE: an order below MEMORY_MIN_ORDER fits no allocation
+    memset(b, 0x00, sizeof(struct memory_block));
+    a->device_allocations -= 1;
+}
+
+// A new block holds at least one node of the given order, returns its index or MEMORY_NONE
+static u32
+memory_add_block(struct memory_allocator *a, u32 type, struct memory_pool *pool, u32 order)
+{
+    VkMemoryAllocateInfo alloc_info;
+    struct memory_block b;
+    u32 nodes, slot;
+    
+    memset(&b, 0x00, sizeof(struct memory_block));
+    
+    b.order = memory_order(MEMORY_BLOCK_SIZE);
+    b.order = b.order > order ? b.order : order;
+    
+    if (b.order >= MEMORY_MIN_ORDER + MEMORY_MAX_ORDERS) {
+        return(MEMORY_NONE);
+    }
+    
+    alloc_info.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.pNext           = NULL;
+    alloc_info.allocationSize  = 1ull << b.order;
+    alloc_info.memoryTypeIndex = type;
+    
+    if (vkAllocateMemory(a->device, &alloc_info, NULL, &b.memory) != VK_SUCCESS) {
+        return(MEMORY_NONE);
+    }
+    
+    if (a->properties.memoryTypes[type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+        ASSERT_VK(vkMapMemory(a->device, b.memory, 0, VK_WHOLE_SIZE, 0, (void **) &b.mapped));
+    }
+    
+    nodes = 1u << (b.order - MEMORY_MIN_ORDER);
+    
+    ASSERT(b.next = malloc(nodes * sizeof(u32)));
+    ASSERT(b.prev = malloc(nodes * sizeof(u32)));
+    ASSERT(b.free_order = calloc(nodes, sizeof(u8)));
+    
+    for (u32 k = 0; k < MEMORY_MAX_ORDERS; ++k) {
+        b.heads[k] = MEMORY_NONE;
+    }
+    
+    memory_push(&b, b.order, 0);
+    
+    a->device_allocations += 1;
+    
+    for (slot = 0; slot < pool->nblocks; ++slot) {
+        if (!pool->blocks[slot].memory) {
+            pool->blocks[slot] = b;
+            return(slot);
+        }
+    }
+    
+    MEMORY_PUSH(pool->blocks, pool->nblocks, pool->cap, b);
+    
+    return(slot);
+}
+
+// First fit over the pool's blocks, a new block when none has room. False when the device is out of memory.
+static bool
+memory_alloc(struct memory_allocator *a, VkMemoryRequirements *reqs, VkMemoryPropertyFlags flags, bool linear, struct memory_allocation *out)
+{
+    VkDeviceSize size = reqs->size > reqs->alignment ? reqs->size : reqs->alignment;
+    u32 order = memory_order(size);
+    u32 type = MEMORY_NONE;
+    struct memory_pool *pool;
+    
+    memset(out, 0x00, sizeof(struct memory_allocation));
+    
+    for (u32 i = 0; i < a->properties.memoryTypeCount; ++i) {
+        if ((reqs->memoryTypeBits & (1u << i)) && (a->properties.memoryTypes[i].propertyFlags & flags) == flags) {
+            type = i;
+            break;
+        }
+    }
+    
+    if (type == MEMORY_NONE) {
+        return(false);
+    }
+    
+    // NOTE: without a granularity to respect buffers and images share blocks
+    out->pool = 2 * type + (a->granularity > 1 && !linear);
+    pool = &a->pools[out->pool];
+    
+    for (out->block = 0; out->block < pool->nblocks; ++out->block) {
+        if (memory_block_alloc(&pool->blocks[out->block], order, &out->offset)) {
+            break;
+        }
+    }
+    
+    if (out->block == pool->nblocks) {
+        out->block = memory_add_block(a, type, pool, order);
+        
+        if (out->block == MEMORY_NONE || !memory_block_alloc(&pool->blocks[out->block], order, &out->offset)) {
+            return(false);
+        }
+    }
+    
+    out->memory = pool->blocks[out->block].memory;
+    out->size = reqs->size;
+    out->order = order;
+    out->mapped = pool->blocks[out->block].mapped ? pool->blocks[out->block].mapped + out->offset : NULL;
+    
+    pool->requested += reqs->size;
+    
+    return(true);
+}
+
+static void
+memory_free(struct memory_allocator *a, struct memory_allocation *allocation)
+{
+    struct memory_pool *pool = &a->pools[allocation->pool];
+    struct memory_block *b;
+    
+    if (!allocation->memory) {
+        return;
+    }
+    
+    b = &pool->blocks[allocation->block];
+    
+    memory_block_free(b, allocation->order, allocation->offset);
+    pool->requested -= allocation->size;
+    
+    if (!b->allocations && b->order > memory_order(MEMORY_BLOCK_SIZE)) {
+        memory_release_block(a, b);
+    }
+    
+    memset(allocation, 0x00, sizeof(struct memory_allocation));
+}
+
+static void
+memory_bind_buffer(struct memory_allocator *a, VkBuffer buffer, VkMemoryPropertyFlags flags, struct memory_allocation *out)
+{
+    VkMemoryRequirements reqs;
+    
+    vkGetBufferMemoryRequirements(a->device, buffer, &reqs);
+    
+    ASSERT(memory_alloc(a, &reqs, flags, true, out));
+    ASSERT_VK(vkBindBufferMemory(a->device, buffer, out->memory, out->offset));
+}
+
+// Linear for images with linear tiling, they go with the buffers
+static void
+memory_bind_image(struct memory_allocator *a, VkImage image, bool linear, VkMemoryPropertyFlags flags, struct memory_allocation *out)
+{
+    VkMemoryRequirements reqs;
+    
+    vkGetImageMemoryRequirements(a->device, image, &reqs);
+    
+    ASSERT(memory_alloc(a, &reqs, flags, linear, out));
+    ASSERT_VK(vkBindImageMemory(a->device, image, out->memory, out->offset));
+}
+
+// Fragmentation is the part of the free memory outside the largest free node of its block, what big allocations cannot use
+static void
+memory_report(struct memory_allocator *a, FILE *out)
+{
+    fprintf(out, "[MEMORY] %u device allocations\n", a->device_allocations);
+    
+    for (u32 p = 0; p < 2 * VK_MAX_MEMORY_TYPES; ++p) {
+        struct memory_pool *pool = &a->pools[p];
+        VkDeviceSize reserved = 0, used = 0, largest = 0, contiguous = 0;
+        u32 blocks = 0, allocations = 0;
+        
+        for (u32 i = 0; i < pool->nblocks; ++i) {
+            struct memory_block *b = &pool->blocks[i];
+            
+            if (!b->memory) {
+                continue;
+            }
+            
+            blocks += 1;
+            reserved += 1ull << b->order;
+            used += b->used;
+            allocations += b->allocations;
+            
+            for (u32 k = b->order; k >= MEMORY_MIN_ORDER; --k) {
+                if (b->heads[k - MEMORY_MIN_ORDER] != MEMORY_NONE) {
+                    largest = largest > (1ull << k) ? largest : (1ull << k);
+                    contiguous += 1ull << k;
+                    break;
+                }
+            }
+        }
+        
+        if (!blocks) {
+            continue;
+        }
+        
+        fprintf(out, "    type %2u %-7s %u blocks, %.2f of %.2f MiB in %u allocations (%.2f MiB requested), largest free %.2f MiB, %.0f%% fragmented\n",
+                p / 2, p % 2 ? "optimal" : "linear", blocks, (f64) used / (1 << 20), (f64) reserved / (1 << 20), allocations,
+                (f64) pool->requested / (1 << 20), (f64) largest / (1 << 20),
+                reserved > used ? 100.0 * (1.0 - (f64) contiguous / (f64) (reserved - used)) : 0.0);
+    }
+}
+
+static void
+memory_destroy(struct memory_allocator *a)
+{
+    for (u32 p = 0; p < 2 * VK_MAX_MEMORY_TYPES; ++p) {
+        struct memory_pool *pool = &a->pools[p];
+        
+        for (u32 i = 0; i < pool->nblocks; ++i) {
+            if (pool->blocks[i].memory) {
+                memory_release_block(a, &pool->blocks[i]);
+            }
+        }
+        
+        free(pool->blocks);
+    }
+    
+    memset(a->pools, 0x00, sizeof(a->pools));
+}
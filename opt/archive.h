@@ -0,0 +1,191 @@
+// Packed shader archive. Opening it maps the file once, every module in it is
+// then a u32 view into the mapping, no further file system calls.
+//
+// Layout, all offsets in bytes from the start of the file:
+//   header
+//   index, one entry per module sorted by the hash of its name
+//   string table, nul-terminated module and entry point names
+//   payloads, every module 4-byte aligned, identical modules stored once
+
+#define ARCHIVE_MAGIC   0x41565053  // "SPVA"
+#define ARCHIVE_VERSION 1
+
+struct archive_header {
+    u32 magic;
+    u32 version;
+    u32 count;
+    u32 strings;
+    u32 strings_size;
+    u32 payloads;
+    u32 payloads_size;
+    u32 reserved;
+};
+
+struct archive_entry {
+    u64 hash;
+    u32 name;         // string table offset
+    u32 entry_point;  // string table offset, name of the first entry point
+    u32 offset;
+    u32 size;         // in words
+    u32 model;        // execution model of the first entry point
+    u32 reserved;
+};
+
+struct shader_archive {
+    void *map;
+    u64 length;
+    const struct archive_header *header;
+    const struct archive_entry *entries;
+    const char *strings;
+};
+
+// FNV-1a, names only need to spread over the index
+static u64
+archive_hash(const char *name)
+{
+    u64 hash = 0xcbf29ce484222325ull;
+
+    for (const u8 *p = (const u8 *) name; *p; ++p) {
+        hash ^= *p;
+        hash *= 0x100000001b3ull;
+    }
+
+    return(hash);
+}
+
+static s32
+archive_entry_compare(const void *a, const void *b)
+{
+    u64 x = ((const struct archive_entry *) a)->hash;
+    u64 y = ((const struct archive_entry *) b)->hash;
+
+    return((x > y) - (x < y));
+}
+
+static bool
+archive_valid(struct shader_archive *a)
+{
+    const struct archive_header *h = a->header;
+
+    if (a->length < sizeof(struct archive_header) || h->magic != ARCHIVE_MAGIC || h->version != ARCHIVE_VERSION) {
+        return(false);
+    }
+
+    if (sizeof(struct archive_header) + (u64) h->count * sizeof(struct archive_entry) > h->strings ||
+        (u64) h->strings + h->strings_size > a->length || !h->strings_size ||
+        a->strings[h->strings_size - 1] != '\0') {
+        return(false);
+    }
+
+    for (u32 i = 0; i < h->count; ++i) {
+        const struct archive_entry *e = &a->entries[i];
+
+        if (e->offset % sizeof(u32) || (u64) e->offset + (u64) e->size * sizeof(u32) > a->length ||
+            e->name >= h->strings_size || e->entry_point >= h->strings_size) {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+// False when the archive does not exist or is not valid, it is then left closed
+static bool
+archive_open(struct shader_archive *a, const char *path)
+{
+    struct stat st;
+    s32 fd;
+
+    memset(a, 0x00, sizeof(struct shader_archive));
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        return(false);
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) sizeof(struct archive_header)) {
+        printf("[ERROR] %s is not a shader archive\n", path);
+        close(fd);
+        return(false);
+    }
+
+    a->length = st.st_size;
+    a->map = mmap(NULL, a->length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (a->map == MAP_FAILED) {
+        printf("[ERROR] Could not map %s\n", path);
+        memset(a, 0x00, sizeof(struct shader_archive));
+        return(false);
+    }
+
+    a->header = a->map;
+    a->entries = (const struct archive_entry *) (a->header + 1);
+    a->strings = (const char *) a->map + a->header->strings;
+
+    if (!archive_valid(a)) {
+        printf("[ERROR] %s is not a valid shader archive\n", path);
+        munmap(a->map, a->length);
+        memset(a, 0x00, sizeof(struct shader_archive));
+        return(false);
+    }
+
+    return(true);
+}
+
+// The entry for name, NULL when the archive is closed or does not have it
+static const struct archive_entry *
+archive_entry(struct shader_archive *a, const char *name)
+{
+    struct archive_entry key = { 0 };
+    const struct archive_entry *e;
+
+    if (!a->map) {
+        return(NULL);
+    }
+
+    key.hash = archive_hash(name);
+
+    if (!(e = bsearch(&key, a->entries, a->header->count, sizeof(struct archive_entry), archive_entry_compare))) {
+        return(NULL);
+    }
+
+    // NOTE: equal hashes are next to each other, the names tell them apart
+    while (e > a->entries && e[-1].hash == key.hash) {
+        e -= 1;
+    }
+
+    for (; e < a->entries + a->header->count && e->hash == key.hash; ++e) {
+        if (!strcmp(a->strings + e->name, name)) {
+            return(e);
+        }
+    }
+
+    return(NULL);
+}
+
+// Zero-copy view of a module, valid until archive_close
+static bool
+archive_find(struct shader_archive *a, const char *name, const u32 **words, u32 *size)
+{
+    const struct archive_entry *e = archive_entry(a, name);
+
+    if (!e) {
+        return(false);
+    }
+
+    *words = (const u32 *) ((const u8 *) a->map + e->offset);
+    *size = e->size;
+
+    return(true);
+}
+
+static void
+archive_close(struct shader_archive *a)
+{
+    if (a->map) {
+        munmap(a->map, a->length);
+    }
+
+    memset(a, 0x00, sizeof(struct shader_archive));
+}
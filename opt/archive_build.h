@@ -0,0 +1,159 @@
+// Builds a packed shader archive (archive.h) in memory and writes it out. Only
+// spvpack writes archives, the viewer just maps them.
+
+#define ARCHIVE_PUSH(arr, count, cap, item) {\
+    if ((count) == (cap)) {\
+        (cap) = (cap) ? (cap) * 2 : 8;\
+        ASSERT((arr) = realloc((arr), (cap) * sizeof(*(arr))));\
+    }\
+    (arr)[(count)++] = (item);\
+}
+
+// Modules are copied in as they are added
+struct archive_builder {
+    struct archive_entry *entries;
+    u32 count;
+    u32 cap;
+    char *strings;
+    u32 strings_size;
+    u32 strings_cap;
+    u32 *payloads;
+    u32 payloads_size;
+    u32 payloads_cap;
+    u64 *payload_hashes;  // per entry, for deduplication
+    bool dedup;
+    u32 deduped;
+};
+
+static u32
+archive_add_string(struct archive_builder *b, const char *s)
+{
+    u32 at = b->strings_size;
+
+    for (u32 i = 0; i <= strlen(s); ++i) {
+        ARCHIVE_PUSH(b->strings, b->strings_size, b->strings_cap, s[i]);
+    }
+
+    return(at);
+}
+
+static u64
+archive_payload_hash(const u32 *words, u32 size)
+{
+    u64 hash = 0xcbf29ce484222325ull;
+
+    for (u32 i = 0; i < size; ++i) {
+        hash ^= words[i];
+        hash *= 0x100000001b3ull;
+    }
+
+    return(hash);
+}
+
+static void
+archive_add(struct archive_builder *b, const char *name, const u32 *words, u32 size, u32 model, const char *entry_point)
+{
+    struct archive_entry e = { 0 };
+    u64 payload = archive_payload_hash(words, size);
+    u32 cap = b->cap;
+
+    e.hash = archive_hash(name);
+    e.name = archive_add_string(b, name);
+    e.entry_point = archive_add_string(b, entry_point ? entry_point : "");
+    e.size = size;
+    e.model = model;
+    e.offset = UINT32_MAX;
+
+    for (u32 i = 0; i < b->count && b->dedup; ++i) {
+        if (b->payload_hashes[i] == payload && b->entries[i].size == size &&
+            !memcmp(b->payloads + b->entries[i].offset, words, size * sizeof(u32))) {
+            e.offset = b->entries[i].offset;
+            b->deduped += 1;
+            break;
+        }
+    }
+
+    // NOTE: payload offsets are in words until archive_write places them in the file
+    if (e.offset == UINT32_MAX) {
+        e.offset = b->payloads_size;
+
+        for (u32 i = 0; i < size; ++i) {
+            ARCHIVE_PUSH(b->payloads, b->payloads_size, b->payloads_cap, words[i]);
+        }
+    }
+
+    ARCHIVE_PUSH(b->entries, b->count, b->cap, e);
+
+    if (b->cap != cap) {
+        ASSERT(b->payload_hashes = realloc(b->payload_hashes, b->cap * sizeof(u64)));
+    }
+
+    b->payload_hashes[b->count - 1] = payload;
+}
+
+// Written next to path and renamed over it, a reader that has the old archive mapped keeps a valid mapping
+static bool
+archive_write(struct archive_builder *b, const char *path)
+{
+    struct archive_header h = { 0 };
+    char temp[4096];
+    FILE *file;
+    bool written;
+    u32 pad = 0;
+
+    h.magic = ARCHIVE_MAGIC;
+    h.version = ARCHIVE_VERSION;
+    h.count = b->count;
+    h.strings = sizeof(struct archive_header) + b->count * sizeof(struct archive_entry);
+    h.strings_size = b->strings_size;
+    h.payloads = (h.strings + h.strings_size + 3) & ~3u;
+    h.payloads_size = b->payloads_size * sizeof(u32);
+
+    for (u32 i = 0; i < b->count; ++i) {
+        b->entries[i].offset = h.payloads + b->entries[i].offset * sizeof(u32);
+    }
+
+    qsort(b->entries, b->count, sizeof(struct archive_entry), archive_entry_compare);
+
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+
+    if (!(file = fopen(temp, "wb"))) {
+        printf("[ERROR] Could not open %s\n", temp);
+        return(false);
+    }
+
+    written = fwrite(&h, sizeof(h), 1, file) == 1 &&
+              fwrite(b->entries, sizeof(struct archive_entry), b->count, file) == b->count &&
+              fwrite(b->strings, 1, b->strings_size, file) == b->strings_size &&
+              fwrite(&pad, 1, h.payloads - h.strings - h.strings_size, file) == h.payloads - h.strings - h.strings_size &&
+              fwrite(b->payloads, sizeof(u32), b->payloads_size, file) == b->payloads_size;
+
+    // NOTE: the data has to be on disk before the rename replaces the old archive
+    written = written && !fflush(file) && !fsync(fileno(file));
+    written = !fclose(file) && written;
+
+    if (!written) {
+        printf("[ERROR] Could not write %s\n", temp);
+        unlink(temp);
+        return(false);
+    }
+
+    if (rename(temp, path)) {
+        printf("[ERROR] Could not rename %s\n", temp);
+        unlink(temp);
+        return(false);
+    }
+
+    return(true);
+}
+
+static void
+archive_builder_free(struct archive_builder *b)
+{
+    free(b->entries);
+    free(b->strings);
+    free(b->payloads);
+    free(b->payload_hashes);
+
+    memset(b, 0x00, sizeof(struct archive_builder));
+}
@@ -0,0 +1,307 @@
+// Content-addressed disk cache of optimized modules. The key is the SHA-256 of
+// the input words, every option that changes what the pipeline emits and the
+// pipeline version, so a stale entry is never found rather than invalidated.
+// An entry is the bare SPIR-V of the optimized module in <dir>/<key>.spv, so a
+// hit maps the file and hands the words to the driver without copying.
+//
+// Entries are written to a temporary file and renamed into place, readers only
+// ever see complete files. The modification time of an entry is its last use,
+// once the directory grows past the capacity the least recently used go first.
+// The directory is scanned once for its size, after that stores keep a running
+// total and the next scan only happens when the total crosses the capacity.
+
+#define CACHE_DEFAULT_CAPACITY (256ull << 20)
+#define CACHE_PATH_SIZE 4096
+
+struct shader_cache {
+    const char *dir;
+    u64 capacity;
+    u64 used;
+    bool sized;
+    u32 hits;
+    u32 misses;
+    u32 stored;
+    u32 evicted;
+};
+
+struct cache_key {
+    u8 digest[SHA256_SIZE];
+};
+
+// A mapped entry, words stays valid until cache_release
+struct cache_entry {
+    const u32 *words;
+    u32 size;
+    void *map;
+    u64 length;
+};
+
+struct cache_file {
+    char name[2 * SHA256_SIZE + 8];
+    u64 size;
+    struct timespec used;
+};
+
+static bool
+cache_init(struct shader_cache *c, const char *dir, u64 capacity)
+{
+    memset(c, 0x00, sizeof(struct shader_cache));
+
+    c->dir = dir;
+    c->capacity = capacity ? capacity : CACHE_DEFAULT_CAPACITY;
+
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        printf("[ERROR] Could not create the cache directory %s\n", dir);
+        return(false);
+    }
+
+    return(true);
+}
+
+static void
+cache_hash_u32(struct sha256 *s, u32 value)
+{
+    sha256_update(s, &value, sizeof(u32));
+}
+
+static void
+cache_key(const u32 *words, u32 size, struct pipeline_options *opts, struct cache_key *key)
+{
+    struct sha256 s;
+
+    sha256_init(&s);
+
+    // NOTE: field by field, padding in the struct would make the key unstable. stats and the budget do not change the output.
+    cache_hash_u32(&s, PIPELINE_VERSION);
+    cache_hash_u32(&s, opts->sroa);
+    cache_hash_u32(&s, opts->simplify);
+    cache_hash_u32(&s, opts->composite);
+    cache_hash_u32(&s, opts->strength);
+    cache_hash_u32(&s, opts->peephole);
+    cache_hash_u32(&s, opts->licm);
+    cache_hash_u32(&s, opts->precision);
+    cache_hash_u32(&s, opts->dedup);
+    cache_hash_u32(&s, opts->half);
+    cache_hash_u32(&s, opts->fma);
+    cache_hash_u32(&s, opts->strict);
+    cache_hash_u32(&s, opts->select_cost);
+    cache_hash_u32(&s, opts->licm_pressure);
+    cache_hash_u32(&s, size);
+
+    sha256_update(&s, words, (u64) size * sizeof(u32));
+    sha256_final(&s, key->digest);
+}
+
+static void
+cache_path(struct shader_cache *c, struct cache_key *key, const char *suffix, char *path)
+{
+    s32 at = snprintf(path, CACHE_PATH_SIZE, "%s/", c->dir);
+
+    for (u32 i = 0; i < SHA256_SIZE && at < CACHE_PATH_SIZE; ++i) {
+        at += snprintf(path + at, CACHE_PATH_SIZE - at, "%02x", key->digest[i]);
+    }
+
+    snprintf(path + at, at < CACHE_PATH_SIZE ? CACHE_PATH_SIZE - at : 0, "%s", suffix);
+}
+
+static bool
+cache_lookup(struct shader_cache *c, struct cache_key *key, struct cache_entry *entry)
+{
+    char path[CACHE_PATH_SIZE];
+    struct stat st;
+    s32 fd;
+
+    memset(entry, 0x00, sizeof(struct cache_entry));
+    cache_path(c, key, ".spv", path);
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        c->misses += 1;
+        return(false);
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t) (SPV_HEADER_SIZE * sizeof(u32)) || st.st_size % sizeof(u32)) {
+        close(fd);
+        c->misses += 1;
+        return(false);
+    }
+
+    entry->length = st.st_size;
+    entry->map = mmap(NULL, entry->length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (entry->map == MAP_FAILED || ((const u32 *) entry->map)[0] != SPV_MAGIC) {
+        if (entry->map != MAP_FAILED) {
+            munmap(entry->map, entry->length);
+        }
+
+        memset(entry, 0x00, sizeof(struct cache_entry));
+        c->misses += 1;
+        return(false);
+    }
+
+    entry->words = entry->map;
+    entry->size = (u32) (entry->length / sizeof(u32));
+
+    // NOTE: the modification time is the last use for eviction
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    c->hits += 1;
+
+    return(true);
+}
+
+static void
+cache_release(struct cache_entry *entry)
+{
+    if (entry->map) {
+        munmap(entry->map, entry->length);
+    }
+
+    memset(entry, 0x00, sizeof(struct cache_entry));
+}
+
+static s32
+cache_file_compare(const void *a, const void *b)
+{
+    const struct timespec *x = &((const struct cache_file *) a)->used;
+    const struct timespec *y = &((const struct cache_file *) b)->used;
+
+    if (x->tv_sec != y->tv_sec) {
+        return(x->tv_sec < y->tv_sec ? -1 : 1);
+    }
+
+    return((x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec));
+}
+
+// Sizes the directory and removes the least recently used entries until it fits the capacity
+static void
+cache_evict(struct shader_cache *c)
+{
+    struct cache_file *files = NULL;
+    u32 nfiles = 0, cap = 0;
+    u64 total = 0;
+    struct dirent *e;
+    DIR *dir;
+
+    if (!(dir = opendir(c->dir))) {
+        return;
+    }
+
+    while ((e = readdir(dir))) {
+        char path[CACHE_PATH_SIZE];
+        struct cache_file file;
+        struct stat st;
+        u32 length = strlen(e->d_name);
+
+        if (length != 2 * SHA256_SIZE + 4 || strcmp(e->d_name + 2 * SHA256_SIZE, ".spv")) {
+            continue;
+        }
+
+        snprintf(path, sizeof(path), "%s/%s", c->dir, e->d_name);
+
+        if (stat(path, &st)) {
+            continue;
+        }
+
+        memcpy(file.name, e->d_name, length + 1);
+        file.size = st.st_size;
+        file.used = st.st_mtim;
+
+        total += file.size;
+
+        IR_PUSH(files, nfiles, cap, file);
+    }
+
+    closedir(dir);
+
+    if (total > c->capacity) {
+        qsort(files, nfiles, sizeof(struct cache_file), cache_file_compare);
+
+        for (u32 i = 0; i < nfiles && total > c->capacity; ++i) {
+            char path[CACHE_PATH_SIZE];
+
+            snprintf(path, sizeof(path), "%s/%s", c->dir, files[i].name);
+
+            if (!unlink(path)) {
+                total -= files[i].size;
+                c->evicted += 1;
+            }
+        }
+    }
+
+    // NOTE: the scan also picks up what other processes sharing the directory stored
+    c->used = total;
+    c->sized = true;
+
+    free(files);
+}
+
+static bool
+cache_store(struct shader_cache *c, struct cache_key *key, const u32 *words, u32 size)
+{
+    char path[CACHE_PATH_SIZE];
+    char temp[CACHE_PATH_SIZE];
+    const u8 *p = (const u8 *) words;
+    u64 left = (u64) size * sizeof(u32);
+    struct stat st;
+    bool replaced;
+    s32 fd;
+
+    cache_path(c, key, ".spv", path);
+    cache_path(c, key, ".tmp.XXXXXX", temp);
+
+    // NOTE: a unique temporary per writer, threads and processes storing the same key must not share one
+    if ((fd = mkstemp(temp)) < 0) {
+        printf("[ERROR] Could not write %s\n", temp);
+        return(false);
+    }
+
+    fchmod(fd, 0644);
+
+    while (left) {
+        ssize_t n = write(fd, p, left);
+
+        if (n <= 0) {
+            printf("[ERROR] Could not write %s\n", temp);
+            close(fd);
+            unlink(temp);
+            return(false);
+        }
+
+        p += n;
+        left -= n;
+    }
+
+    // NOTE: the data has to be on disk before the rename makes it visible
+    fsync(fd);
+    close(fd);
+
+    // NOTE: the key covers the content, an entry that is already there is replaced by one of the same size
+    replaced = !stat(path, &st);
+
+    if (rename(temp, path)) {
+        printf("[ERROR] Could not rename %s\n", temp);
+        unlink(temp);
+        return(false);
+    }
+
+    c->stored += 1;
+
+    if (!replaced) {
+        c->used += (u64) size * sizeof(u32);
+    }
+
+    if (!c->sized || c->used > c->capacity) {
+        cache_evict(c);
+    }
+
+    return(true);
+}
+
+static void
+cache_report(struct shader_cache *c, FILE *out)
+{
+    fprintf(out, "[CACHE] %u hits, %u misses, %u stored, %u evicted (%s, %llu MiB capacity)\n",
+            c->hits, c->misses, c->stored, c->evicted, c->dir, (unsigned long long) (c->capacity >> 20));
+}
@@ -0,0 +1,264 @@
+// Control flow graph of one function, with blocks referred to by their index
+// in func->blocks. Built on demand by the passes that need it and thrown away
+// once the function changes shape.
+
+struct cfg_edges {
+    u32 *items;
+    u32 count;
+    u32 cap;
+};
+
+struct cfg {
+    struct ir_function *func;
+    u32 nblocks;
+    struct cfg_edges *succ;
+    struct cfg_edges *pred;
+    u32 *rpo;    // reachable blocks in reverse postorder
+    u32 nrpo;
+    u32 *order;  // block -> position in rpo, UINT32_MAX when unreachable
+    u32 *idom;   // block -> immediate dominator, the entry block dominates itself
+    struct cfg_edges *frontier;  // dominance frontiers, NULL until cfg_frontiers
+};
+
+static u32
+cfg_block_index(struct cfg *g, u32 label)
+{
+    for (u32 i = 0; i < g->nblocks; ++i) {
+        if (g->func->blocks[i]->label == label) {
+            return(i);
+        }
+    }
+
+    return(UINT32_MAX);
+}
+
+static void
+cfg_postorder(struct cfg *g, u32 block, bool *visited, u32 *post, u32 *npost)
+{
+    // NOTE: explicit stack, shaders rarely have deep CFGs but recursion depth is unbounded
+    u32 *stack, *next;
+    u32 top = 0;
+
+    ASSERT(stack = malloc(g->nblocks * sizeof(u32)));
+    ASSERT(next = calloc(g->nblocks, sizeof(u32)));
+
+    visited[block] = true;
+    stack[top++] = block;
+
+    while (top) {
+        u32 b = stack[top - 1];
+
+        if (next[b] < g->succ[b].count) {
+            u32 s = g->succ[b].items[next[b]++];
+
+            if (!visited[s]) {
+                visited[s] = true;
+                stack[top++] = s;
+            }
+        } else {
+            post[(*npost)++] = b;
+            top -= 1;
+        }
+    }
+
+    free(stack);
+    free(next);
+}
+
+static u32
+cfg_intersect(struct cfg *g, u32 a, u32 b)
+{
+    while (a != b) {
+        while (g->order[a] > g->order[b]) {
+            a = g->idom[a];
+        }
+        while (g->order[b] > g->order[a]) {
+            b = g->idom[b];
+        }
+    }
+
+    return(a);
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+static void
+cfg_dominators(struct cfg *g)
+{
+    bool changed = true;
+
+    for (u32 i = 0; i < g->nblocks; ++i) {
+        g->idom[i] = UINT32_MAX;
+    }
+
+    g->idom[g->rpo[0]] = g->rpo[0];
+
+    while (changed) {
+        changed = false;
+
+        for (u32 i = 1; i < g->nrpo; ++i) {
+            u32 b = g->rpo[i];
+            u32 idom = UINT32_MAX;
+
+            for (u32 p = 0; p < g->pred[b].count; ++p) {
+                u32 pred = g->pred[b].items[p];
+
+                if (g->idom[pred] == UINT32_MAX) {
+                    continue;
+                }
+
+                idom = (idom == UINT32_MAX) ? pred : cfg_intersect(g, pred, idom);
+            }
+
+            if (g->idom[b] != idom) {
+                g->idom[b] = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static void
+cfg_build(struct cfg *g, struct ir_function *func)
+{
+    bool *visited;
+    u32 *post;
+    u32 npost = 0;
+
+    memset(g, 0x00, sizeof(struct cfg));
+
+    g->func = func;
+    g->nblocks = func->nblocks;
+
+    ASSERT(g->succ = calloc(g->nblocks, sizeof(struct cfg_edges)));
+    ASSERT(g->pred = calloc(g->nblocks, sizeof(struct cfg_edges)));
+    ASSERT(g->rpo = malloc(g->nblocks * sizeof(u32)));
+    ASSERT(g->order = malloc(g->nblocks * sizeof(u32)));
+    ASSERT(g->idom = malloc(g->nblocks * sizeof(u32)));
+    ASSERT(visited = calloc(g->nblocks, sizeof(bool)));
+    ASSERT(post = malloc(g->nblocks * sizeof(u32)));
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        u32 labels[256];
+        u32 n = ir_successors(func->blocks[b], labels, 256);
+
+        for (u32 i = 0; i < n; ++i) {
+            u32 s = cfg_block_index(g, labels[i]);
+
+            ASSERT(s != UINT32_MAX);
+
+            IR_PUSH(g->succ[b].items, g->succ[b].count, g->succ[b].cap, s);
+            IR_PUSH(g->pred[s].items, g->pred[s].count, g->pred[s].cap, b);
+        }
+    }
+
+    if (g->nblocks) {
+        cfg_postorder(g, 0, visited, post, &npost);
+    }
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        g->order[b] = UINT32_MAX;
+    }
+
+    for (u32 i = 0; i < npost; ++i) {
+        g->rpo[i] = post[npost - 1 - i];
+        g->order[g->rpo[i]] = i;
+    }
+
+    g->nrpo = npost;
+
+    if (g->nrpo) {
+        cfg_dominators(g);
+    }
+
+    free(visited);
+    free(post);
+}
+
+static void
+cfg_free(struct cfg *g)
+{
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        free(g->succ[b].items);
+        free(g->pred[b].items);
+    }
+
+    if (g->frontier) {
+        for (u32 b = 0; b < g->nblocks; ++b) {
+            free(g->frontier[b].items);
+        }
+    }
+
+    free(g->frontier);
+    free(g->succ);
+    free(g->pred);
+    free(g->rpo);
+    free(g->order);
+    free(g->idom);
+}
+
+static bool
+cfg_reachable(struct cfg *g, u32 b)
+{
+    return(g->order[b] != UINT32_MAX);
+}
+
+// True when every path from the entry to b goes through a
+static bool
+cfg_dominates(struct cfg *g, u32 a, u32 b)
+{
+    if (!cfg_reachable(g, a) || !cfg_reachable(g, b)) {
+        return(false);
+    }
+
+    while (b != a && g->idom[b] != b) {
+        b = g->idom[b];
+    }
+
+    return(a == b);
+}
+
+// Dominance frontier of every reachable block: the blocks where its dominance
+// ends, walked up from each join point as in Cooper, Harvey and Kennedy
+static void
+cfg_frontiers(struct cfg *g)
+{
+    if (g->frontier) {
+        return;
+    }
+
+    ASSERT(g->frontier = calloc(g->nblocks, sizeof(struct cfg_edges)));
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        if (!cfg_reachable(g, b) || g->pred[b].count < 2) {
+            continue;
+        }
+
+        for (u32 p = 0; p < g->pred[b].count; ++p) {
+            u32 runner = g->pred[b].items[p];
+
+            if (!cfg_reachable(g, runner)) {
+                continue;
+            }
+
+            while (runner != g->idom[b]) {
+                struct cfg_edges *df = &g->frontier[runner];
+                bool seen = false;
+
+                for (u32 i = 0; i < df->count; ++i) {
+                    seen |= (df->items[i] == b);
+                }
+
+                if (!seen) {
+                    IR_PUSH(df->items, df->count, df->cap, b);
+                }
+
+                // NOTE: the entry block is its own idom, a loop back to it stops here
+                if (runner == g->idom[runner]) {
+                    break;
+                }
+
+                runner = g->idom[runner];
+            }
+        }
+    }
+}
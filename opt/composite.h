@@ -0,0 +1,382 @@
+// Composite and shuffle chain elimination. Every component of a vector built
+// by OpCompositeConstruct, OpVectorShuffle or OpCompositeInsert is traced back
+// to where it really comes from: a component of some other vector, or a scalar.
+// Then:
+//  - a vector equal to its source vector is replaced with it,
+//  - a vector taking components from at most two vectors becomes one
+//    OpVectorShuffle, with constant scalars gathered into a constant vector,
+//  - an OpCompositeExtract reads straight from the source, or is replaced with
+//    the scalar or member it would return.
+// The intermediate composites are left unused and removed.
+
+#define COMPOSITE_MAX 16
+#define COMPOSITE_SCALAR UINT32_MAX
+
+// Where one component comes from: component index of vector id, or the scalar
+// id itself when index is COMPOSITE_SCALAR. Id 0 stands for an undefined component.
+struct composite_source {
+    u32 id;
+    u32 index;
+};
+
+struct composite {
+    struct ir_module *m;
+    struct composite_source *sources;  // COMPOSITE_MAX per id
+    u8 *known;
+    u32 nsources;
+    u32 forwarded;
+    u32 shuffles;
+    u32 extracts;
+    u32 before;
+    u32 after;
+};
+
+static u32 composite_sources(struct composite *c, u32 id, struct composite_source *out);
+
+static struct composite_source
+composite_scalar_source(struct composite *c, u32 id)
+{
+    struct ir_inst *def = ir_def(c->m, id);
+    struct composite_source src = { id, COMPOSITE_SCALAR };
+    struct composite_source vector[COMPOSITE_MAX];
+
+    // NOTE: no sources (not a vector, or too wide) leaves the extract as the scalar itself
+    if (def && def->opcode == SpvOpCompositeExtract && def->nops == 2 &&
+        def->ops[1] < composite_sources(c, def->ops[0], vector)) {
+        src = vector[def->ops[1]];
+    }
+
+    return(src.id ? src : (struct composite_source) { id, COMPOSITE_SCALAR });
+}
+
+// Sources of every component of vector id, returns the component count (0 when id is not a vector)
+static u32
+composite_sources(struct composite *c, u32 id, struct composite_source *out)
+{
+    struct ir_inst *def = ir_def(c->m, id);
+
+    if (!def || !ir_is_vector_type(c->m, def->type)) {
+        return(0);
+    }
+
+    u32 n = ir_vector_size(c->m, def->type);
+
+    if (n > COMPOSITE_MAX) {
+        return(0);
+    }
+
+    if (id < c->nsources && c->known[id]) {
+        memcpy(out, c->sources + id * COMPOSITE_MAX, n * sizeof(struct composite_source));
+        return(n);
+    }
+
+    for (u32 k = 0; k < n; ++k) {
+        out[k] = (struct composite_source) { id, k };
+    }
+
+    switch (def->opcode) {
+        case SpvOpCompositeConstruct: {
+            struct composite_source part[COMPOSITE_MAX];
+            u32 k = 0;
+
+            for (u32 i = 0; i < def->nops && k < n; ++i) {
+                u32 count = composite_sources(c, def->ops[i], part);
+
+                if (count) {
+                    for (u32 j = 0; j < count && k < n; ++j) {
+                        out[k++] = part[j];
+                    }
+                } else {
+                    out[k++] = composite_scalar_source(c, def->ops[i]);
+                }
+            }
+        } break;
+
+        case SpvOpVectorShuffle: {
+            struct composite_source a[COMPOSITE_MAX], b[COMPOSITE_MAX];
+            u32 na = composite_sources(c, def->ops[0], a);
+            u32 nb = composite_sources(c, def->ops[1], b);
+
+            for (u32 k = 0; k < n; ++k) {
+                u32 select = def->ops[2 + k];
+
+                if (select == UINT32_MAX) {
+                    out[k] = (struct composite_source) { 0, 0 };
+                } else if (select < na) {
+                    out[k] = a[select];
+                } else if (select - na < nb) {
+                    out[k] = b[select - na];
+                }
+            }
+        } break;
+
+        case SpvOpCompositeInsert: {
+            if (def->nops == 3 && def->ops[2] < composite_sources(c, def->ops[1], out)) {
+                out[def->ops[2]] = composite_scalar_source(c, def->ops[0]);
+            }
+        } break;
+    }
+
+    if (id < c->nsources) {
+        memcpy(c->sources + id * COMPOSITE_MAX, out, n * sizeof(struct composite_source));
+        c->known[id] = 1;
+    }
+
+    return(n);
+}
+
+static void
+composite_forward(struct composite *c, struct ir_inst *inst, u32 value)
+{
+    ir_replace_uses(c->m, inst->id, value);
+    c->forwarded += 1;
+}
+
+// Whether an operand of inst is itself part of a chain worth collapsing
+static bool
+composite_is_chain(struct composite *c, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < inst->nops; ++i) {
+        struct ir_inst *def = ir_operand_is_id(inst, i) ? ir_def(c->m, inst->ops[i]) : NULL;
+
+        if (def && (def->opcode == SpvOpCompositeExtract || def->opcode == SpvOpCompositeConstruct ||
+                    def->opcode == SpvOpVectorShuffle || def->opcode == SpvOpCompositeInsert)) {
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+static bool
+composite_vector(struct composite *c, struct ir_inst *inst)
+{
+    struct ir_module *m = c->m;
+    struct composite_source src[COMPOSITE_MAX];
+    u32 n = composite_sources(c, inst->id, src);
+    u32 vectors[3] = { 0 };
+    u32 constants[COMPOSITE_MAX] = { 0 };
+    u32 nvectors = 0;
+    u32 base = 0;
+    bool identity = true;
+
+    if (!n || !composite_is_chain(c, inst)) {
+        return(false);
+    }
+
+    for (u32 k = 0; k < n; ++k) {
+        if (!src[k].id) {
+            continue;
+        }
+
+        identity = identity && src[k].index == k && (!base || base == src[k].id);
+        base = src[k].id;
+    }
+
+    if (identity && base && base != inst->id && ir_def(m, base)->type == inst->type) {
+        composite_forward(c, inst, base);
+        return(true);
+    }
+
+    // At most two vectors, constant scalars are gathered into one more
+    u32 constant = 0;
+
+    for (u32 k = 0; k < n; ++k) {
+        bool seen = false;
+
+        if (!src[k].id) {
+            continue;
+        }
+
+        if (src[k].index == COMPOSITE_SCALAR) {
+            if (!ir_is_constant(m, src[k].id)) {
+                return(false);
+            }
+
+            constants[k] = constant = src[k].id;
+            continue;
+        }
+
+        for (u32 v = 0; v < nvectors; ++v) {
+            seen |= (vectors[v] == src[k].id);
+        }
+
+        if (!seen) {
+            if (nvectors == 2) {
+                return(false);
+            }
+
+            vectors[nvectors++] = src[k].id;
+        }
+    }
+
+    if (constant) {
+        if (nvectors == 2) {
+            return(false);
+        }
+
+        for (u32 k = 0; k < n; ++k) {
+            constants[k] = constants[k] ? constants[k] : constant;
+        }
+
+        u32 vector = ir_composite_constant(m, inst->type, constants, n);
+
+        for (u32 k = 0; k < n; ++k) {
+            if (src[k].id && src[k].index == COMPOSITE_SCALAR) {
+                src[k] = (struct composite_source) { vector, k };
+            }
+        }
+
+        vectors[nvectors++] = vector;
+    }
+
+    if (!nvectors) {
+        return(false);
+    }
+
+    if (nvectors == 1 && constant && inst->opcode == SpvOpCompositeConstruct && vectors[0] != inst->id) {
+        // NOTE: every component was a constant
+        composite_forward(c, inst, vectors[0]);
+        return(true);
+    }
+
+    vectors[1] = nvectors == 2 ? vectors[1] : vectors[0];
+
+    u32 na = ir_vector_size(m, ir_def(m, vectors[0])->type);
+    u32 ops[2 + COMPOSITE_MAX] = { vectors[0], vectors[1] };
+
+    for (u32 k = 0; k < n; ++k) {
+        if (!src[k].id) {
+            ops[2 + k] = UINT32_MAX;
+        } else {
+            ops[2 + k] = src[k].id == vectors[0] ? src[k].index : na + src[k].index;
+        }
+    }
+
+    if (inst->opcode == SpvOpVectorShuffle && !memcmp(inst->ops, ops, (2 + n) * sizeof(u32))) {
+        return(false);
+    }
+
+    inst->opcode = SpvOpVectorShuffle;
+    ir_set_nops(inst, 2 + n);
+    memcpy(inst->ops, ops, (2 + n) * sizeof(u32));
+
+    c->shuffles += 1;
+
+    return(true);
+}
+
+static bool
+composite_extract(struct composite *c, struct ir_inst *inst)
+{
+    struct ir_module *m = c->m;
+    struct ir_inst *def = ir_def(m, inst->ops[0]);
+
+    if (!def) {
+        return(false);
+    }
+
+    if (ir_is_vector_type(m, def->type) && inst->nops == 2) {
+        struct composite_source src[COMPOSITE_MAX];
+
+        if (!composite_sources(c, def->id, src) || !src[inst->ops[1]].id || src[inst->ops[1]].id == def->id) {
+            return(false);
+        }
+
+        if (src[inst->ops[1]].index == COMPOSITE_SCALAR) {
+            composite_forward(c, inst, src[inst->ops[1]].id);
+        } else {
+            inst->ops[0] = src[inst->ops[1]].id;
+            inst->ops[1] = src[inst->ops[1]].index;
+            c->extracts += 1;
+        }
+
+        return(true);
+    }
+
+    // Members of structs, arrays and matrices
+    if (def->opcode == SpvOpCompositeConstruct && !ir_is_vector_type(m, def->type) && inst->ops[1] < def->nops) {
+        if (inst->nops == 2) {
+            composite_forward(c, inst, def->ops[inst->ops[1]]);
+        } else {
+            inst->ops[0] = def->ops[inst->ops[1]];
+            memmove(inst->ops + 1, inst->ops + 2, (inst->nops - 2) * sizeof(u32));
+            ir_set_nops(inst, inst->nops - 1);
+            c->extracts += 1;
+        }
+
+        return(true);
+    }
+
+    if (def->opcode == SpvOpCompositeInsert) {
+        if (def->nops == inst->nops + 1 && !memcmp(def->ops + 2, inst->ops + 1, (inst->nops - 1) * sizeof(u32))) {
+            composite_forward(c, inst, def->ops[0]);
+            return(true);
+        }
+
+        // NOTE: a different member at the first level is untouched by the insert
+        if (def->ops[2] != inst->ops[1]) {
+            inst->ops[0] = def->ops[1];
+            c->extracts += 1;
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+static void
+composite_run(struct ir_module *m, struct composite *c)
+{
+    bool changed = true;
+
+    memset(c, 0x00, sizeof(struct composite));
+
+    c->m = m;
+    c->nsources = m->bound;
+    c->before = ir_count_insts(m);
+
+    ASSERT(c->sources = malloc((u64) c->nsources * COMPOSITE_MAX * sizeof(struct composite_source)));
+    ASSERT(c->known = calloc(c->nsources, sizeof(u8)));
+
+    // NOTE: rewrites keep every component's source, so the cached sources stay valid between rounds
+    for (u32 round = 0; round < 8 && changed; ++round) {
+        changed = false;
+
+        for (u32 f = 0; f < m->nfunctions; ++f) {
+            struct ir_function *func = m->functions[f];
+
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+                    struct ir_inst *inst = func->blocks[b]->insts[i];
+
+                    switch (inst->opcode) {
+                        case SpvOpCompositeConstruct:
+                        case SpvOpVectorShuffle:
+                        case SpvOpCompositeInsert: {
+                            changed |= composite_vector(c, inst);
+                        } break;
+
+                        case SpvOpCompositeExtract: {
+                            changed |= composite_extract(c, inst);
+                        } break;
+                    }
+                }
+            }
+        }
+
+        ir_remove_dead_code(m);
+    }
+
+    c->after = ir_count_insts(m);
+
+    free(c->sources);
+    free(c->known);
+}
+
+static void
+composite_report(struct composite *c, FILE *out)
+{
+    fprintf(out, "[COMPOSITE] %u values forwarded, %u shuffles formed, %u extracts shortened, %u -> %u instructions (%d)\n",
+            c->forwarded, c->shuffles, c->extracts, c->before, c->after, (s32) c->after - (s32) c->before);
+}
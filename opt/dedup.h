@@ -0,0 +1,438 @@
+// Type and constant deduplication with global-section compaction. Linked or
+// generated modules repeat OpType*, OpConstant* and OpDecorate entries, and
+// the driver parses and hashes every one of them.
+//
+// Types, constants and undefs are hash-consed in declaration order: two are
+// the same when opcode, result type, literals, operand ids (already made
+// canonical) and decorations all match. Every use is rewritten to the first of
+// them and the others are removed. Then, last to first so a composite takes
+// its parts with it, types, constants and Private variables nothing uses go,
+// together with the names and decorations left on them and every repeated
+// annotation. Needs every function of the module, a use it does not see is a
+// global it removes.
+
+#define DEDUP_FNV_OFFSET 0xcbf29ce484222325ull
+#define DEDUP_FNV_PRIME  0x100000001b3ull
+
+struct dedup_slot {
+    u64 hash;
+    u32 id;  // or global index + 1 for annotations, 0 when empty
+};
+
+struct dedup {
+    struct ir_module *m;
+    u32 *canonical;      // per id, the id that replaces it
+    u32 *annotations;    // per id, first annotation global index + 1
+    u32 *next;           // per global index, the next annotation of the same id + 1
+    u64 *decorations;    // per id, order-independent hash of its annotations
+    bool *pinned;        // per id, pointers declared forward
+    bool *removed;       // per id
+    struct dedup_slot *slots;
+    u32 nslots;
+    u32 types;
+    u32 constants;
+    u32 unused;
+    u32 removed_annotations;
+    u32 globals_before;
+    u32 globals_after;
+    u32 words_before;
+    u32 words_after;
+};
+
+static u64
+dedup_mix(u64 hash, u32 word)
+{
+    hash ^= word;
+    hash *= DEDUP_FNV_PRIME;
+
+    return(hash);
+}
+
+static u32
+dedup_words(struct ir_module *m, u32 *nglobals)
+{
+    u32 words = 0;
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        words += 1 + m->globals[i]->nops + (m->globals[i]->type ? 1 : 0) + (m->globals[i]->id ? 1 : 0);
+    }
+
+    *nglobals = m->nglobals;
+
+    return(words);
+}
+
+static bool
+dedup_is_type(u32 opcode)
+{
+    return(opcode >= SpvOpTypeVoid && opcode <= SpvOpTypeFunction);
+}
+
+// NOTE: spec constants are left alone, each one can be specialized on its own
+static bool
+dedup_is_constant(u32 opcode)
+{
+    return((opcode >= SpvOpConstantTrue && opcode <= SpvOpConstantNull) || opcode == SpvOpUndef);
+}
+
+static u32
+dedup_canonical(struct dedup *d, u32 id)
+{
+    return(id < d->m->bound ? d->canonical[id] : id);
+}
+
+// Threads the annotations of every id into a list and hashes them, the order they come in does not matter
+static void
+dedup_index_annotations(struct dedup *d)
+{
+    struct ir_module *m = d->m;
+
+    for (u32 i = m->nglobals; i-- > 0;) {
+        struct ir_inst *inst = m->globals[i];
+        u64 hash = dedup_mix(DEDUP_FNV_OFFSET, inst->opcode);
+
+        if (!ir_is_annotation(inst->opcode) || inst->ops[0] >= m->bound) {
+            continue;
+        }
+
+        d->next[i] = d->annotations[inst->ops[0]];
+        d->annotations[inst->ops[0]] = i + 1;
+
+        // NOTE: names do not change what an id is
+        if (inst->opcode == SpvOpName || inst->opcode == SpvOpMemberName) {
+            continue;
+        }
+
+        for (u32 k = 1; k < inst->nops; ++k) {
+            hash = dedup_mix(hash, inst->ops[k]);
+        }
+
+        d->decorations[inst->ops[0]] += hash;
+    }
+}
+
+static bool
+dedup_has_decoration(struct dedup *d, u32 id, struct ir_inst *decoration)
+{
+    for (u32 at = d->annotations[id]; at; at = d->next[at - 1]) {
+        struct ir_inst *inst = d->m->globals[at - 1];
+
+        if (inst->opcode == decoration->opcode && inst->nops == decoration->nops &&
+            !memcmp(inst->ops + 1, decoration->ops + 1, (inst->nops - 1) * sizeof(u32))) {
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+static bool
+dedup_same_decorations(struct dedup *d, u32 a, u32 b)
+{
+    if (d->decorations[a] != d->decorations[b]) {
+        return(false);
+    }
+
+    for (u32 pass = 0; pass < 2; ++pass) {
+        u32 from = pass ? b : a;
+        u32 to = pass ? a : b;
+
+        for (u32 at = d->annotations[from]; at; at = d->next[at - 1]) {
+            struct ir_inst *inst = d->m->globals[at - 1];
+
+            if (inst->opcode != SpvOpName && inst->opcode != SpvOpMemberName && !dedup_has_decoration(d, to, inst)) {
+                return(false);
+            }
+        }
+    }
+
+    return(true);
+}
+
+static u64
+dedup_hash(struct dedup *d, struct ir_inst *inst)
+{
+    u64 hash = dedup_mix(DEDUP_FNV_OFFSET, inst->opcode);
+
+    hash = dedup_mix(hash, dedup_canonical(d, inst->type));
+    hash = dedup_mix(hash, inst->nops);
+
+    for (u32 i = 0; i < inst->nops; ++i) {
+        hash = dedup_mix(hash, ir_operand_is_id(inst, i) ? dedup_canonical(d, inst->ops[i]) : inst->ops[i]);
+    }
+
+    return(hash ^ d->decorations[inst->id]);
+}
+
+static bool
+dedup_equal(struct dedup *d, struct ir_inst *a, struct ir_inst *b)
+{
+    if (a->opcode != b->opcode || a->nops != b->nops || dedup_canonical(d, a->type) != dedup_canonical(d, b->type)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i < a->nops; ++i) {
+        bool id = ir_operand_is_id(a, i);
+
+        if ((id ? dedup_canonical(d, a->ops[i]) : a->ops[i]) != (id ? dedup_canonical(d, b->ops[i]) : b->ops[i])) {
+            return(false);
+        }
+    }
+
+    return(dedup_same_decorations(d, a->id, b->id));
+}
+
+static void
+dedup_slots_reset(struct dedup *d, u32 count)
+{
+    u32 nslots = 16;
+
+    while (nslots < 2 * count) {
+        nslots *= 2;
+    }
+
+    if (nslots > d->nslots) {
+        ASSERT(d->slots = realloc(d->slots, nslots * sizeof(struct dedup_slot)));
+        d->nslots = nslots;
+    }
+
+    memset(d->slots, 0x00, d->nslots * sizeof(struct dedup_slot));
+}
+
+// Maps every duplicate type and constant to the first one declared
+static void
+dedup_merge(struct dedup *d)
+{
+    struct ir_module *m = d->m;
+
+    dedup_slots_reset(d, m->nglobals);
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        bool type = dedup_is_type(inst->opcode);
+
+        if (!inst->id || (!type && !dedup_is_constant(inst->opcode))) {
+            continue;
+        }
+
+        // NOTE: a pointer declared forward has to stay where the forward declaration expects it
+        if (d->pinned[inst->id]) {
+            continue;
+        }
+
+        u64 hash = dedup_hash(d, inst);
+        u32 at = (u32) hash & (d->nslots - 1);
+
+        for (; d->slots[at].id; at = (at + 1) & (d->nslots - 1)) {
+            if (d->slots[at].hash == hash && dedup_equal(d, inst, ir_def(m, d->slots[at].id))) {
+                break;
+            }
+        }
+
+        if (d->slots[at].id) {
+            d->canonical[inst->id] = d->slots[at].id;
+            d->types += type;
+            d->constants += !type;
+        } else {
+            d->slots[at] = (struct dedup_slot) { hash, inst->id };
+        }
+    }
+}
+
+// Drops the globals marked in drop in one sweep
+static void
+dedup_compact(struct dedup *d, bool *drop)
+{
+    struct ir_module *m = d->m;
+    u32 kept = 0;
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+
+        if (!drop[i]) {
+            m->globals[kept++] = inst;
+            continue;
+        }
+
+        if (inst->id && ir_def(m, inst->id) == inst) {
+            m->defs[inst->id] = NULL;
+        }
+
+        ir_free_inst(inst);
+    }
+
+    m->nglobals = kept;
+}
+
+static void
+dedup_remove_unused(struct dedup *d, bool *drop)
+{
+    struct ir_module *m = d->m;
+    u32 *uses = ir_use_counts(m);
+
+    // NOTE: the operands of OpDecorateId are real uses
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+
+        for (u32 k = 2; inst->opcode == SpvOpDecorateId && k < inst->nops; ++k) {
+            uses[inst->ops[k]] += inst->ops[k] < m->bound;
+        }
+    }
+
+    for (u32 i = m->nglobals; i-- > 0;) {
+        struct ir_inst *inst = m->globals[i];
+        bool removable = dedup_is_type(inst->opcode) || dedup_is_constant(inst->opcode) ||
+                         (inst->opcode == SpvOpVariable && inst->ops[0] == SpvStorageClassPrivate);
+
+        if (drop[i] || !inst->id || !removable || uses[inst->id]) {
+            continue;
+        }
+
+        drop[i] = true;
+        d->removed[inst->id] = true;
+        d->unused += 1;
+
+        if (inst->type) {
+            uses[inst->type] -= 1;
+        }
+
+        for (u32 k = 0; k < inst->nops; ++k) {
+            if (ir_operand_is_id(inst, k) && inst->ops[k] < m->bound && uses[inst->ops[k]]) {
+                uses[inst->ops[k]] -= 1;
+            }
+        }
+    }
+
+    free(uses);
+}
+
+// Annotations on removed ids and repeats of one seen before
+static void
+dedup_remove_annotations(struct dedup *d, bool *drop)
+{
+    struct ir_module *m = d->m;
+
+    dedup_slots_reset(d, m->nglobals);
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        u64 hash = dedup_mix(DEDUP_FNV_OFFSET, inst->opcode);
+
+        if (!ir_is_annotation(inst->opcode) || drop[i]) {
+            continue;
+        }
+
+        if (inst->ops[0] < m->bound && d->removed[inst->ops[0]]) {
+            drop[i] = true;
+            d->removed_annotations += 1;
+            continue;
+        }
+
+        for (u32 k = 0; k < inst->nops; ++k) {
+            hash = dedup_mix(hash, inst->ops[k]);
+        }
+
+        u32 at = (u32) hash & (d->nslots - 1);
+
+        for (; d->slots[at].id; at = (at + 1) & (d->nslots - 1)) {
+            struct ir_inst *other = m->globals[d->slots[at].id - 1];
+
+            if (d->slots[at].hash == hash && other->opcode == inst->opcode && other->nops == inst->nops &&
+                !memcmp(other->ops, inst->ops, inst->nops * sizeof(u32))) {
+                break;
+            }
+        }
+
+        if (d->slots[at].id) {
+            drop[i] = true;
+            d->removed_annotations += 1;
+        } else {
+            d->slots[at] = (struct dedup_slot) { hash, i + 1 };
+        }
+    }
+}
+
+static void
+dedup_run(struct ir_module *m, struct dedup *d)
+{
+    bool *drop;
+
+    memset(d, 0x00, sizeof(struct dedup));
+
+    d->m = m;
+    d->words_before = dedup_words(m, &d->globals_before);
+
+    ASSERT(d->canonical = malloc(m->bound * sizeof(u32)));
+    ASSERT(d->annotations = calloc(m->bound, sizeof(u32)));
+    ASSERT(d->decorations = calloc(m->bound, sizeof(u64)));
+    ASSERT(d->pinned = calloc(m->bound, sizeof(bool)));
+    ASSERT(d->removed = calloc(m->bound, sizeof(bool)));
+    ASSERT(d->next = calloc(m->nglobals + 1, sizeof(u32)));
+    ASSERT(drop = calloc(m->nglobals + 1, sizeof(bool)));
+
+    for (u32 id = 0; id < m->bound; ++id) {
+        d->canonical[id] = id;
+    }
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpTypeForwardPointer && m->globals[i]->ops[0] < m->bound) {
+            d->pinned[m->globals[i]->ops[0]] = true;
+        }
+    }
+
+    dedup_index_annotations(d);
+    dedup_merge(d);
+
+    // The duplicates carry the same decorations as what replaces them, theirs and their names go
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+
+        if ((inst->id && d->canonical[inst->id] != inst->id) ||
+            (ir_is_annotation(inst->opcode) && dedup_canonical(d, inst->ops[0]) != inst->ops[0])) {
+            drop[i] = true;
+            d->removed_annotations += !inst->id;
+        }
+    }
+
+    IR_FOR_EACH_INST(m, inst, {
+        inst->type = dedup_canonical(d, inst->type);
+        for (u32 i = 0; i < inst->nops; ++i) {
+            if (ir_operand_is_id(inst, i)) {
+                inst->ops[i] = dedup_canonical(d, inst->ops[i]);
+            }
+        }
+    });
+
+    dedup_compact(d, drop);
+
+    memset(drop, 0x00, (m->nglobals + 1) * sizeof(bool));
+
+    dedup_remove_unused(d, drop);
+    dedup_remove_annotations(d, drop);
+    dedup_compact(d, drop);
+
+    d->words_after = dedup_words(m, &d->globals_after);
+
+    free(drop);
+}
+
+static void
+dedup_report(struct dedup *d, FILE *out)
+{
+    fprintf(out, "[DEDUP] %u types and %u constants merged, %u unused globals and %u annotations removed, "
+            "%u -> %u globals, %u -> %u words (%d)\n",
+            d->types, d->constants, d->unused, d->removed_annotations, d->globals_before, d->globals_after,
+            d->words_before, d->words_after, (s32) d->words_after - (s32) d->words_before);
+}
+
+static void
+dedup_free(struct dedup *d)
+{
+    free(d->canonical);
+    free(d->annotations);
+    free(d->next);
+    free(d->decorations);
+    free(d->pinned);
+    free(d->removed);
+    free(d->slots);
+}
@@ -0,0 +1,66 @@
+// Float semantics a rewrite may give up. By default shaders get the usual GPU
+// freedoms; the module's SignedZeroInfNanPreserve mode, an FPFastMathMode
+// decoration or NoContraction on the instruction narrow them, and strict IEEE
+// mode removes them altogether.
+
+enum fp_relax {
+    FP_NSZ      = 0x01,  // sign of zero may change
+    FP_NAN_INF  = 0x02,  // NaN and infinity operands may be ignored
+    FP_REASSOC  = 0x04,  // rounding may change through reassociation
+    FP_CONTRACT = 0x08,  // multiply and add may be fused
+    FP_RECIP    = 0x10,  // division may become multiplication by the reciprocal
+    FP_ALL      = 0x1F,
+};
+
+// What the module as a whole allows, before per-instruction decorations
+static u32
+fp_module_relax(struct ir_module *m, bool strict)
+{
+    u32 relax = FP_ALL;
+    u32 width;
+
+    if (strict) {
+        return(0);
+    }
+
+    if (ir_execution_mode(m, SpvExecutionModeSignedZeroInfNanPreserve, &width) && width == 32) {
+        relax &= ~(FP_NSZ | FP_NAN_INF);
+    }
+
+    return(relax);
+}
+
+static bool
+fp_allowed(struct ir_module *m, u32 module_relax, struct ir_inst *inst, u32 relax)
+{
+    u32 mode;
+
+    if (!relax) {
+        return(true);
+    }
+
+    if (ir_decoration(m, inst->id, SpvDecorationNoContraction, NULL)) {
+        return(false);
+    }
+
+    if (ir_decoration(m, inst->id, SpvDecorationFPFastMathMode, &mode)) {
+        u32 allowed = 0;
+
+        if (mode & SpvFPFastMathModeFast) {
+            allowed = FP_ALL;
+        }
+        if (mode & SpvFPFastMathModeNSZ) {
+            allowed |= FP_NSZ;
+        }
+        if ((mode & SpvFPFastMathModeNotNaN) && (mode & SpvFPFastMathModeNotInf)) {
+            allowed |= FP_NAN_INF;
+        }
+        if (mode & SpvFPFastMathModeAllowRecip) {
+            allowed |= FP_RECIP;
+        }
+
+        module_relax &= allowed;
+    }
+
+    return((relax & module_relax) == relax);
+}
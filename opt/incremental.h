@@ -0,0 +1,534 @@
+// Function hashing and body import, the base of incremental re-optimization
+// (incremental_reload.h). Every function of a module is hashed with its ids
+// made canonical: results, parameters and labels are numbered in order of
+// definition, a global is replaced by a hash of its structure and decorations,
+// a callee by the callee's own hash. Names and line numbers are left out, so a
+// function keeps its hash unless it, or something it calls, really changed.
+//
+// A function body can then be copied from one module into another, ids
+// remapped, globals it needs matched by hash or cloned.
+
+#define INCREMENTAL_FNV_OFFSET 0xcbf29ce484222325ull
+#define INCREMENTAL_FNV_PRIME  0x100000001b3ull
+
+struct incremental_hasher {
+    struct ir_module *m;
+    u64 *globals;    // by id, 0 when not computed yet
+    u64 *functions;  // by id
+    u32 *locals;     // by id, canonical number + 1 inside the function being hashed
+    u64 *decorations;
+    u64 *variables;  // base hashes of the variables seen so far
+    u32 nvariables;
+};
+
+struct incremental_global {
+    u64 hash;
+    u32 id;
+};
+
+// Carries the id mapping while function bodies move from another module into
+// m. Functions are matched through keys: a call to the source function with
+// from_keys[f] becomes a call to the function of m with the same keys[g].
+struct incremental_import {
+    struct ir_module *m;
+    struct ir_module *from;
+    struct incremental_hasher source;
+    struct incremental_global *table;  // globals of m by structural hash
+    u32 ntable;
+    u32 tcap;
+    u64 *keys;
+    u64 *from_keys;
+    u32 *remap;  // by source id
+};
+
+static u64
+incremental_mix(u64 hash, u32 word)
+{
+    for (u32 i = 0; i < 4; ++i) {
+        hash ^= (word >> (8 * i)) & 0xFF;
+        hash *= INCREMENTAL_FNV_PRIME;
+    }
+
+    return(hash);
+}
+
+static u64 incremental_function_hash(struct incremental_hasher *h, struct ir_function *func);
+
+static u64
+incremental_global_hash(struct incremental_hasher *h, u32 id)
+{
+    struct ir_module *m = h->m;
+    struct ir_inst *def = ir_def(m, id);
+
+    if (!def) {
+        return(0);
+    }
+
+    if (h->globals[id]) {
+        return(h->globals[id]);
+    }
+
+    // NOTE: marks the id as in progress, forward pointers make cycles
+    h->globals[id] = 1;
+
+    u64 hash = incremental_mix(INCREMENTAL_FNV_OFFSET, def->opcode);
+
+    hash = incremental_mix(hash, (u32) incremental_global_hash(h, def->type));
+
+    for (u32 i = 0; i < def->nops; ++i) {
+        if (ir_operand_is_id(def, i) && ir_def(m, def->ops[i])) {
+            hash = incremental_mix(hash, (u32) incremental_global_hash(h, def->ops[i]));
+        } else {
+            hash = incremental_mix(hash, def->ops[i]);
+        }
+    }
+
+    hash ^= h->decorations[id];
+
+    // Identical constants and types can stand for each other, identical variables cannot
+    if (def->opcode == SpvOpVariable) {
+        u32 ordinal = 0;
+
+        for (u32 v = 0; v < h->nvariables; ++v) {
+            ordinal += (h->variables[v] == hash);
+        }
+
+        h->variables[h->nvariables++] = hash;
+        hash = incremental_mix(hash, ordinal);
+    }
+
+    h->globals[id] = hash ? hash : 2;
+
+    return(h->globals[id]);
+}
+
+static u64
+incremental_reference(struct incremental_hasher *h, u64 hash, u32 id)
+{
+    struct ir_function *callee;
+
+    if (h->locals[id]) {
+        return(incremental_mix(hash, h->locals[id]));
+    }
+
+    if ((callee = ir_find_function(h->m, id))) {
+        u64 other = incremental_function_hash(h, callee);
+        return(incremental_mix(incremental_mix(hash, (u32) other), (u32) (other >> 32)));
+    }
+
+    u64 other = incremental_global_hash(h, id);
+
+    return(incremental_mix(incremental_mix(hash, (u32) other), (u32) (other >> 32)));
+}
+
+static u64
+incremental_function_hash(struct incremental_hasher *h, struct ir_function *func)
+{
+    u32 id = func->def->id;
+    u32 next = 1;
+
+    if (h->functions[id]) {
+        return(h->functions[id]);
+    }
+
+    h->functions[id] = 1;
+
+    // NOTE: callees first, the local numbering below is shared by every function
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            struct ir_inst *inst = func->blocks[b]->insts[i];
+            struct ir_function *callee;
+
+            if (inst->opcode == SpvOpFunctionCall && (callee = ir_find_function(h->m, inst->ops[0]))) {
+                incremental_function_hash(h, callee);
+            }
+        }
+    }
+
+    for (u32 p = 0; p < func->nparams; ++p) {
+        h->locals[func->params[p]->id] = next++;
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        h->locals[func->blocks[b]->label] = next++;
+
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            if (func->blocks[b]->insts[i]->id) {
+                h->locals[func->blocks[b]->insts[i]->id] = next++;
+            }
+        }
+    }
+
+    u64 hash = incremental_mix(INCREMENTAL_FNV_OFFSET, func->def->ops[0]);
+
+    hash = incremental_reference(h, hash, func->def->type);
+    hash = incremental_reference(h, hash, func->def->ops[1]);
+
+    for (u32 p = 0; p < func->nparams; ++p) {
+        hash = incremental_reference(h, hash, func->params[p]->type);
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        hash = incremental_mix(hash, SpvOpLabel);
+
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            struct ir_inst *inst = func->blocks[b]->insts[i];
+
+            hash = incremental_mix(hash, inst->opcode);
+            hash = inst->type ? incremental_reference(h, hash, inst->type) : hash;
+            hash = incremental_mix(hash, inst->id ? h->locals[inst->id] : 0);
+
+            for (u32 k = 0; k < inst->nops; ++k) {
+                if (ir_operand_is_id(inst, k) && inst->ops[k] < h->m->bound) {
+                    hash = incremental_reference(h, hash, inst->ops[k]);
+                } else {
+                    hash = incremental_mix(hash, inst->ops[k]);
+                }
+            }
+
+            // Decorations of results, e.g. RelaxedPrecision or NoContraction
+            if (inst->id) {
+                hash ^= h->decorations[inst->id];
+            }
+        }
+    }
+
+    for (u32 p = 0; p < func->nparams; ++p) {
+        h->locals[func->params[p]->id] = 0;
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        h->locals[func->blocks[b]->label] = 0;
+
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            h->locals[func->blocks[b]->insts[i]->id] = 0;
+        }
+    }
+
+    h->functions[id] = hash ? hash : 2;
+
+    return(h->functions[id]);
+}
+
+static void
+incremental_hasher_init(struct incremental_hasher *h, struct ir_module *m)
+{
+    memset(h, 0x00, sizeof(struct incremental_hasher));
+
+    h->m = m;
+
+    ASSERT(h->globals = calloc(m->bound, sizeof(u64)));
+    ASSERT(h->functions = calloc(m->bound, sizeof(u64)));
+    ASSERT(h->locals = calloc(m->bound, sizeof(u32)));
+    ASSERT(h->decorations = calloc(m->bound, sizeof(u64)));
+    ASSERT(h->variables = malloc((m->nglobals + 1) * sizeof(u64)));
+
+    // NOTE: summed so the order of the decorations does not matter
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        u64 hash = incremental_mix(INCREMENTAL_FNV_OFFSET, inst->opcode);
+
+        if (inst->opcode != SpvOpDecorate && inst->opcode != SpvOpMemberDecorate) {
+            continue;
+        }
+
+        for (u32 k = 1; k < inst->nops; ++k) {
+            hash = incremental_mix(hash, inst->ops[k]);
+        }
+
+        if (inst->ops[0] < m->bound) {
+            h->decorations[inst->ops[0]] += hash;
+        }
+    }
+
+    // Variables are numbered in the order they are declared
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->id) {
+            incremental_global_hash(h, m->globals[i]->id);
+        }
+    }
+}
+
+static void
+incremental_hasher_free(struct incremental_hasher *h)
+{
+    free(h->globals);
+    free(h->functions);
+    free(h->locals);
+    free(h->decorations);
+    free(h->variables);
+}
+
+static s32
+incremental_global_compare(const void *a, const void *b)
+{
+    u64 x = ((const struct incremental_global *) a)->hash;
+    u64 y = ((const struct incremental_global *) b)->hash;
+
+    return((x > y) - (x < y));
+}
+
+static u32 incremental_map(struct incremental_import *im, u32 id);
+
+// h must be the hasher of m, it is only needed here
+static void
+incremental_import_init(struct incremental_import *im, struct ir_module *m, struct incremental_hasher *h, u64 *keys,
+                        struct ir_module *from, u64 *from_keys)
+{
+    memset(im, 0x00, sizeof(struct incremental_import));
+
+    im->m = m;
+    im->from = from;
+    im->keys = keys;
+    im->from_keys = from_keys;
+
+    incremental_hasher_init(&im->source, from);
+
+    ASSERT(im->remap = calloc(from->bound, sizeof(u32)));
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->id) {
+            struct incremental_global g = { h->globals[m->globals[i]->id], m->globals[i]->id };
+            IR_PUSH(im->table, im->ntable, im->tcap, g);
+        }
+    }
+
+    qsort(im->table, im->ntable, sizeof(struct incremental_global), incremental_global_compare);
+}
+
+static void
+incremental_import_free(struct incremental_import *im)
+{
+    incremental_hasher_free(&im->source);
+    free(im->table);
+    free(im->remap);
+}
+
+// Copies a global the passes created in the source module, e.g. a new constant or type
+static u32
+incremental_clone_global(struct incremental_import *im, struct ir_inst *def, u64 hash)
+{
+    struct ir_inst *inst = ir_new_inst(def->opcode, 0, ir_new_id(im->m), def->nops);
+    struct incremental_global g = { hash, inst->id };
+    u32 at;
+
+    im->remap[def->id] = inst->id;
+
+    inst->type = incremental_map(im, def->type);
+
+    for (u32 i = 0; i < def->nops; ++i) {
+        inst->ops[i] = ir_operand_is_id(def, i) ? incremental_map(im, def->ops[i]) : def->ops[i];
+    }
+
+    // NOTE: an import or a string belongs to its own section, only types, constants and variables go to the end
+    ir_insert_global(im->m, ir_section_end(im->m, inst->opcode), inst);
+
+    if (inst->opcode == SpvOpExtInstImport && !strcmp((const char *) inst->ops, "GLSL.std.450")) {
+        im->m->glsl_set = inst->id;
+    }
+
+    // NOTE: kept sorted, another source module may have created the same global. Mapping the operands may have
+    // cloned more globals, so the end of the table is only known now.
+    at = im->ntable;
+
+    IR_PUSH(im->table, im->ntable, im->tcap, g);
+
+    while (at > 0 && im->table[at - 1].hash > hash) {
+        im->table[at] = im->table[at - 1];
+        at -= 1;
+    }
+
+    im->table[at] = g;
+
+    return(inst->id);
+}
+
+// Id in m of a source module id outside the function being copied
+static u32
+incremental_map(struct incremental_import *im, u32 id)
+{
+    struct ir_module *from = im->from;
+    struct ir_inst *def = ir_def(from, id);
+
+    if (!id || id >= from->bound) {
+        return(id);
+    }
+
+    if (im->remap[id]) {
+        return(im->remap[id]);
+    }
+
+    for (u32 f = 0; f < from->nfunctions; ++f) {
+        if (from->functions[f]->def->id != id) {
+            continue;
+        }
+
+        for (u32 g = 0; g < im->m->nfunctions; ++g) {
+            if (im->keys[g] == im->from_keys[f]) {
+                return(im->remap[id] = im->m->functions[g]->def->id);
+            }
+        }
+
+        return(id);
+    }
+
+    if (!def) {
+        return(id);
+    }
+
+    struct incremental_global key = { incremental_global_hash(&im->source, id), 0 };
+    struct incremental_global *found = bsearch(&key, im->table, im->ntable, sizeof(struct incremental_global),
+                                               incremental_global_compare);
+
+    if (found) {
+        return(im->remap[id] = found->id);
+    }
+
+    return(incremental_clone_global(im, def, key.hash));
+}
+
+// Empties the body of func, the names and decorations of its results go in one sweep over the globals
+static void
+incremental_clear(struct ir_module *m, struct ir_function *func)
+{
+    bool *local;
+
+    ASSERT(local = calloc(m->bound, sizeof(bool)));
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        local[func->blocks[b]->label] = true;
+
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            local[func->blocks[b]->insts[i]->id] = true;
+        }
+    }
+
+    local[0] = false;
+
+    for (u32 i = m->nglobals; i-- > 0;) {
+        if (ir_is_annotation(m->globals[i]->opcode) && m->globals[i]->ops[0] < m->bound && local[m->globals[i]->ops[0]]) {
+            ir_remove_global(m, i);
+        }
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        struct ir_block *block = func->blocks[b];
+
+        while (block->ninsts) {
+            ir_remove(m, block, block->ninsts - 1);
+        }
+
+        free(block->insts);
+        free(block);
+    }
+
+    func->nblocks = 0;
+
+    free(local);
+}
+
+// Index right after the debug names, before OpModuleProcessed and the annotations
+static u32
+incremental_names_end(struct ir_module *m)
+{
+    u32 end = ir_types_start(m);
+
+    for (u32 i = 0; i < end; ++i) {
+        u32 op = m->globals[i]->opcode;
+
+        if (op == SpvOpModuleProcessed || op == SpvOpDecorate || op == SpvOpMemberDecorate || op == SpvOpDecorateId ||
+            op == SpvOpDecorationGroup || op == SpvOpGroupDecorate || op == SpvOpGroupMemberDecorate) {
+            return(i);
+        }
+    }
+
+    return(end);
+}
+
+// Replaces the body of to with the body of the source function from, line numbers moved by delta
+static void
+incremental_copy(struct incremental_import *im, struct ir_function *to, struct ir_function *from, s32 delta)
+{
+    struct ir_module *m = im->m;
+    struct ir_module *source = im->from;
+
+    incremental_clear(m, to);
+
+    im->remap[from->def->id] = to->def->id;
+
+    for (u32 p = 0; p < from->nparams && p < to->nparams; ++p) {
+        im->remap[from->params[p]->id] = to->params[p]->id;
+    }
+
+    for (u32 b = 0; b < from->nblocks; ++b) {
+        im->remap[from->blocks[b]->label] = ir_new_id(m);
+
+        for (u32 i = 0; i < from->blocks[b]->ninsts; ++i) {
+            if (from->blocks[b]->insts[i]->id) {
+                im->remap[from->blocks[b]->insts[i]->id] = ir_new_id(m);
+            }
+        }
+    }
+
+    for (u32 b = 0; b < from->nblocks; ++b) {
+        struct ir_block *block = ir_new_block(to, im->remap[from->blocks[b]->label]);
+
+        IR_PUSH(to->blocks, to->nblocks, to->bcap, block);
+
+        for (u32 i = 0; i < from->blocks[b]->ninsts; ++i) {
+            struct ir_inst *src = from->blocks[b]->insts[i];
+            struct ir_inst *inst = ir_new_inst(src->opcode, incremental_map(im, src->type),
+                                               src->id ? im->remap[src->id] : 0, src->nops);
+
+            for (u32 k = 0; k < src->nops; ++k) {
+                inst->ops[k] = ir_operand_is_id(src, k) ? incremental_map(im, src->ops[k]) : src->ops[k];
+            }
+
+            inst->file = src->line ? incremental_map(im, src->file) : 0;
+            inst->line = src->line ? (u32) ((s32) src->line + delta) : 0;
+
+            ir_append(block, inst);
+            ir_register_inst(m, inst);
+        }
+    }
+
+    // Names and decorations of results come along, each into its own section
+    for (u32 i = 0; i < source->nglobals; ++i) {
+        struct ir_inst *src = source->globals[i];
+        struct ir_inst *target = (src->opcode == SpvOpName || src->opcode == SpvOpDecorate) ? ir_def(source, src->ops[0]) : NULL;
+
+        if (target && target->block && target->block->func == from) {
+            struct ir_inst *inst = ir_new_inst(src->opcode, 0, 0, src->nops);
+
+            memcpy(inst->ops, src->ops, src->nops * sizeof(u32));
+            inst->ops[0] = im->remap[src->ops[0]];
+
+            ir_insert_global(m, src->opcode == SpvOpName ? incremental_names_end(m) : ir_types_start(m), inst);
+        }
+    }
+
+    // Copied bodies may need what the passes enabled in the source module
+    for (u32 i = 0; i < source->nglobals; ++i) {
+        struct ir_inst *src = source->globals[i];
+        bool present = false;
+
+        if (src->opcode == SpvOpCapability) {
+            ir_add_capability(m, src->ops[0]);
+        }
+
+        if (src->opcode != SpvOpExtension) {
+            continue;
+        }
+
+        for (u32 k = 0; k < m->nglobals && !present; ++k) {
+            present = (m->globals[k]->opcode == SpvOpExtension && !strcmp((const char *) m->globals[k]->ops, (const char *) src->ops));
+        }
+
+        if (!present) {
+            struct ir_inst *inst = ir_new_inst(SpvOpExtension, 0, 0, src->nops);
+
+            memcpy(inst->ops, src->ops, src->nops * sizeof(u32));
+            ir_insert_global(m, ir_section_end(m, SpvOpExtension), inst);
+        }
+    }
+}
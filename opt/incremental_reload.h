@@ -0,0 +1,185 @@
+// Incremental re-optimization for hot reload. The optimized module of the
+// last load is kept along with the hash each of its functions had before
+// optimization. On the next load unchanged functions get their optimized body
+// copied over, ids remapped into the new module, and the passes only run on
+// the rest.
+
+struct incremental {
+    struct ir_module module;  // optimized result of the last load
+    u64 *keys;                // per function of module, hash of the function it was optimized from
+    u32 *first_lines;         // per function of module, first line of that input function
+    bool valid;
+    u32 functions;
+    u32 reused;
+    f64 msec;
+};
+
+static u32
+incremental_first_line(struct ir_function *func)
+{
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            if (func->blocks[b]->insts[i]->line) {
+                return(func->blocks[b]->insts[i]->line);
+            }
+        }
+    }
+
+    return(func->def->line);
+}
+
+// What every function is optimized under: the capabilities, e.g. Float16 for the
+// precision pass, and the execution modes, e.g. SignedZeroInfNanPreserve for the
+// float rewrites. Mixed into the keys so a change to either optimizes everything again.
+static u64
+incremental_environment(struct incremental_hasher *h)
+{
+    struct ir_module *m = h->m;
+    u64 environment = 0;
+
+    // NOTE: summed so the order of the instructions does not matter, the entry point id is left out
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        u64 hash = incremental_mix(INCREMENTAL_FNV_OFFSET, inst->opcode);
+
+        if (inst->opcode == SpvOpCapability) {
+            hash = incremental_mix(hash, inst->ops[0]);
+        } else if (inst->opcode == SpvOpExecutionMode || inst->opcode == SpvOpExecutionModeId) {
+            for (u32 k = 1; k < inst->nops; ++k) {
+                hash = (inst->opcode == SpvOpExecutionModeId && k > 1) ? incremental_reference(h, hash, inst->ops[k])
+                                                                      : incremental_mix(hash, inst->ops[k]);
+            }
+        } else {
+            continue;
+        }
+
+        environment += hash;
+    }
+
+    return(environment);
+}
+
+// Parses words into the cache's module and optimizes the functions that changed
+// since the last call, copying the others from the previous result. Returns
+// false when the module does not parse, the cache is left as it was then.
+static bool
+incremental_optimize(struct incremental *inc, const u32 *words, u32 size, struct pipeline_options *opts, FILE *out)
+{
+    struct timespec beg;
+    struct ir_module m;
+    struct incremental_hasher h;
+    u64 *keys;
+    u32 *first_lines;
+    bool *reused;
+
+    clock_gettime(CLOCK_MONOTONIC, &beg);
+
+    if (!ir_parse(words, size, &m)) {
+        ir_free_module(&m);
+        return(false);
+    }
+
+    ASSERT(keys = malloc((m.nfunctions + 1) * sizeof(u64)));
+    ASSERT(first_lines = malloc((m.nfunctions + 1) * sizeof(u32)));
+    ASSERT(reused = calloc(m.nfunctions + 1, sizeof(bool)));
+
+    incremental_hasher_init(&h, &m);
+
+    u64 environment = incremental_environment(&h);
+
+    for (u32 f = 0; f < m.nfunctions; ++f) {
+        u64 hash = incremental_function_hash(&h, m.functions[f]);
+
+        keys[f] = incremental_mix(incremental_mix(hash, (u32) environment), (u32) (environment >> 32));
+        first_lines[f] = incremental_first_line(m.functions[f]);
+    }
+
+    inc->functions = m.nfunctions;
+    inc->reused = 0;
+
+    if (inc->valid) {
+        struct incremental_import im;
+
+        incremental_import_init(&im, &m, &h, keys, &inc->module, inc->keys);
+
+        for (u32 f = 0; f < m.nfunctions; ++f) {
+            for (u32 k = 0; k < inc->module.nfunctions && !reused[f]; ++k) {
+                if (inc->keys[k] == keys[f]) {
+                    incremental_copy(&im, m.functions[f], inc->module.functions[k], (s32) first_lines[f] - (s32) inc->first_lines[k]);
+                    reused[f] = true;
+                    inc->reused += 1;
+                }
+            }
+        }
+
+        incremental_import_free(&im);
+    }
+
+    incremental_hasher_free(&h);
+
+    // NOTE: the passes only see the functions that were not reused, the order is restored after
+    struct ir_function **all = m.functions;
+    u32 count = m.nfunctions;
+
+    ASSERT(m.functions = malloc((count + 1) * sizeof(struct ir_function *)));
+    m.nfunctions = 0;
+
+    for (u32 f = 0; f < count; ++f) {
+        if (!reused[f]) {
+            m.functions[m.nfunctions++] = all[f];
+        }
+    }
+
+    struct pipeline_options local = *opts;
+
+    local.dedup = false;
+
+    if (m.nfunctions) {
+        pipeline_run(&m, &local, out);
+    }
+
+    free(m.functions);
+    m.functions = all;
+    m.nfunctions = count;
+
+    // NOTE: deduplication would drop the globals only the reused functions use
+    if (opts->dedup) {
+        pipeline_dedup(&m, opts, out);
+    }
+
+    if (inc->valid) {
+        ir_free_module(&inc->module);
+        free(inc->keys);
+        free(inc->first_lines);
+    }
+
+    inc->module = m;
+    inc->keys = keys;
+    inc->first_lines = first_lines;
+    inc->valid = true;
+
+    free(reused);
+
+    inc->msec = pipeline_msec(&beg);
+
+    return(true);
+}
+
+static void
+incremental_report(struct incremental *inc, FILE *out)
+{
+    fprintf(out, "[INCREMENTAL] %u of %u functions reused, %u optimized in %.2f ms\n",
+            inc->reused, inc->functions, inc->functions - inc->reused, inc->msec);
+}
+
+static void
+incremental_free(struct incremental *inc)
+{
+    if (inc->valid) {
+        ir_free_module(&inc->module);
+        free(inc->keys);
+        free(inc->first_lines);
+    }
+
+    memset(inc, 0x00, sizeof(struct incremental));
+}
@@ -0,0 +1,1005 @@
+// CPU reference interpreter for shader modules. Every value and every
+// variable is flattened into 32-bit slots: a vec4 takes four, a mat4 sixteen
+// and a struct the sum of its members. Pointers are slot offsets into the
+// variable memory. Recursion is forbidden in SPIR-V, so every result id and
+// every variable gets one statically assigned slot range.
+//
+// Block executions are also counted per calling context, a node for every
+// distinct chain of callers from the entry point, so a profile can tell which
+// caller a function's time belongs to.
+
+#define INTERP_MAX_STEPS (1 << 20)
+#define INTERP_NONE UINT32_MAX
+
+union interp_word {
+    u32 u;
+    s32 s;
+    f32 f;
+};
+
+struct interp_context {
+    struct ir_function *func;
+    u32 parent;    // INTERP_NONE for the entry point
+    u32 child;     // first callee context, INTERP_NONE when it called nothing yet
+    u32 sibling;   // next callee context of the same parent
+    u64 *counts;   // executions of every block, indexed like func->blocks
+};
+
+struct interp {
+    struct ir_module *m;
+    struct ir_function *entry;
+    u32 model;
+
+    u32 *type_size;
+    u32 *value_offset;
+    union interp_word *regs;
+    u32 nregs;
+
+    union interp_word *memory;
+    u32 nmemory;
+
+    union interp_word *scratch;
+    u32 scratch_size;
+
+    u32 width;
+    u32 height;
+    u32 x;
+    u32 y;
+
+    u64 steps;
+    bool killed;
+    bool failed;
+
+    // NOTE: executions of every block, indexed by label id
+    u64 *block_counts;
+    u64 invocations;
+
+    // NOTE: calling context tree, the entry point is the first node
+    struct interp_context *contexts;
+    u32 ncontexts;
+    u32 ccap;
+    u32 context;
+};
+
+static u32
+interp_type_size(struct interp *it, u32 type)
+{
+    if (it->type_size[type] != INTERP_NONE) {
+        return(it->type_size[type]);
+    }
+
+    struct ir_inst *def = ir_def(it->m, type);
+    u32 size = 0;
+
+    ASSERT(def);
+
+    switch (def->opcode) {
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypePointer:
+        case SpvOpTypeImage:
+        case SpvOpTypeSampler:
+        case SpvOpTypeSampledImage: {
+            size = 1;
+        } break;
+
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix: {
+            size = def->ops[1] * interp_type_size(it, def->ops[0]);
+        } break;
+
+        case SpvOpTypeArray: {
+            u32 length = 1;
+            ir_constant_bits(it->m, def->ops[1], 0, &length);
+            size = length * interp_type_size(it, def->ops[0]);
+        } break;
+
+        case SpvOpTypeStruct: {
+            for (u32 i = 0; i < def->nops; ++i) {
+                size += interp_type_size(it, def->ops[i]);
+            }
+        } break;
+    }
+
+    it->type_size[type] = size;
+
+    return(size);
+}
+
+// Slot offset of member `index` inside a value of the given type
+static u32
+interp_member_offset(struct interp *it, u32 type, u32 index, u32 *member_type)
+{
+    struct ir_inst *def = ir_def(it->m, type);
+    u32 offset = 0;
+
+    if (def->opcode == SpvOpTypeStruct) {
+        index = index < def->nops ? index : (u32) def->nops - 1;
+
+        for (u32 i = 0; i < index; ++i) {
+            offset += interp_type_size(it, def->ops[i]);
+        }
+
+        *member_type = def->ops[index];
+
+        return(offset);
+    }
+
+    u32 count = def->opcode == SpvOpTypeArray ? 0 : def->ops[1];
+    u32 elem = def->ops[0];
+
+    if (def->opcode == SpvOpTypeArray) {
+        ir_constant_bits(it->m, def->ops[1], 0, &count);
+    }
+
+    // NOTE: out of bounds access is undefined, clamp like robust buffer access would
+    if (count && index >= count) {
+        index = count - 1;
+    }
+
+    *member_type = elem;
+
+    return(index * interp_type_size(it, elem));
+}
+
+static union interp_word *
+interp_value(struct interp *it, u32 id)
+{
+    ASSERT(it->value_offset[id] != INTERP_NONE);
+    return(it->regs + it->value_offset[id]);
+}
+
+static void
+interp_load_constant(struct interp *it, struct ir_inst *inst, union interp_word *dst)
+{
+    switch (inst->opcode) {
+        case SpvOpConstant:
+        case SpvOpSpecConstant: {
+            dst[0].u = inst->ops[0];
+        } break;
+
+        case SpvOpConstantTrue:
+        case SpvOpSpecConstantTrue: {
+            dst[0].u = 1;
+        } break;
+
+        case SpvOpConstantComposite:
+        case SpvOpSpecConstantComposite: {
+            for (u32 i = 0; i < inst->nops; ++i) {
+                u32 size = interp_type_size(it, ir_def(it->m, inst->ops[i])->type);
+                memcpy(dst, interp_value(it, inst->ops[i]), size * sizeof(union interp_word));
+                dst += size;
+            }
+        } break;
+
+        default: {
+            memset(dst, 0x00, interp_type_size(it, inst->type) * sizeof(union interp_word));
+        }
+    }
+}
+
+static u32
+interp_add_context(struct interp *it, struct ir_function *func, u32 parent)
+{
+    struct interp_context context = { func, parent, INTERP_NONE, INTERP_NONE, NULL };
+
+    ASSERT(context.counts = calloc(func->nblocks + 1, sizeof(u64)));
+
+    if (parent != INTERP_NONE) {
+        context.sibling = it->contexts[parent].child;
+        it->contexts[parent].child = it->ncontexts;
+    }
+
+    IR_PUSH(it->contexts, it->ncontexts, it->ccap, context);
+
+    return(it->ncontexts - 1);
+}
+
+// Context of a call to callee from the current one, created on the first such call
+static u32
+interp_enter(struct interp *it, struct ir_function *callee)
+{
+    for (u32 c = it->contexts[it->context].child; c != INTERP_NONE; c = it->contexts[c].sibling) {
+        if (it->contexts[c].func == callee) {
+            return(c);
+        }
+    }
+
+    return(interp_add_context(it, callee, it->context));
+}
+
+static bool
+interp_init(struct interp *it, struct ir_module *m, u32 width, u32 height)
+{
+    memset(it, 0x00, sizeof(struct interp));
+
+    struct ir_inst *ep = ir_entry_point(m, &it->model);
+
+    if (!ep || !(it->entry = ir_find_function(m, ep->ops[1]))) {
+        printf("[ERROR] Module has no entry point\n");
+        return(false);
+    }
+
+    it->m      = m;
+    it->width  = width;
+    it->height = height;
+
+    ASSERT(it->type_size = malloc(m->bound * sizeof(u32)));
+    ASSERT(it->value_offset = malloc(m->bound * sizeof(u32)));
+    ASSERT(it->block_counts = calloc(m->bound, sizeof(u64)));
+
+    it->context = interp_add_context(it, it->entry, INTERP_NONE);
+
+    memset(it->type_size, 0xFF, m->bound * sizeof(u32));
+    memset(it->value_offset, 0xFF, m->bound * sizeof(u32));
+
+    // Assign register and memory slots
+    IR_FOR_EACH_INST(m, inst, {
+        if (inst->id && inst->type && ir_def(m, inst->type) && ir_def(m, inst->type)->opcode != SpvOpTypeVoid &&
+            ir_def(m, inst->type)->opcode != SpvOpTypeFunction) {
+            it->value_offset[inst->id] = it->nregs;
+            it->nregs += interp_type_size(it, inst->type);
+
+            if (inst->opcode == SpvOpVariable) {
+                it->nmemory += interp_type_size(it, ir_pointee_type(m, inst->type));
+            }
+        }
+    });
+
+    ASSERT(it->regs = calloc(it->nregs + 1, sizeof(union interp_word)));
+    ASSERT(it->memory = calloc(it->nmemory + 1, sizeof(union interp_word)));
+
+    // NOTE: phis of one block are evaluated in parallel, scratch holds all of them
+    it->scratch_size = it->nregs + 1;
+    ASSERT(it->scratch = calloc(it->scratch_size, sizeof(union interp_word)));
+
+    u32 memory_at = 0;
+
+    IR_FOR_EACH_INST(m, inst, {
+        if (inst->opcode == SpvOpVariable) {
+            interp_value(it, inst->id)->u = memory_at;
+            memory_at += interp_type_size(it, ir_pointee_type(m, inst->type));
+        } else if (!inst->block && inst->id && it->value_offset[inst->id] != INTERP_NONE &&
+                   inst->opcode != SpvOpFunction && inst->opcode != SpvOpFunctionParameter) {
+            interp_load_constant(it, inst, interp_value(it, inst->id));
+        }
+    });
+
+    return(true);
+}
+
+static void
+interp_free(struct interp *it)
+{
+    free(it->type_size);
+    free(it->value_offset);
+    free(it->regs);
+    free(it->memory);
+    free(it->scratch);
+    free(it->block_counts);
+
+    for (u32 c = 0; c < it->ncontexts; ++c) {
+        free(it->contexts[c].counts);
+    }
+
+    free(it->contexts);
+}
+
+// Copies raw buffer contents into the Uniform/PushConstant/StorageBuffer variable at (set, binding)
+static bool
+interp_bind_buffer(struct interp *it, u32 set, u32 binding, const void *src, u32 size)
+{
+    for (u32 i = 0; i < it->m->nglobals; ++i) {
+        struct ir_inst *inst = it->m->globals[i];
+        u32 var_set = 0, var_binding = 0;
+
+        if (inst->opcode != SpvOpVariable) {
+            continue;
+        }
+
+        ir_decoration(it->m, inst->id, SpvDecorationDescriptorSet, &var_set);
+
+        if (!ir_decoration(it->m, inst->id, SpvDecorationBinding, &var_binding) || var_set != set || var_binding != binding) {
+            continue;
+        }
+
+        u32 slots = interp_type_size(it, ir_pointee_type(it->m, inst->type));
+
+        if (size > slots * sizeof(u32)) {
+            size = slots * sizeof(u32);
+        }
+
+        memcpy(it->memory + interp_value(it, inst->id)->u, src, size);
+
+        return(true);
+    }
+
+    return(false);
+}
+
+static void interp_exec(struct interp *it, struct ir_inst *inst);
+
+// Synthesizes inputs for the invocation at (x, y) of the grid
+static void
+interp_setup_inputs(struct interp *it)
+{
+    u32 linear = it->y * it->width + it->x;
+
+    for (u32 i = 0; i < it->m->nglobals; ++i) {
+        struct ir_inst *inst = it->m->globals[i];
+        u32 builtin;
+
+        if (inst->opcode != SpvOpVariable) {
+            continue;
+        }
+
+        // NOTE: per-invocation storage starts from its initializer (or zero) every time
+        if (inst->ops[0] == SpvStorageClassPrivate || inst->ops[0] == SpvStorageClassOutput) {
+            interp_exec(it, inst);
+            continue;
+        }
+
+        if (inst->ops[0] != SpvStorageClassInput) {
+            continue;
+        }
+
+        u32 type = ir_pointee_type(it->m, inst->type);
+        u32 slots = interp_type_size(it, type);
+        union interp_word *dst = it->memory + interp_value(it, inst->id)->u;
+        bool is_float = ir_is_float_type(it->m, type);
+
+        if (ir_decoration(it->m, inst->id, SpvDecorationBuiltIn, &builtin)) {
+            switch (builtin) {
+                case SpvBuiltInFragCoord: {
+                    dst[0].f = it->x + 0.5f;
+                    dst[1].f = it->y + 0.5f;
+                    dst[2].f = 0.5f;
+                    dst[3].f = 1.0f;
+                } continue;
+
+                case SpvBuiltInFrontFacing: {
+                    dst[0].u = 1;
+                } continue;
+
+                case SpvBuiltInVertexIndex:
+                case SpvBuiltInVertexId: {
+                    dst[0].u = linear;
+                } continue;
+
+                case SpvBuiltInInstanceIndex:
+                case SpvBuiltInInstanceId: {
+                    dst[0].u = 0;
+                } continue;
+            }
+        }
+
+        // NOTE: user varyings sweep [0, 1] over the grid: (u, v, 0.5, 1.0), repeated
+        for (u32 s = 0; s < slots; ++s) {
+            if (is_float) {
+                f32 pattern[4] = { (it->x + 0.5f) / it->width, (it->y + 0.5f) / it->height, 0.5f, 1.0f };
+                dst[s].f = pattern[s % 4];
+            } else {
+                dst[s].u = linear;
+            }
+        }
+    }
+}
+
+static void
+interp_glsl(struct interp *it, struct ir_inst *inst, union interp_word *r, u32 n)
+{
+    u32 op = inst->ops[1];
+    union interp_word *a = inst->nops > 2 ? interp_value(it, inst->ops[2]) : NULL;
+    union interp_word *b = inst->nops > 3 ? interp_value(it, inst->ops[3]) : NULL;
+    union interp_word *c = inst->nops > 4 ? interp_value(it, inst->ops[4]) : NULL;
+    u32 an = inst->nops > 2 ? interp_type_size(it, ir_def(it->m, inst->ops[2])->type) : 0;
+
+    switch (op) {
+        case GLSLstd450Length:
+        case GLSLstd450Distance: {
+            f32 sum = 0.0f;
+            for (u32 i = 0; i < an; ++i) {
+                f32 d = op == GLSLstd450Distance ? a[i].f - b[i].f : a[i].f;
+                sum += d * d;
+            }
+            r[0].f = sqrtf(sum);
+        } return;
+
+        case GLSLstd450Normalize: {
+            f32 sum = 0.0f;
+            for (u32 i = 0; i < n; ++i) {
+                sum += a[i].f * a[i].f;
+            }
+            for (u32 i = 0; i < n; ++i) {
+                r[i].f = a[i].f / sqrtf(sum);
+            }
+        } return;
+
+        case GLSLstd450Cross: {
+            r[0].f = a[1].f * b[2].f - b[1].f * a[2].f;
+            r[1].f = a[2].f * b[0].f - b[2].f * a[0].f;
+            r[2].f = a[0].f * b[1].f - b[0].f * a[1].f;
+        } return;
+
+        case GLSLstd450Reflect: {
+            f32 dot = 0.0f;
+            for (u32 i = 0; i < n; ++i) {
+                dot += a[i].f * b[i].f;
+            }
+            for (u32 i = 0; i < n; ++i) {
+                r[i].f = a[i].f - 2.0f * dot * b[i].f;
+            }
+        } return;
+
+        case GLSLstd450FaceForward: {
+            f32 dot = 0.0f;
+            for (u32 i = 0; i < n; ++i) {
+                dot += c[i].f * b[i].f;
+            }
+            for (u32 i = 0; i < n; ++i) {
+                r[i].f = dot < 0.0f ? a[i].f : -a[i].f;
+            }
+        } return;
+    }
+
+    for (u32 i = 0; i < n; ++i) {
+        // NOTE: scalar operands of vector functions (e.g. mix with a float weight) are broadcast
+        f32 x = a ? a[an == 1 ? 0 : i].f : 0.0f;
+        f32 y = b ? b[i].f : 0.0f;
+        f32 z = c ? c[i].f : 0.0f;
+
+        switch (op) {
+            case GLSLstd450Round:       r[i].f = roundf(x); break;
+            case GLSLstd450RoundEven:   r[i].f = rintf(x); break;
+            case GLSLstd450Trunc:       r[i].f = truncf(x); break;
+            case GLSLstd450FAbs:        r[i].f = fabsf(x); break;
+            case GLSLstd450SAbs:        r[i].s = abs(a[i].s); break;
+            case GLSLstd450FSign:       r[i].f = x > 0.0f ? 1.0f : (x < 0.0f ? -1.0f : 0.0f); break;
+            case GLSLstd450SSign:       r[i].s = a[i].s > 0 ? 1 : (a[i].s < 0 ? -1 : 0); break;
+            case GLSLstd450Floor:       r[i].f = floorf(x); break;
+            case GLSLstd450Ceil:        r[i].f = ceilf(x); break;
+            case GLSLstd450Fract:       r[i].f = x - floorf(x); break;
+            case GLSLstd450Radians:     r[i].f = x * 0.017453292f; break;
+            case GLSLstd450Degrees:     r[i].f = x * 57.29578f; break;
+            case GLSLstd450Sin:         r[i].f = sinf(x); break;
+            case GLSLstd450Cos:         r[i].f = cosf(x); break;
+            case GLSLstd450Tan:         r[i].f = tanf(x); break;
+            case GLSLstd450Asin:        r[i].f = asinf(x); break;
+            case GLSLstd450Acos:        r[i].f = acosf(x); break;
+            case GLSLstd450Atan:        r[i].f = atanf(x); break;
+            case GLSLstd450Atan2:       r[i].f = atan2f(x, y); break;
+            case GLSLstd450Pow:         r[i].f = powf(x, y); break;
+            case GLSLstd450Exp:         r[i].f = expf(x); break;
+            case GLSLstd450Log:         r[i].f = logf(x); break;
+            case GLSLstd450Exp2:        r[i].f = exp2f(x); break;
+            case GLSLstd450Log2:        r[i].f = log2f(x); break;
+            case GLSLstd450Sqrt:        r[i].f = sqrtf(x); break;
+            case GLSLstd450InverseSqrt: r[i].f = 1.0f / sqrtf(x); break;
+            case GLSLstd450NMin:
+            case GLSLstd450FMin:        r[i].f = fminf(x, b[i].f); break;
+            case GLSLstd450NMax:
+            case GLSLstd450FMax:        r[i].f = fmaxf(x, b[i].f); break;
+            case GLSLstd450UMin:        r[i].u = a[i].u < b[i].u ? a[i].u : b[i].u; break;
+            case GLSLstd450SMin:        r[i].s = a[i].s < b[i].s ? a[i].s : b[i].s; break;
+            case GLSLstd450UMax:        r[i].u = a[i].u > b[i].u ? a[i].u : b[i].u; break;
+            case GLSLstd450SMax:        r[i].s = a[i].s > b[i].s ? a[i].s : b[i].s; break;
+            case GLSLstd450NClamp:
+            case GLSLstd450FClamp:      r[i].f = fminf(fmaxf(x, y), z); break;
+            case GLSLstd450FMix:        r[i].f = x * (1.0f - z) + y * z; break;
+            case GLSLstd450Step:        r[i].f = y < x ? 0.0f : 1.0f; break;
+            case GLSLstd450Fma:         r[i].f = fmaf(x, y, z); break;
+            case GLSLstd450SmoothStep: {
+                f32 t = fminf(fmaxf((z - x) / (y - x), 0.0f), 1.0f);
+                r[i].f = t * t * (3.0f - 2.0f * t);
+            } break;
+
+            default: {
+                r[i].u = 0;
+            }
+        }
+    }
+}
+
+static bool interp_call(struct interp *it, struct ir_function *func, union interp_word *ret);
+
+// Executes one non-control-flow instruction
+static void
+interp_exec(struct interp *it, struct ir_inst *inst)
+{
+    struct ir_module *m = it->m;
+    union interp_word *r = NULL;
+    union interp_word *a = NULL;
+    union interp_word *b = NULL;
+    u32 n = 0;
+
+    if (inst->id && it->value_offset[inst->id] != INTERP_NONE) {
+        r = interp_value(it, inst->id);
+        n = interp_type_size(it, inst->type);
+    }
+
+    if (inst->nops > 0 && ir_operand_is_id(inst, 0) && inst->ops[0] < m->bound && it->value_offset[inst->ops[0]] != INTERP_NONE) {
+        a = interp_value(it, inst->ops[0]);
+    }
+
+    if (inst->nops > 1 && ir_operand_is_id(inst, 1) && inst->ops[1] < m->bound && it->value_offset[inst->ops[1]] != INTERP_NONE) {
+        b = interp_value(it, inst->ops[1]);
+    }
+
+#define FOR_N(expr) for (u32 i = 0; i < n; ++i) { expr; }
+
+    switch (inst->opcode) {
+        case SpvOpVariable: {
+            u32 size = interp_type_size(it, ir_pointee_type(m, inst->type));
+            union interp_word *mem = it->memory + r[0].u;
+
+            if (inst->nops > 1) {
+                memcpy(mem, b, size * sizeof(union interp_word));
+            } else {
+                memset(mem, 0x00, size * sizeof(union interp_word));
+            }
+        } break;
+
+        case SpvOpLoad: {
+            memcpy(r, it->memory + a[0].u, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpStore: {
+            u32 size = interp_type_size(it, ir_def(m, inst->ops[1])->type);
+            memcpy(it->memory + a[0].u, b, size * sizeof(union interp_word));
+        } break;
+
+        case SpvOpCopyMemory: {
+            u32 size = interp_type_size(it, ir_pointee_type(m, ir_def(m, inst->ops[0])->type));
+            memmove(it->memory + a[0].u, it->memory + b[0].u, size * sizeof(union interp_word));
+        } break;
+
+        case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain: {
+            u32 type = ir_pointee_type(m, ir_def(m, inst->ops[0])->type);
+            u32 offset = a[0].u;
+
+            for (u32 i = 1; i < inst->nops; ++i) {
+                offset += interp_member_offset(it, type, interp_value(it, inst->ops[i])->u, &type);
+            }
+
+            r[0].u = offset;
+        } break;
+
+        case SpvOpCompositeConstruct: {
+            union interp_word *dst = r;
+
+            for (u32 i = 0; i < inst->nops; ++i) {
+                u32 size = interp_type_size(it, ir_def(m, inst->ops[i])->type);
+                memcpy(dst, interp_value(it, inst->ops[i]), size * sizeof(union interp_word));
+                dst += size;
+            }
+        } break;
+
+        case SpvOpCompositeExtract:
+        case SpvOpCompositeInsert: {
+            bool insert = inst->opcode == SpvOpCompositeInsert;
+            union interp_word *composite = insert ? b : a;
+            u32 type = ir_def(m, inst->ops[insert ? 1 : 0])->type;
+            u32 offset = 0;
+
+            for (u32 i = insert ? 2 : 1; i < inst->nops; ++i) {
+                offset += interp_member_offset(it, type, inst->ops[i], &type);
+            }
+
+            if (insert) {
+                memcpy(it->scratch, composite, n * sizeof(union interp_word));
+                memcpy(it->scratch + offset, a, interp_type_size(it, type) * sizeof(union interp_word));
+                memcpy(r, it->scratch, n * sizeof(union interp_word));
+            } else {
+                memmove(r, composite + offset, n * sizeof(union interp_word));
+            }
+        } break;
+
+        case SpvOpVectorShuffle: {
+            u32 an = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+
+            for (u32 i = 0; i < n; ++i) {
+                u32 c = inst->ops[2 + i];
+                it->scratch[i].u = c == 0xFFFFFFFF ? 0 : (c < an ? a[c].u : b[c - an].u);
+            }
+
+            memcpy(r, it->scratch, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpVectorExtractDynamic: {
+            u32 an = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+            r[0] = a[b[0].u < an ? b[0].u : an - 1];
+        } break;
+
+        case SpvOpVectorInsertDynamic: {
+            u32 index = interp_value(it, inst->ops[2])->u;
+            memmove(r, a, n * sizeof(union interp_word));
+            r[index < n ? index : n - 1] = b[0];
+        } break;
+
+        case SpvOpCopyObject: {
+            memmove(r, a, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpTranspose: {
+            u32 rows = ir_vector_size(m, ir_member_type(m, inst->type, 0));
+            u32 cols = n / rows;
+
+            for (u32 c = 0; c < cols; ++c) {
+                for (u32 row = 0; row < rows; ++row) {
+                    it->scratch[c * rows + row] = a[row * cols + c];
+                }
+            }
+
+            memcpy(r, it->scratch, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpFNegate:              FOR_N(r[i].f = -a[i].f) break;
+        case SpvOpFAdd:                 FOR_N(r[i].f = a[i].f + b[i].f) break;
+        case SpvOpFSub:                 FOR_N(r[i].f = a[i].f - b[i].f) break;
+        case SpvOpFMul:                 FOR_N(r[i].f = a[i].f * b[i].f) break;
+        case SpvOpFDiv:                 FOR_N(r[i].f = a[i].f / b[i].f) break;
+        case SpvOpFRem:                 FOR_N(r[i].f = fmodf(a[i].f, b[i].f)) break;
+        case SpvOpFMod:                 FOR_N(r[i].f = a[i].f - b[i].f * floorf(a[i].f / b[i].f)) break;
+        case SpvOpVectorTimesScalar:
+        case SpvOpMatrixTimesScalar:    FOR_N(r[i].f = a[i].f * b[0].f) break;
+        case SpvOpSNegate:              FOR_N(r[i].s = -a[i].s) break;
+        case SpvOpIAdd:                 FOR_N(r[i].u = a[i].u + b[i].u) break;
+        case SpvOpISub:                 FOR_N(r[i].u = a[i].u - b[i].u) break;
+        case SpvOpIMul:                 FOR_N(r[i].u = a[i].u * b[i].u) break;
+        case SpvOpUDiv:                 FOR_N(r[i].u = b[i].u ? a[i].u / b[i].u : 0) break;
+        case SpvOpSDiv:                 FOR_N(r[i].s = b[i].s ? a[i].s / b[i].s : 0) break;
+        case SpvOpUMod:                 FOR_N(r[i].u = b[i].u ? a[i].u % b[i].u : 0) break;
+        case SpvOpSRem:                 FOR_N(r[i].s = b[i].s ? a[i].s % b[i].s : 0) break;
+        case SpvOpSMod:                 FOR_N(r[i].s = b[i].s ? ((a[i].s % b[i].s) + b[i].s) % b[i].s : 0) break;
+        case SpvOpShiftRightLogical:    FOR_N(r[i].u = a[i].u >> (b[i].u & 31)) break;
+        case SpvOpShiftRightArithmetic: FOR_N(r[i].s = a[i].s >> (b[i].u & 31)) break;
+        case SpvOpShiftLeftLogical:     FOR_N(r[i].u = a[i].u << (b[i].u & 31)) break;
+        case SpvOpBitwiseOr:            FOR_N(r[i].u = a[i].u | b[i].u) break;
+        case SpvOpBitwiseXor:           FOR_N(r[i].u = a[i].u ^ b[i].u) break;
+        case SpvOpBitwiseAnd:           FOR_N(r[i].u = a[i].u & b[i].u) break;
+        case SpvOpNot:                  FOR_N(r[i].u = ~a[i].u) break;
+        case SpvOpBitCount:             FOR_N(r[i].u = __builtin_popcount(a[i].u)) break;
+        case SpvOpConvertFToU:          FOR_N(r[i].u = (u32) a[i].f) break;
+        case SpvOpConvertFToS:          FOR_N(r[i].s = (s32) a[i].f) break;
+        case SpvOpConvertSToF:          FOR_N(r[i].f = (f32) a[i].s) break;
+        case SpvOpConvertUToF:          FOR_N(r[i].f = (f32) a[i].u) break;
+        case SpvOpUConvert:
+        case SpvOpSConvert:
+        case SpvOpFConvert:
+        case SpvOpQuantizeToF16:
+        case SpvOpBitcast:              FOR_N(r[i] = a[i]) break;
+        case SpvOpLogicalEqual:         FOR_N(r[i].u = a[i].u == b[i].u) break;
+        case SpvOpLogicalNotEqual:      FOR_N(r[i].u = a[i].u != b[i].u) break;
+        case SpvOpLogicalOr:            FOR_N(r[i].u = a[i].u || b[i].u) break;
+        case SpvOpLogicalAnd:           FOR_N(r[i].u = a[i].u && b[i].u) break;
+        case SpvOpLogicalNot:           FOR_N(r[i].u = !a[i].u) break;
+        case SpvOpIEqual:               FOR_N(r[i].u = a[i].u == b[i].u) break;
+        case SpvOpINotEqual:            FOR_N(r[i].u = a[i].u != b[i].u) break;
+        case SpvOpUGreaterThan:         FOR_N(r[i].u = a[i].u > b[i].u) break;
+        case SpvOpSGreaterThan:         FOR_N(r[i].u = a[i].s > b[i].s) break;
+        case SpvOpUGreaterThanEqual:    FOR_N(r[i].u = a[i].u >= b[i].u) break;
+        case SpvOpSGreaterThanEqual:    FOR_N(r[i].u = a[i].s >= b[i].s) break;
+        case SpvOpULessThan:            FOR_N(r[i].u = a[i].u < b[i].u) break;
+        case SpvOpSLessThan:            FOR_N(r[i].u = a[i].s < b[i].s) break;
+        case SpvOpULessThanEqual:       FOR_N(r[i].u = a[i].u <= b[i].u) break;
+        case SpvOpSLessThanEqual:       FOR_N(r[i].u = a[i].s <= b[i].s) break;
+        case SpvOpFOrdEqual:            FOR_N(r[i].u = a[i].f == b[i].f) break;
+        case SpvOpFUnordEqual:          FOR_N(r[i].u = !(a[i].f != b[i].f)) break;
+        case SpvOpFOrdNotEqual:         FOR_N(r[i].u = a[i].f < b[i].f || a[i].f > b[i].f) break;
+        case SpvOpFUnordNotEqual:       FOR_N(r[i].u = a[i].f != b[i].f) break;
+        case SpvOpFOrdLessThan:         FOR_N(r[i].u = a[i].f < b[i].f) break;
+        case SpvOpFUnordLessThan:       FOR_N(r[i].u = !(a[i].f >= b[i].f)) break;
+        case SpvOpFOrdGreaterThan:      FOR_N(r[i].u = a[i].f > b[i].f) break;
+        case SpvOpFUnordGreaterThan:    FOR_N(r[i].u = !(a[i].f <= b[i].f)) break;
+        case SpvOpFOrdLessThanEqual:    FOR_N(r[i].u = a[i].f <= b[i].f) break;
+        case SpvOpFUnordLessThanEqual:  FOR_N(r[i].u = !(a[i].f > b[i].f)) break;
+        case SpvOpFOrdGreaterThanEqual: FOR_N(r[i].u = a[i].f >= b[i].f) break;
+        case SpvOpFUnordGreaterThanEqual: FOR_N(r[i].u = !(a[i].f < b[i].f)) break;
+        case SpvOpIsNan:                FOR_N(r[i].u = isnan(a[i].f)) break;
+        case SpvOpIsInf:                FOR_N(r[i].u = isinf(a[i].f)) break;
+
+        case SpvOpAny:
+        case SpvOpAll: {
+            u32 an = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+            bool all = true, any = false;
+
+            for (u32 i = 0; i < an; ++i) {
+                all &= a[i].u != 0;
+                any |= a[i].u != 0;
+            }
+
+            r[0].u = inst->opcode == SpvOpAll ? all : any;
+        } break;
+
+        case SpvOpSelect: {
+            union interp_word *c = interp_value(it, inst->ops[2]);
+            u32 cn = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+
+            FOR_N(r[i] = a[cn == 1 ? 0 : i].u ? b[i] : c[i])
+        } break;
+
+        case SpvOpDot: {
+            u32 an = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+            f32 sum = 0.0f;
+
+            for (u32 i = 0; i < an; ++i) {
+                sum += a[i].f * b[i].f;
+            }
+
+            r[0].f = sum;
+        } break;
+
+        case SpvOpMatrixTimesVector: {
+            u32 cols = interp_type_size(it, ir_def(m, inst->ops[1])->type);
+
+            for (u32 row = 0; row < n; ++row) {
+                f32 sum = 0.0f;
+                for (u32 c = 0; c < cols; ++c) {
+                    sum += a[c * n + row].f * b[c].f;
+                }
+                it->scratch[row].f = sum;
+            }
+
+            memcpy(r, it->scratch, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpVectorTimesMatrix: {
+            u32 rows = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+
+            for (u32 c = 0; c < n; ++c) {
+                f32 sum = 0.0f;
+                for (u32 row = 0; row < rows; ++row) {
+                    sum += a[row].f * b[c * rows + row].f;
+                }
+                it->scratch[c].f = sum;
+            }
+
+            memcpy(r, it->scratch, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpMatrixTimesMatrix: {
+            u32 rows = ir_vector_size(m, ir_member_type(m, inst->type, 0));
+            u32 inner = interp_type_size(it, ir_def(m, inst->ops[0])->type) / rows;
+            u32 cols = n / rows;
+
+            for (u32 c = 0; c < cols; ++c) {
+                for (u32 row = 0; row < rows; ++row) {
+                    f32 sum = 0.0f;
+                    for (u32 k = 0; k < inner; ++k) {
+                        sum += a[k * rows + row].f * b[c * inner + k].f;
+                    }
+                    it->scratch[c * rows + row].f = sum;
+                }
+            }
+
+            memcpy(r, it->scratch, n * sizeof(union interp_word));
+        } break;
+
+        case SpvOpOuterProduct: {
+            u32 rows = interp_type_size(it, ir_def(m, inst->ops[0])->type);
+
+            FOR_N(r[i].f = a[i % rows].f * b[i / rows].f)
+        } break;
+
+        case SpvOpExtInst: {
+            if (inst->ops[0] == m->glsl_set) {
+                interp_glsl(it, inst, r, n);
+            } else {
+                FOR_N(r[i].u = 0)
+            }
+        } break;
+
+        case SpvOpFunctionCall: {
+            struct ir_function *callee = ir_find_function(m, inst->ops[0]);
+
+            for (u32 i = 0; i < callee->nparams; ++i) {
+                struct ir_inst *param = callee->params[i];
+                u32 size = interp_type_size(it, param->type);
+                memcpy(interp_value(it, param->id), interp_value(it, inst->ops[1 + i]), size * sizeof(union interp_word));
+            }
+
+            u32 caller = it->context;
+
+            it->context = interp_enter(it, callee);
+            interp_call(it, callee, r);
+            it->context = caller;
+        } break;
+
+        case SpvOpImageSampleImplicitLod:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageSampleDrefImplicitLod:
+        case SpvOpImageSampleDrefExplicitLod:
+        case SpvOpImageSampleProjImplicitLod:
+        case SpvOpImageSampleProjExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageGather:
+        case SpvOpImageRead: {
+            // NOTE: no texture data on the reference path, sampling returns mid grey
+            if (ir_is_float_type(m, inst->type)) {
+                FOR_N(r[i].f = 0.5f)
+            } else {
+                FOR_N(r[i].u = 0)
+            }
+        } break;
+
+        case SpvOpImageQuerySize:
+        case SpvOpImageQuerySizeLod: {
+            FOR_N(r[i].u = i == 0 ? it->width : it->height)
+        } break;
+
+        case SpvOpUndef:
+        case SpvOpDPdx:
+        case SpvOpDPdy:
+        case SpvOpFwidth:
+        case SpvOpDPdxFine:
+        case SpvOpDPdyFine:
+        case SpvOpFwidthFine:
+        case SpvOpDPdxCoarse:
+        case SpvOpDPdyCoarse:
+        case SpvOpFwidthCoarse: {
+            FOR_N(r[i].u = 0)
+        } break;
+
+        case SpvOpSelectionMerge:
+        case SpvOpLoopMerge:
+        case SpvOpNop:
+        case SpvOpSampledImage:
+        case SpvOpImage:
+        case SpvOpImageWrite:
+        case SpvOpControlBarrier:
+        case SpvOpMemoryBarrier:
+        break;
+
+        default: {
+            if (r) {
+                FOR_N(r[i].u = 0)
+            }
+        }
+    }
+
+#undef FOR_N
+}
+
+static u32
+interp_switch_target(struct interp *it, struct ir_inst *term)
+{
+    u32 selector = interp_value(it, term->ops[0])->u;
+
+    for (u32 i = 2; i + 1 < term->nops; i += 2) {
+        if (term->ops[i] == selector) {
+            return(term->ops[i + 1]);
+        }
+    }
+
+    return(term->ops[1]);
+}
+
+// Runs a function until it returns. False when the invocation was killed or aborted.
+static bool
+interp_call(struct interp *it, struct ir_function *func, union interp_word *ret)
+{
+    struct ir_block *block = func->blocks[0];
+    u64 *counts = it->contexts[it->context].counts;
+    u32 index = 0;
+    u32 prev = 0;
+
+    while (true) {
+        u32 first = 0;
+
+        it->block_counts[block->label] += 1;
+        counts[index] += 1;
+        it->steps += block->ninsts;
+
+        if (it->steps > INTERP_MAX_STEPS) {
+            it->failed = true;
+            return(false);
+        }
+
+        // Phis read their incoming values before any of them is written
+        {
+            u32 at = 0;
+
+            for (first = 0; first < block->ninsts && block->insts[first]->opcode == SpvOpPhi; ++first) {
+                struct ir_inst *phi = block->insts[first];
+                u32 size = interp_type_size(it, phi->type);
+
+                for (u32 i = 0; i + 1 < phi->nops; i += 2) {
+                    if (phi->ops[i + 1] == prev) {
+                        memcpy(it->scratch + at, interp_value(it, phi->ops[i]), size * sizeof(union interp_word));
+                        break;
+                    }
+                }
+
+                at += size;
+            }
+
+            at = 0;
+
+            for (u32 i = 0; i < first; ++i) {
+                struct ir_inst *phi = block->insts[i];
+                u32 size = interp_type_size(it, phi->type);
+
+                memcpy(interp_value(it, phi->id), it->scratch + at, size * sizeof(union interp_word));
+                at += size;
+            }
+        }
+
+        for (u32 i = first; i + 1 < block->ninsts; ++i) {
+            interp_exec(it, block->insts[i]);
+
+            if (it->killed || it->failed) {
+                return(false);
+            }
+        }
+
+        struct ir_inst *term = ir_terminator(block);
+        u32 next = 0;
+
+        switch (term->opcode) {
+            case SpvOpBranch: {
+                next = term->ops[0];
+            } break;
+
+            case SpvOpBranchConditional: {
+                next = interp_value(it, term->ops[0])->u ? term->ops[1] : term->ops[2];
+            } break;
+
+            case SpvOpSwitch: {
+                next = interp_switch_target(it, term);
+            } break;
+
+            case SpvOpReturnValue: {
+                u32 size = interp_type_size(it, ir_def(it->m, term->ops[0])->type);
+                memcpy(ret, interp_value(it, term->ops[0]), size * sizeof(union interp_word));
+            } return(true);
+
+            case SpvOpReturn:
+            return(true);
+
+            case SpvOpKill: {
+                it->killed = true;
+            } return(false);
+
+            default: {
+                it->failed = true;
+            } return(false);
+        }
+
+        prev = block->label;
+
+        index = ir_block_index(func, next);
+
+        if (index == UINT32_MAX) {
+            it->failed = true;
+            return(false);
+        }
+
+        block = func->blocks[index];
+    }
+}
+
+// Executes the entry point once per cell of the width x height grid
+static bool
+interp_run_grid(struct interp *it)
+{
+    for (it->y = 0; it->y < it->height; ++it->y) {
+        for (it->x = 0; it->x < it->width; ++it->x) {
+            it->killed = false;
+            it->steps  = 0;
+
+            interp_setup_inputs(it);
+            interp_call(it, it->entry, NULL);
+
+            if (it->failed) {
+                printf("[ERROR] Invocation (%d, %d) did not terminate\n", it->x, it->y);
+                return(false);
+            }
+
+            it->invocations += 1;
+        }
+    }
+
+    return(true);
+}
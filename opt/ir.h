@@ -0,0 +1,1473 @@
+// In-memory SPIR-V module. Everything before the first OpFunction lives in
+// the flat globals list, functions are split into basic blocks. Instructions
+// are heap allocated and referenced by pointer so the id -> definition table
+// survives insertions and removals.
+//
+// A thread that sets ir_arena takes new instructions from that arena instead
+// and frees none of them one by one, they all go when the arena is reset.
+
+#define IR_PUSH(arr, count, cap, item) {\
+    if ((count) == (cap)) {\
+        (cap) = (cap) ? (cap) * 2 : 8;\
+        ASSERT((arr) = realloc((arr), (cap) * sizeof(*(arr))));\
+    }\
+    (arr)[(count)++] = (item);\
+}
+
+static const char *
+spv_op_name(u32 opcode)
+{
+    switch (opcode) {
+#define SPV_OP_NAME(name, value, type, result) case value: return("Op" #name);
+        SPV_OPS(SPV_OP_NAME)
+#undef SPV_OP_NAME
+    }
+    
+    return("OpUnknown");
+}
+
+static void
+spv_op_info(u32 opcode, bool *has_type, bool *has_result)
+{
+    switch (opcode) {
+#define SPV_OP_INFO(name, value, type, result) case value: *has_type = type; *has_result = result; return;
+        SPV_OPS(SPV_OP_INFO)
+#undef SPV_OP_INFO
+    }
+    
+    // NOTE: group/subgroup operations (1.3) all produce a typed result
+    *has_type = *has_result = (opcode >= 333 && opcode <= 366);
+}
+
+struct ir_block;
+struct ir_function;
+
+struct ir_inst {
+    u16 opcode;
+    u16 nops;
+    u32 type;
+    u32 id;
+    u32 file;
+    u32 line;
+    bool arena;  // from an ir_arena, ops included
+    u32 *ops;
+    struct ir_block *block;
+};
+
+struct ir_block {
+    u32 label;
+    u32 ninsts;
+    u32 cap;
+    struct ir_inst **insts;
+    struct ir_function *func;
+};
+
+struct ir_function {
+    struct ir_inst *def;
+    struct ir_inst **params;
+    u32 nparams;
+    u32 pcap;
+    struct ir_block **blocks;
+    u32 nblocks;
+    u32 bcap;
+};
+
+struct ir_module {
+    u32 version;
+    u32 generator;
+    u32 bound;
+    u32 schema;
+    
+    struct ir_inst **globals;
+    u32 nglobals;
+    u32 gcap;
+    
+    struct ir_function **functions;
+    u32 nfunctions;
+    u32 fcap;
+    
+    struct ir_inst **defs;
+    u32 dcap;
+    
+    u32 glsl_set;
+};
+
+#define IR_ARENA_CHUNK (1ull << 20)
+
+struct ir_arena_chunk {
+    struct ir_arena_chunk *next;
+    u64 used;
+    u64 size;
+    u8 data[];
+};
+
+struct ir_arena {
+    struct ir_arena_chunk *chunks;  // the one being filled first
+    u64 bytes;                      // handed out since the last reset
+};
+
+static _Thread_local struct ir_arena *ir_arena;
+
+// Zeroed, 8 byte aligned
+static void *
+ir_arena_alloc(struct ir_arena *a, u64 size)
+{
+    struct ir_arena_chunk *chunk = a->chunks;
+    void *ptr;
+    
+    size = (size + 7) & ~7ull;
+    
+    if (!chunk || chunk->used + size > chunk->size) {
+        u64 cap = size > IR_ARENA_CHUNK ? size : IR_ARENA_CHUNK;
+        
+        ASSERT(chunk = malloc(sizeof(struct ir_arena_chunk) + cap));
+        
+        chunk->next = a->chunks;
+        chunk->used = 0;
+        chunk->size = cap;
+        a->chunks = chunk;
+    }
+    
+    ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    a->bytes += size;
+    
+    memset(ptr, 0x00, size);
+    
+    return(ptr);
+}
+
+static struct ir_inst *
+ir_new_inst(u32 opcode, u32 type, u32 id, u32 nops)
+{
+    struct ir_inst *inst;
+    
+    if (ir_arena) {
+        inst = ir_arena_alloc(ir_arena, sizeof(struct ir_inst) + nops * sizeof(u32));
+        inst->arena = true;
+        inst->ops = nops ? (u32 *) (inst + 1) : NULL;
+    } else {
+        ASSERT(inst = calloc(1, sizeof(struct ir_inst)));
+        
+        if (nops) {
+            ASSERT(inst->ops = calloc(nops, sizeof(u32)));
+        }
+    }
+    
+    inst->opcode = opcode;
+    inst->type   = type;
+    inst->id     = id;
+    inst->nops   = nops;
+    
+    return(inst);
+}
+
+// NOTE: with an arena nothing is freed, arena instructions go with it and the others belong to a module it only reads
+static void
+ir_free_inst(struct ir_inst *inst)
+{
+    if (inst->arena || ir_arena) {
+        return;
+    }
+    
+    free(inst->ops);
+    free(inst);
+}
+
+static void
+ir_set_nops(struct ir_inst *inst, u32 nops)
+{
+    if (ir_arena) {
+        u32 *ops = ir_arena_alloc(ir_arena, (nops ? nops : 1) * sizeof(u32));
+        
+        if (inst->nops) {
+            memcpy(ops, inst->ops, (inst->nops < nops ? inst->nops : nops) * sizeof(u32));
+        }
+        
+        inst->ops = ops;
+    } else {
+        ASSERT(!inst->arena);
+        ASSERT(inst->ops = realloc(inst->ops, (nops ? nops : 1) * sizeof(u32)));
+        
+        for (u32 i = inst->nops; i < nops; ++i) {
+            inst->ops[i] = 0;
+        }
+    }
+    
+    inst->nops = nops;
+}
+
+static struct ir_inst *
+ir_def(struct ir_module *m, u32 id)
+{
+    if (id == 0 || id >= m->bound) {
+        return(NULL);
+    }
+    
+    return(m->defs[id]);
+}
+
+static void
+ir_set_def(struct ir_module *m, u32 id, struct ir_inst *inst)
+{
+    if (id >= m->dcap) {
+        u32 old = m->dcap;
+        
+        m->dcap = m->dcap ? m->dcap : 64;
+        while (m->dcap <= id) {
+            m->dcap *= 2;
+        }
+        
+        ASSERT(m->defs = realloc(m->defs, m->dcap * sizeof(struct ir_inst *)));
+        memset(m->defs + old, 0x00, (m->dcap - old) * sizeof(struct ir_inst *));
+    }
+    
+    if (id >= m->bound) {
+        m->bound = id + 1;
+    }
+    
+    m->defs[id] = inst;
+}
+
+static u32
+ir_new_id(struct ir_module *m)
+{
+    u32 id = m->bound;
+    ir_set_def(m, id, NULL);
+    return(id);
+}
+
+static struct ir_block *
+ir_new_block(struct ir_function *func, u32 label)
+{
+    struct ir_block *block;
+    
+    ASSERT(block = calloc(1, sizeof(struct ir_block)));
+    
+    block->label = label;
+    block->func  = func;
+    
+    return(block);
+}
+
+static void
+ir_insert(struct ir_block *block, u32 index, struct ir_inst *inst)
+{
+    if (block->ninsts == block->cap) {
+        block->cap = block->cap ? block->cap * 2 : 8;
+        ASSERT(block->insts = realloc(block->insts, block->cap * sizeof(struct ir_inst *)));
+    }
+    
+    memmove(block->insts + index + 1, block->insts + index, (block->ninsts - index) * sizeof(struct ir_inst *));
+    
+    block->insts[index] = inst;
+    block->ninsts += 1;
+    inst->block = block;
+}
+
+static void
+ir_append(struct ir_block *block, struct ir_inst *inst)
+{
+    ir_insert(block, block->ninsts, inst);
+}
+
+// NOTE: detaches the instruction without freeing it
+static struct ir_inst *
+ir_detach(struct ir_block *block, u32 index)
+{
+    struct ir_inst *inst = block->insts[index];
+    
+    memmove(block->insts + index, block->insts + index + 1, (block->ninsts - index - 1) * sizeof(struct ir_inst *));
+    
+    block->ninsts -= 1;
+    inst->block = NULL;
+    
+    return(inst);
+}
+
+static void
+ir_remove(struct ir_module *m, struct ir_block *block, u32 index)
+{
+    struct ir_inst *inst = ir_detach(block, index);
+    
+    if (inst->id && ir_def(m, inst->id) == inst) {
+        m->defs[inst->id] = NULL;
+    }
+    
+    ir_free_inst(inst);
+}
+
+static s32
+ir_index_of(struct ir_block *block, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < block->ninsts; ++i) {
+        if (block->insts[i] == inst) {
+            return(i);
+        }
+    }
+    
+    return(-1);
+}
+
+// Index of the block in func->blocks, UINT32_MAX when func has no such block
+static u32
+ir_block_index(struct ir_function *func, u32 label)
+{
+    for (u32 i = 0; i < func->nblocks; ++i) {
+        if (func->blocks[i]->label == label) {
+            return(i);
+        }
+    }
+    
+    return(UINT32_MAX);
+}
+
+static struct ir_inst *
+ir_terminator(struct ir_block *block)
+{
+    ASSERT(block->ninsts);
+    return(block->insts[block->ninsts - 1]);
+}
+
+// NOTE: the merge instruction (OpSelectionMerge/OpLoopMerge), if any, sits right before the terminator
+static struct ir_inst *
+ir_merge_inst(struct ir_block *block)
+{
+    if (block->ninsts < 2) {
+        return(NULL);
+    }
+    
+    struct ir_inst *inst = block->insts[block->ninsts - 2];
+    
+    if (inst->opcode == SpvOpSelectionMerge || inst->opcode == SpvOpLoopMerge) {
+        return(inst);
+    }
+    
+    return(NULL);
+}
+
+static bool
+ir_is_terminator(u32 opcode)
+{
+    return(opcode == SpvOpBranch || opcode == SpvOpBranchConditional || opcode == SpvOpSwitch ||
+           opcode == SpvOpReturn || opcode == SpvOpReturnValue || opcode == SpvOpKill ||
+           opcode == SpvOpUnreachable);
+}
+
+// Successor labels of a block, in terminator operand order. Returns the count.
+static u32
+ir_successors(struct ir_block *block, u32 *succ, u32 max)
+{
+    struct ir_inst *term = ir_terminator(block);
+    u32 count = 0;
+    
+    switch (term->opcode) {
+        case SpvOpBranch: {
+            succ[count++] = term->ops[0];
+        } break;
+        
+        case SpvOpBranchConditional: {
+            succ[count++] = term->ops[1];
+            if (term->ops[2] != term->ops[1]) {
+                succ[count++] = term->ops[2];
+            }
+        } break;
+        
+        case SpvOpSwitch: {
+            // default target, then (literal, label) pairs
+            for (u32 i = 1; i < term->nops; i += 2) {
+                bool seen = false;
+                
+                for (u32 j = 0; j < count; ++j) {
+                    seen |= (succ[j] == term->ops[i]);
+                }
+                
+                if (!seen) {
+                    ASSERT(count < max);
+                    succ[count++] = term->ops[i];
+                }
+            }
+        } break;
+    }
+    
+    ASSERT(count <= max);
+    
+    return(count);
+}
+
+// Number of words taken by a nul-terminated literal string
+static u32
+ir_string_words(const u32 *words, u32 max)
+{
+    for (u32 i = 0; i < max; ++i) {
+        if (memchr(words + i, 0, sizeof(u32))) {
+            return(i + 1);
+        }
+    }
+    
+    return(max);
+}
+
+// Which operands (after type and result id) hold ids rather than literals
+static bool
+ir_operand_is_id(struct ir_inst *inst, u32 i)
+{
+    switch (inst->opcode) {
+        case SpvOpSource:
+        return(i == 2);
+        
+        case SpvOpName:
+        case SpvOpMemberName:
+        case SpvOpDecorate:
+        case SpvOpMemberDecorate:
+        case SpvOpExecutionMode:
+        case SpvOpSelectionMerge:
+        case SpvOpTypeForwardPointer:
+        return(i == 0);
+        
+        // storage class, then the pointee type
+        case SpvOpTypePointer:
+        return(i == 1);
+        
+        case SpvOpDecorateId:
+        case SpvOpExecutionModeId:
+        return(i == 0 || i >= 2);
+        
+        case SpvOpEntryPoint:
+        return(i == 1 || i >= 2 + ir_string_words(inst->ops + 2, inst->nops - 2));
+        
+        case SpvOpLine:
+        return(i == 0);
+        
+        case SpvOpExtInst:
+        return(i != 1);
+        
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeImage:
+        return(i == 0);
+        
+        case SpvOpTypeArray:
+        case SpvOpTypeRuntimeArray:
+        case SpvOpTypeSampledImage:
+        case SpvOpTypeStruct:
+        case SpvOpTypeFunction:
+        case SpvOpConstantComposite:
+        case SpvOpSpecConstantComposite:
+        case SpvOpPhi:
+        case SpvOpBranch:
+        case SpvOpBranchConditional:
+        case SpvOpReturnValue:
+        case SpvOpFunctionCall:
+        case SpvOpCompositeConstruct:
+        case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain:
+        case SpvOpPtrAccessChain:
+        case SpvOpInBoundsPtrAccessChain:
+        case SpvOpGroupDecorate:
+        return(true);
+        
+        case SpvOpSpecConstantOp:
+        return(i >= 1);
+        
+        case SpvOpVariable:
+        return(i == 1);
+        
+        case SpvOpFunction:
+        return(i == 1);
+        
+        case SpvOpLoad:
+        return(i == 0);
+        
+        case SpvOpStore:
+        case SpvOpCopyMemory:
+        return(i <= 1);
+        
+        case SpvOpCopyMemorySized:
+        return(i <= 2);
+        
+        case SpvOpLoopMerge:
+        return(i <= 1);
+        
+        case SpvOpSwitch:
+        return(i <= 1 || (i % 2 == 1));
+        
+        case SpvOpCompositeExtract:
+        return(i == 0);
+        
+        case SpvOpVectorShuffle:
+        case SpvOpCompositeInsert:
+        return(i <= 1);
+        
+        case SpvOpTypeVoid:
+        case SpvOpTypeBool:
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        case SpvOpTypeSampler:
+        case SpvOpTypeOpaque:
+        case SpvOpConstant:
+        case SpvOpSpecConstant:
+        case SpvOpConstantTrue:
+        case SpvOpConstantFalse:
+        case SpvOpConstantNull:
+        case SpvOpSpecConstantTrue:
+        case SpvOpSpecConstantFalse:
+        case SpvOpConstantSampler:
+        case SpvOpCapability:
+        case SpvOpExtension:
+        case SpvOpExtInstImport:
+        case SpvOpMemoryModel:
+        case SpvOpSourceContinued:
+        case SpvOpSourceExtension:
+        case SpvOpString:
+        case SpvOpModuleProcessed:
+        case SpvOpLabel:
+        case SpvOpUndef:
+        case SpvOpFunctionParameter:
+        case SpvOpFunctionEnd:
+        case SpvOpReturn:
+        case SpvOpKill:
+        case SpvOpUnreachable:
+        case SpvOpNoLine:
+        case SpvOpDecorationGroup:
+        return(false);
+        
+        case SpvOpImageSampleImplicitLod:
+        case SpvOpImageSampleExplicitLod:
+        case SpvOpImageSampleProjImplicitLod:
+        case SpvOpImageSampleProjExplicitLod:
+        case SpvOpImageFetch:
+        case SpvOpImageRead:
+        return(i != 2);
+        
+        case SpvOpImageSampleDrefImplicitLod:
+        case SpvOpImageSampleDrefExplicitLod:
+        case SpvOpImageSampleProjDrefImplicitLod:
+        case SpvOpImageSampleProjDrefExplicitLod:
+        case SpvOpImageGather:
+        case SpvOpImageDrefGather:
+        return(i != 3);
+        
+        case SpvOpImageWrite:
+        return(i != 3);
+        
+        case SpvOpControlBarrier:
+        case SpvOpMemoryBarrier:
+        return(true);
+    }
+    
+    return(true);
+}
+
+static void
+ir_register_inst(struct ir_module *m, struct ir_inst *inst)
+{
+    if (inst->id) {
+        ir_set_def(m, inst->id, inst);
+    }
+}
+
+static bool
+ir_parse(const u32 *words, u32 size, struct ir_module *m)
+{
+    memset(m, 0x00, sizeof(struct ir_module));
+    
+    if (size < SPV_HEADER_SIZE || words[0] != SPV_MAGIC) {
+        printf("[ERROR] Not a SPIR-V module\n");
+        return(false);
+    }
+    
+    m->version   = words[1];
+    m->generator = words[2];
+    m->schema    = words[4];
+    
+    ir_set_def(m, words[3] ? words[3] - 1 : 0, NULL);
+    
+    struct ir_function *func = NULL;
+    struct ir_block *block = NULL;
+    u32 file = 0;
+    u32 line = 0;
+    
+    for (u32 at = SPV_HEADER_SIZE; at < size; ) {
+        u32 opcode = words[at] & 0xFFFF;
+        u32 count = words[at] >> 16;
+        bool has_type, has_result;
+        
+        if (count == 0 || at + count > size) {
+            printf("[ERROR] Truncated SPIR-V instruction at word %d\n", at);
+            return(false);
+        }
+        
+        spv_op_info(opcode, &has_type, &has_result);
+        
+        const u32 *w = words + at + 1;
+        u32 nops = count - 1;
+        u32 type = 0;
+        u32 id = 0;
+        
+        if (has_type) {
+            type = *w++;
+            --nops;
+        }
+        
+        if (has_result) {
+            id = *w++;
+            --nops;
+        }
+        
+        at += count;
+        
+        // NOTE: debug lines are kept per instruction and re-emitted on write
+        if (opcode == SpvOpLine) {
+            file = w[0];
+            line = w[1];
+            continue;
+        }
+        
+        if (opcode == SpvOpNoLine) {
+            file = line = 0;
+            continue;
+        }
+        
+        if (opcode == SpvOpLabel) {
+            ASSERT(func);
+            block = ir_new_block(func, id);
+            IR_PUSH(func->blocks, func->nblocks, func->bcap, block);
+            continue;
+        }
+        
+        struct ir_inst *inst = ir_new_inst(opcode, type, id, nops);
+        
+        memcpy(inst->ops, w, nops * sizeof(u32));
+        inst->file = file;
+        inst->line = line;
+        
+        ir_register_inst(m, inst);
+        
+        if (opcode == SpvOpExtInstImport && !strcmp((const char *) inst->ops, "GLSL.std.450")) {
+            m->glsl_set = id;
+        }
+        
+        switch (opcode) {
+            case SpvOpFunction: {
+                ASSERT(func = calloc(1, sizeof(struct ir_function)));
+                func->def = inst;
+                IR_PUSH(m->functions, m->nfunctions, m->fcap, func);
+            } break;
+            
+            case SpvOpFunctionParameter: {
+                ASSERT(func);
+                IR_PUSH(func->params, func->nparams, func->pcap, inst);
+            } break;
+            
+            case SpvOpFunctionEnd: {
+                ir_free_inst(inst);
+                func = NULL;
+                block = NULL;
+                file = line = 0;
+            } break;
+            
+            default: {
+                if (func) {
+                    ASSERT(block);
+                    ir_append(block, inst);
+                    if (ir_is_terminator(opcode)) {
+                        block = NULL;
+                    }
+                } else {
+                    IR_PUSH(m->globals, m->nglobals, m->gcap, inst);
+                }
+            }
+        }
+    }
+    
+    return(true);
+}
+
+static void
+ir_free_module(struct ir_module *m)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        ir_free_inst(m->globals[i]);
+    }
+    
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+            
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                ir_free_inst(block->insts[i]);
+            }
+            
+            free(block->insts);
+            free(block);
+        }
+        
+        for (u32 i = 0; i < func->nparams; ++i) {
+            ir_free_inst(func->params[i]);
+        }
+        
+        ir_free_inst(func->def);
+        free(func->params);
+        free(func->blocks);
+        free(func);
+    }
+    
+    free(m->globals);
+    free(m->functions);
+    free(m->defs);
+    
+    memset(m, 0x00, sizeof(struct ir_module));
+}
+
+struct ir_writer {
+    u32 *words;
+    u32 size;
+    u32 cap;
+    u32 file;
+    u32 line;
+};
+
+static void
+ir_write_word(struct ir_writer *w, u32 word)
+{
+    IR_PUSH(w->words, w->size, w->cap, word);
+}
+
+static void
+ir_write_raw(struct ir_writer *w, u32 opcode, u32 type, u32 id, const u32 *ops, u32 nops)
+{
+    u32 count = 1 + nops + (type ? 1 : 0) + (id ? 1 : 0);
+    
+    ir_write_word(w, (count << 16) | opcode);
+    
+    if (type) {
+        ir_write_word(w, type);
+    }
+    
+    if (id) {
+        ir_write_word(w, id);
+    }
+    
+    for (u32 i = 0; i < nops; ++i) {
+        ir_write_word(w, ops[i]);
+    }
+}
+
+static void
+ir_write_inst(struct ir_writer *w, struct ir_inst *inst)
+{
+    if (inst->line != w->line || inst->file != w->file) {
+        if (inst->line) {
+            u32 ops[3] = { inst->file, inst->line, 0 };
+            ir_write_raw(w, SpvOpLine, 0, 0, ops, 3);
+        } else {
+            ir_write_raw(w, SpvOpNoLine, 0, 0, NULL, 0);
+        }
+        
+        w->file = inst->file;
+        w->line = inst->line;
+    }
+    
+    ir_write_raw(w, inst->opcode, inst->type, inst->id, inst->ops, inst->nops);
+}
+
+static u32 *
+ir_emit(struct ir_module *m, u32 *size)
+{
+    struct ir_writer w = { 0 };
+    
+    ir_write_word(&w, SPV_MAGIC);
+    ir_write_word(&w, m->version);
+    ir_write_word(&w, m->generator);
+    ir_write_word(&w, m->bound);
+    ir_write_word(&w, m->schema);
+    
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        ir_write_raw(&w, inst->opcode, inst->type, inst->id, inst->ops, inst->nops);
+    }
+    
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        
+        w.file = w.line = 0;
+        
+        ir_write_inst(&w, func->def);
+        
+        for (u32 i = 0; i < func->nparams; ++i) {
+            ir_write_inst(&w, func->params[i]);
+        }
+        
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+            
+            ir_write_raw(&w, SpvOpLabel, 0, block->label, NULL, 0);
+            
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                ir_write_inst(&w, block->insts[i]);
+            }
+        }
+        
+        ir_write_raw(&w, SpvOpFunctionEnd, 0, 0, NULL, 0);
+    }
+    
+    *size = w.size;
+    
+    return(w.words);
+}
+
+// Index of the first global that belongs to the types/constants/variables section
+static u32
+ir_types_start(struct ir_module *m)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        u32 op = m->globals[i]->opcode;
+        
+        if (op != SpvOpCapability && op != SpvOpExtension && op != SpvOpExtInstImport &&
+            op != SpvOpMemoryModel && op != SpvOpEntryPoint && op != SpvOpExecutionMode &&
+            op != SpvOpExecutionModeId && op != SpvOpString && op != SpvOpSource &&
+            op != SpvOpSourceExtension && op != SpvOpSourceContinued && op != SpvOpName &&
+            op != SpvOpMemberName && op != SpvOpModuleProcessed && op != SpvOpDecorate &&
+            op != SpvOpMemberDecorate && op != SpvOpDecorationGroup && op != SpvOpGroupDecorate &&
+            op != SpvOpGroupMemberDecorate && op != SpvOpDecorateId) {
+            return(i);
+        }
+    }
+    
+    return(m->nglobals);
+}
+
+// Logical layout section of a global instruction, in the order the specification requires
+static u32
+ir_layout_section(u32 opcode)
+{
+    switch (opcode) {
+        case SpvOpCapability: return(0);
+        case SpvOpExtension: return(1);
+        case SpvOpExtInstImport: return(2);
+        case SpvOpMemoryModel: return(3);
+        case SpvOpEntryPoint: return(4);
+        case SpvOpExecutionMode:
+        case SpvOpExecutionModeId: return(5);
+        case SpvOpString:
+        case SpvOpSource:
+        case SpvOpSourceExtension:
+        case SpvOpSourceContinued: return(6);
+        case SpvOpName:
+        case SpvOpMemberName: return(7);
+        case SpvOpModuleProcessed: return(8);
+        case SpvOpDecorate:
+        case SpvOpMemberDecorate:
+        case SpvOpDecorateId:
+        case SpvOpDecorationGroup:
+        case SpvOpGroupDecorate:
+        case SpvOpGroupMemberDecorate: return(9);
+    }
+    
+    return(10);
+}
+
+// Index right after the last global of the section opcode belongs to
+static u32
+ir_section_end(struct ir_module *m, u32 opcode)
+{
+    u32 section = ir_layout_section(opcode);
+    
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (ir_layout_section(m->globals[i]->opcode) > section) {
+            return(i);
+        }
+    }
+    
+    return(m->nglobals);
+}
+
+static void
+ir_insert_global(struct ir_module *m, u32 index, struct ir_inst *inst)
+{
+    IR_PUSH(m->globals, m->nglobals, m->gcap, inst);
+    
+    memmove(m->globals + index + 1, m->globals + index, (m->nglobals - index - 1) * sizeof(struct ir_inst *));
+    m->globals[index] = inst;
+    
+    ir_register_inst(m, inst);
+}
+
+// NOTE: new types and constants go to the end of the global section, which is always after their operands
+static void
+ir_add_global(struct ir_module *m, struct ir_inst *inst)
+{
+    ir_insert_global(m, m->nglobals, inst);
+}
+
+static void
+ir_remove_global(struct ir_module *m, u32 index)
+{
+    struct ir_inst *inst = m->globals[index];
+    
+    memmove(m->globals + index, m->globals + index + 1, (m->nglobals - index - 1) * sizeof(struct ir_inst *));
+    m->nglobals -= 1;
+    
+    if (inst->id && ir_def(m, inst->id) == inst) {
+        m->defs[inst->id] = NULL;
+    }
+    
+    ir_free_inst(inst);
+}
+
+static void
+ir_add_capability(struct ir_module *m, u32 capability)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpCapability && m->globals[i]->ops[0] == capability) {
+            return;
+        }
+    }
+    
+    struct ir_inst *inst = ir_new_inst(SpvOpCapability, 0, 0, 1);
+    inst->ops[0] = capability;
+    ir_insert_global(m, 0, inst);
+}
+
+static bool
+ir_has_capability(struct ir_module *m, u32 capability)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpCapability && m->globals[i]->ops[0] == capability) {
+            return(true);
+        }
+    }
+    
+    return(false);
+}
+
+static bool
+ir_decoration(struct ir_module *m, u32 id, u32 decoration, u32 *value)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == SpvOpDecorate && inst->ops[0] == id && inst->ops[1] == decoration) {
+            if (value) {
+                *value = inst->nops > 2 ? inst->ops[2] : 0;
+            }
+            return(true);
+        }
+    }
+    
+    return(false);
+}
+
+static void
+ir_add_decoration(struct ir_module *m, u32 id, u32 decoration)
+{
+    if (ir_decoration(m, id, decoration, NULL)) {
+        return;
+    }
+    
+    struct ir_inst *inst = ir_new_inst(SpvOpDecorate, 0, 0, 2);
+    
+    inst->ops[0] = id;
+    inst->ops[1] = decoration;
+    
+    ir_insert_global(m, ir_types_start(m), inst);
+}
+
+static bool
+ir_execution_mode(struct ir_module *m, u32 mode, u32 *value)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == SpvOpExecutionMode && inst->ops[1] == mode) {
+            if (value) {
+                *value = inst->nops > 2 ? inst->ops[2] : 0;
+            }
+            return(true);
+        }
+    }
+    
+    return(false);
+}
+
+// Id of the GLSL.std.450 import, added after the existing imports when the module has none
+static u32
+ir_glsl_import(struct ir_module *m)
+{
+    if (m->glsl_set) {
+        return(m->glsl_set);
+    }
+    
+    struct ir_inst *inst = ir_new_inst(SpvOpExtInstImport, 0, ir_new_id(m), 4);
+    memcpy(inst->ops, "GLSL.std.450", 13);
+    ir_insert_global(m, ir_section_end(m, SpvOpExtInstImport), inst);
+    
+    m->glsl_set = inst->id;
+    
+    return(inst->id);
+}
+
+// Runs body for every instruction in the module, including function headers and parameters
+#define IR_FOR_EACH_INST(m, inst, body) {\
+    for (u32 _g = 0; _g < (m)->nglobals; ++_g) {\
+        struct ir_inst *inst = (m)->globals[_g];\
+        body\
+    }\
+    for (u32 _f = 0; _f < (m)->nfunctions; ++_f) {\
+        struct ir_function *_func = (m)->functions[_f];\
+        {\
+            struct ir_inst *inst = _func->def;\
+            body\
+        }\
+        for (u32 _p = 0; _p < _func->nparams; ++_p) {\
+            struct ir_inst *inst = _func->params[_p];\
+            body\
+        }\
+        for (u32 _b = 0; _b < _func->nblocks; ++_b) {\
+            for (u32 _i = 0; _i < _func->blocks[_b]->ninsts; ++_i) {\
+                struct ir_inst *inst = _func->blocks[_b]->insts[_i];\
+                body\
+            }\
+        }\
+    }\
+}
+
+// Names and decorations only annotate an id, they do not keep it alive
+static bool
+ir_is_annotation(u32 opcode)
+{
+    return(opcode == SpvOpName || opcode == SpvOpMemberName || opcode == SpvOpDecorate ||
+           opcode == SpvOpMemberDecorate || opcode == SpvOpDecorateId);
+}
+
+// Drops the names and decorations that target id, so removing its definition leaves no dangling references
+static void
+ir_remove_annotations(struct ir_module *m, u32 id)
+{
+    for (u32 i = m->nglobals; i-- > 0;) {
+        if (ir_is_annotation(m->globals[i]->opcode) && m->globals[i]->ops[0] == id) {
+            ir_remove_global(m, i);
+        }
+    }
+}
+
+// Points every use of from at to. Names and decorations are not moved over,
+// they describe from and go with it rather than landing on to.
+static void
+ir_replace_uses(struct ir_module *m, u32 from, u32 to)
+{
+    ir_remove_annotations(m, from);
+    
+    IR_FOR_EACH_INST(m, inst, {
+        if (inst->type == from) {
+            inst->type = to;
+        }
+        for (u32 i = 0; i < inst->nops; ++i) {
+            if (inst->ops[i] == from && ir_operand_is_id(inst, i)) {
+                inst->ops[i] = to;
+            }
+        }
+    });
+}
+
+// Number of uses of every id, not counting annotations, indexed by id. Caller frees.
+static u32 *
+ir_use_counts(struct ir_module *m)
+{
+    u32 *uses;
+    
+    ASSERT(uses = calloc(m->bound, sizeof(u32)));
+    
+    IR_FOR_EACH_INST(m, inst, {
+        if (inst->type) {
+            uses[inst->type] += 1;
+        }
+        for (u32 i = 0; i < inst->nops; ++i) {
+            if (inst->ops[i] < m->bound && ir_operand_is_id(inst, i) && !ir_is_annotation(inst->opcode)) {
+                uses[inst->ops[i]] += 1;
+            }
+        }
+    });
+    
+    return(uses);
+}
+
+// Deletes a block and everything in it, names and decorations of its results included
+static void
+ir_remove_block(struct ir_module *m, struct ir_function *func, u32 index)
+{
+    struct ir_block *block = func->blocks[index];
+    
+    for (u32 i = block->ninsts; i-- > 0;) {
+        if (block->insts[i]->id) {
+            ir_remove_annotations(m, block->insts[i]->id);
+        }
+        
+        ir_remove(m, block, i);
+    }
+    
+    ir_remove_annotations(m, block->label);
+    
+    memmove(func->blocks + index, func->blocks + index + 1, (func->nblocks - index - 1) * sizeof(struct ir_block *));
+    func->nblocks -= 1;
+    
+    free(block->insts);
+    free(block);
+}
+
+// Instructions that neither write memory nor have other side effects, so they
+// can be removed when unused. Loads are included, they only read.
+static bool
+ir_is_pure(struct ir_module *m, struct ir_inst *inst)
+{
+    switch (inst->opcode) {
+        case SpvOpUndef:
+        case SpvOpLoad:
+        case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain:
+        case SpvOpPtrAccessChain:
+        case SpvOpInBoundsPtrAccessChain:
+        case SpvOpArrayLength:
+        case SpvOpPhi:
+        case SpvOpSelect:
+        return(true);
+        
+        case SpvOpExtInst:
+        return(inst->ops[0] == m->glsl_set && inst->ops[1] != GLSLstd450Modf && inst->ops[1] != GLSLstd450Frexp);
+    }
+    
+    // vector/composite, conversion, arithmetic, relational, logical and bit operations
+    return((inst->opcode >= SpvOpVectorExtractDynamic && inst->opcode <= SpvOpTranspose) ||
+           (inst->opcode >= SpvOpConvertFToU && inst->opcode <= SpvOpBitcast) ||
+           (inst->opcode >= SpvOpSNegate && inst->opcode <= SpvOpBitCount));
+}
+
+// Removes unused pure instructions until none are left. Returns the count.
+static u32
+ir_remove_dead_code(struct ir_module *m)
+{
+    u32 removed = 0;
+    bool changed = true;
+    
+    while (changed) {
+        u32 *uses = ir_use_counts(m);
+        
+        changed = false;
+        
+        for (u32 f = 0; f < m->nfunctions; ++f) {
+            struct ir_function *func = m->functions[f];
+            
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                struct ir_block *block = func->blocks[b];
+                
+                for (u32 i = block->ninsts; i-- > 0;) {
+                    struct ir_inst *inst = block->insts[i];
+                    
+                    if (inst->id && !uses[inst->id] && ir_is_pure(m, inst)) {
+                        ir_remove_annotations(m, inst->id);
+                        ir_remove(m, block, i);
+                        removed += 1;
+                        changed = true;
+                    }
+                }
+            }
+        }
+        
+        free(uses);
+    }
+    
+    return(removed);
+}
+
+static struct ir_function *
+ir_find_function(struct ir_module *m, u32 id)
+{
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        if (m->functions[f]->def->id == id) {
+            return(m->functions[f]);
+        }
+    }
+    
+    return(NULL);
+}
+
+static struct ir_inst *
+ir_entry_point(struct ir_module *m, u32 *model)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpEntryPoint) {
+            if (model) {
+                *model = m->globals[i]->ops[0];
+            }
+            return(m->globals[i]);
+        }
+    }
+    
+    return(NULL);
+}
+
+static const char *
+ir_name(struct ir_module *m, u32 id)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == SpvOpName && inst->ops[0] == id && ((const char *) (inst->ops + 1))[0]) {
+            return((const char *) (inst->ops + 1));
+        }
+    }
+    
+    return(NULL);
+}
+
+// Type helpers
+
+static u32
+ir_scalar_type(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+    
+    while (def && (def->opcode == SpvOpTypeVector || def->opcode == SpvOpTypeMatrix)) {
+        def = ir_def(m, def->ops[0]);
+    }
+    
+    return(def ? def->id : 0);
+}
+
+static bool
+ir_is_float_type(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, ir_scalar_type(m, type));
+    return(def && def->opcode == SpvOpTypeFloat);
+}
+
+static u32
+ir_float_width(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, ir_scalar_type(m, type));
+    return(def && def->opcode == SpvOpTypeFloat ? def->ops[0] : 0);
+}
+
+// Number of vector components (1 for scalars)
+static u32
+ir_vector_size(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+    return(def && def->opcode == SpvOpTypeVector ? def->ops[1] : 1);
+}
+
+static bool
+ir_is_vector_type(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+    return(def && def->opcode == SpvOpTypeVector);
+}
+
+// Element type of a composite at the given literal index
+static u32
+ir_member_type(struct ir_module *m, u32 type, u32 index)
+{
+    struct ir_inst *def = ir_def(m, type);
+    
+    if (!def) {
+        return(0);
+    }
+    
+    switch (def->opcode) {
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        case SpvOpTypeArray:
+        case SpvOpTypeRuntimeArray:
+        return(def->ops[0]);
+        
+        case SpvOpTypeStruct:
+        return(index < def->nops ? def->ops[index] : 0);
+    }
+    
+    return(0);
+}
+
+static u32
+ir_pointee_type(struct ir_module *m, u32 pointer_type)
+{
+    struct ir_inst *def = ir_def(m, pointer_type);
+    return(def && def->opcode == SpvOpTypePointer ? def->ops[1] : 0);
+}
+
+static u32
+ir_storage_class(struct ir_module *m, u32 pointer_type)
+{
+    struct ir_inst *def = ir_def(m, pointer_type);
+    return(def && def->opcode == SpvOpTypePointer ? def->ops[0] : UINT32_MAX);
+}
+
+static u32
+ir_find_or_add_type(struct ir_module *m, u32 opcode, const u32 *ops, u32 nops)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == opcode && inst->nops == nops && !memcmp(inst->ops, ops, nops * sizeof(u32))) {
+            return(inst->id);
+        }
+    }
+    
+    struct ir_inst *inst = ir_new_inst(opcode, 0, ir_new_id(m), nops);
+    memcpy(inst->ops, ops, nops * sizeof(u32));
+    ir_add_global(m, inst);
+    
+    return(inst->id);
+}
+
+static u32
+ir_pointer_type(struct ir_module *m, u32 storage, u32 pointee)
+{
+    u32 ops[2] = { storage, pointee };
+    return(ir_find_or_add_type(m, SpvOpTypePointer, ops, 2));
+}
+
+// Constant helpers
+
+static bool
+ir_is_constant(struct ir_module *m, u32 id)
+{
+    struct ir_inst *def = ir_def(m, id);
+    
+    return(def && (def->opcode == SpvOpConstant || def->opcode == SpvOpConstantComposite ||
+                   def->opcode == SpvOpConstantTrue || def->opcode == SpvOpConstantFalse ||
+                   def->opcode == SpvOpConstantNull));
+}
+
+// Bit pattern of a scalar constant, or of component `index` of a composite one
+static bool
+ir_constant_bits(struct ir_module *m, u32 id, u32 index, u32 *bits)
+{
+    struct ir_inst *def = ir_def(m, id);
+    
+    if (!def) {
+        return(false);
+    }
+    
+    switch (def->opcode) {
+        case SpvOpConstant: {
+            *bits = def->ops[0];
+        } return(true);
+        
+        case SpvOpConstantTrue: {
+            *bits = 1;
+        } return(true);
+        
+        case SpvOpConstantFalse:
+        case SpvOpConstantNull: {
+            *bits = 0;
+        } return(true);
+        
+        case SpvOpConstantComposite: {
+            if (index >= def->nops) {
+                return(false);
+            }
+        } return(ir_constant_bits(m, def->ops[index], 0, bits));
+    }
+    
+    return(false);
+}
+
+static u32
+ir_constant(struct ir_module *m, u32 type, u32 bits)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == SpvOpConstant && inst->type == type && inst->nops == 1 && inst->ops[0] == bits) {
+            return(inst->id);
+        }
+    }
+    
+    struct ir_inst *inst = ir_new_inst(SpvOpConstant, type, ir_new_id(m), 1);
+    inst->ops[0] = bits;
+    ir_add_global(m, inst);
+    
+    return(inst->id);
+}
+
+static u32
+ir_composite_constant(struct ir_module *m, u32 type, const u32 *ids, u32 n)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        
+        if (inst->opcode == SpvOpConstantComposite && inst->type == type && inst->nops == n &&
+            !memcmp(inst->ops, ids, n * sizeof(u32))) {
+            return(inst->id);
+        }
+    }
+    
+    struct ir_inst *inst = ir_new_inst(SpvOpConstantComposite, type, ir_new_id(m), n);
+    memcpy(inst->ops, ids, n * sizeof(u32));
+    ir_add_global(m, inst);
+    
+    return(inst->id);
+}
+
+static u32
+ir_undef(struct ir_module *m, u32 type)
+{
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpUndef && m->globals[i]->type == type) {
+            return(m->globals[i]->id);
+        }
+    }
+    
+    struct ir_inst *undef = ir_new_inst(SpvOpUndef, type, ir_new_id(m), 0);
+    ir_add_global(m, undef);
+    
+    return(undef->id);
+}
+
+// Scalar or splatted vector float constant of the given type
+static u32
+ir_float_constant(struct ir_module *m, u32 type, f32 value)
+{
+    union { u32 u; f32 f; } c;
+    u32 scalar = ir_scalar_type(m, type);
+    u32 ids[4];
+    
+    c.f = value;
+    
+    u32 id = ir_constant(m, scalar, c.u);
+    
+    if (scalar == type) {
+        return(id);
+    }
+    
+    u32 n = ir_vector_size(m, type);
+    
+    ASSERT(n <= 4);
+    
+    for (u32 j = 0; j < n; ++j) {
+        ids[j] = id;
+    }
+    
+    return(ir_composite_constant(m, type, ids, n));
+}
+
+static u32
+ir_count_insts(struct ir_module *m)
+{
+    u32 count = m->nglobals;
+    
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        
+        count += 2 + func->nparams + func->nblocks;
+        
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            count += func->blocks[b]->ninsts;
+        }
+    }
+    
+    return(count);
+}
@@ -0,0 +1,394 @@
+// Loop-invariant code motion. Loops come from OpLoopMerge: the loop of a
+// header is every block it dominates that the merge block does not. Pure
+// instructions whose operands are all defined outside the loop, and loads
+// from read-only uniform memory, move to the end of the preheader, the one
+// predecessor of the header outside the loop.
+//
+// Arithmetic can be executed speculatively, memory accesses can not: an index
+// guarded by a branch or by the loop condition may be out of bounds. Loads
+// and access chains only leave blocks that run whenever the loop is entered.
+//
+// A hoisted value stays live across the whole loop, so hoisting stops once the
+// loop's peak pressure plus the hoisted values would exceed the budget.
+
+#define LICM_DEFAULT_PRESSURE 64
+
+struct licm {
+    struct ir_module *m;
+    u32 budget;
+    FILE *log;
+    u32 loops;
+    u32 hoisted;
+    u32 guarded;
+    u32 skipped;
+    u32 kept;
+};
+
+// Base variable of a pointer, looking through access chains
+static struct ir_inst *
+licm_base_variable(struct ir_module *m, u32 pointer)
+{
+    struct ir_inst *def = ir_def(m, pointer);
+
+    while (def && (def->opcode == SpvOpAccessChain || def->opcode == SpvOpInBoundsAccessChain ||
+                   def->opcode == SpvOpPtrAccessChain || def->opcode == SpvOpInBoundsPtrAccessChain ||
+                   def->opcode == SpvOpCopyObject)) {
+        def = ir_def(m, def->ops[0]);
+    }
+
+    return(def && def->opcode == SpvOpVariable ? def : NULL);
+}
+
+// Uniform blocks, push constants and uniform constants cannot change while the shader runs
+static bool
+licm_is_read_only(struct ir_module *m, struct ir_inst *load)
+{
+    struct ir_inst *var = licm_base_variable(m, load->ops[0]);
+
+    if (!var || (load->nops > 1 && (load->ops[1] & SpvMemoryAccessVolatile))) {
+        return(false);
+    }
+
+    switch (var->ops[0]) {
+        case SpvStorageClassUniformConstant:
+        case SpvStorageClassPushConstant:
+        return(true);
+
+        case SpvStorageClassUniform: {
+            // NOTE: BufferBlock marks the old style storage buffers, which are writable
+            u32 block = ir_pointee_type(m, var->type);
+
+            while (ir_def(m, block) && (ir_def(m, block)->opcode == SpvOpTypeArray ||
+                                        ir_def(m, block)->opcode == SpvOpTypeRuntimeArray)) {
+                block = ir_def(m, block)->ops[0];
+            }
+
+            return(!ir_decoration(m, block, SpvDecorationBufferBlock, NULL));
+        }
+    }
+
+    return(false);
+}
+
+static bool
+licm_touches_memory(struct ir_inst *inst)
+{
+    switch (inst->opcode) {
+        case SpvOpLoad:
+        case SpvOpAccessChain:
+        case SpvOpInBoundsAccessChain:
+        case SpvOpPtrAccessChain:
+        case SpvOpInBoundsPtrAccessChain:
+        case SpvOpArrayLength:
+        return(true);
+    }
+
+    return(false);
+}
+
+// Value of a scalar integer id on the first trip through the header: a constant,
+// or a header phi whose value from the preheader is one
+static bool
+licm_entry_value(struct licm *l, struct ir_block *header, u32 preheader, u32 id, u32 *value)
+{
+    struct ir_inst *def = ir_def(l->m, id);
+
+    if (def && def->opcode == SpvOpPhi && def->block == header) {
+        for (u32 k = 0; k + 1 < def->nops; k += 2) {
+            if (def->ops[k + 1] == preheader) {
+                id = def->ops[k];
+                def = ir_def(l->m, id);
+                break;
+            }
+        }
+    }
+
+    return(def && ir_is_constant(l->m, id) && ir_def(l->m, def->type) &&
+           ir_def(l->m, def->type)->opcode == SpvOpTypeInt && ir_constant_bits(l->m, id, 0, value));
+}
+
+// Whether the loop test lets the first trip in. Only loops with a single exit
+// comparing constants and header phis are proven, like for (i = 0; i < 4; ++i).
+static bool
+licm_runs_once(struct licm *l, struct cfg *g, const bool *in_loop, u32 header, u32 preheader, u32 exit)
+{
+    struct ir_block *block = g->func->blocks[exit];
+    struct ir_block *hblock = g->func->blocks[header];
+    struct ir_inst *branch = block->insts[block->ninsts - 1];
+    struct ir_inst *cond = branch->opcode == SpvOpBranchConditional ? ir_def(l->m, branch->ops[0]) : NULL;
+    u32 from = g->func->blocks[preheader]->label;
+    u32 a, b;
+    bool taken;
+
+    if (!cond || cond->nops != 2 || !licm_entry_value(l, hblock, from, cond->ops[0], &a) ||
+        !licm_entry_value(l, hblock, from, cond->ops[1], &b)) {
+        return(false);
+    }
+
+    switch (cond->opcode) {
+        case SpvOpIEqual:               taken = a == b; break;
+        case SpvOpINotEqual:            taken = a != b; break;
+        case SpvOpULessThan:            taken = a < b; break;
+        case SpvOpULessThanEqual:       taken = a <= b; break;
+        case SpvOpUGreaterThan:         taken = a > b; break;
+        case SpvOpUGreaterThanEqual:    taken = a >= b; break;
+        case SpvOpSLessThan:            taken = (s32) a < (s32) b; break;
+        case SpvOpSLessThanEqual:       taken = (s32) a <= (s32) b; break;
+        case SpvOpSGreaterThan:         taken = (s32) a > (s32) b; break;
+        case SpvOpSGreaterThanEqual:    taken = (s32) a >= (s32) b; break;
+        default:                        return(false);
+    }
+
+    u32 target = cfg_block_index(g, branch->ops[taken ? 1 : 2]);
+
+    return(target < g->nblocks && in_loop[target]);
+}
+
+// Blocks that run on every entry to the loop: those ahead of every exit, or, when the
+// first trip is certain and the test is the only exit, those ahead of every back edge
+static void
+licm_guaranteed(struct licm *l, struct cfg *g, const bool *in_loop, u32 header, u32 preheader, bool *guaranteed)
+{
+    u32 *exits;
+    u32 nexits = 0;
+
+    ASSERT(exits = malloc(g->nblocks * sizeof(u32)));
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        bool exiting = in_loop[b] && !g->succ[b].count;
+
+        for (u32 s = 0; s < g->succ[b].count && in_loop[b]; ++s) {
+            exiting |= !in_loop[g->succ[b].items[s]];
+        }
+
+        if (exiting) {
+            exits[nexits++] = b;
+        }
+    }
+
+    bool once = (nexits == 1 && licm_runs_once(l, g, in_loop, header, preheader, exits[0]));
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        guaranteed[b] = in_loop[b] && nexits;
+
+        for (u32 e = 0; e < nexits && guaranteed[b]; ++e) {
+            guaranteed[b] = cfg_dominates(g, b, exits[e]);
+        }
+
+        if (!guaranteed[b] && in_loop[b] && once) {
+            guaranteed[b] = true;
+
+            for (u32 p = 0; p < g->pred[header].count; ++p) {
+                u32 latch = g->pred[header].items[p];
+
+                if (in_loop[latch] && !cfg_dominates(g, b, latch)) {
+                    guaranteed[b] = false;
+                }
+            }
+        }
+    }
+
+    free(exits);
+}
+
+static bool
+licm_is_invariant(struct licm *l, struct cfg *g, const bool *in_loop, struct ir_inst *inst)
+{
+    if (!inst->id || inst->opcode == SpvOpPhi || !ir_is_pure(l->m, inst)) {
+        return(false);
+    }
+
+    if (inst->opcode == SpvOpLoad && !licm_is_read_only(l->m, inst)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i < inst->nops; ++i) {
+        struct ir_inst *def = ir_operand_is_id(inst, i) ? ir_def(l->m, inst->ops[i]) : NULL;
+
+        // NOTE: globals and parameters have no block, hoisted instructions now live in the preheader
+        if (def && def->block && in_loop[cfg_block_index(g, def->block->label)]) {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+static u32
+licm_loop_pressure(struct liveness *live, const bool *in_loop)
+{
+    u32 max = 0;
+
+    for (u32 b = 0; b < live->g->nblocks; ++b) {
+        if (in_loop[b]) {
+            u32 pressure = liveness_pressure(live, b, live->width, NULL);
+            max = pressure > max ? pressure : max;
+        }
+    }
+
+    return(max);
+}
+
+static void
+licm_log(struct licm *l, struct ir_inst *inst, u32 from, u32 to, const char *note)
+{
+    if (!l->log) {
+        return;
+    }
+
+    fprintf(l->log, "[LICM] %%%u %s from %%%u to %%%u", inst->id, spv_op_name(inst->opcode), from, to);
+
+    if (inst->line) {
+        fprintf(l->log, " (%s:%u)", profile_file_name(l->m, inst->file), inst->line);
+    }
+
+    fprintf(l->log, "%s\n", note);
+}
+
+static void
+licm_loop(struct licm *l, struct ir_function *func, u32 header)
+{
+    struct cfg g;
+    struct liveness live;
+    struct ir_block *hblock = func->blocks[header];
+    u32 preheader = UINT32_MAX;
+    bool *in_loop;
+
+    cfg_build(&g, func);
+
+    u32 merge = cfg_block_index(&g, ir_merge_inst(hblock)->ops[0]);
+
+    ASSERT(in_loop = calloc(g.nblocks, sizeof(bool)));
+
+    for (u32 b = 0; b < g.nblocks; ++b) {
+        in_loop[b] = cfg_dominates(&g, header, b) && !cfg_dominates(&g, merge, b);
+    }
+
+    for (u32 p = 0; p < g.pred[header].count; ++p) {
+        u32 pred = g.pred[header].items[p];
+
+        if (!in_loop[pred]) {
+            preheader = (preheader == UINT32_MAX) ? pred : UINT32_MAX - 1;
+        }
+    }
+
+    l->loops += 1;
+
+    if (preheader >= g.nblocks) {
+        if (l->log) {
+            fprintf(l->log, "[LICM] loop %%%u skipped, no single preheader\n", hblock->label);
+        }
+
+        l->skipped += 1;
+        free(in_loop);
+        cfg_free(&g);
+        return;
+    }
+
+    liveness_build(&live, l->m, &g);
+
+    struct ir_block *pblock = func->blocks[preheader];
+    u32 pressure = licm_loop_pressure(&live, in_loop);
+    bool full = false;
+    bool *guaranteed;
+
+    ASSERT(guaranteed = calloc(g.nblocks, sizeof(bool)));
+    licm_guaranteed(l, &g, in_loop, header, preheader, guaranteed);
+
+    for (u32 r = 0; r < g.nrpo && !full; ++r) {
+        u32 b = g.rpo[r];
+        struct ir_block *block = func->blocks[b];
+
+        if (!in_loop[b]) {
+            continue;
+        }
+
+        for (u32 i = 0; i < block->ninsts; ++i) {
+            struct ir_inst *inst = block->insts[i];
+
+            if (!licm_is_invariant(l, &g, in_loop, inst)) {
+                continue;
+            }
+
+            if (licm_touches_memory(inst) && !guaranteed[b]) {
+                licm_log(l, inst, block->label, pblock->label, ", kept: block may not run");
+                l->kept += 1;
+                continue;
+            }
+
+            u32 width = liveness_width(l->m, inst->type);
+
+            if (width && pressure + width > l->budget) {
+                licm_log(l, inst, block->label, pblock->label, ", stopped: pressure budget");
+                l->guarded += 1;
+                full = true;
+                break;
+            }
+
+            u32 at = pblock->ninsts - 1;
+
+            if (ir_merge_inst(pblock)) {
+                at -= 1;
+            }
+
+            ir_detach(block, i);
+            ir_insert(pblock, at, inst);
+            i -= 1;
+
+            pressure += width;
+            l->hoisted += 1;
+
+            licm_log(l, inst, block->label, pblock->label, "");
+        }
+    }
+
+    liveness_free(&live);
+    free(guaranteed);
+    free(in_loop);
+    cfg_free(&g);
+}
+
+static void
+licm_run(struct ir_module *m, u32 budget, FILE *log, struct licm *l)
+{
+    memset(l, 0x00, sizeof(struct licm));
+
+    l->m = m;
+    l->budget = budget;
+    l->log = log;
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        struct cfg g;
+        u32 *headers;
+        u32 nheaders = 0;
+
+        cfg_build(&g, func);
+        ASSERT(headers = malloc(g.nblocks * sizeof(u32)));
+
+        for (u32 r = 0; r < g.nrpo; ++r) {
+            struct ir_inst *merge = ir_merge_inst(func->blocks[g.rpo[r]]);
+
+            if (merge && merge->opcode == SpvOpLoopMerge) {
+                headers[nheaders++] = g.rpo[r];
+            }
+        }
+
+        cfg_free(&g);
+
+        // Inner loops first, what they hoist can then leave the outer loop too
+        for (u32 h = nheaders; h-- > 0;) {
+            licm_loop(l, func, headers[h]);
+        }
+
+        free(headers);
+    }
+}
+
+static void
+licm_report(struct licm *l, FILE *out)
+{
+    fprintf(out, "[LICM] %u loops, %u instructions hoisted, %u loops stopped by the pressure budget, %u skipped\n",
+            l->loops, l->hoisted, l->guarded, l->skipped);
+    fprintf(out, "[LICM] %u invariant memory accesses kept in blocks that may not run\n", l->kept);
+}
@@ -0,0 +1,346 @@
+// Liveness of SSA values in one function. Only values that need a register
+// are tracked: instruction results and parameters that are not pointers.
+// Live sets are bit-packed, one bit per value, and solved backwards to a
+// fixpoint. Phi operands are live out of the matching predecessor only.
+//
+// Pressure is counted both in 32-bit scalar registers, where a vec4 weighs 4,
+// and in vector registers, one per scalar or per vector of up to 4 components.
+
+struct liveness {
+    struct ir_module *m;
+    struct cfg *g;
+    u32 nvalues;
+    u32 *index;    // id -> value index + 1, 0 for ids that are not tracked
+    u32 *ids;      // value index -> id
+    u32 *width;    // value index -> scalar registers
+    u32 *slots;    // value index -> vector registers
+    u32 words;     // u64 words per set
+    u64 *live_in;  // nblocks sets
+    u64 *live_out;
+    u32 iterations;
+};
+
+#define LIVENESS_SET(l, sets, b) ((sets) + (u64) (b) * (l)->words)
+#define LIVENESS_TEST(set, i) (((set)[(i) >> 6] >> ((i) & 63)) & 1)
+#define LIVENESS_ADD(set, i) ((set)[(i) >> 6] |= (1ull << ((i) & 63)))
+#define LIVENESS_DEL(set, i) ((set)[(i) >> 6] &= ~(1ull << ((i) & 63)))
+
+// Scalar registers taken by a value of the given type, 0 when it lives in memory or is an address
+static u32
+liveness_width(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+
+    if (!def) {
+        return(0);
+    }
+
+    switch (def->opcode) {
+        case SpvOpTypeBool:
+        return(1);
+
+        case SpvOpTypeInt:
+        case SpvOpTypeFloat:
+        return(def->ops[0] == 64 ? 2 : 1);
+
+        case SpvOpTypeVector:
+        case SpvOpTypeMatrix:
+        return(def->ops[1] * liveness_width(m, def->ops[0]));
+
+        case SpvOpTypeArray: {
+            u32 length;
+
+            if (!ir_constant_bits(m, def->ops[1], 0, &length)) {
+                return(0);
+            }
+
+            return(length * liveness_width(m, def->ops[0]));
+        }
+
+        case SpvOpTypeStruct: {
+            u32 width = 0;
+
+            for (u32 i = 0; i < def->nops; ++i) {
+                width += liveness_width(m, def->ops[i]);
+            }
+
+            return(width);
+        }
+    }
+
+    // pointers, images, samplers and void
+    return(0);
+}
+
+// Vector registers taken by a value of the given type: a matrix takes one per
+// column, wide vectors of 64-bit components take two
+static u32
+liveness_slots(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+
+    if (!def) {
+        return(0);
+    }
+
+    switch (def->opcode) {
+        case SpvOpTypeVector:
+        return((liveness_width(m, type) + 3) / 4);
+
+        case SpvOpTypeMatrix:
+        return(def->ops[1] * liveness_slots(m, def->ops[0]));
+
+        case SpvOpTypeArray: {
+            u32 length;
+
+            if (!ir_constant_bits(m, def->ops[1], 0, &length)) {
+                return(0);
+            }
+
+            return(length * liveness_slots(m, def->ops[0]));
+        }
+
+        case SpvOpTypeStruct: {
+            u32 slots = 0;
+
+            for (u32 i = 0; i < def->nops; ++i) {
+                slots += liveness_slots(m, def->ops[i]);
+            }
+
+            return(slots);
+        }
+    }
+
+    return(liveness_width(m, type) ? 1 : 0);
+}
+
+static u32
+liveness_value(struct liveness *l, u32 id)
+{
+    return(id < l->m->bound && l->index[id] ? l->index[id] - 1 : UINT32_MAX);
+}
+
+static void
+liveness_track(struct liveness *l, struct ir_inst *inst, u32 *cap)
+{
+    u32 width = liveness_width(l->m, inst->type);
+
+    if (!inst->id || !width) {
+        return;
+    }
+
+    if (l->nvalues == *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        ASSERT(l->ids = realloc(l->ids, *cap * sizeof(u32)));
+        ASSERT(l->width = realloc(l->width, *cap * sizeof(u32)));
+        ASSERT(l->slots = realloc(l->slots, *cap * sizeof(u32)));
+    }
+
+    l->index[inst->id] = l->nvalues + 1;
+    l->ids[l->nvalues] = inst->id;
+    l->width[l->nvalues] = width;
+    l->slots[l->nvalues] = liveness_slots(l->m, inst->type);
+    l->nvalues += 1;
+}
+
+// Updates live (the set after inst) to the set before it
+static void
+liveness_step(struct liveness *l, struct ir_inst *inst, u64 *live)
+{
+    u32 v = liveness_value(l, inst->id);
+
+    if (v != UINT32_MAX) {
+        LIVENESS_DEL(live, v);
+    }
+
+    // NOTE: phi operands are accounted for on the incoming edges
+    if (inst->opcode == SpvOpPhi) {
+        return;
+    }
+
+    for (u32 i = 0; i < inst->nops; ++i) {
+        u32 u = ir_operand_is_id(inst, i) ? liveness_value(l, inst->ops[i]) : UINT32_MAX;
+
+        if (u != UINT32_MAX) {
+            LIVENESS_ADD(live, u);
+        }
+    }
+}
+
+// Live out of b: live in of every successor minus its phis, plus the phi operands coming from b
+static void
+liveness_out(struct liveness *l, u32 b, u64 *out)
+{
+    struct ir_function *func = l->g->func;
+
+    memset(out, 0x00, l->words * sizeof(u64));
+
+    for (u32 s = 0; s < l->g->succ[b].count; ++s) {
+        u32 succ = l->g->succ[b].items[s];
+        struct ir_block *block = func->blocks[succ];
+        u64 *in = LIVENESS_SET(l, l->live_in, succ);
+
+        for (u32 w = 0; w < l->words; ++w) {
+            out[w] |= in[w];
+        }
+
+        for (u32 i = 0; i < block->ninsts && block->insts[i]->opcode == SpvOpPhi; ++i) {
+            struct ir_inst *phi = block->insts[i];
+            u32 v = liveness_value(l, phi->id);
+
+            if (v != UINT32_MAX) {
+                LIVENESS_DEL(out, v);
+            }
+        }
+
+        for (u32 i = 0; i < block->ninsts && block->insts[i]->opcode == SpvOpPhi; ++i) {
+            struct ir_inst *phi = block->insts[i];
+
+            for (u32 p = 0; p + 1 < phi->nops; p += 2) {
+                u32 u = liveness_value(l, phi->ops[p]);
+
+                if (phi->ops[p + 1] == func->blocks[b]->label && u != UINT32_MAX) {
+                    LIVENESS_ADD(out, u);
+                }
+            }
+        }
+    }
+}
+
+static void
+liveness_build(struct liveness *l, struct ir_module *m, struct cfg *g)
+{
+    struct ir_function *func = g->func;
+    u32 cap = 0;
+    u64 *live;
+    bool changed = true;
+
+    memset(l, 0x00, sizeof(struct liveness));
+
+    l->m = m;
+    l->g = g;
+
+    ASSERT(l->index = calloc(m->bound, sizeof(u32)));
+
+    for (u32 p = 0; p < func->nparams; ++p) {
+        liveness_track(l, func->params[p], &cap);
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            liveness_track(l, func->blocks[b]->insts[i], &cap);
+        }
+    }
+
+    l->words = (l->nvalues + 63) / 64;
+    l->words = l->words ? l->words : 1;
+
+    ASSERT(l->live_in = calloc((u64) func->nblocks * l->words, sizeof(u64)));
+    ASSERT(l->live_out = calloc((u64) func->nblocks * l->words, sizeof(u64)));
+    ASSERT(live = malloc(l->words * sizeof(u64)));
+
+    // Postorder (reverse rpo) converges in a few rounds for a backward problem
+    while (changed) {
+        changed = false;
+        l->iterations += 1;
+
+        for (u32 i = g->nrpo; i-- > 0;) {
+            u32 b = g->rpo[i];
+            struct ir_block *block = func->blocks[b];
+            u64 *out = LIVENESS_SET(l, l->live_out, b);
+            u64 *in = LIVENESS_SET(l, l->live_in, b);
+
+            liveness_out(l, b, out);
+            memcpy(live, out, l->words * sizeof(u64));
+
+            for (u32 j = block->ninsts; j-- > 0;) {
+                liveness_step(l, block->insts[j], live);
+            }
+
+            // phi results are defined on entry, so they are live in
+            for (u32 j = 0; j < block->ninsts && block->insts[j]->opcode == SpvOpPhi; ++j) {
+                u32 v = liveness_value(l, block->insts[j]->id);
+
+                if (v != UINT32_MAX) {
+                    LIVENESS_ADD(live, v);
+                }
+            }
+
+            if (memcmp(live, in, l->words * sizeof(u64))) {
+                memcpy(in, live, l->words * sizeof(u64));
+                changed = true;
+            }
+        }
+    }
+
+    free(live);
+}
+
+static void
+liveness_free(struct liveness *l)
+{
+    free(l->index);
+    free(l->ids);
+    free(l->width);
+    free(l->slots);
+    free(l->live_in);
+    free(l->live_out);
+}
+
+// Sum of weights (l->width or l->slots) over the values in set
+static u32
+liveness_weight(struct liveness *l, const u64 *set, const u32 *weights)
+{
+    u32 weight = 0;
+
+    for (u32 w = 0; w < l->words; ++w) {
+        u64 bits = set[w];
+
+        while (bits) {
+            u32 bit = __builtin_ctzll(bits);
+
+            weight += weights[w * 64 + bit];
+            bits &= bits - 1;
+        }
+    }
+
+    return(weight);
+}
+
+// Registers live right after every instruction of block b, weighted by
+// l->width or l->slots, written to points when given (block->ninsts entries).
+// Returns the maximum over the block.
+static u32
+liveness_pressure(struct liveness *l, u32 b, const u32 *weights, u32 *points)
+{
+    struct ir_block *block = l->g->func->blocks[b];
+    u32 max = 0;
+    u64 *live;
+
+    ASSERT(live = malloc(l->words * sizeof(u64)));
+    memcpy(live, LIVENESS_SET(l, l->live_out, b), l->words * sizeof(u64));
+
+    for (u32 i = block->ninsts; i-- > 0;) {
+        struct ir_inst *inst = block->insts[i];
+        u32 v = liveness_value(l, inst->id);
+
+        // NOTE: a result counts at its definition even when it is never used
+        if (v != UINT32_MAX) {
+            LIVENESS_ADD(live, v);
+        }
+
+        u32 weight = liveness_weight(l, live, weights);
+
+        if (points) {
+            points[i] = weight;
+        }
+
+        max = weight > max ? weight : max;
+
+        liveness_step(l, inst, live);
+    }
+
+    free(live);
+
+    return(max);
+}
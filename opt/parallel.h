@@ -0,0 +1,683 @@
+// Function-parallel optimization for modules with many functions. The
+// function-local passes (SROA, CFG simplification, composite folding,
+// strength reduction, peephole, LICM) only touch the body of one function and
+// the globals they add, so functions can be optimized independently.
+//
+// The workers are a pool that lives as long as the struct parallel, a run is
+// started by bumping the generation like the record jobs of the viewer. The
+// module is parsed once. A worker sees it through a view: its own list of
+// pointers to the module's globals, read only, and a copy of the function it
+// took from a shared queue, with the same ids. Everything the passes allocate
+// on a worker comes from that worker's arena, new ids continue above the
+// module's bound in every view.
+//
+// Once every function is done the ones that changed are copied back in
+// function order, unchanged ones are dropped. Ids of the module map to
+// themselves, only the globals the passes created are matched by structure, so
+// a constant made by two workers exists once, and nothing is hashed. Module
+// level passes (precision, deduplication) run after that sync point, on the
+// whole module.
+
+struct parallel_worker;
+
+// A function a worker changed, held until the merge
+struct parallel_result {
+    struct parallel_worker *worker;  // its view resolves the new ids
+    struct ir_function *func;        // the optimized copy, NULL when unchanged
+    struct ir_inst **globals;        // created by the passes, then the annotations of the copy's results
+    u32 nglobals;
+    u32 gcap;
+};
+
+struct parallel_worker {
+    struct parallel *p;
+    pthread_t thread;
+    struct ir_arena arena;
+    struct ir_module view;  // the module's globals and the function being optimized
+    u32 *remap;             // by id above the base, filled by the merge
+    u32 functions;
+    u32 changed;
+    u64 arena_bytes;        // of the last run
+};
+
+struct parallel {
+    u32 threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    u32 generation;
+    u32 running;
+    bool quit;
+    struct parallel_worker *workers;
+
+    // The current run
+    struct ir_module *m;
+    struct pipeline_options local;
+    u32 base;  // bound of the module when the run started
+    u32 next;
+    u32 nfunctions;
+    u32 changed;
+    struct parallel_result *results;  // per function
+    f64 optimize_msec;
+    f64 merge_msec;
+};
+
+// All cores for 0
+static u32
+parallel_threads(u32 threads)
+{
+    s64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return(threads ? threads : (cores > 0 ? (u32) cores : 1));
+}
+
+static u32
+parallel_take(struct parallel *p)
+{
+    u32 f = UINT32_MAX;
+
+    pthread_mutex_lock(&p->mutex);
+
+    if (p->next < p->nfunctions) {
+        f = p->next++;
+    }
+
+    pthread_mutex_unlock(&p->mutex);
+
+    return(f);
+}
+
+// Keeps the newest chunk for the next run
+static void
+parallel_arena_reset(struct ir_arena *a)
+{
+    struct ir_arena_chunk *chunk = a->chunks ? a->chunks->next : NULL;
+
+    while (chunk) {
+        struct ir_arena_chunk *next = chunk->next;
+
+        free(chunk);
+        chunk = next;
+    }
+
+    if (a->chunks) {
+        a->chunks->next = NULL;
+        a->chunks->used = 0;
+    }
+
+    a->bytes = 0;
+}
+
+static struct ir_inst *
+parallel_clone_inst(struct ir_module *view, struct ir_inst *src)
+{
+    struct ir_inst *inst = ir_new_inst(src->opcode, src->type, src->id, src->nops);
+
+    if (src->nops) {
+        memcpy(inst->ops, src->ops, src->nops * sizeof(u32));
+    }
+
+    inst->file = src->file;
+    inst->line = src->line;
+
+    ir_register_inst(view, inst);
+
+    return(inst);
+}
+
+// Copy of func with the same ids, its definitions replace the module's in the view
+static struct ir_function *
+parallel_clone(struct ir_module *view, struct ir_function *func)
+{
+    struct ir_function *copy;
+
+    ASSERT(copy = calloc(1, sizeof(struct ir_function)));
+
+    copy->def = parallel_clone_inst(view, func->def);
+
+    for (u32 i = 0; i < func->nparams; ++i) {
+        IR_PUSH(copy->params, copy->nparams, copy->pcap, parallel_clone_inst(view, func->params[i]));
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        struct ir_block *block = ir_new_block(copy, func->blocks[b]->label);
+
+        IR_PUSH(copy->blocks, copy->nblocks, copy->bcap, block);
+
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            ir_append(block, parallel_clone_inst(view, func->blocks[b]->insts[i]));
+        }
+    }
+
+    return(copy);
+}
+
+// NOTE: the instructions are in an arena, only the lists are freed
+static void
+parallel_release(struct ir_function *func)
+{
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        free(func->blocks[b]->insts);
+        free(func->blocks[b]);
+    }
+
+    free(func->params);
+    free(func->blocks);
+    free(func);
+}
+
+// Whether the passes changed the body or the globals, the view starts out with the module's
+static bool
+parallel_changed(struct ir_module *m, struct ir_function *func, struct ir_module *view, struct ir_function *copy)
+{
+    if (view->nglobals != m->nglobals || memcmp(view->globals, m->globals, m->nglobals * sizeof(struct ir_inst *))) {
+        return(true);
+    }
+
+    if (copy->nblocks != func->nblocks) {
+        return(true);
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        struct ir_block *x = func->blocks[b];
+        struct ir_block *y = copy->blocks[b];
+
+        if (x->label != y->label || x->ninsts != y->ninsts) {
+            return(true);
+        }
+
+        for (u32 i = 0; i < x->ninsts; ++i) {
+            struct ir_inst *a = x->insts[i];
+            struct ir_inst *c = y->insts[i];
+
+            if (a->opcode != c->opcode || a->type != c->type || a->id != c->id || a->nops != c->nops ||
+                a->file != c->file || a->line != c->line || (a->nops && memcmp(a->ops, c->ops, a->nops * sizeof(u32)))) {
+                return(true);
+            }
+        }
+    }
+
+    return(false);
+}
+
+// Created globals first, they come in the order they were made so operands go before their users. The
+// annotations of the copy's results are copied, the module's own are freed before the merge copies them back.
+static void
+parallel_collect(struct ir_module *view, struct ir_function *copy, struct parallel_result *r)
+{
+    for (u32 i = 0; i < view->nglobals; ++i) {
+        struct ir_inst *inst = view->globals[i];
+
+        if (inst->arena && !ir_is_annotation(inst->opcode)) {
+            IR_PUSH(r->globals, r->nglobals, r->gcap, inst);
+        }
+    }
+
+    for (u32 i = 0; i < view->nglobals; ++i) {
+        struct ir_inst *inst = view->globals[i];
+        struct ir_inst *target;
+
+        if (!ir_is_annotation(inst->opcode)) {
+            continue;
+        }
+
+        target = ir_def(view, inst->ops[0]);
+
+        if (inst->arena) {
+            IR_PUSH(r->globals, r->nglobals, r->gcap, inst);
+        } else if (target && target->block && target->block->func == copy) {
+            IR_PUSH(r->globals, r->nglobals, r->gcap, parallel_clone_inst(view, inst));
+        }
+    }
+}
+
+static void
+parallel_optimize(struct parallel_worker *w)
+{
+    struct parallel *p = w->p;
+    struct ir_module *m = p->m;
+    struct ir_module *view = &w->view;
+    struct ir_function *copy;
+    u32 f;
+
+    memset(view, 0x00, sizeof(struct ir_module));
+
+    view->version   = m->version;
+    view->generator = m->generator;
+    view->schema    = m->schema;
+    view->bound     = m->bound;
+    view->dcap      = m->dcap;
+    view->gcap      = m->nglobals + 1;
+
+    ASSERT(view->defs = malloc(view->dcap * sizeof(struct ir_inst *)));
+    ASSERT(view->globals = malloc(view->gcap * sizeof(struct ir_inst *)));
+    memcpy(view->defs, m->defs, m->dcap * sizeof(struct ir_inst *));
+
+    w->functions = w->changed = 0;
+
+    while ((f = parallel_take(p)) != UINT32_MAX) {
+        // NOTE: the view starts over at the module's globals, the ids of earlier functions stay taken
+        if (view->gcap < m->nglobals) {
+            view->gcap = m->nglobals;
+            ASSERT(view->globals = realloc(view->globals, view->gcap * sizeof(struct ir_inst *)));
+        }
+
+        memcpy(view->globals, m->globals, m->nglobals * sizeof(struct ir_inst *));
+        view->nglobals = m->nglobals;
+        view->glsl_set = m->glsl_set;
+
+        copy = parallel_clone(view, m->functions[f]);
+        view->functions = &copy;
+        view->nfunctions = 1;
+
+        pipeline_run(view, &p->local, NULL);
+
+        w->functions += 1;
+
+        if (parallel_changed(m, m->functions[f], view, copy)) {
+            p->results[f].worker = w;
+            p->results[f].func = copy;
+            parallel_collect(view, copy, &p->results[f]);
+            w->changed += 1;
+        } else {
+            parallel_release(copy);
+        }
+
+        view->functions = NULL;
+        view->nfunctions = 0;
+    }
+}
+
+static void *
+parallel_worker(void *arg)
+{
+    struct parallel_worker *w = arg;
+    struct parallel *p = w->p;
+    u32 seen = 0;
+
+    // NOTE: everything the passes allocate on this thread comes from its arena
+    ir_arena = &w->arena;
+
+    while (true) {
+        pthread_mutex_lock(&p->mutex);
+
+        while (p->generation == seen && !p->quit) {
+            pthread_cond_wait(&p->start, &p->mutex);
+        }
+
+        seen = p->generation;
+
+        if (p->quit) {
+            pthread_mutex_unlock(&p->mutex);
+            break;
+        }
+
+        pthread_mutex_unlock(&p->mutex);
+
+        parallel_optimize(w);
+
+        pthread_mutex_lock(&p->mutex);
+
+        if (--p->running == 0) {
+            pthread_cond_signal(&p->done);
+        }
+
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    return(NULL);
+}
+
+static void
+parallel_init(struct parallel *p, u32 threads)
+{
+    memset(p, 0x00, sizeof(struct parallel));
+
+    p->threads = parallel_threads(threads);
+
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    ASSERT(p->workers = calloc(p->threads, sizeof(struct parallel_worker)));
+
+    for (u32 t = 0; t < p->threads; ++t) {
+        p->workers[t].p = p;
+        ASSERT(!pthread_create(&p->workers[t].thread, NULL, parallel_worker, &p->workers[t]));
+    }
+}
+
+// Id in the module of an id the worker's view used
+static u32
+parallel_map(struct parallel *p, struct parallel_worker *w, u32 id)
+{
+    struct ir_module *m = p->m;
+    struct ir_inst *def, *inst;
+    u32 *slot;
+
+    if (id < p->base) {
+        return(id);
+    }
+
+    slot = &w->remap[id - p->base];
+
+    if (*slot) {
+        return(*slot);
+    }
+
+    def = ir_def(&w->view, id);
+
+    // NOTE: labels have no definition, results of the copy sit in a block
+    if (!def || def->block) {
+        return(*slot = ir_new_id(m));
+    }
+
+    if (def->opcode == SpvOpExtInstImport && !strcmp((const char *) def->ops, "GLSL.std.450")) {
+        return(*slot = ir_glsl_import(m));
+    }
+
+    inst = ir_new_inst(def->opcode, parallel_map(p, w, def->type), 0, def->nops);
+
+    for (u32 i = 0; i < def->nops; ++i) {
+        inst->ops[i] = ir_operand_is_id(def, i) ? parallel_map(p, w, def->ops[i]) : def->ops[i];
+    }
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *g = m->globals[i];
+
+        if (g->opcode == inst->opcode && g->type == inst->type && g->nops == inst->nops && g->id &&
+            !memcmp(g->ops, inst->ops, inst->nops * sizeof(u32))) {
+            ir_free_inst(inst);
+            return(*slot = g->id);
+        }
+    }
+
+    inst->id = ir_new_id(m);
+    ir_insert_global(m, ir_section_end(m, inst->opcode), inst);
+
+    return(*slot = inst->id);
+}
+
+// Capabilities and extensions the passes enabled for the copy
+static void
+parallel_enable(struct ir_module *m, struct ir_inst *src)
+{
+    struct ir_inst *inst;
+
+    if (src->opcode == SpvOpCapability) {
+        ir_add_capability(m, src->ops[0]);
+        return;
+    }
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == src->opcode && !strcmp((const char *) m->globals[i]->ops, (const char *) src->ops)) {
+            return;
+        }
+    }
+
+    inst = ir_new_inst(src->opcode, 0, 0, src->nops);
+    memcpy(inst->ops, src->ops, src->nops * sizeof(u32));
+    ir_insert_global(m, ir_section_end(m, inst->opcode), inst);
+}
+
+// Builds the body of to from the worker's copy, names and decorations go to the lists
+static void
+parallel_copy(struct parallel *p, struct ir_function *to, struct parallel_result *r,
+              struct ir_inst ***annotations, u32 *nannotations, u32 *acap)
+{
+    struct ir_module *m = p->m;
+    struct parallel_worker *w = r->worker;
+    struct ir_function *from = r->func;
+
+    for (u32 i = 0; i < r->nglobals; ++i) {
+        struct ir_inst *src = r->globals[i];
+
+        if (ir_is_annotation(src->opcode)) {
+            struct ir_inst *inst = ir_new_inst(src->opcode, 0, 0, src->nops);
+
+            for (u32 k = 0; k < src->nops; ++k) {
+                inst->ops[k] = ir_operand_is_id(src, k) ? parallel_map(p, w, src->ops[k]) : src->ops[k];
+            }
+
+            IR_PUSH(*annotations, *nannotations, *acap, inst);
+        } else if (src->id) {
+            parallel_map(p, w, src->id);
+        } else {
+            parallel_enable(m, src);
+        }
+    }
+
+    for (u32 b = 0; b < from->nblocks; ++b) {
+        struct ir_block *block = ir_new_block(to, parallel_map(p, w, from->blocks[b]->label));
+
+        IR_PUSH(to->blocks, to->nblocks, to->bcap, block);
+
+        for (u32 i = 0; i < from->blocks[b]->ninsts; ++i) {
+            struct ir_inst *src = from->blocks[b]->insts[i];
+            struct ir_inst *inst = ir_new_inst(src->opcode, parallel_map(p, w, src->type),
+                                               src->id ? parallel_map(p, w, src->id) : 0, src->nops);
+
+            for (u32 k = 0; k < src->nops; ++k) {
+                inst->ops[k] = ir_operand_is_id(src, k) ? parallel_map(p, w, src->ops[k]) : src->ops[k];
+            }
+
+            inst->file = src->file;
+            inst->line = src->line;
+
+            ir_append(block, inst);
+            ir_register_inst(m, inst);
+        }
+    }
+}
+
+// Inserts the list at index with a single move of the globals after it
+static void
+parallel_insert_globals(struct ir_module *m, u32 index, struct ir_inst **insts, u32 count)
+{
+    if (!count) {
+        return;
+    }
+
+    if (m->nglobals + count > m->gcap) {
+        m->gcap = m->nglobals + count;
+        ASSERT(m->globals = realloc(m->globals, m->gcap * sizeof(struct ir_inst *)));
+    }
+
+    memmove(m->globals + index + count, m->globals + index, (m->nglobals - index) * sizeof(struct ir_inst *));
+    memcpy(m->globals + index, insts, count * sizeof(struct ir_inst *));
+    m->nglobals += count;
+}
+
+// Copies the changed functions back. The old bodies and their annotations go in one sweep over the globals,
+// the new annotations come back in one insertion per section.
+static void
+parallel_merge(struct parallel *p)
+{
+    struct ir_module *m = p->m;
+    struct ir_inst **names = NULL, **decorations = NULL, **annotations = NULL;
+    u32 nnames = 0, ncap = 0, ndecorations = 0, dcap = 0, nannotations = 0, acap = 0;
+    u32 kept = 0;
+    bool *old;
+
+    ASSERT(old = calloc(m->bound, sizeof(bool)));
+
+    for (u32 f = 0; f < p->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        if (!p->results[f].func) {
+            continue;
+        }
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            old[func->blocks[b]->label] = true;
+
+            for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+                old[func->blocks[b]->insts[i]->id] = true;
+            }
+        }
+
+        p->changed += 1;
+    }
+
+    old[0] = false;
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+
+        if (ir_is_annotation(inst->opcode) && inst->ops[0] < m->bound && old[inst->ops[0]]) {
+            ir_free_inst(inst);
+        } else {
+            m->globals[kept++] = inst;
+        }
+    }
+
+    m->nglobals = kept;
+
+    free(old);
+
+    for (u32 t = 0; t < p->threads; ++t) {
+        struct parallel_worker *w = &p->workers[t];
+
+        ASSERT(w->remap = calloc(w->view.bound - p->base + 1, sizeof(u32)));
+    }
+
+    for (u32 f = 0; f < p->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        struct parallel_result *r = &p->results[f];
+
+        if (!r->func) {
+            continue;
+        }
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+
+            while (block->ninsts) {
+                ir_remove(m, block, block->ninsts - 1);
+            }
+
+            free(block->insts);
+            free(block);
+        }
+
+        func->nblocks = 0;
+
+        parallel_copy(p, func, r, &annotations, &nannotations, &acap);
+        parallel_release(r->func);
+        free(r->globals);
+    }
+
+    for (u32 i = 0; i < nannotations; ++i) {
+        if (annotations[i]->opcode == SpvOpName || annotations[i]->opcode == SpvOpMemberName) {
+            IR_PUSH(names, nnames, ncap, annotations[i]);
+        } else {
+            IR_PUSH(decorations, ndecorations, dcap, annotations[i]);
+        }
+    }
+
+    parallel_insert_globals(m, ir_section_end(m, SpvOpDecorate), decorations, ndecorations);
+    parallel_insert_globals(m, ir_section_end(m, SpvOpName), names, nnames);
+
+    for (u32 t = 0; t < p->threads; ++t) {
+        struct parallel_worker *w = &p->workers[t];
+
+        w->arena_bytes = w->arena.bytes;
+        parallel_arena_reset(&w->arena);
+
+        free(w->remap);
+        free(w->view.defs);
+        free(w->view.globals);
+        memset(&w->view, 0x00, sizeof(struct ir_module));
+        w->remap = NULL;
+    }
+
+    free(names);
+    free(decorations);
+    free(annotations);
+}
+
+static void
+parallel_run(struct parallel *p, struct ir_module *m, struct pipeline_options *opts, FILE *out)
+{
+    struct pipeline_options global = *opts;
+    struct timespec beg;
+
+    clock_gettime(CLOCK_MONOTONIC, &beg);
+
+    p->m = m;
+    p->local = *opts;
+    p->local.precision = false;
+    p->local.dedup = false;
+    p->local.stats = false;
+    p->base = m->bound;
+    p->next = 0;
+    p->nfunctions = m->nfunctions;
+    p->changed = 0;
+
+    ASSERT(p->results = calloc(m->nfunctions + 1, sizeof(struct parallel_result)));
+
+    pthread_mutex_lock(&p->mutex);
+
+    p->running = p->threads;
+    p->generation += 1;
+    pthread_cond_broadcast(&p->start);
+
+    while (p->running) {
+        pthread_cond_wait(&p->done, &p->mutex);
+    }
+
+    pthread_mutex_unlock(&p->mutex);
+
+    p->optimize_msec = pipeline_msec(&beg);
+
+    clock_gettime(CLOCK_MONOTONIC, &beg);
+    parallel_merge(p);
+    p->merge_msec = pipeline_msec(&beg);
+
+    free(p->results);
+    p->results = NULL;
+
+    // Sync point: module-level passes see every function
+    global.sroa = global.simplify = global.composite = false;
+    global.strength = global.peephole = global.licm = false;
+
+    pipeline_run(m, &global, out);
+}
+
+static void
+parallel_report(struct parallel *p, FILE *out)
+{
+    fprintf(out, "[PARALLEL] %u functions on %u threads, %u changed, optimized in %.2f ms, merged in %.2f ms\n",
+            p->nfunctions, p->threads, p->changed, p->optimize_msec, p->merge_msec);
+
+    for (u32 t = 0; t < p->threads; ++t) {
+        struct parallel_worker *w = &p->workers[t];
+
+        fprintf(out, "    thread %2u: %u functions, %u changed, %.1f KiB arena\n",
+                t, w->functions, w->changed, (f64) w->arena_bytes / 1024.0);
+    }
+}
+
+static void
+parallel_free(struct parallel *p)
+{
+    pthread_mutex_lock(&p->mutex);
+    p->quit = true;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->mutex);
+
+    for (u32 t = 0; t < p->threads; ++t) {
+        struct parallel_worker *w = &p->workers[t];
+
+        pthread_join(w->thread, NULL);
+        parallel_arena_reset(&w->arena);
+        free(w->arena.chunks);
+    }
+
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->workers);
+
+    memset(p, 0x00, sizeof(struct parallel));
+}
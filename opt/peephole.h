@@ -0,0 +1,545 @@
+// Algebraic peephole simplifier. Each rule matches a single instruction and
+// either forwards its uses to an existing value or rewrites it in place.
+// Rules are retried until a whole round fires nothing, then the instructions
+// left without uses are removed.
+//
+// Float rules declare which IEEE guarantees they give up, see fpmode.h.
+
+#define PEEPHOLE_MAX_ROUNDS 32
+#define PEEPHOLE_MAX_RULES  32
+
+struct peephole_rule;
+
+struct peephole {
+    struct ir_module *m;
+    const char *name;
+    const struct peephole_rule *rules;
+    u32 nrules;
+    u32 allowed;
+    u32 *uses;
+    u32 nuses;
+    u32 rounds;
+    u32 removed;
+    u32 fired[PEEPHOLE_MAX_RULES];
+};
+
+// NOTE: opcode 0 (OpNop) matches every instruction, the rule filters by itself
+struct peephole_rule {
+    const char *name;
+    u32 opcode;
+    bool (*apply)(struct peephole *p, struct ir_inst *inst);
+};
+
+static bool
+peephole_allowed(struct peephole *p, struct ir_inst *inst, u32 relax)
+{
+    return(fp_allowed(p->m, p->allowed, inst, relax));
+}
+
+static u32
+peephole_type(struct peephole *p, u32 id)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+    return(def ? def->type : 0);
+}
+
+// Defining instruction of id when it has the given opcode
+static struct ir_inst *
+peephole_match(struct peephole *p, u32 id, u32 opcode)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+    return(def && def->opcode == opcode ? def : NULL);
+}
+
+// True when every component of the constant id has exactly these bits
+static bool
+peephole_is_bits(struct peephole *p, u32 id, u32 bits)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+
+    if (!def || !ir_is_constant(p->m, id)) {
+        return(false);
+    }
+
+    u32 n = ir_vector_size(p->m, def->type);
+
+    for (u32 i = 0; i < n; ++i) {
+        u32 c;
+
+        if (!ir_constant_bits(p->m, id, def->opcode == SpvOpConstantComposite ? i : 0, &c) || c != bits) {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+// Exact bit match, so 0.0 and -0.0 are told apart.
+// NOTE: only 32-bit floats are matched, the bit patterns differ for other widths
+static bool
+peephole_is_float(struct peephole *p, u32 id, f32 value)
+{
+    union { u32 u; f32 f; } c;
+
+    c.f = value;
+
+    return(ir_float_width(p->m, peephole_type(p, id)) == 32 && peephole_is_bits(p, id, c.u));
+}
+
+static void
+peephole_use(struct peephole *p, u32 id, s32 delta)
+{
+    if (id < p->nuses) {
+        p->uses[id] += delta;
+    }
+}
+
+// Sends every use of inst to value. The instruction is left dead for the final cleanup.
+static bool
+peephole_forward(struct peephole *p, struct ir_inst *inst, u32 value)
+{
+    if (peephole_type(p, value) != inst->type) {
+        return(false);
+    }
+
+    ir_replace_uses(p->m, inst->id, value);
+
+    peephole_use(p, value, p->uses[inst->id]);
+    p->uses[inst->id] = 0;
+
+    return(true);
+}
+
+static void
+peephole_rewrite(struct peephole *p, struct ir_inst *inst, u32 opcode, const u32 *ops, u32 nops)
+{
+    for (u32 i = 0; i < inst->nops; ++i) {
+        if (ir_operand_is_id(inst, i)) {
+            peephole_use(p, inst->ops[i], -1);
+        }
+    }
+
+    inst->opcode = opcode;
+    ir_set_nops(inst, nops);
+    memcpy(inst->ops, ops, nops * sizeof(u32));
+
+    for (u32 i = 0; i < inst->nops; ++i) {
+        if (ir_operand_is_id(inst, i)) {
+            peephole_use(p, inst->ops[i], 1);
+        }
+    }
+}
+
+static void
+peephole_rewrite1(struct peephole *p, struct ir_inst *inst, u32 opcode, u32 a)
+{
+    peephole_rewrite(p, inst, opcode, &a, 1);
+}
+
+static void
+peephole_rewrite2(struct peephole *p, struct ir_inst *inst, u32 opcode, u32 a, u32 b)
+{
+    u32 ops[2] = { a, b };
+    peephole_rewrite(p, inst, opcode, ops, 2);
+}
+
+// New instruction right before inst, returns its id
+static u32
+peephole_emit(struct peephole *p, struct ir_inst *inst, u32 opcode, u32 type, const u32 *ops, u32 nops)
+{
+    struct ir_inst *emitted = ir_new_inst(opcode, type, ir_new_id(p->m), nops);
+
+    memcpy(emitted->ops, ops, nops * sizeof(u32));
+    emitted->file = inst->file;
+    emitted->line = inst->line;
+
+    ir_insert(inst->block, ir_index_of(inst->block, inst), emitted);
+    ir_register_inst(p->m, emitted);
+
+    for (u32 i = 0; i < nops; ++i) {
+        if (ir_operand_is_id(emitted, i)) {
+            peephole_use(p, ops[i], 1);
+        }
+    }
+
+    return(emitted->id);
+}
+
+static u32
+peephole_emit2(struct peephole *p, struct ir_inst *inst, u32 opcode, u32 type, u32 a, u32 b)
+{
+    u32 ops[2] = { a, b };
+    return(peephole_emit(p, inst, opcode, type, ops, 2));
+}
+
+// Float rules
+
+// x * 1 -> x
+static bool
+peephole_fmul_one(struct peephole *p, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_float(p, inst->ops[i], 1.0f)) {
+            return(peephole_forward(p, inst, inst->ops[1 - i]));
+        }
+    }
+
+    return(false);
+}
+
+// x * -1 -> -x
+static bool
+peephole_fmul_neg_one(struct peephole *p, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_float(p, inst->ops[i], -1.0f)) {
+            peephole_rewrite1(p, inst, SpvOpFNegate, inst->ops[1 - i]);
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+// x * 0 -> 0
+static bool
+peephole_fmul_zero(struct peephole *p, struct ir_inst *inst)
+{
+    if (!peephole_allowed(p, inst, FP_NSZ | FP_NAN_INF)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_float(p, inst->ops[i], 0.0f)) {
+            return(peephole_forward(p, inst, inst->ops[i]));
+        }
+    }
+
+    return(false);
+}
+
+// -a * -b -> a * b
+static bool
+peephole_fmul_fneg_fneg(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *a = peephole_match(p, inst->ops[0], SpvOpFNegate);
+    struct ir_inst *b = peephole_match(p, inst->ops[1], SpvOpFNegate);
+
+    if (!a || !b) {
+        return(false);
+    }
+
+    peephole_rewrite2(p, inst, SpvOpFMul, a->ops[0], b->ops[0]);
+
+    return(true);
+}
+
+// x + -0 -> x, and x + 0 -> x when the sign of zero does not matter
+static bool
+peephole_fadd_zero(struct peephole *p, struct ir_inst *inst)
+{
+    bool nsz = peephole_allowed(p, inst, FP_NSZ);
+
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_float(p, inst->ops[i], -0.0f)) {
+            return(peephole_forward(p, inst, inst->ops[1 - i]));
+        }
+
+        if (nsz && peephole_is_float(p, inst->ops[i], 0.0f)) {
+            return(peephole_forward(p, inst, inst->ops[1 - i]));
+        }
+    }
+
+    return(false);
+}
+
+// a + -b -> a - b, -a + b -> b - a
+static bool
+peephole_fadd_fneg(struct peephole *p, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < 2; ++i) {
+        struct ir_inst *neg = peephole_match(p, inst->ops[i], SpvOpFNegate);
+
+        if (neg) {
+            peephole_rewrite2(p, inst, SpvOpFSub, inst->ops[1 - i], neg->ops[0]);
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+// a * b + c -> fma(a, b, c) when the multiply has no other use
+static bool
+peephole_fadd_fma(struct peephole *p, struct ir_inst *inst)
+{
+    if (!peephole_allowed(p, inst, FP_CONTRACT)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i < 2; ++i) {
+        struct ir_inst *mul = peephole_match(p, inst->ops[i], SpvOpFMul);
+
+        if (!mul || mul->block != inst->block || mul->type != inst->type || p->uses[mul->id] != 1 ||
+            !peephole_allowed(p, mul, FP_CONTRACT)) {
+            continue;
+        }
+
+        u32 ops[5] = { ir_glsl_import(p->m), GLSLstd450Fma, mul->ops[0], mul->ops[1], inst->ops[1 - i] };
+        peephole_rewrite(p, inst, SpvOpExtInst, ops, 5);
+
+        return(true);
+    }
+
+    return(false);
+}
+
+// x - 0 -> x
+static bool
+peephole_fsub_zero(struct peephole *p, struct ir_inst *inst)
+{
+    if (peephole_is_float(p, inst->ops[1], 0.0f)) {
+        return(peephole_forward(p, inst, inst->ops[0]));
+    }
+
+    return(false);
+}
+
+// 0 - x -> -x
+static bool
+peephole_fsub_from_zero(struct peephole *p, struct ir_inst *inst)
+{
+    if (peephole_is_float(p, inst->ops[0], 0.0f) && peephole_allowed(p, inst, FP_NSZ)) {
+        peephole_rewrite1(p, inst, SpvOpFNegate, inst->ops[1]);
+        return(true);
+    }
+
+    return(false);
+}
+
+// a - -b -> a + b
+static bool
+peephole_fsub_fneg(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *neg = peephole_match(p, inst->ops[1], SpvOpFNegate);
+
+    if (neg) {
+        peephole_rewrite2(p, inst, SpvOpFAdd, inst->ops[0], neg->ops[0]);
+        return(true);
+    }
+
+    return(false);
+}
+
+// a - (a - x) -> x
+static bool
+peephole_fsub_fsub(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *sub = peephole_match(p, inst->ops[1], SpvOpFSub);
+    u32 relax = FP_REASSOC | FP_NAN_INF;
+
+    if (sub && sub->ops[0] == inst->ops[0] && peephole_allowed(p, inst, relax) && peephole_allowed(p, sub, relax)) {
+        return(peephole_forward(p, inst, sub->ops[1]));
+    }
+
+    return(false);
+}
+
+// -(-x) -> x
+static bool
+peephole_fneg_fneg(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *neg = peephole_match(p, inst->ops[0], SpvOpFNegate);
+    return(neg && peephole_forward(p, inst, neg->ops[0]));
+}
+
+// -(a - b) -> b - a
+static bool
+peephole_fneg_fsub(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *sub = peephole_match(p, inst->ops[0], SpvOpFSub);
+
+    if (sub && peephole_allowed(p, inst, FP_NSZ) && peephole_allowed(p, sub, FP_NSZ)) {
+        peephole_rewrite2(p, inst, SpvOpFSub, sub->ops[1], sub->ops[0]);
+        return(true);
+    }
+
+    return(false);
+}
+
+// v * 1 -> v
+static bool
+peephole_vts_one(struct peephole *p, struct ir_inst *inst)
+{
+    return(peephole_is_float(p, inst->ops[1], 1.0f) && peephole_forward(p, inst, inst->ops[0]));
+}
+
+// Integer and logical rules
+
+// x + 0 -> x
+static bool
+peephole_iadd_zero(struct peephole *p, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_bits(p, inst->ops[i], 0)) {
+            return(peephole_forward(p, inst, inst->ops[1 - i]));
+        }
+    }
+
+    return(false);
+}
+
+// x - 0 -> x
+static bool
+peephole_isub_zero(struct peephole *p, struct ir_inst *inst)
+{
+    return(peephole_is_bits(p, inst->ops[1], 0) && peephole_forward(p, inst, inst->ops[0]));
+}
+
+// x * 1 -> x
+static bool
+peephole_imul_one(struct peephole *p, struct ir_inst *inst)
+{
+    for (u32 i = 0; i < 2; ++i) {
+        if (peephole_is_bits(p, inst->ops[i], 1)) {
+            return(peephole_forward(p, inst, inst->ops[1 - i]));
+        }
+    }
+
+    return(false);
+}
+
+// Involutions: -(-x), ~~x and !!x -> x
+static bool
+peephole_involution(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *inner = peephole_match(p, inst->ops[0], inst->opcode);
+    return(inner && peephole_forward(p, inst, inner->ops[0]));
+}
+
+// c ? x : x -> x
+static bool
+peephole_select_same(struct peephole *p, struct ir_inst *inst)
+{
+    return(inst->ops[1] == inst->ops[2] && peephole_forward(p, inst, inst->ops[1]));
+}
+
+// NOTE: rules for the same opcode are tried in order, the first one that fires wins
+static const struct peephole_rule peephole_rules[] = {
+    { "fmul-one",        SpvOpFMul,              peephole_fmul_one },
+    { "fmul-neg-one",    SpvOpFMul,              peephole_fmul_neg_one },
+    { "fmul-zero",       SpvOpFMul,              peephole_fmul_zero },
+    { "fmul-fneg-fneg",  SpvOpFMul,              peephole_fmul_fneg_fneg },
+    { "fadd-zero",       SpvOpFAdd,              peephole_fadd_zero },
+    { "fadd-fneg",       SpvOpFAdd,              peephole_fadd_fneg },
+    { "fadd-fma",        SpvOpFAdd,              peephole_fadd_fma },
+    { "fsub-zero",       SpvOpFSub,              peephole_fsub_zero },
+    { "fsub-from-zero",  SpvOpFSub,              peephole_fsub_from_zero },
+    { "fsub-fneg",       SpvOpFSub,              peephole_fsub_fneg },
+    { "fsub-fsub",       SpvOpFSub,              peephole_fsub_fsub },
+    { "fneg-fneg",       SpvOpFNegate,           peephole_fneg_fneg },
+    { "fneg-fsub",       SpvOpFNegate,           peephole_fneg_fsub },
+    { "vts-one",         SpvOpVectorTimesScalar, peephole_vts_one },
+    { "iadd-zero",       SpvOpIAdd,              peephole_iadd_zero },
+    { "isub-zero",       SpvOpISub,              peephole_isub_zero },
+    { "imul-one",        SpvOpIMul,              peephole_imul_one },
+    { "sneg-sneg",       SpvOpSNegate,           peephole_involution },
+    { "not-not",         SpvOpNot,               peephole_involution },
+    { "lnot-lnot",       SpvOpLogicalNot,        peephole_involution },
+    { "select-same",     SpvOpSelect,            peephole_select_same },
+};
+
+#define PEEPHOLE_NRULES (sizeof(peephole_rules) / sizeof(peephole_rules[0]))
+
+static void
+peephole_init_rules(struct ir_module *m, u32 relax, const char *name, const struct peephole_rule *rules, u32 nrules,
+                    struct peephole *p)
+{
+    ASSERT(nrules <= PEEPHOLE_MAX_RULES);
+
+    memset(p, 0x00, sizeof(struct peephole));
+
+    p->m       = m;
+    p->name    = name;
+    p->rules   = rules;
+    p->nrules  = nrules;
+    p->allowed = relax;
+}
+
+static void
+peephole_init(struct ir_module *m, u32 relax, struct peephole *p)
+{
+    peephole_init_rules(m, relax, "PEEPHOLE", peephole_rules, PEEPHOLE_NRULES, p);
+}
+
+// Returns the number of rewrites
+static u32
+peephole_run(struct peephole *p)
+{
+    struct ir_module *m = p->m;
+    u32 total = 0;
+
+    for (p->rounds = 0; p->rounds < PEEPHOLE_MAX_ROUNDS;) {
+        u32 fired = 0;
+
+        p->uses  = ir_use_counts(m);
+        p->nuses = m->bound;
+        p->rounds += 1;
+
+        for (u32 f = 0; f < m->nfunctions; ++f) {
+            struct ir_function *func = m->functions[f];
+
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                struct ir_block *block = func->blocks[b];
+
+                for (u32 i = 0; i < block->ninsts; ++i) {
+                    struct ir_inst *inst = block->insts[i];
+
+                    // NOTE: dead instructions are skipped, forwarded ones would otherwise match forever.
+                    // Instructions created during this round are left for the next one.
+                    if (!inst->id || inst->id >= p->nuses || !p->uses[inst->id]) {
+                        continue;
+                    }
+
+                    for (u32 r = 0; r < p->nrules; ++r) {
+                        u32 opcode = p->rules[r].opcode;
+
+                        if ((opcode == SpvOpNop || opcode == inst->opcode) && p->rules[r].apply(p, inst)) {
+                            p->fired[r] += 1;
+                            fired += 1;
+
+                            // the rule may have inserted instructions before this one
+                            i = ir_index_of(block, inst);
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        free(p->uses);
+        p->uses = NULL;
+
+        total += fired;
+
+        if (!fired) {
+            break;
+        }
+    }
+
+    p->removed = ir_remove_dead_code(m);
+
+    return(total);
+}
+
+static void
+peephole_report(struct peephole *p, FILE *out)
+{
+    fprintf(out, "[%s] %u rounds, %u dead instructions removed\n", p->name, p->rounds, p->removed);
+
+    for (u32 r = 0; r < p->nrules; ++r) {
+        if (p->fired[r]) {
+            fprintf(out, "    %-20s %u\n", p->rules[r].name, p->fired[r]);
+        }
+    }
+}
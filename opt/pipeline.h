@@ -0,0 +1,202 @@
+// The optimization passes in the order they run, shared by spvopt and the
+// viewer's hot reload path. Reports go to out when stats is set, the LICM
+// hoist log goes to out whenever it is not NULL.
+//
+// With a time budget a pass only starts while the budget is not used up, the
+// ones after it are skipped. A pass that started always finishes.
+//
+// Deduplication runs last and has to see every function. Callers that run the
+// passes on some functions only turn it off there and call pipeline_dedup
+// once the module is whole again.
+
+// Bump whenever a pass changes what it emits, cached results of older versions are then never found
+#define PIPELINE_VERSION 2
+
+struct pipeline_options {
+    bool sroa;
+    bool simplify;
+    bool composite;
+    bool strength;
+    bool peephole;
+    bool licm;
+    bool precision;
+    bool dedup;
+    bool half;
+    bool fma;
+    bool strict;
+    bool stats;
+    u32 select_cost;
+    u32 licm_pressure;
+    f64 budget_msec;  // 0 for no limit
+};
+
+static f64
+pipeline_msec(struct timespec *beg)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return((f64) (now.tv_sec - beg->tv_sec) * 1000.0 + (f64) (now.tv_nsec - beg->tv_nsec) / 1000000.0);
+}
+
+// Nothing enabled, every tunable at its default
+static void
+pipeline_defaults(struct pipeline_options *opts)
+{
+    memset(opts, 0x00, sizeof(struct pipeline_options));
+
+    opts->fma = true;
+    opts->select_cost = SIMPLIFY_DEFAULT_COST;
+    opts->licm_pressure = LICM_DEFAULT_PRESSURE;
+}
+
+// What -O runs
+static void
+pipeline_enable_all(struct pipeline_options *opts)
+{
+    opts->sroa = true;
+    opts->simplify = true;
+    opts->composite = true;
+    opts->strength = true;
+    opts->peephole = true;
+    opts->licm = true;
+    opts->dedup = true;
+}
+
+// Single sweeps over the instructions, no control flow analysis, for the first tier of a hot reload
+static void
+pipeline_enable_cheap(struct pipeline_options *opts)
+{
+    opts->composite = true;
+    opts->strength = true;
+    opts->peephole = true;
+}
+
+// Whether the next pass may start, counts the ones that do
+static bool
+pipeline_start(struct pipeline_options *opts, struct timespec *beg, u32 *ran)
+{
+    if (opts->budget_msec > 0.0 && pipeline_msec(beg) >= opts->budget_msec) {
+        return(false);
+    }
+
+    *ran += 1;
+
+    return(true);
+}
+
+static void
+pipeline_dedup(struct ir_module *m, struct pipeline_options *opts, FILE *out)
+{
+    struct dedup d;
+
+    dedup_run(m, &d);
+
+    if (opts->stats && out) {
+        dedup_report(&d, out);
+    }
+
+    dedup_free(&d);
+}
+
+// Returns the number of passes that ran
+static u32
+pipeline_run(struct ir_module *m, struct pipeline_options *opts, FILE *out)
+{
+    struct timespec beg;
+    u32 ran = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &beg);
+
+    u32 relax = fp_module_relax(m, opts->strict);
+
+    if (!opts->fma) {
+        relax &= ~FP_CONTRACT;
+    }
+
+    if (opts->sroa && pipeline_start(opts, &beg, &ran)) {
+        struct sroa s;
+
+        sroa_run(m, &s);
+
+        if (opts->stats && out) {
+            sroa_report(&s, out);
+        }
+    }
+
+    if (opts->simplify && pipeline_start(opts, &beg, &ran)) {
+        struct simplify s;
+
+        simplify_run(m, opts->select_cost, &s);
+
+        if (opts->stats && out) {
+            simplify_report(&s, out);
+        }
+    }
+
+    if (opts->composite && pipeline_start(opts, &beg, &ran)) {
+        struct composite c;
+
+        composite_run(m, &c);
+
+        if (opts->stats && out) {
+            composite_report(&c, out);
+        }
+    }
+
+    if (opts->strength && pipeline_start(opts, &beg, &ran)) {
+        struct peephole p;
+
+        strength_init(m, relax, &p);
+        peephole_run(&p);
+
+        if (opts->stats && out) {
+            peephole_report(&p, out);
+        }
+    }
+
+    if (opts->peephole && pipeline_start(opts, &beg, &ran)) {
+        struct peephole p;
+
+        peephole_init(m, relax, &p);
+        peephole_run(&p);
+
+        if (opts->stats && out) {
+            peephole_report(&p, out);
+        }
+    }
+
+    if (opts->licm && pipeline_start(opts, &beg, &ran)) {
+        struct licm l;
+
+        licm_run(m, opts->licm_pressure, out, &l);
+
+        if (opts->stats && out) {
+            licm_report(&l, out);
+        }
+    }
+
+    if (opts->precision && pipeline_start(opts, &beg, &ran)) {
+        struct precision p;
+
+        precision_run(m, opts->half, &p);
+
+        if (p.half_refused && out) {
+            fprintf(out, "[PRECISION] Float16 not declared by the module, keeping RelaxedPrecision\n");
+        }
+
+        // NOTE: the report of what was relaxed is the pass's output, it does not wait for --stats
+        if (out) {
+            precision_report(&p, out);
+        }
+
+        precision_free(&p);
+    }
+
+    if (opts->dedup && pipeline_start(opts, &beg, &ran)) {
+        pipeline_dedup(m, opts, out);
+    }
+
+    return(ran);
+}
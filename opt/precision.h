@@ -0,0 +1,768 @@
+// Reduced precision promotion. A value may drop to fp16 when every consumer
+// only needs fp16 and its range fits: chains that end in color outputs (the
+// fragment outputs of this app all go to 8-bit UNORM attachments) and
+// normalized vectors. Value ranges come from a forward interval analysis;
+// inputs named like colors are assumed to lie in [0, 1].
+//
+// Relaxed values are decorated RelaxedPrecision. They are retyped to Float16,
+// with FConvert at the boundaries, only when asked to and the module already
+// declares that capability, which is what says the target can run it.
+
+#define PRECISION_F16_MAX 65504.0f
+#define PRECISION_F16_MIN_NORMAL 6.103515625e-5f
+
+struct precision_range {
+    f32 lo;
+    f32 hi;
+};
+
+struct precision {
+    struct ir_module *m;
+    u32 model;
+    u32 bound;
+    struct precision_range *range;
+    bool *candidate;
+    u32 nfloat;
+    u32 nrelaxed;
+    u32 nconversions;
+    bool half;
+    bool half_refused;
+};
+
+static bool
+precision_name_is_color(struct ir_module *m, u32 id)
+{
+    const char *name = ir_name(m, id);
+    char lower[64];
+    u32 i;
+
+    if (!name) {
+        return(false);
+    }
+
+    for (i = 0; name[i] && i < sizeof(lower) - 1; ++i) {
+        lower[i] = (name[i] >= 'A' && name[i] <= 'Z') ? name[i] - 'A' + 'a' : name[i];
+    }
+
+    lower[i] = 0;
+
+    return(strstr(lower, "color") || strstr(lower, "colour"));
+}
+
+static bool
+precision_is_color_output(struct precision *p, u32 var)
+{
+    struct ir_inst *def = ir_def(p->m, var);
+
+    if (!def || def->opcode != SpvOpVariable || def->ops[0] != SpvStorageClassOutput ||
+        ir_decoration(p->m, var, SpvDecorationBuiltIn, NULL)) {
+        return(false);
+    }
+
+    return(p->model == SpvExecutionModelFragment || precision_name_is_color(p->m, var));
+}
+
+static bool
+precision_is_color_input(struct precision *p, u32 var)
+{
+    struct ir_inst *def = ir_def(p->m, var);
+
+    return(def && def->opcode == SpvOpVariable && def->ops[0] == SpvStorageClassInput &&
+           !ir_decoration(p->m, var, SpvDecorationBuiltIn, NULL) && precision_name_is_color(p->m, var));
+}
+
+// Relaxable 32-bit float scalars and vectors
+static bool
+precision_is_float32(struct precision *p, u32 type)
+{
+    struct ir_inst *def = ir_def(p->m, type);
+
+    return(def && (def->opcode == SpvOpTypeFloat || def->opcode == SpvOpTypeVector) &&
+           ir_float_width(p->m, type) == 32);
+}
+
+static struct precision_range
+precision_get(struct precision *p, u32 id)
+{
+    struct precision_range unknown = { -INFINITY, INFINITY };
+    return(id < p->bound ? p->range[id] : unknown);
+}
+
+static struct precision_range
+precision_union(struct precision_range a, struct precision_range b)
+{
+    struct precision_range r = { fminf(a.lo, b.lo), fmaxf(a.hi, b.hi) };
+    return(r);
+}
+
+static struct precision_range
+precision_mul(struct precision_range a, struct precision_range b)
+{
+    f32 c[4] = { a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi };
+    struct precision_range r = { c[0], c[0] };
+
+    for (u32 i = 0; i < 4; ++i) {
+        // NOTE: 0 * inf, give up
+        if (isnan(c[i])) {
+            r.lo = -INFINITY;
+            r.hi = INFINITY;
+            return(r);
+        }
+
+        r.lo = fminf(r.lo, c[i]);
+        r.hi = fmaxf(r.hi, c[i]);
+    }
+
+    return(r);
+}
+
+// NOTE: a value that never reaches the smallest normal half keeps only subnormal bits, none where denormals flush
+static bool
+precision_fits(struct precision_range r)
+{
+    f32 magnitude = fmaxf(fabsf(r.lo), fabsf(r.hi));
+
+    return(r.lo >= -PRECISION_F16_MAX && r.hi <= PRECISION_F16_MAX &&
+           (magnitude == 0.0f || magnitude >= PRECISION_F16_MIN_NORMAL));
+}
+
+// Constants with a non-zero component below the smallest normal half, scale factors like these would flush
+static bool
+precision_is_tiny_constant(struct precision *p, u32 id)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+
+    if (!def || !ir_is_constant(p->m, id) || ir_float_width(p->m, def->type) != 32) {
+        return(false);
+    }
+
+    for (u32 c = 0; c < ir_vector_size(p->m, def->type); ++c) {
+        union { u32 u; f32 f; } v;
+
+        if (!ir_constant_bits(p->m, id, def->opcode == SpvOpConstantComposite ? c : 0, &v.u)) {
+            return(true);
+        }
+
+        if (v.f != 0.0f && fabsf(v.f) < PRECISION_F16_MIN_NORMAL) {
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+// Whether the consumers of inst decide the precision of its float operands
+static bool
+precision_propagates(struct precision *p, struct ir_inst *inst)
+{
+    switch (inst->opcode) {
+        case SpvOpFNegate:
+        case SpvOpFAdd:
+        case SpvOpFSub:
+        case SpvOpFMul:
+        case SpvOpFDiv:
+        case SpvOpVectorTimesScalar:
+        case SpvOpDot:
+        case SpvOpCompositeConstruct:
+        case SpvOpCompositeExtract:
+        case SpvOpVectorShuffle:
+        case SpvOpCopyObject:
+        case SpvOpSelect:
+        return(true);
+
+        case SpvOpExtInst: {
+            if (inst->ops[0] != p->m->glsl_set) {
+                return(false);
+            }
+
+            switch (inst->ops[1]) {
+                case GLSLstd450FAbs:
+                case GLSLstd450Floor:
+                case GLSLstd450Ceil:
+                case GLSLstd450Fract:
+                case GLSLstd450FMin:
+                case GLSLstd450FMax:
+                case GLSLstd450FClamp:
+                case GLSLstd450FMix:
+                case GLSLstd450Fma:
+                case GLSLstd450Sqrt:
+                return(true);
+            }
+        } return(false);
+    }
+
+    return(false);
+}
+
+// Forward interval analysis. Instructions are visited in block order, which
+// defines every operand first except for phis, and phis are left unknown.
+static struct precision_range
+precision_transfer(struct precision *p, struct ir_inst *inst)
+{
+    struct precision_range unknown = { -INFINITY, INFINITY };
+    struct precision_range r = unknown;
+
+    switch (inst->opcode) {
+        case SpvOpLoad: {
+            if (precision_is_color_input(p, inst->ops[0])) {
+                r.lo = 0.0f;
+                r.hi = 1.0f;
+            }
+        } break;
+
+        case SpvOpFNegate: {
+            struct precision_range a = precision_get(p, inst->ops[0]);
+            r.lo = -a.hi;
+            r.hi = -a.lo;
+        } break;
+
+        case SpvOpFAdd: {
+            struct precision_range a = precision_get(p, inst->ops[0]);
+            struct precision_range b = precision_get(p, inst->ops[1]);
+            r.lo = a.lo + b.lo;
+            r.hi = a.hi + b.hi;
+        } break;
+
+        case SpvOpFSub: {
+            struct precision_range a = precision_get(p, inst->ops[0]);
+            struct precision_range b = precision_get(p, inst->ops[1]);
+            r.lo = a.lo - b.hi;
+            r.hi = a.hi - b.lo;
+        } break;
+
+        case SpvOpFMul:
+        case SpvOpVectorTimesScalar: {
+            r = precision_mul(precision_get(p, inst->ops[0]), precision_get(p, inst->ops[1]));
+        } break;
+
+        case SpvOpFDiv: {
+            struct precision_range b = precision_get(p, inst->ops[1]);
+
+            if (b.lo > 0.0f || b.hi < 0.0f) {
+                struct precision_range inv = { 1.0f / b.hi, 1.0f / b.lo };
+                r = precision_mul(precision_get(p, inst->ops[0]), inv);
+            }
+        } break;
+
+        case SpvOpDot: {
+            struct ir_inst *a = ir_def(p->m, inst->ops[0]);
+            f32 n = a ? ir_vector_size(p->m, a->type) : 1;
+
+            r = precision_mul(precision_get(p, inst->ops[0]), precision_get(p, inst->ops[1]));
+            r.lo = fminf(r.lo * n, r.lo);
+            r.hi = fmaxf(r.hi * n, r.hi);
+        } break;
+
+        case SpvOpCompositeConstruct: {
+            r = precision_get(p, inst->ops[0]);
+            for (u32 i = 1; i < inst->nops; ++i) {
+                r = precision_union(r, precision_get(p, inst->ops[i]));
+            }
+        } break;
+
+        case SpvOpCompositeExtract:
+        case SpvOpCopyObject: {
+            r = precision_get(p, inst->ops[0]);
+        } break;
+
+        case SpvOpVectorShuffle: {
+            r = precision_union(precision_get(p, inst->ops[0]), precision_get(p, inst->ops[1]));
+        } break;
+
+        case SpvOpSelect: {
+            r = precision_union(precision_get(p, inst->ops[1]), precision_get(p, inst->ops[2]));
+        } break;
+
+        case SpvOpExtInst: {
+            if (inst->ops[0] != p->m->glsl_set) {
+                break;
+            }
+
+            struct precision_range x = inst->nops > 2 ? precision_get(p, inst->ops[2]) : unknown;
+            struct precision_range y = inst->nops > 3 ? precision_get(p, inst->ops[3]) : unknown;
+            struct precision_range z = inst->nops > 4 ? precision_get(p, inst->ops[4]) : unknown;
+
+            switch (inst->ops[1]) {
+                case GLSLstd450FAbs: {
+                    r.lo = (x.lo <= 0.0f && x.hi >= 0.0f) ? 0.0f : fminf(fabsf(x.lo), fabsf(x.hi));
+                    r.hi = fmaxf(fabsf(x.lo), fabsf(x.hi));
+                } break;
+
+                case GLSLstd450Floor:
+                case GLSLstd450Ceil: {
+                    r.lo = floorf(x.lo);
+                    r.hi = ceilf(x.hi);
+                } break;
+
+                case GLSLstd450Fract: {
+                    r.lo = 0.0f;
+                    r.hi = 1.0f;
+                } break;
+
+                case GLSLstd450FMin: {
+                    r.lo = fminf(x.lo, y.lo);
+                    r.hi = fminf(x.hi, y.hi);
+                } break;
+
+                case GLSLstd450FMax: {
+                    r.lo = fmaxf(x.lo, y.lo);
+                    r.hi = fmaxf(x.hi, y.hi);
+                } break;
+
+                case GLSLstd450FClamp: {
+                    r.lo = fminf(fmaxf(x.lo, y.lo), z.lo);
+                    r.hi = fmaxf(fminf(x.hi, z.hi), y.hi);
+                } break;
+
+                case GLSLstd450FMix: {
+                    if (z.lo >= 0.0f && z.hi <= 1.0f) {
+                        r = precision_union(x, y);
+                    }
+                } break;
+
+                case GLSLstd450Fma: {
+                    struct precision_range m = precision_mul(x, y);
+                    r.lo = m.lo + z.lo;
+                    r.hi = m.hi + z.hi;
+                } break;
+
+                case GLSLstd450Sqrt: {
+                    r.lo = sqrtf(fmaxf(x.lo, 0.0f));
+                    r.hi = sqrtf(fmaxf(x.hi, 0.0f));
+                } break;
+
+                case GLSLstd450Normalize:
+                case GLSLstd450Sin:
+                case GLSLstd450Cos: {
+                    r.lo = -1.0f;
+                    r.hi = 1.0f;
+                } break;
+            }
+        } break;
+    }
+
+    if (isnan(r.lo) || isnan(r.hi)) {
+        r = unknown;
+    }
+
+    return(r);
+}
+
+static void
+precision_analyze_ranges(struct precision *p)
+{
+    struct ir_module *m = p->m;
+
+    for (u32 id = 0; id < p->bound; ++id) {
+        p->range[id].lo = -INFINITY;
+        p->range[id].hi = INFINITY;
+    }
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+        u32 n = ir_vector_size(m, inst->type);
+
+        if (!ir_is_constant(m, inst->id) || ir_float_width(m, inst->type) != 32 ||
+            (inst->opcode == SpvOpConstantComposite && !ir_is_vector_type(m, inst->type))) {
+            continue;
+        }
+
+        for (u32 c = 0; c < n; ++c) {
+            union { u32 u; f32 f; } v;
+
+            if (!ir_constant_bits(m, inst->id, inst->opcode == SpvOpConstantComposite ? c : 0, &v.u)) {
+                break;
+            }
+
+            p->range[inst->id].lo = c ? fminf(p->range[inst->id].lo, v.f) : v.f;
+            p->range[inst->id].hi = c ? fmaxf(p->range[inst->id].hi, v.f) : v.f;
+        }
+    }
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                struct ir_inst *inst = block->insts[i];
+
+                if (inst->id && precision_is_float32(p, inst->type)) {
+                    p->range[inst->id] = precision_transfer(p, inst);
+                }
+            }
+        }
+    }
+}
+
+// Local conditions: a relaxable opcode and every float value involved within fp16 range
+static bool
+precision_is_candidate(struct precision *p, struct ir_inst *inst)
+{
+    bool normalize = (inst->opcode == SpvOpExtInst && inst->ops[0] == p->m->glsl_set &&
+                      inst->ops[1] == GLSLstd450Normalize);
+
+    if (!inst->id || !precision_is_float32(p, inst->type) || !precision_fits(precision_get(p, inst->id))) {
+        return(false);
+    }
+
+    if (inst->opcode == SpvOpLoad) {
+        return(precision_is_color_input(p, inst->ops[0]));
+    }
+
+    if (!normalize && !precision_propagates(p, inst)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i < inst->nops; ++i) {
+        struct ir_inst *def = ir_def(p->m, inst->ops[i]);
+
+        if (ir_operand_is_id(inst, i) && def && precision_is_float32(p, def->type) &&
+            (!precision_fits(precision_get(p, inst->ops[i])) || precision_is_tiny_constant(p, inst->ops[i]))) {
+            return(false);
+        }
+    }
+
+    return(true);
+}
+
+// Greatest fixpoint: candidates lose their status as soon as one use needs full precision.
+// Normalized vectors are no exception, positions and depth derived from them stay 32-bit.
+static void
+precision_analyze_uses(struct precision *p)
+{
+    struct ir_module *m = p->m;
+    bool changed = true;
+
+    while (changed) {
+        u32 *uses;
+
+        changed = false;
+
+        ASSERT(uses = calloc(p->bound, sizeof(u32)));
+
+        for (u32 f = 0; f < m->nfunctions; ++f) {
+            struct ir_function *func = m->functions[f];
+
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                struct ir_block *block = func->blocks[b];
+
+                for (u32 i = 0; i < block->ninsts; ++i) {
+                    struct ir_inst *inst = block->insts[i];
+                    bool relaxed_user = (inst->id && inst->id < p->bound && p->candidate[inst->id] &&
+                                         precision_propagates(p, inst));
+
+                    for (u32 o = 0; o < inst->nops; ++o) {
+                        u32 id = inst->ops[o];
+
+                        if (!ir_operand_is_id(inst, o) || id >= p->bound || !p->candidate[id]) {
+                            continue;
+                        }
+
+                        uses[id] += 1;
+
+                        if (relaxed_user) {
+                            continue;
+                        }
+
+                        if (inst->opcode == SpvOpStore && o == 1 && precision_is_color_output(p, inst->ops[0])) {
+                            continue;
+                        }
+
+                        p->candidate[id] = false;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        for (u32 id = 0; id < p->bound; ++id) {
+            if (p->candidate[id] && !uses[id]) {
+                p->candidate[id] = false;
+                changed = true;
+            }
+        }
+
+        free(uses);
+    }
+}
+
+static u32
+precision_half_type(struct precision *p, u32 type)
+{
+    u32 width = 16;
+    u32 half = ir_find_or_add_type(p->m, SpvOpTypeFloat, &width, 1);
+
+    if (ir_is_vector_type(p->m, type)) {
+        u32 ops[2] = { half, ir_vector_size(p->m, type) };
+        return(ir_find_or_add_type(p->m, SpvOpTypeVector, ops, 2));
+    }
+
+    return(half);
+}
+
+// IEEE binary16 bits of a float, rounding to nearest even
+static u32
+precision_f16_bits(f32 value)
+{
+    union { u32 u; f32 f; } v;
+
+    v.f = value;
+
+    u32 sign = (v.u >> 16) & 0x8000;
+    s32 exponent = (s32) ((v.u >> 23) & 0xFF) - 127 + 15;
+    u32 mantissa = v.u & 0x7FFFFF;
+
+    if (((v.u >> 23) & 0xFF) == 0xFF) {
+        return(sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    }
+
+    if (exponent >= 31) {
+        return(sign | 0x7C00);
+    }
+
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return(sign);
+        }
+
+        mantissa |= 0x800000;
+
+        u32 shift = 14 - exponent;
+        u32 half = mantissa >> shift;
+        u32 rest = mantissa & ((1u << shift) - 1);
+        u32 midpoint = 1u << (shift - 1);
+
+        if (rest > midpoint || (rest == midpoint && (half & 1))) {
+            half += 1;
+        }
+
+        return(sign | half);
+    }
+
+    u32 half = sign | (exponent << 10) | (mantissa >> 13);
+    u32 rest = mantissa & 0x1FFF;
+
+    // NOTE: a carry out of the mantissa correctly bumps the exponent
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half += 1;
+    }
+
+    return(half);
+}
+
+static u32
+precision_half_constant(struct precision *p, u32 id)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+    u32 type = precision_half_type(p, def->type);
+    u32 n = ir_vector_size(p->m, def->type);
+    u32 ids[4];
+
+    ASSERT(n <= 4);
+
+    for (u32 c = 0; c < n; ++c) {
+        union { u32 u; f32 f; } v;
+
+        ASSERT(ir_constant_bits(p->m, id, def->opcode == SpvOpConstantComposite ? c : 0, &v.u));
+        ids[c] = ir_constant(p->m, ir_scalar_type(p->m, type), precision_f16_bits(v.f));
+    }
+
+    return(n == 1 && !ir_is_vector_type(p->m, def->type) ? ids[0] : ir_composite_constant(p->m, type, ids, n));
+}
+
+static u32
+precision_convert(struct precision *p, struct ir_block *block, u32 index, u32 type, u32 value)
+{
+    struct ir_inst *conv = ir_new_inst(SpvOpFConvert, type, ir_new_id(p->m), 1);
+
+    conv->ops[0] = value;
+    ir_insert(block, index, conv);
+    ir_register_inst(p->m, conv);
+
+    p->nconversions += 1;
+
+    return(conv->id);
+}
+
+// Retypes the relaxed arithmetic to Float16. Loads stay 32-bit, the interface
+// variables keep their types, so conversions sit at both ends of every chain.
+static void
+precision_to_half(struct precision *p)
+{
+    struct ir_module *m = p->m;
+    u32 *widened;
+
+    ASSERT(widened = calloc(p->bound, sizeof(u32)));
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                struct ir_inst *inst = block->insts[i];
+
+                if (!inst->id || inst->id >= p->bound || !p->candidate[inst->id] || inst->opcode == SpvOpLoad) {
+                    continue;
+                }
+
+                for (u32 o = 0; o < inst->nops; ++o) {
+                    u32 id = inst->ops[o];
+                    struct ir_inst *def = ir_def(m, id);
+
+                    if (!ir_operand_is_id(inst, o) || !def || !precision_is_float32(p, def->type) ||
+                        (id < p->bound && p->candidate[id] && def->opcode != SpvOpLoad)) {
+                        continue;
+                    }
+
+                    if (ir_is_constant(m, id)) {
+                        inst->ops[o] = precision_half_constant(p, id);
+                    } else {
+                        inst->ops[o] = precision_convert(p, block, i, precision_half_type(p, def->type), id);
+                        i += 1;
+                    }
+                }
+
+                widened[inst->id] = inst->type;
+                inst->type = precision_half_type(p, inst->type);
+            }
+        }
+    }
+
+    // Users that stayed 32-bit read a widened copy placed right after the definition
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                struct ir_inst *inst = block->insts[i];
+                bool half_user = (inst->id && inst->id < p->bound && widened[inst->id]);
+
+                for (u32 o = 0; o < inst->nops && !half_user; ++o) {
+                    u32 id = inst->ops[o];
+
+                    if (!ir_operand_is_id(inst, o) || id >= p->bound || !widened[id]) {
+                        continue;
+                    }
+
+                    struct ir_inst *def = ir_def(m, id);
+                    u32 wide = 0;
+
+                    // NOTE: the copy is created on the first 32-bit use and shared by the others
+                    for (u32 j = 0; j < def->block->ninsts && !wide; ++j) {
+                        struct ir_inst *other = def->block->insts[j];
+
+                        if (other->opcode == SpvOpFConvert && other->ops[0] == id && other->type == widened[id]) {
+                            wide = other->id;
+                        }
+                    }
+
+                    if (!wide) {
+                        struct ir_block *home = def->block;
+                        u32 index = ir_index_of(home, def) + 1;
+
+                        wide = precision_convert(p, home, index, widened[id], id);
+
+                        if (home == block && index <= i) {
+                            i += 1;
+                        }
+                    }
+
+                    inst->ops[o] = wide;
+                }
+            }
+        }
+    }
+
+    free(widened);
+}
+
+static void
+precision_run(struct ir_module *m, bool half, struct precision *p)
+{
+    memset(p, 0x00, sizeof(struct precision));
+
+    p->m = m;
+    p->bound = m->bound;
+    p->half = half && ir_has_capability(m, SpvCapabilityFloat16);
+    p->half_refused = half && !p->half;
+
+    ir_entry_point(m, &p->model);
+
+    ASSERT(p->range = calloc(p->bound, sizeof(struct precision_range)));
+    ASSERT(p->candidate = calloc(p->bound, sizeof(bool)));
+
+    precision_analyze_ranges(p);
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                struct ir_inst *inst = block->insts[i];
+
+                if (inst->id && precision_is_float32(p, inst->type)) {
+                    p->nfloat += 1;
+                }
+
+                if (precision_is_candidate(p, inst)) {
+                    p->candidate[inst->id] = true;
+                }
+            }
+        }
+    }
+
+    precision_analyze_uses(p);
+
+    for (u32 id = 0; id < p->bound; ++id) {
+        p->nrelaxed += p->candidate[id];
+    }
+
+    if (p->half) {
+        precision_to_half(p);
+    }
+
+    // NOTE: with Float16 only the loads, which stay 32-bit, need the decoration
+    for (u32 id = 0; id < p->bound; ++id) {
+        if (p->candidate[id] && (!p->half || ir_def(m, id)->opcode == SpvOpLoad)) {
+            ir_add_decoration(m, id, SpvDecorationRelaxedPrecision);
+        }
+    }
+}
+
+static void
+precision_report(struct precision *p, FILE *out)
+{
+    fprintf(out, "[PRECISION] %u of %u float instructions relaxed (%s), %u conversions\n",
+            p->nrelaxed, p->nfloat, p->half ? "Float16" : "RelaxedPrecision", p->nconversions);
+
+    for (u32 id = 0; id < p->bound; ++id) {
+        struct ir_inst *inst = ir_def(p->m, id);
+
+        if (!p->candidate[id] || !inst) {
+            continue;
+        }
+
+        fprintf(out, "    %%%-5u %-22s [%g, %g]", id, spv_op_name(inst->opcode), p->range[id].lo, p->range[id].hi);
+
+        if (inst->line) {
+            fprintf(out, " %s:%u", profile_file_name(p->m, inst->file), inst->line);
+        }
+
+        fprintf(out, "\n");
+    }
+}
+
+static void
+precision_free(struct precision *p)
+{
+    free(p->range);
+    free(p->candidate);
+}
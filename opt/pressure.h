@@ -0,0 +1,224 @@
+// Register pressure per entry point, from the liveness of every function the
+// entry point reaches through OpFunctionCall. Functions are measured on their
+// own, so a call does not add the caller's live values to the callee's.
+//
+// A program point is the position right after an instruction. The report has
+// the maximum and average over all points and the hottest few of them.
+// Points are named after the instruction that defines a value there.
+
+#define PRESSURE_HOTTEST 8
+
+struct pressure_point {
+    struct ir_inst *inst;
+    u32 label;
+    u32 scalars;
+    u32 vectors;
+};
+
+struct pressure_entry {
+    const char *name;
+    u32 model;
+    u32 max_scalars;
+    u32 max_vectors;
+    u64 sum_scalars;
+    u64 sum_vectors;
+    u32 points;
+    struct pressure_point hottest[PRESSURE_HOTTEST];
+    u32 nhottest;
+};
+
+struct pressure {
+    struct ir_module *m;
+    struct pressure_entry *entries;
+    u32 nentries;
+};
+
+static const char *
+pressure_model_name(u32 model)
+{
+    switch (model) {
+        case SpvExecutionModelVertex:    return("vertex");
+        case SpvExecutionModelFragment:  return("fragment");
+        case SpvExecutionModelGLCompute: return("compute");
+    }
+
+    return("other");
+}
+
+// Keeps the hottest points sorted by decreasing scalar pressure
+static void
+pressure_keep(struct pressure_entry *e, struct pressure_point point)
+{
+    u32 i = e->nhottest;
+
+    if (i == PRESSURE_HOTTEST) {
+        if (point.scalars <= e->hottest[i - 1].scalars) {
+            return;
+        }
+
+        i -= 1;
+    } else {
+        e->nhottest += 1;
+    }
+
+    while (i > 0 && e->hottest[i - 1].scalars < point.scalars) {
+        e->hottest[i] = e->hottest[i - 1];
+        i -= 1;
+    }
+
+    e->hottest[i] = point;
+}
+
+static void
+pressure_function(struct pressure *p, struct pressure_entry *e, struct ir_function *func)
+{
+    struct cfg g;
+    struct liveness live;
+
+    cfg_build(&g, func);
+    liveness_build(&live, p->m, &g);
+
+    for (u32 r = 0; r < g.nrpo; ++r) {
+        struct ir_block *block = func->blocks[g.rpo[r]];
+        u32 *scalars, *vectors;
+
+        if (!block->ninsts) {
+            continue;
+        }
+
+        ASSERT(scalars = malloc(block->ninsts * sizeof(u32)));
+        ASSERT(vectors = malloc(block->ninsts * sizeof(u32)));
+
+        liveness_pressure(&live, g.rpo[r], live.width, scalars);
+        liveness_pressure(&live, g.rpo[r], live.slots, vectors);
+
+        for (u32 i = 0; i < block->ninsts; ++i) {
+            struct pressure_point point = { block->insts[i], block->label, scalars[i], vectors[i] };
+
+            e->max_scalars = scalars[i] > e->max_scalars ? scalars[i] : e->max_scalars;
+            e->max_vectors = vectors[i] > e->max_vectors ? vectors[i] : e->max_vectors;
+            e->sum_scalars += scalars[i];
+            e->sum_vectors += vectors[i];
+            e->points += 1;
+
+            // NOTE: pressure only rises where a value is defined, so those are the points worth naming
+            if (block->insts[i]->id) {
+                pressure_keep(e, point);
+            }
+        }
+
+        free(scalars);
+        free(vectors);
+    }
+
+    liveness_free(&live);
+    cfg_free(&g);
+}
+
+static void
+pressure_entry_point(struct pressure *p, struct ir_inst *ep, struct pressure_entry *e)
+{
+    struct ir_module *m = p->m;
+    struct ir_function **queue;
+    u32 nqueue = 0;
+
+    memset(e, 0x00, sizeof(struct pressure_entry));
+
+    e->model = ep->ops[0];
+    e->name = (const char *) (ep->ops + 2);
+
+    ASSERT(queue = malloc((m->nfunctions + 1) * sizeof(struct ir_function *)));
+
+    if (ir_find_function(m, ep->ops[1])) {
+        queue[nqueue++] = ir_find_function(m, ep->ops[1]);
+    }
+
+    // NOTE: the queue doubles as the visited set, call graphs are small
+    for (u32 q = 0; q < nqueue; ++q) {
+        struct ir_function *func = queue[q];
+
+        pressure_function(p, e, func);
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+                struct ir_inst *inst = func->blocks[b]->insts[i];
+                struct ir_function *callee;
+                bool seen = false;
+
+                if (inst->opcode != SpvOpFunctionCall || !(callee = ir_find_function(m, inst->ops[0]))) {
+                    continue;
+                }
+
+                for (u32 s = 0; s < nqueue; ++s) {
+                    seen |= (queue[s] == callee);
+                }
+
+                if (!seen) {
+                    queue[nqueue++] = callee;
+                }
+            }
+        }
+    }
+
+    free(queue);
+}
+
+static void
+pressure_run(struct ir_module *m, struct pressure *p)
+{
+    memset(p, 0x00, sizeof(struct pressure));
+
+    p->m = m;
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        if (m->globals[i]->opcode == SpvOpEntryPoint) {
+            ASSERT(p->entries = realloc(p->entries, (p->nentries + 1) * sizeof(struct pressure_entry)));
+            pressure_entry_point(p, m->globals[i], &p->entries[p->nentries++]);
+        }
+    }
+}
+
+// Number of entry points whose peak scalar pressure is above budget
+static u32
+pressure_over_budget(struct pressure *p, u32 budget)
+{
+    u32 over = 0;
+
+    for (u32 i = 0; i < p->nentries; ++i) {
+        over += (p->entries[i].max_scalars > budget);
+    }
+
+    return(over);
+}
+
+static void
+pressure_report(struct pressure *p, FILE *out)
+{
+    for (u32 i = 0; i < p->nentries; ++i) {
+        struct pressure_entry *e = &p->entries[i];
+        u32 n = e->points ? e->points : 1;
+
+        fprintf(out, "[PRESSURE] %s (%s): max %u scalar / %u vector registers, average %.2f / %.2f over %u points\n",
+                e->name, pressure_model_name(e->model), e->max_scalars, e->max_vectors,
+                (f64) e->sum_scalars / n, (f64) e->sum_vectors / n, e->points);
+
+        for (u32 h = 0; h < e->nhottest; ++h) {
+            struct pressure_point *point = &e->hottest[h];
+
+            fprintf(out, "    %4u %4u  after %%%-5u %-22s in %%%u", point->scalars, point->vectors,
+                    point->inst->id, spv_op_name(point->inst->opcode), point->label);
+
+            if (point->inst->line) {
+                fprintf(out, " %s:%u", profile_file_name(p->m, point->inst->file), point->inst->line);
+            }
+
+            fprintf(out, "\n");
+        }
+    }
+}
+
+static void
+pressure_free(struct pressure *p)
+{
+    free(p->entries);
+}
@@ -0,0 +1,160 @@
+// Dynamic instruction profile of a module executed on the reference
+// interpreter. Blocks are straight-line code, so per-block execution counts
+// are enough to derive exact counts per opcode and per source line.
+
+struct profile {
+    u64 total;
+    u64 invocations;
+    u64 by_opcode[512];
+};
+
+struct profile_line {
+    u32 file;
+    u32 line;
+    u64 count;
+};
+
+static bool
+profile_run(struct ir_module *m, u32 width, u32 height, const void *uniform, u32 uniform_size,
+            struct interp *it, struct profile *p)
+{
+    memset(p, 0x00, sizeof(struct profile));
+
+    if (!interp_init(it, m, width, height)) {
+        return(false);
+    }
+
+    if (uniform) {
+        interp_bind_buffer(it, 0, 0, uniform, uniform_size);
+    }
+
+    if (!interp_run_grid(it)) {
+        return(false);
+    }
+
+    p->invocations = it->invocations;
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+            u64 count = it->block_counts[block->label];
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                p->by_opcode[block->insts[i]->opcode & 511] += count;
+                p->total += count;
+            }
+        }
+    }
+
+    return(true);
+}
+
+static s32
+profile_cmp_lines(const void *a, const void *b)
+{
+    const struct profile_line *la = a;
+    const struct profile_line *lb = b;
+
+    return(la->count < lb->count ? 1 : (la->count > lb->count ? -1 : 0));
+}
+
+static const char *
+profile_file_name(struct ir_module *m, u32 file)
+{
+    struct ir_inst *def = ir_def(m, file);
+    return(def && def->opcode == SpvOpString ? (const char *) def->ops : "?");
+}
+
+static void
+profile_report(struct ir_module *m, struct interp *it, struct profile *p, FILE *out)
+{
+    fprintf(out, "[PROFILE] %" PRIu64 " invocations, %" PRIu64 " instructions (%.2f per invocation)\n",
+            p->invocations, p->total, p->invocations ? (f64) p->total / p->invocations : 0.0);
+
+    // By opcode, in decreasing order
+    {
+        bool printed[512] = { 0 };
+
+        fprintf(out, "[PROFILE] by opcode:\n");
+
+        while (true) {
+            u32 best = 0;
+
+            for (u32 op = 0; op < 512; ++op) {
+                if (!printed[op] && p->by_opcode[op] > p->by_opcode[best]) {
+                    best = op;
+                }
+            }
+
+            if (printed[best] || p->by_opcode[best] == 0) {
+                break;
+            }
+
+            printed[best] = true;
+            fprintf(out, "    %-28s %12lu %6.2f%%\n", spv_op_name(best), p->by_opcode[best], 100.0 * p->by_opcode[best] / p->total);
+        }
+    }
+
+    // By block
+    fprintf(out, "[PROFILE] by block:\n");
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        const char *fname = ir_name(m, func->def->id);
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+            u64 count = it->block_counts[block->label];
+
+            fprintf(out, "    %s %%%d: %" PRIu64 " executions, %" PRIu64 " instructions\n", fname ? fname : "?", block->label, count, count * block->ninsts);
+        }
+    }
+
+    // By source line
+    {
+        struct profile_line *lines = NULL;
+        u32 nlines = 0, cap = 0;
+
+        for (u32 f = 0; f < m->nfunctions; ++f) {
+            struct ir_function *func = m->functions[f];
+
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                struct ir_block *block = func->blocks[b];
+
+                for (u32 i = 0; i < block->ninsts; ++i) {
+                    struct ir_inst *inst = block->insts[i];
+                    u32 j;
+
+                    for (j = 0; j < nlines; ++j) {
+                        if (lines[j].file == inst->file && lines[j].line == inst->line) {
+                            break;
+                        }
+                    }
+
+                    if (j == nlines) {
+                        struct profile_line line = { inst->file, inst->line, 0 };
+                        IR_PUSH(lines, nlines, cap, line);
+                    }
+
+                    lines[j].count += it->block_counts[block->label];
+                }
+            }
+        }
+
+        qsort(lines, nlines, sizeof(struct profile_line), profile_cmp_lines);
+
+        fprintf(out, "[PROFILE] by source line:\n");
+
+        for (u32 i = 0; i < nlines; ++i) {
+            if (lines[i].line) {
+                fprintf(out, "    %s:%d %" PRIu64 "\n", profile_file_name(m, lines[i].file), lines[i].line, lines[i].count);
+            } else {
+                fprintf(out, "    <no line info> %" PRIu64 "\n", lines[i].count);
+            }
+        }
+
+        free(lines);
+    }
+}
@@ -0,0 +1,123 @@
+// SHA-256 (FIPS 180-4), for cache keys that must not collide by accident.
+
+#define SHA256_SIZE 32
+
+struct sha256 {
+    u32 state[8];
+    u8 block[64];
+    u32 used;
+    u64 length;
+};
+
+static const u32 SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_init(struct sha256 *s)
+{
+    static const u32 initial[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memset(s, 0x00, sizeof(struct sha256));
+    memcpy(s->state, initial, sizeof(initial));
+}
+
+static void
+sha256_block(struct sha256 *s, const u8 *block)
+{
+    u32 w[64];
+    u32 v[8];
+
+    for (u32 i = 0; i < 16; ++i) {
+        w[i] = ((u32) block[4 * i] << 24) | ((u32) block[4 * i + 1] << 16) | ((u32) block[4 * i + 2] << 8) | block[4 * i + 3];
+    }
+
+    for (u32 i = 16; i < 64; ++i) {
+        u32 s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        u32 s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(v, s->state, sizeof(v));
+
+    for (u32 i = 0; i < 64; ++i) {
+        u32 s1 = SHA256_ROTR(v[4], 6) ^ SHA256_ROTR(v[4], 11) ^ SHA256_ROTR(v[4], 25);
+        u32 ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+        u32 t1 = v[7] + s1 + ch + SHA256_K[i] + w[i];
+        u32 s0 = SHA256_ROTR(v[0], 2) ^ SHA256_ROTR(v[0], 13) ^ SHA256_ROTR(v[0], 22);
+        u32 maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+
+        memmove(v + 1, v, 7 * sizeof(u32));
+        v[4] += t1;
+        v[0] = t1 + s0 + maj;
+    }
+
+    for (u32 i = 0; i < 8; ++i) {
+        s->state[i] += v[i];
+    }
+}
+
+static void
+sha256_update(struct sha256 *s, const void *bytes, u64 count)
+{
+    const u8 *p = bytes;
+
+    s->length += count;
+
+    while (count) {
+        u32 n = 64 - s->used;
+
+        n = count < n ? (u32) count : n;
+        memcpy(s->block + s->used, p, n);
+
+        s->used += n;
+        p += n;
+        count -= n;
+
+        if (s->used == 64) {
+            sha256_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+static void
+sha256_final(struct sha256 *s, u8 *digest)
+{
+    u64 bits = s->length * 8;
+    u8 pad = 0x80;
+    u8 length[8];
+
+    sha256_update(s, &pad, 1);
+
+    pad = 0;
+
+    while (s->used != 56) {
+        sha256_update(s, &pad, 1);
+    }
+
+    for (u32 i = 0; i < 8; ++i) {
+        length[i] = (u8) (bits >> (56 - 8 * i));
+    }
+
+    sha256_update(s, length, 8);
+
+    for (u32 i = 0; i < 8; ++i) {
+        digest[4 * i]     = (u8) (s->state[i] >> 24);
+        digest[4 * i + 1] = (u8) (s->state[i] >> 16);
+        digest[4 * i + 2] = (u8) (s->state[i] >> 8);
+        digest[4 * i + 3] = (u8) s->state[i];
+    }
+}
@@ -0,0 +1,539 @@
+// Control flow simplification, repeated until nothing changes:
+//  - conditional branches and switches on constants become plain branches,
+//  - blocks that are no longer reachable are deleted,
+//  - small if/else diamonds and if triangles without side effects are
+//    flattened into the header with OpSelect in place of the phis,
+//  - a block whose only predecessor branches straight to it is merged into it.
+//
+// Structured control flow stays valid. A selection header that stops branching
+// loses its OpSelectionMerge, except a switch that a nested construct breaks out
+// of: it keeps its merge and only loses the cases that cannot be taken. Merge
+// blocks and continue targets are never merged away, when unreachable they are
+// kept as OpUnreachable or as a branch back to the loop header.
+
+#define SIMPLIFY_DEFAULT_COST 8
+
+struct simplify {
+    struct ir_module *m;
+    u32 cost;
+    u32 folded;
+    u32 removed;
+    u32 merged;
+    u32 converted;
+    u32 blocks_before;
+    u32 blocks_after;
+};
+
+// Whether label is the merge block or the continue target of a header in func
+static bool
+simplify_is_target(struct ir_function *func, u32 label)
+{
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        struct ir_inst *merge = ir_merge_inst(func->blocks[b]);
+
+        if (merge && (merge->ops[0] == label || (merge->opcode == SpvOpLoopMerge && merge->ops[1] == label))) {
+            return(true);
+        }
+    }
+
+    return(false);
+}
+
+// Replaces the terminator with a branch to target, a selection header loses its merge
+static void
+simplify_branch(struct simplify *s, struct ir_block *block, u32 target)
+{
+    struct ir_inst *term = ir_terminator(block);
+    struct ir_inst *merge = ir_merge_inst(block);
+
+    term->opcode = SpvOpBranch;
+    ir_set_nops(term, 1);
+    term->ops[0] = target;
+
+    if (merge && merge->opcode == SpvOpSelectionMerge) {
+        ir_remove(s->m, block, block->ninsts - 2);
+    }
+}
+
+// Whether a construct nested in the one headed by header branches to its merge
+// block. Only a switch can be left like that, by a break out of an inner if.
+static bool
+simplify_nested_break(struct ir_function *func, struct ir_block *header, u32 merge)
+{
+    struct cfg g;
+    u32 h, target;
+    bool found = false;
+
+    cfg_build(&g, func);
+
+    h = cfg_block_index(&g, header->label);
+    target = cfg_block_index(&g, merge);
+
+    for (u32 i = 0; target != UINT32_MAX && i < g.pred[target].count && !found; ++i) {
+        u32 p = g.pred[target].items[i];
+
+        // NOTE: p sits in the construct of an inner header n when n dominates it and n's merge block does not
+        for (u32 n = 0; n < g.nblocks && p != h && !found; ++n) {
+            struct ir_inst *inner = ir_merge_inst(func->blocks[n]);
+            u32 exit;
+
+            if (n == h || !inner || !cfg_dominates(&g, h, n) || !cfg_dominates(&g, n, p)) {
+                continue;
+            }
+
+            exit = cfg_block_index(&g, inner->ops[0]);
+            found = exit == UINT32_MAX || !cfg_dominates(&g, exit, p);
+        }
+    }
+
+    cfg_free(&g);
+
+    return(found);
+}
+
+static bool
+simplify_fold(struct simplify *s, struct ir_function *func, struct ir_block *block)
+{
+    struct ir_module *m = s->m;
+    struct ir_inst *term = ir_terminator(block);
+    struct ir_inst *merge = ir_merge_inst(block);
+    u32 target = 0;
+    u32 bits;
+
+    if (term->opcode == SpvOpBranchConditional) {
+        if (term->ops[1] == term->ops[2]) {
+            target = term->ops[1];
+        } else if (ir_is_constant(m, term->ops[0]) && ir_constant_bits(m, term->ops[0], 0, &bits)) {
+            target = bits ? term->ops[1] : term->ops[2];
+        }
+    } else if (term->opcode == SpvOpSwitch && ir_is_constant(m, term->ops[0]) &&
+               ir_def(m, ir_def(m, term->ops[0])->type)->ops[0] <= 32 && ir_constant_bits(m, term->ops[0], 0, &bits)) {
+        // NOTE: selectors up to 32 bits only. A 64-bit one takes two words per case literal, which the IR reads as one everywhere, so it is left alone
+        target = term->ops[1];
+
+        for (u32 i = 2; i + 1 < term->nops; i += 2) {
+            if (term->ops[i] == bits) {
+                target = term->ops[i + 1];
+                break;
+            }
+        }
+
+        // NOTE: a break from an inner construct needs the merge, what is left is a switch with only the taken target as default
+        if (merge && simplify_nested_break(func, block, merge->ops[0])) {
+            if (term->nops == 2 && term->ops[1] == target) {
+                return(false);
+            }
+
+            ir_set_nops(term, 2);
+            term->ops[1] = target;
+            s->folded += 1;
+
+            return(true);
+        }
+    }
+
+    if (!target) {
+        return(false);
+    }
+
+    simplify_branch(s, block, target);
+    s->folded += 1;
+
+    return(true);
+}
+
+// Deletes unreachable blocks. The ones a reachable header still names as its
+// merge block or continue target are emptied instead.
+static bool
+simplify_unreachable(struct simplify *s, struct ir_function *func)
+{
+    struct cfg g;
+    u32 *header;
+    bool changed = false;
+
+    cfg_build(&g, func);
+    ASSERT(header = malloc(g.nblocks * sizeof(u32)));
+
+    // UINT32_MAX: delete, 0: keep as OpUnreachable, otherwise: branch back to that loop header
+    for (u32 b = 0; b < g.nblocks; ++b) {
+        u32 label = func->blocks[b]->label;
+
+        header[b] = UINT32_MAX;
+
+        for (u32 h = 0; h < g.nblocks && !cfg_reachable(&g, b); ++h) {
+            struct ir_inst *merge = ir_merge_inst(func->blocks[h]);
+
+            if (!cfg_reachable(&g, h) || !merge) {
+                continue;
+            }
+
+            if (merge->opcode == SpvOpLoopMerge && merge->ops[1] == label) {
+                header[b] = func->blocks[h]->label;
+            } else if (merge->ops[0] == label && header[b] == UINT32_MAX) {
+                header[b] = 0;
+            }
+        }
+    }
+
+    for (u32 b = g.nblocks; b-- > 0;) {
+        struct ir_block *block = func->blocks[b];
+
+        if (cfg_reachable(&g, b)) {
+            continue;
+        }
+
+        if (header[b] == UINT32_MAX) {
+            ir_remove_block(s->m, func, b);
+            s->removed += 1;
+            changed = true;
+            continue;
+        }
+
+        struct ir_inst *term = ir_terminator(block);
+        u32 opcode = header[b] ? SpvOpBranch : SpvOpUnreachable;
+
+        if (block->ninsts == 1 && term->opcode == opcode && (!header[b] || term->ops[0] == header[b])) {
+            continue;
+        }
+
+        while (block->ninsts) {
+            if (block->insts[0]->id) {
+                ir_remove_annotations(s->m, block->insts[0]->id);
+            }
+
+            ir_remove(s->m, block, 0);
+        }
+
+        term = ir_new_inst(opcode, 0, 0, header[b] ? 1 : 0);
+
+        if (header[b]) {
+            term->ops[0] = header[b];
+        }
+
+        ir_append(block, term);
+        changed = true;
+    }
+
+    free(header);
+    cfg_free(&g);
+
+    return(changed);
+}
+
+// Gives every phi exactly one entry per predecessor. Entries for new
+// predecessors, or whose value was deleted with its block, become OpUndef.
+static void
+simplify_fix_phis(struct simplify *s, struct ir_function *func)
+{
+    struct cfg g;
+
+    cfg_build(&g, func);
+
+    for (u32 b = 0; b < g.nblocks; ++b) {
+        struct ir_block *block = func->blocks[b];
+        u32 n = g.pred[b].count;
+
+        for (u32 i = 0; i < block->ninsts && block->insts[i]->opcode == SpvOpPhi; ++i) {
+            struct ir_inst *phi = block->insts[i];
+            u32 *ops;
+
+            ASSERT(ops = malloc((2 * n + 1) * sizeof(u32)));
+
+            for (u32 p = 0; p < n; ++p) {
+                u32 label = func->blocks[g.pred[b].items[p]]->label;
+                u32 value = 0;
+
+                for (u32 k = 0; k + 1 < phi->nops; k += 2) {
+                    if (phi->ops[k + 1] == label) {
+                        value = phi->ops[k];
+                        break;
+                    }
+                }
+
+                ops[2 * p] = (value && ir_def(s->m, value)) ? value : ir_undef(s->m, phi->type);
+                ops[2 * p + 1] = label;
+            }
+
+            ir_set_nops(phi, 2 * n);
+            memcpy(phi->ops, ops, 2 * n * sizeof(u32));
+
+            free(ops);
+        }
+    }
+
+    cfg_free(&g);
+}
+
+static bool
+simplify_is_selectable(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+
+    return(def && (def->opcode == SpvOpTypeBool || def->opcode == SpvOpTypeInt ||
+                   def->opcode == SpvOpTypeFloat || def->opcode == SpvOpTypeVector));
+}
+
+// One side of a selection: free of side effects and of anything that may
+// trap or fault once executed unconditionally, ending in a branch to the merge
+static bool
+simplify_is_side(struct simplify *s, struct cfg *g, u32 b, u32 merge, u32 *cost)
+{
+    struct ir_block *block = g->func->blocks[b];
+    struct ir_inst *term = ir_terminator(block);
+
+    if (g->pred[b].count != 1 || term->opcode != SpvOpBranch || term->ops[0] != merge ||
+        simplify_is_target(g->func, block->label)) {
+        return(false);
+    }
+
+    for (u32 i = 0; i + 1 < block->ninsts; ++i) {
+        struct ir_inst *inst = block->insts[i];
+
+        switch (inst->opcode) {
+            case SpvOpPhi:
+            case SpvOpLoad:
+            case SpvOpUDiv:
+            case SpvOpSDiv:
+            case SpvOpUMod:
+            case SpvOpSRem:
+            case SpvOpSMod:
+            return(false);
+        }
+
+        if (!ir_is_pure(s->m, inst)) {
+            return(false);
+        }
+
+        *cost += 1;
+    }
+
+    return(true);
+}
+
+// Moves every instruction but the terminator of from to the end of to, before its merge and terminator
+static void
+simplify_hoist(struct ir_block *from, struct ir_block *to)
+{
+    while (from->ninsts > 1) {
+        struct ir_inst *inst = ir_detach(from, 0);
+        ir_insert(to, to->ninsts - (ir_merge_inst(to) ? 2 : 1), inst);
+    }
+}
+
+static bool
+simplify_if_convert(struct simplify *s, struct ir_function *func)
+{
+    struct ir_module *m = s->m;
+    struct cfg g;
+
+    cfg_build(&g, func);
+
+    for (u32 h = 0; h < g.nblocks; ++h) {
+        struct ir_block *header = func->blocks[h];
+        struct ir_inst *merge = ir_merge_inst(header);
+        struct ir_inst *term = ir_terminator(header);
+        u32 cost = 0;
+
+        if (!cfg_reachable(&g, h) || !merge || merge->opcode != SpvOpSelectionMerge ||
+            term->opcode != SpvOpBranchConditional || term->ops[1] == term->ops[2]) {
+            continue;
+        }
+
+        u32 mb = cfg_block_index(&g, merge->ops[0]);
+        u32 tb = cfg_block_index(&g, term->ops[1]);
+        u32 fb = cfg_block_index(&g, term->ops[2]);
+        struct ir_block *join = func->blocks[mb];
+        bool ok = g.pred[mb].count == 2 && cfg_reachable(&g, mb);
+
+        ok = ok && (tb == mb || simplify_is_side(s, &g, tb, join->label, &cost));
+        ok = ok && (fb == mb || simplify_is_side(s, &g, fb, join->label, &cost));
+
+        for (u32 i = 0; ok && i < join->ninsts && join->insts[i]->opcode == SpvOpPhi; ++i) {
+            ok = simplify_is_selectable(m, join->insts[i]->type);
+            cost += 1;
+        }
+
+        if (!ok || cost > s->cost) {
+            continue;
+        }
+
+        u32 cond = term->ops[0];
+        u32 tlabel = (tb == mb) ? header->label : term->ops[1];
+        u32 flabel = (fb == mb) ? header->label : term->ops[2];
+
+        if (tb != mb) {
+            simplify_hoist(func->blocks[tb], header);
+        }
+
+        if (fb != mb) {
+            simplify_hoist(func->blocks[fb], header);
+        }
+
+        while (join->ninsts && join->insts[0]->opcode == SpvOpPhi) {
+            struct ir_inst *phi = join->insts[0];
+            struct ir_inst *select = ir_new_inst(SpvOpSelect, phi->type, ir_new_id(m), 3);
+            u32 condition = cond;
+
+            // NOTE: before SPIR-V 1.4 a vector select needs a condition with as many components
+            if (m->version < 0x10400 && ir_is_vector_type(m, phi->type)) {
+                u32 n = ir_vector_size(m, phi->type);
+                u32 ops[2] = { ir_def(m, cond)->type, n };
+                struct ir_inst *splat = ir_new_inst(SpvOpCompositeConstruct, ir_find_or_add_type(m, SpvOpTypeVector, ops, 2),
+                                                    ir_new_id(m), n);
+
+                for (u32 k = 0; k < n; ++k) {
+                    splat->ops[k] = cond;
+                }
+
+                ir_insert(header, header->ninsts - 2, splat);
+                ir_register_inst(m, splat);
+                condition = splat->id;
+            }
+
+            select->ops[0] = condition;
+            select->file = phi->file;
+            select->line = phi->line;
+
+            for (u32 k = 0; k + 1 < phi->nops; k += 2) {
+                if (phi->ops[k + 1] == tlabel) {
+                    select->ops[1] = phi->ops[k];
+                }
+                if (phi->ops[k + 1] == flabel) {
+                    select->ops[2] = phi->ops[k];
+                }
+            }
+
+            ir_insert(header, header->ninsts - 2, select);
+            ir_register_inst(m, select);
+            ir_replace_uses(m, phi->id, select->id);
+            ir_remove(m, join, 0);
+        }
+
+        simplify_branch(s, header, join->label);
+
+        // NOTE: higher index first, so the other one stays put
+        u32 first = tb > fb ? tb : fb;
+        u32 second = tb > fb ? fb : tb;
+
+        if (first != mb) {
+            ir_remove_block(m, func, first);
+        }
+
+        if (second != mb) {
+            ir_remove_block(m, func, second);
+        }
+
+        s->converted += 1;
+        cfg_free(&g);
+
+        return(true);
+    }
+
+    cfg_free(&g);
+
+    return(false);
+}
+
+// Merges one block into its only predecessor, when that one branches straight to it
+static bool
+simplify_merge(struct simplify *s, struct ir_function *func)
+{
+    struct cfg g;
+
+    cfg_build(&g, func);
+
+    for (u32 a = 0; a < g.nblocks; ++a) {
+        struct ir_block *pred = func->blocks[a];
+        struct ir_inst *term = ir_terminator(pred);
+
+        if (!cfg_reachable(&g, a) || term->opcode != SpvOpBranch || ir_merge_inst(pred)) {
+            continue;
+        }
+
+        u32 b = cfg_block_index(&g, term->ops[0]);
+        struct ir_block *block = func->blocks[b];
+
+        if (b == a || b == 0 || g.pred[b].count != 1 || simplify_is_target(func, block->label)) {
+            continue;
+        }
+
+        while (block->ninsts && block->insts[0]->opcode == SpvOpPhi) {
+            struct ir_inst *phi = block->insts[0];
+
+            ir_replace_uses(s->m, phi->id, phi->ops[0]);
+            ir_remove(s->m, block, 0);
+        }
+
+        ir_remove(s->m, pred, pred->ninsts - 1);
+
+        while (block->ninsts) {
+            ir_append(pred, ir_detach(block, 0));
+        }
+
+        // successors' phis now come from pred
+        ir_replace_uses(s->m, block->label, pred->label);
+        ir_remove_block(s->m, func, b);
+
+        s->merged += 1;
+        cfg_free(&g);
+
+        return(true);
+    }
+
+    cfg_free(&g);
+
+    return(false);
+}
+
+static u32
+simplify_count_blocks(struct ir_module *m)
+{
+    u32 count = 0;
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        count += m->functions[f]->nblocks;
+    }
+
+    return(count);
+}
+
+static void
+simplify_run(struct ir_module *m, u32 cost, struct simplify *s)
+{
+    memset(s, 0x00, sizeof(struct simplify));
+
+    s->m = m;
+    s->cost = cost;
+    s->blocks_before = simplify_count_blocks(m);
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        struct ir_function *func = m->functions[f];
+        bool changed = func->nblocks > 0;
+
+        while (changed) {
+            changed = false;
+
+            for (u32 b = 0; b < func->nblocks; ++b) {
+                changed |= simplify_fold(s, func, func->blocks[b]);
+            }
+
+            changed |= simplify_unreachable(s, func);
+            simplify_fix_phis(s, func);
+
+            changed |= simplify_if_convert(s, func);
+            changed |= simplify_merge(s, func);
+        }
+    }
+
+    ir_remove_dead_code(m);
+
+    s->blocks_after = simplify_count_blocks(m);
+}
+
+static void
+simplify_report(struct simplify *s, FILE *out)
+{
+    fprintf(out, "[SIMPLIFY] %u -> %u blocks: %u branches folded, %u unreachable blocks removed, "
+            "%u blocks merged, %u selections turned into OpSelect\n",
+            s->blocks_before, s->blocks_after, s->folded, s->removed, s->merged, s->converted);
+}
@@ -0,0 +1,379 @@
+// SPIR-V enumerants used by the optimizer. Values follow the unified1
+// SPIR-V 1.3 and GLSL.std.450 specifications. Only what the passes and the
+// reference interpreter look at is listed.
+
+#define SPV_MAGIC 0x07230203
+#define SPV_HEADER_SIZE 5
+
+// X(name, opcode, has result type, has result id)
+#define SPV_OPS(X) \
+    X(Nop, 0, 0, 0) \
+    X(Undef, 1, 1, 1) \
+    X(SourceContinued, 2, 0, 0) \
+    X(Source, 3, 0, 0) \
+    X(SourceExtension, 4, 0, 0) \
+    X(Name, 5, 0, 0) \
+    X(MemberName, 6, 0, 0) \
+    X(String, 7, 0, 1) \
+    X(Line, 8, 0, 0) \
+    X(Extension, 10, 0, 0) \
+    X(ExtInstImport, 11, 0, 1) \
+    X(ExtInst, 12, 1, 1) \
+    X(MemoryModel, 14, 0, 0) \
+    X(EntryPoint, 15, 0, 0) \
+    X(ExecutionMode, 16, 0, 0) \
+    X(Capability, 17, 0, 0) \
+    X(TypeVoid, 19, 0, 1) \
+    X(TypeBool, 20, 0, 1) \
+    X(TypeInt, 21, 0, 1) \
+    X(TypeFloat, 22, 0, 1) \
+    X(TypeVector, 23, 0, 1) \
+    X(TypeMatrix, 24, 0, 1) \
+    X(TypeImage, 25, 0, 1) \
+    X(TypeSampler, 26, 0, 1) \
+    X(TypeSampledImage, 27, 0, 1) \
+    X(TypeArray, 28, 0, 1) \
+    X(TypeRuntimeArray, 29, 0, 1) \
+    X(TypeStruct, 30, 0, 1) \
+    X(TypeOpaque, 31, 0, 1) \
+    X(TypePointer, 32, 0, 1) \
+    X(TypeFunction, 33, 0, 1) \
+    X(TypeForwardPointer, 39, 0, 0) \
+    X(ConstantTrue, 41, 1, 1) \
+    X(ConstantFalse, 42, 1, 1) \
+    X(Constant, 43, 1, 1) \
+    X(ConstantComposite, 44, 1, 1) \
+    X(ConstantSampler, 45, 1, 1) \
+    X(ConstantNull, 46, 1, 1) \
+    X(SpecConstantTrue, 48, 1, 1) \
+    X(SpecConstantFalse, 49, 1, 1) \
+    X(SpecConstant, 50, 1, 1) \
+    X(SpecConstantComposite, 51, 1, 1) \
+    X(SpecConstantOp, 52, 1, 1) \
+    X(Function, 54, 1, 1) \
+    X(FunctionParameter, 55, 1, 1) \
+    X(FunctionEnd, 56, 0, 0) \
+    X(FunctionCall, 57, 1, 1) \
+    X(Variable, 59, 1, 1) \
+    X(ImageTexelPointer, 60, 1, 1) \
+    X(Load, 61, 1, 1) \
+    X(Store, 62, 0, 0) \
+    X(CopyMemory, 63, 0, 0) \
+    X(CopyMemorySized, 64, 0, 0) \
+    X(AccessChain, 65, 1, 1) \
+    X(InBoundsAccessChain, 66, 1, 1) \
+    X(PtrAccessChain, 67, 1, 1) \
+    X(ArrayLength, 68, 1, 1) \
+    X(InBoundsPtrAccessChain, 70, 1, 1) \
+    X(Decorate, 71, 0, 0) \
+    X(MemberDecorate, 72, 0, 0) \
+    X(DecorationGroup, 73, 0, 1) \
+    X(GroupDecorate, 74, 0, 0) \
+    X(GroupMemberDecorate, 75, 0, 0) \
+    X(VectorExtractDynamic, 77, 1, 1) \
+    X(VectorInsertDynamic, 78, 1, 1) \
+    X(VectorShuffle, 79, 1, 1) \
+    X(CompositeConstruct, 80, 1, 1) \
+    X(CompositeExtract, 81, 1, 1) \
+    X(CompositeInsert, 82, 1, 1) \
+    X(CopyObject, 83, 1, 1) \
+    X(Transpose, 84, 1, 1) \
+    X(SampledImage, 86, 1, 1) \
+    X(ImageSampleImplicitLod, 87, 1, 1) \
+    X(ImageSampleExplicitLod, 88, 1, 1) \
+    X(ImageSampleDrefImplicitLod, 89, 1, 1) \
+    X(ImageSampleDrefExplicitLod, 90, 1, 1) \
+    X(ImageSampleProjImplicitLod, 91, 1, 1) \
+    X(ImageSampleProjExplicitLod, 92, 1, 1) \
+    X(ImageSampleProjDrefImplicitLod, 93, 1, 1) \
+    X(ImageSampleProjDrefExplicitLod, 94, 1, 1) \
+    X(ImageFetch, 95, 1, 1) \
+    X(ImageGather, 96, 1, 1) \
+    X(ImageDrefGather, 97, 1, 1) \
+    X(ImageRead, 98, 1, 1) \
+    X(ImageWrite, 99, 0, 0) \
+    X(Image, 100, 1, 1) \
+    X(ImageQueryFormat, 101, 1, 1) \
+    X(ImageQueryOrder, 102, 1, 1) \
+    X(ImageQuerySizeLod, 103, 1, 1) \
+    X(ImageQuerySize, 104, 1, 1) \
+    X(ImageQueryLod, 105, 1, 1) \
+    X(ImageQueryLevels, 106, 1, 1) \
+    X(ImageQuerySamples, 107, 1, 1) \
+    X(ConvertFToU, 109, 1, 1) \
+    X(ConvertFToS, 110, 1, 1) \
+    X(ConvertSToF, 111, 1, 1) \
+    X(ConvertUToF, 112, 1, 1) \
+    X(UConvert, 113, 1, 1) \
+    X(SConvert, 114, 1, 1) \
+    X(FConvert, 115, 1, 1) \
+    X(QuantizeToF16, 116, 1, 1) \
+    X(Bitcast, 124, 1, 1) \
+    X(SNegate, 126, 1, 1) \
+    X(FNegate, 127, 1, 1) \
+    X(IAdd, 128, 1, 1) \
+    X(FAdd, 129, 1, 1) \
+    X(ISub, 130, 1, 1) \
+    X(FSub, 131, 1, 1) \
+    X(IMul, 132, 1, 1) \
+    X(FMul, 133, 1, 1) \
+    X(UDiv, 134, 1, 1) \
+    X(SDiv, 135, 1, 1) \
+    X(FDiv, 136, 1, 1) \
+    X(UMod, 137, 1, 1) \
+    X(SRem, 138, 1, 1) \
+    X(SMod, 139, 1, 1) \
+    X(FRem, 140, 1, 1) \
+    X(FMod, 141, 1, 1) \
+    X(VectorTimesScalar, 142, 1, 1) \
+    X(MatrixTimesScalar, 143, 1, 1) \
+    X(VectorTimesMatrix, 144, 1, 1) \
+    X(MatrixTimesVector, 145, 1, 1) \
+    X(MatrixTimesMatrix, 146, 1, 1) \
+    X(OuterProduct, 147, 1, 1) \
+    X(Dot, 148, 1, 1) \
+    X(IAddCarry, 149, 1, 1) \
+    X(ISubBorrow, 150, 1, 1) \
+    X(UMulExtended, 151, 1, 1) \
+    X(SMulExtended, 152, 1, 1) \
+    X(Any, 154, 1, 1) \
+    X(All, 155, 1, 1) \
+    X(IsNan, 156, 1, 1) \
+    X(IsInf, 157, 1, 1) \
+    X(IsFinite, 158, 1, 1) \
+    X(IsNormal, 159, 1, 1) \
+    X(SignBitSet, 160, 1, 1) \
+    X(LessOrGreater, 161, 1, 1) \
+    X(Ordered, 162, 1, 1) \
+    X(Unordered, 163, 1, 1) \
+    X(LogicalEqual, 164, 1, 1) \
+    X(LogicalNotEqual, 165, 1, 1) \
+    X(LogicalOr, 166, 1, 1) \
+    X(LogicalAnd, 167, 1, 1) \
+    X(LogicalNot, 168, 1, 1) \
+    X(Select, 169, 1, 1) \
+    X(IEqual, 170, 1, 1) \
+    X(INotEqual, 171, 1, 1) \
+    X(UGreaterThan, 172, 1, 1) \
+    X(SGreaterThan, 173, 1, 1) \
+    X(UGreaterThanEqual, 174, 1, 1) \
+    X(SGreaterThanEqual, 175, 1, 1) \
+    X(ULessThan, 176, 1, 1) \
+    X(SLessThan, 177, 1, 1) \
+    X(ULessThanEqual, 178, 1, 1) \
+    X(SLessThanEqual, 179, 1, 1) \
+    X(FOrdEqual, 180, 1, 1) \
+    X(FUnordEqual, 181, 1, 1) \
+    X(FOrdNotEqual, 182, 1, 1) \
+    X(FUnordNotEqual, 183, 1, 1) \
+    X(FOrdLessThan, 184, 1, 1) \
+    X(FUnordLessThan, 185, 1, 1) \
+    X(FOrdGreaterThan, 186, 1, 1) \
+    X(FUnordGreaterThan, 187, 1, 1) \
+    X(FOrdLessThanEqual, 188, 1, 1) \
+    X(FUnordLessThanEqual, 189, 1, 1) \
+    X(FOrdGreaterThanEqual, 190, 1, 1) \
+    X(FUnordGreaterThanEqual, 191, 1, 1) \
+    X(ShiftRightLogical, 194, 1, 1) \
+    X(ShiftRightArithmetic, 195, 1, 1) \
+    X(ShiftLeftLogical, 196, 1, 1) \
+    X(BitwiseOr, 197, 1, 1) \
+    X(BitwiseXor, 198, 1, 1) \
+    X(BitwiseAnd, 199, 1, 1) \
+    X(Not, 200, 1, 1) \
+    X(BitFieldInsert, 201, 1, 1) \
+    X(BitFieldSExtract, 202, 1, 1) \
+    X(BitFieldUExtract, 203, 1, 1) \
+    X(BitReverse, 204, 1, 1) \
+    X(BitCount, 205, 1, 1) \
+    X(DPdx, 207, 1, 1) \
+    X(DPdy, 208, 1, 1) \
+    X(Fwidth, 209, 1, 1) \
+    X(DPdxFine, 210, 1, 1) \
+    X(DPdyFine, 211, 1, 1) \
+    X(FwidthFine, 212, 1, 1) \
+    X(DPdxCoarse, 213, 1, 1) \
+    X(DPdyCoarse, 214, 1, 1) \
+    X(FwidthCoarse, 215, 1, 1) \
+    X(EmitVertex, 218, 0, 0) \
+    X(EndPrimitive, 219, 0, 0) \
+    X(ControlBarrier, 224, 0, 0) \
+    X(MemoryBarrier, 225, 0, 0) \
+    X(AtomicLoad, 227, 1, 1) \
+    X(AtomicStore, 228, 0, 0) \
+    X(AtomicExchange, 229, 1, 1) \
+    X(AtomicCompareExchange, 230, 1, 1) \
+    X(AtomicIIncrement, 232, 1, 1) \
+    X(AtomicIDecrement, 233, 1, 1) \
+    X(AtomicIAdd, 234, 1, 1) \
+    X(AtomicISub, 235, 1, 1) \
+    X(AtomicSMin, 236, 1, 1) \
+    X(AtomicUMin, 237, 1, 1) \
+    X(AtomicSMax, 238, 1, 1) \
+    X(AtomicUMax, 239, 1, 1) \
+    X(AtomicAnd, 240, 1, 1) \
+    X(AtomicOr, 241, 1, 1) \
+    X(AtomicXor, 242, 1, 1) \
+    X(Phi, 245, 1, 1) \
+    X(LoopMerge, 246, 0, 0) \
+    X(SelectionMerge, 247, 0, 0) \
+    X(Label, 248, 0, 1) \
+    X(Branch, 249, 0, 0) \
+    X(BranchConditional, 250, 0, 0) \
+    X(Switch, 251, 0, 0) \
+    X(Kill, 252, 0, 0) \
+    X(Return, 253, 0, 0) \
+    X(ReturnValue, 254, 0, 0) \
+    X(Unreachable, 255, 0, 0) \
+    X(NoLine, 317, 0, 0) \
+    X(ModuleProcessed, 330, 0, 0) \
+    X(ExecutionModeId, 331, 0, 0) \
+    X(DecorateId, 332, 0, 0)
+
+enum spv_op {
+#define SPV_OP_ENUM(name, value, type, result) SpvOp##name = value,
+    SPV_OPS(SPV_OP_ENUM)
+#undef SPV_OP_ENUM
+};
+
+enum spv_capability {
+    SpvCapabilityMatrix  = 0,
+    SpvCapabilityShader  = 1,
+    SpvCapabilityFloat16 = 9,
+    SpvCapabilityFloat64 = 10,
+    SpvCapabilityInt64   = 11,
+    SpvCapabilityInt16   = 22,
+};
+
+enum spv_execution_model {
+    SpvExecutionModelVertex    = 0,
+    SpvExecutionModelFragment  = 4,
+    SpvExecutionModelGLCompute = 5,
+};
+
+enum spv_execution_mode {
+    SpvExecutionModeOriginUpperLeft          = 7,
+    SpvExecutionModeDenormPreserve           = 4459,
+    SpvExecutionModeDenormFlushToZero        = 4460,
+    SpvExecutionModeSignedZeroInfNanPreserve = 4461,
+    SpvExecutionModeRoundingModeRTE          = 4462,
+    SpvExecutionModeRoundingModeRTZ          = 4463,
+};
+
+enum spv_storage_class {
+    SpvStorageClassUniformConstant = 0,
+    SpvStorageClassInput           = 1,
+    SpvStorageClassUniform         = 2,
+    SpvStorageClassOutput          = 3,
+    SpvStorageClassWorkgroup       = 4,
+    SpvStorageClassCrossWorkgroup  = 5,
+    SpvStorageClassPrivate         = 6,
+    SpvStorageClassFunction        = 7,
+    SpvStorageClassPushConstant    = 9,
+    SpvStorageClassImage           = 11,
+    SpvStorageClassStorageBuffer   = 12,
+};
+
+enum spv_decoration {
+    SpvDecorationRelaxedPrecision = 0,
+    SpvDecorationSpecId           = 1,
+    SpvDecorationBlock            = 2,
+    SpvDecorationBufferBlock      = 3,
+    SpvDecorationRowMajor         = 4,
+    SpvDecorationColMajor         = 5,
+    SpvDecorationArrayStride      = 6,
+    SpvDecorationMatrixStride     = 7,
+    SpvDecorationBuiltIn          = 11,
+    SpvDecorationFlat             = 14,
+    SpvDecorationInvariant        = 18,
+    SpvDecorationVolatile         = 21,
+    SpvDecorationLocation         = 30,
+    SpvDecorationBinding          = 33,
+    SpvDecorationDescriptorSet    = 34,
+    SpvDecorationOffset           = 35,
+    SpvDecorationFPRoundingMode   = 39,
+    SpvDecorationFPFastMathMode   = 40,
+    SpvDecorationNoContraction    = 42,
+};
+
+enum spv_builtin {
+    SpvBuiltInPosition      = 0,
+    SpvBuiltInPointSize     = 1,
+    SpvBuiltInClipDistance  = 3,
+    SpvBuiltInCullDistance  = 4,
+    SpvBuiltInVertexId      = 5,
+    SpvBuiltInInstanceId    = 6,
+    SpvBuiltInFragCoord     = 15,
+    SpvBuiltInPointCoord    = 16,
+    SpvBuiltInFrontFacing   = 17,
+    SpvBuiltInFragDepth     = 22,
+    SpvBuiltInVertexIndex   = 42,
+    SpvBuiltInInstanceIndex = 43,
+};
+
+enum spv_fp_fast_math_mode {
+    SpvFPFastMathModeNotNaN       = 0x1,
+    SpvFPFastMathModeNotInf       = 0x2,
+    SpvFPFastMathModeNSZ          = 0x4,
+    SpvFPFastMathModeAllowRecip   = 0x8,
+    SpvFPFastMathModeFast         = 0x10,
+};
+
+enum spv_memory_access {
+    SpvMemoryAccessVolatile = 0x1,
+    SpvMemoryAccessAligned  = 0x2,
+};
+
+enum spv_glsl_std_450 {
+    GLSLstd450Round         = 1,
+    GLSLstd450RoundEven     = 2,
+    GLSLstd450Trunc         = 3,
+    GLSLstd450FAbs          = 4,
+    GLSLstd450SAbs          = 5,
+    GLSLstd450FSign         = 6,
+    GLSLstd450SSign         = 7,
+    GLSLstd450Floor         = 8,
+    GLSLstd450Ceil          = 9,
+    GLSLstd450Fract         = 10,
+    GLSLstd450Radians       = 11,
+    GLSLstd450Degrees       = 12,
+    GLSLstd450Sin           = 13,
+    GLSLstd450Cos           = 14,
+    GLSLstd450Tan           = 15,
+    GLSLstd450Asin          = 16,
+    GLSLstd450Acos          = 17,
+    GLSLstd450Atan          = 18,
+    GLSLstd450Atan2         = 25,
+    GLSLstd450Pow           = 26,
+    GLSLstd450Exp           = 27,
+    GLSLstd450Log           = 28,
+    GLSLstd450Exp2          = 29,
+    GLSLstd450Log2          = 30,
+    GLSLstd450Sqrt          = 31,
+    GLSLstd450InverseSqrt   = 32,
+    GLSLstd450Modf          = 35,
+    GLSLstd450ModfStruct    = 36,
+    GLSLstd450FMin          = 37,
+    GLSLstd450UMin          = 38,
+    GLSLstd450SMin          = 39,
+    GLSLstd450FMax          = 40,
+    GLSLstd450UMax          = 41,
+    GLSLstd450SMax          = 42,
+    GLSLstd450FClamp        = 43,
+    GLSLstd450UClamp        = 44,
+    GLSLstd450SClamp        = 45,
+    GLSLstd450FMix          = 46,
+    GLSLstd450Step          = 48,
+    GLSLstd450SmoothStep    = 49,
+    GLSLstd450Fma           = 50,
+    GLSLstd450Frexp         = 51,
+    GLSLstd450Length        = 66,
+    GLSLstd450Distance      = 67,
+    GLSLstd450Cross         = 68,
+    GLSLstd450Normalize     = 69,
+    GLSLstd450FaceForward   = 70,
+    GLSLstd450Reflect       = 71,
+    GLSLstd450NMin          = 79,
+    GLSLstd450NMax          = 80,
+    GLSLstd450NClamp        = 81,
+};
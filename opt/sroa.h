@@ -0,0 +1,548 @@
+// Scalar replacement of aggregates and promotion of memory to SSA values.
+//
+// Function-scope variables of struct, array or vector type that are only
+// accessed through constant-index access chains and whole loads and stores are
+// split into one variable per member, repeatedly, until the members are no
+// longer aggregates or cannot be split.
+//
+// Variables that are then only loaded and stored directly are promoted: phis go
+// at the iterated dominance frontiers of the stores, where the variable is live
+// in, loads are replaced with the value that reaches them and the variable is
+// deleted.
+
+#define SROA_MAX_MEMBERS 16
+
+struct sroa {
+    struct ir_module *m;
+    u32 split;
+    u32 members;
+    u32 promoted;
+    u32 phis;
+    u32 loads;
+    u32 stores;
+};
+
+static bool
+sroa_is_local(struct ir_module *m, struct ir_inst *inst)
+{
+    return(inst->opcode == SpvOpVariable && inst->ops[0] == SpvStorageClassFunction &&
+           ir_storage_class(m, inst->type) == SpvStorageClassFunction);
+}
+
+static bool
+sroa_is_volatile(struct ir_inst *inst)
+{
+    u32 access = inst->opcode == SpvOpLoad ? 1 : 2;
+    return(inst->nops > access && (inst->ops[access] & SpvMemoryAccessVolatile));
+}
+
+// Number of members a variable of the given type splits into, 0 when it does not split
+static u32
+sroa_members(struct ir_module *m, u32 type)
+{
+    struct ir_inst *def = ir_def(m, type);
+    u32 count = 0;
+
+    if (!def) {
+        return(0);
+    }
+
+    switch (def->opcode) {
+        case SpvOpTypeStruct: {
+            count = def->nops;
+        } break;
+
+        case SpvOpTypeVector: {
+            count = def->ops[1];
+        } break;
+
+        case SpvOpTypeArray: {
+            if (!ir_constant_bits(m, def->ops[1], 0, &count)) {
+                return(0);
+            }
+        } break;
+    }
+
+    return(count <= SROA_MAX_MEMBERS ? count : 0);
+}
+
+// New instruction right before inst, returns it
+static struct ir_inst *
+sroa_emit(struct sroa *s, struct ir_inst *inst, u32 opcode, u32 type, const u32 *ops, u32 nops)
+{
+    struct ir_inst *emitted = ir_new_inst(opcode, type, type ? ir_new_id(s->m) : 0, nops);
+
+    memcpy(emitted->ops, ops, nops * sizeof(u32));
+    emitted->file = inst->file;
+    emitted->line = inst->line;
+
+    ir_insert(inst->block, ir_index_of(inst->block, inst), emitted);
+    ir_register_inst(s->m, emitted);
+
+    return(emitted);
+}
+
+// Whether every use of var is a constant-index access chain or a whole load or
+// store. Variables without access chains are left whole for promotion.
+static bool
+sroa_can_split(struct sroa *s, struct ir_function *func, struct ir_inst *var, u32 count)
+{
+    u32 chains = 0;
+
+    if (var->nops > 1 && ir_def(s->m, var->ops[1])->opcode != SpvOpConstantComposite) {
+        return(false);
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            struct ir_inst *inst = func->blocks[b]->insts[i];
+
+            for (u32 o = 0; o < inst->nops; ++o) {
+                u32 index;
+
+                if (inst->ops[o] != var->id || !ir_operand_is_id(inst, o)) {
+                    continue;
+                }
+
+                switch (inst->opcode) {
+                    case SpvOpAccessChain:
+                    case SpvOpInBoundsAccessChain: {
+                        if (o != 0 || inst->nops < 2 || !ir_is_constant(s->m, inst->ops[1]) ||
+                            !ir_constant_bits(s->m, inst->ops[1], 0, &index) || index >= count) {
+                            return(false);
+                        }
+
+                        chains += 1;
+                    } break;
+
+                    case SpvOpLoad:
+                    case SpvOpStore: {
+                        if (o != 0 || sroa_is_volatile(inst)) {
+                            return(false);
+                        }
+                    } break;
+
+                    default:
+                    return(false);
+                }
+            }
+        }
+    }
+
+    return(chains > 0);
+}
+
+static void
+sroa_split(struct sroa *s, struct ir_function *func, struct ir_inst *var, u32 count)
+{
+    struct ir_module *m = s->m;
+    u32 pointee = ir_pointee_type(m, var->type);
+    struct ir_block *entry = var->block;
+    u32 *members;
+
+    ASSERT(members = malloc(count * sizeof(u32)));
+
+    for (u32 k = 0; k < count; ++k) {
+        u32 type = ir_member_type(m, pointee, k);
+        struct ir_inst *member = ir_new_inst(SpvOpVariable, ir_pointer_type(m, SpvStorageClassFunction, type),
+                                             ir_new_id(m), var->nops);
+
+        member->ops[0] = SpvStorageClassFunction;
+
+        if (var->nops > 1) {
+            member->ops[1] = ir_def(m, var->ops[1])->ops[k];
+        }
+
+        member->file = var->file;
+        member->line = var->line;
+
+        ir_insert(entry, ir_index_of(entry, var) + 1 + k, member);
+        ir_register_inst(m, member);
+        members[k] = member->id;
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        struct ir_block *block = func->blocks[b];
+
+        for (u32 i = 0; i < block->ninsts; ++i) {
+            struct ir_inst *inst = block->insts[i];
+            u32 index;
+
+            if (!inst->nops || inst->ops[0] != var->id || !ir_operand_is_id(inst, 0)) {
+                continue;
+            }
+
+            switch (inst->opcode) {
+                case SpvOpAccessChain:
+                case SpvOpInBoundsAccessChain: {
+                    ir_constant_bits(m, inst->ops[1], 0, &index);
+
+                    if (inst->nops == 2) {
+                        // NOTE: the chain now points at a whole member, the member variable replaces it
+                        ir_replace_uses(m, inst->id, members[index]);
+                        ir_remove(m, block, i);
+                        i -= 1;
+                    } else {
+                        memmove(inst->ops + 1, inst->ops + 2, (inst->nops - 2) * sizeof(u32));
+                        ir_set_nops(inst, inst->nops - 1);
+                        inst->ops[0] = members[index];
+                    }
+                } break;
+
+                case SpvOpLoad: {
+                    u32 *loads;
+
+                    ASSERT(loads = malloc(count * sizeof(u32)));
+
+                    for (u32 k = 0; k < count; ++k) {
+                        u32 type = ir_member_type(m, pointee, k);
+                        loads[k] = sroa_emit(s, inst, SpvOpLoad, type, &members[k], 1)->id;
+                    }
+
+                    inst->opcode = SpvOpCompositeConstruct;
+                    ir_set_nops(inst, count);
+                    memcpy(inst->ops, loads, count * sizeof(u32));
+                    i += count;
+
+                    free(loads);
+                } break;
+
+                case SpvOpStore: {
+                    for (u32 k = 0; k < count; ++k) {
+                        u32 type = ir_member_type(m, pointee, k);
+                        u32 extract[2] = { inst->ops[1], k };
+                        u32 store[2] = { members[k], 0 };
+
+                        store[1] = sroa_emit(s, inst, SpvOpCompositeExtract, type, extract, 2)->id;
+                        sroa_emit(s, inst, SpvOpStore, 0, store, 2);
+                    }
+
+                    ir_remove(m, block, i + 2 * count);
+                    i += 2 * count - 1;
+                } break;
+            }
+        }
+    }
+
+    ir_remove_annotations(m, var->id);
+    ir_remove(m, entry, ir_index_of(entry, var));
+
+    s->split += 1;
+    s->members += count;
+
+    free(members);
+}
+
+// Splits aggregates in func until nothing more splits
+static void
+sroa_split_function(struct sroa *s, struct ir_function *func)
+{
+    bool changed = true;
+
+    while (changed && func->nblocks) {
+        struct ir_block *entry = func->blocks[0];
+
+        changed = false;
+
+        for (u32 i = 0; i < entry->ninsts && !changed; ++i) {
+            struct ir_inst *var = entry->insts[i];
+            u32 count;
+
+            if (!sroa_is_local(s->m, var) || !(count = sroa_members(s->m, ir_pointee_type(s->m, var->type)))) {
+                continue;
+            }
+
+            if (sroa_can_split(s, func, var, count)) {
+                sroa_split(s, func, var, count);
+                changed = true;
+            }
+        }
+    }
+}
+
+static u32
+sroa_resolve(const u32 *replace, u32 nreplace, u32 id)
+{
+    while (id < nreplace && replace[id]) {
+        id = replace[id];
+    }
+
+    return(id);
+}
+
+// Places the phis of variable v, pruned to the blocks where it is live in
+static void
+sroa_place_phis(struct sroa *s, struct cfg *g, struct ir_inst *var, u32 v, u32 nvars, struct ir_inst **phis)
+{
+    struct ir_function *func = g->func;
+    u32 type = ir_pointee_type(s->m, var->type);
+    bool *stores, *live, *queued;
+    u32 *work;
+    u32 nwork = 0;
+
+    ASSERT(stores = calloc(g->nblocks, sizeof(bool)));
+    ASSERT(live = calloc(g->nblocks, sizeof(bool)));
+    ASSERT(queued = calloc(g->nblocks, sizeof(bool)));
+    ASSERT(work = malloc(g->nblocks * sizeof(u32)));
+
+    // Blocks that load before they store have the variable live in
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        struct ir_block *block = func->blocks[b];
+
+        for (u32 i = 0; i < block->ninsts; ++i) {
+            struct ir_inst *inst = block->insts[i];
+
+            if (inst->opcode == SpvOpStore && inst->ops[0] == var->id) {
+                stores[b] = true;
+            } else if (inst->opcode == SpvOpLoad && inst->ops[0] == var->id && !stores[b] && !live[b]) {
+                live[b] = true;
+                work[nwork++] = b;
+            }
+        }
+    }
+
+    while (nwork) {
+        u32 b = work[--nwork];
+
+        for (u32 p = 0; p < g->pred[b].count; ++p) {
+            u32 pred = g->pred[b].items[p];
+
+            if (!stores[pred] && !live[pred]) {
+                live[pred] = true;
+                work[nwork++] = pred;
+            }
+        }
+    }
+
+    for (u32 b = 0; b < g->nblocks; ++b) {
+        if (stores[b] && cfg_reachable(g, b)) {
+            queued[b] = true;
+            work[nwork++] = b;
+        }
+    }
+
+    while (nwork) {
+        u32 b = work[--nwork];
+
+        for (u32 d = 0; d < g->frontier[b].count; ++d) {
+            u32 join = g->frontier[b].items[d];
+
+            if (phis[join * nvars + v] || !live[join]) {
+                continue;
+            }
+
+            struct ir_inst *phi = ir_new_inst(SpvOpPhi, type, ir_new_id(s->m), 0);
+
+            phi->file = var->file;
+            phi->line = var->line;
+
+            ir_insert(func->blocks[join], 0, phi);
+            ir_register_inst(s->m, phi);
+            phis[join * nvars + v] = phi;
+            s->phis += 1;
+
+            if (!queued[join]) {
+                queued[join] = true;
+                work[nwork++] = join;
+            }
+        }
+    }
+
+    free(stores);
+    free(live);
+    free(queued);
+    free(work);
+}
+
+// Replaces the loads and stores of the promoted variables in block b, out holds
+// the value of every variable on entry and is left with the values on exit
+static void
+sroa_rename_block(struct sroa *s, struct ir_block *block, const u32 *var_index, u32 nindex, u32 *out, u32 *replace)
+{
+    for (u32 i = 0; i < block->ninsts; ++i) {
+        struct ir_inst *inst = block->insts[i];
+        u32 v;
+
+        if ((inst->opcode != SpvOpLoad && inst->opcode != SpvOpStore) || inst->ops[0] >= nindex ||
+            !(v = var_index[inst->ops[0]])) {
+            continue;
+        }
+
+        if (inst->opcode == SpvOpLoad) {
+            replace[inst->id] = out[v - 1];
+            ir_remove_annotations(s->m, inst->id);
+            s->loads += 1;
+        } else {
+            out[v - 1] = inst->ops[1];
+            s->stores += 1;
+        }
+
+        ir_remove(s->m, block, i);
+        i -= 1;
+    }
+}
+
+static void
+sroa_promote_function(struct sroa *s, struct ir_function *func)
+{
+    struct ir_module *m = s->m;
+    struct ir_inst **vars;
+    struct ir_inst **phis;
+    u32 *var_index, *out, *replace, *init;
+    u32 nvars = 0;
+    u32 nreplace = m->bound;
+    struct cfg g;
+
+    if (!func->nblocks) {
+        return;
+    }
+
+    struct ir_block *entry = func->blocks[0];
+
+    ASSERT(var_index = calloc(m->bound, sizeof(u32)));
+    ASSERT(vars = malloc(entry->ninsts * sizeof(struct ir_inst *)));
+
+    for (u32 i = 0; i < entry->ninsts; ++i) {
+        if (sroa_is_local(m, entry->insts[i])) {
+            vars[nvars++] = entry->insts[i];
+            var_index[entry->insts[i]->id] = nvars;
+        }
+    }
+
+    // Anything but a plain load or store of the variable itself keeps it in memory
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            struct ir_inst *inst = func->blocks[b]->insts[i];
+
+            for (u32 o = 0; o < inst->nops; ++o) {
+                u32 v = ir_operand_is_id(inst, o) && inst->ops[o] < m->bound ? var_index[inst->ops[o]] : 0;
+
+                if (v && ((inst->opcode != SpvOpLoad && inst->opcode != SpvOpStore) || o != 0 ||
+                          sroa_is_volatile(inst))) {
+                    vars[v - 1] = NULL;
+                }
+            }
+        }
+    }
+
+    u32 kept = 0;
+
+    memset(var_index, 0x00, m->bound * sizeof(u32));
+
+    for (u32 v = 0; v < nvars; ++v) {
+        if (vars[v]) {
+            vars[kept++] = vars[v];
+            var_index[vars[v]->id] = kept;
+        }
+    }
+
+    nvars = kept;
+
+    if (!nvars) {
+        free(var_index);
+        free(vars);
+        return;
+    }
+
+    cfg_build(&g, func);
+    cfg_frontiers(&g);
+
+    ASSERT(phis = calloc((u64) g.nblocks * nvars, sizeof(struct ir_inst *)));
+    ASSERT(out = calloc((u64) g.nblocks * nvars, sizeof(u32)));
+    ASSERT(init = malloc(nvars * sizeof(u32)));
+    ASSERT(replace = calloc(nreplace, sizeof(u32)));
+
+    for (u32 v = 0; v < nvars; ++v) {
+        init[v] = vars[v]->nops > 1 ? vars[v]->ops[1] : ir_undef(m, ir_pointee_type(m, vars[v]->type));
+        sroa_place_phis(s, &g, vars[v], v, nvars, phis);
+    }
+
+    // NOTE: the immediate dominator comes first in reverse postorder, so its values
+    // are final when a block starts. Without a phi, that is the value reaching the block.
+    for (u32 r = 0; r < g.nrpo; ++r) {
+        u32 b = g.rpo[r];
+
+        for (u32 v = 0; v < nvars; ++v) {
+            struct ir_inst *phi = phis[b * nvars + v];
+            out[b * nvars + v] = phi ? phi->id : (r == 0 ? init[v] : out[g.idom[b] * nvars + v]);
+        }
+
+        sroa_rename_block(s, func->blocks[b], var_index, nreplace, out + b * nvars, replace);
+    }
+
+    for (u32 b = 0; b < g.nblocks; ++b) {
+        if (!cfg_reachable(&g, b)) {
+            memcpy(out + b * nvars, init, nvars * sizeof(u32));
+            sroa_rename_block(s, func->blocks[b], var_index, nreplace, out + b * nvars, replace);
+        }
+    }
+
+    for (u32 b = 0; b < g.nblocks; ++b) {
+        for (u32 v = 0; v < nvars; ++v) {
+            struct ir_inst *phi = phis[b * nvars + v];
+
+            if (!phi) {
+                continue;
+            }
+
+            ir_set_nops(phi, 2 * g.pred[b].count);
+
+            for (u32 p = 0; p < g.pred[b].count; ++p) {
+                u32 pred = g.pred[b].items[p];
+
+                phi->ops[2 * p] = out[pred * nvars + v];
+                phi->ops[2 * p + 1] = func->blocks[pred]->label;
+            }
+        }
+    }
+
+    for (u32 b = 0; b < func->nblocks; ++b) {
+        for (u32 i = 0; i < func->blocks[b]->ninsts; ++i) {
+            struct ir_inst *inst = func->blocks[b]->insts[i];
+
+            for (u32 o = 0; o < inst->nops; ++o) {
+                if (ir_operand_is_id(inst, o)) {
+                    inst->ops[o] = sroa_resolve(replace, nreplace, inst->ops[o]);
+                }
+            }
+        }
+    }
+
+    for (u32 v = 0; v < nvars; ++v) {
+        ir_remove_annotations(m, vars[v]->id);
+        ir_remove(m, entry, ir_index_of(entry, vars[v]));
+    }
+
+    s->promoted += nvars;
+
+    cfg_free(&g);
+    free(phis);
+    free(out);
+    free(init);
+    free(replace);
+    free(var_index);
+    free(vars);
+}
+
+static void
+sroa_run(struct ir_module *m, struct sroa *s)
+{
+    memset(s, 0x00, sizeof(struct sroa));
+
+    s->m = m;
+
+    for (u32 f = 0; f < m->nfunctions; ++f) {
+        sroa_split_function(s, m->functions[f]);
+        sroa_promote_function(s, m->functions[f]);
+    }
+
+    ir_remove_dead_code(m);
+}
+
+static void
+sroa_report(struct sroa *s, FILE *out)
+{
+    fprintf(out, "[SROA] %u aggregates split into %u variables, %u variables promoted, "
+            "%u phis, %u loads and %u stores removed\n",
+            s->split, s->members, s->promoted, s->phis, s->loads, s->stores);
+}
@@ -0,0 +1,292 @@
+// Strength reduction of GLSL.std.450 extended instructions and of the
+// arithmetic around them, written as a second rule table for the peephole
+// engine: small constant powers become multiplies, exp2/log2 round trips
+// cancel, division by a constant becomes a multiply by its reciprocal and
+// length/distance comparisons are done on squared values.
+
+static bool
+strength_is_glsl(struct peephole *p, struct ir_inst *inst, u32 op)
+{
+    return(inst->opcode == SpvOpExtInst && inst->ops[0] == p->m->glsl_set && inst->ops[1] == op);
+}
+
+// Defining instruction of id when it is the given GLSL.std.450 instruction
+static struct ir_inst *
+strength_match_glsl(struct peephole *p, u32 id, u32 op)
+{
+    struct ir_inst *def = ir_def(p->m, id);
+    return(def && strength_is_glsl(p, def, op) ? def : NULL);
+}
+
+// Value of a 32-bit float constant whose components are all equal
+static bool
+strength_splat(struct peephole *p, u32 id, f32 *value)
+{
+    union { u32 u; f32 f; } c;
+
+    if (ir_float_width(p->m, peephole_type(p, id)) != 32 || !ir_constant_bits(p->m, id, 0, &c.u)) {
+        return(false);
+    }
+
+    *value = c.f;
+
+    return(peephole_is_bits(p, id, c.u));
+}
+
+static void
+strength_rewrite_glsl(struct peephole *p, struct ir_inst *inst, u32 op, u32 x)
+{
+    u32 ops[3] = { p->m->glsl_set, op, x };
+    peephole_rewrite(p, inst, SpvOpExtInst, ops, 3);
+}
+
+// pow(x, 1) -> x, pow need not be exact
+static bool
+strength_pow_one(struct peephole *p, struct ir_inst *inst)
+{
+    return(strength_is_glsl(p, inst, GLSLstd450Pow) && peephole_is_float(p, inst->ops[3], 1.0f) &&
+           peephole_allowed(p, inst, FP_REASSOC) && peephole_forward(p, inst, inst->ops[2]));
+}
+
+// pow(x, 2) -> x * x, rounds differently
+static bool
+strength_pow_two(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_glsl(p, inst, GLSLstd450Pow) || !peephole_is_float(p, inst->ops[3], 2.0f) ||
+        !peephole_allowed(p, inst, FP_REASSOC)) {
+        return(false);
+    }
+
+    peephole_rewrite2(p, inst, SpvOpFMul, inst->ops[2], inst->ops[2]);
+
+    return(true);
+}
+
+// pow(x, 3) -> (x * x) * x
+static bool
+strength_pow_three(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_glsl(p, inst, GLSLstd450Pow) || !peephole_is_float(p, inst->ops[3], 3.0f) ||
+        !peephole_allowed(p, inst, FP_REASSOC)) {
+        return(false);
+    }
+
+    u32 x = inst->ops[2];
+    u32 square = peephole_emit2(p, inst, SpvOpFMul, inst->type, x, x);
+
+    peephole_rewrite2(p, inst, SpvOpFMul, square, x);
+
+    return(true);
+}
+
+// pow(x, 0.5) -> sqrt(x), differs for -0 and -inf
+static bool
+strength_pow_half(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_glsl(p, inst, GLSLstd450Pow) || !peephole_is_float(p, inst->ops[3], 0.5f) ||
+        !peephole_allowed(p, inst, FP_NSZ | FP_NAN_INF)) {
+        return(false);
+    }
+
+    strength_rewrite_glsl(p, inst, GLSLstd450Sqrt, inst->ops[2]);
+
+    return(true);
+}
+
+// pow(x, -0.5) -> inversesqrt(x)
+static bool
+strength_pow_rsqrt(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_glsl(p, inst, GLSLstd450Pow) || !peephole_is_float(p, inst->ops[3], -0.5f) ||
+        !peephole_allowed(p, inst, FP_NSZ | FP_NAN_INF | FP_REASSOC)) {
+        return(false);
+    }
+
+    strength_rewrite_glsl(p, inst, GLSLstd450InverseSqrt, inst->ops[2]);
+
+    return(true);
+}
+
+// pow(x, -1) -> 1 / x, rounds differently
+static bool
+strength_pow_recip(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_glsl(p, inst, GLSLstd450Pow) || !peephole_is_float(p, inst->ops[3], -1.0f) ||
+        !peephole_allowed(p, inst, FP_REASSOC)) {
+        return(false);
+    }
+
+    peephole_rewrite2(p, inst, SpvOpFDiv, ir_float_constant(p->m, inst->type, 1.0f), inst->ops[2]);
+
+    return(true);
+}
+
+// exp2(log2(x)) -> x and log2(exp2(x)) -> x
+static bool
+strength_exp2_log2(struct peephole *p, struct ir_inst *inst)
+{
+    u32 relax = FP_NAN_INF | FP_REASSOC;
+    struct ir_inst *inner = NULL;
+
+    if (strength_is_glsl(p, inst, GLSLstd450Exp2)) {
+        inner = strength_match_glsl(p, inst->ops[2], GLSLstd450Log2);
+    } else if (strength_is_glsl(p, inst, GLSLstd450Log2)) {
+        inner = strength_match_glsl(p, inst->ops[2], GLSLstd450Exp2);
+    }
+
+    return(inner && peephole_allowed(p, inst, relax) && peephole_allowed(p, inner, relax) &&
+           peephole_forward(p, inst, inner->ops[2]));
+}
+
+// exp2(a) * exp2(b) -> exp2(a + b)
+static bool
+strength_exp2_product(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *a = strength_match_glsl(p, inst->ops[0], GLSLstd450Exp2);
+    struct ir_inst *b = strength_match_glsl(p, inst->ops[1], GLSLstd450Exp2);
+    u32 relax = FP_NAN_INF | FP_REASSOC;
+
+    // NOTE: only worth it when both exponentials go away
+    if (!a || !b || p->uses[a->id] != 1 || p->uses[b->id] != 1 || !peephole_allowed(p, inst, relax) ||
+        !peephole_allowed(p, a, relax) || !peephole_allowed(p, b, relax)) {
+        return(false);
+    }
+
+    u32 sum = peephole_emit2(p, inst, SpvOpFAdd, inst->type, a->ops[2], b->ops[2]);
+
+    strength_rewrite_glsl(p, inst, GLSLstd450Exp2, sum);
+
+    return(true);
+}
+
+// x / c -> x * (1 / c). Exact when c is a power of two with a normal reciprocal.
+static bool
+strength_fdiv_const(struct peephole *p, struct ir_inst *inst)
+{
+    f32 c;
+
+    if (!strength_splat(p, inst->ops[1], &c) || c == 0.0f || !isfinite(c)) {
+        return(false);
+    }
+
+    s32 exponent;
+    f32 recip = 1.0f / c;
+    bool exact = (fabsf(frexpf(c, &exponent)) == 0.5f && fpclassify(recip) == FP_NORMAL);
+
+    if (!isfinite(recip) || (!exact && !peephole_allowed(p, inst, FP_RECIP))) {
+        return(false);
+    }
+
+    peephole_rewrite2(p, inst, SpvOpFMul, inst->ops[0], ir_float_constant(p->m, inst->type, recip));
+
+    return(true);
+}
+
+// normalize(normalize(x)) -> normalize(x)
+static bool
+strength_normalize(struct peephole *p, struct ir_inst *inst)
+{
+    struct ir_inst *inner = strength_match_glsl(p, inst->ops[2], GLSLstd450Normalize);
+
+    return(strength_is_glsl(p, inst, GLSLstd450Normalize) && inner && peephole_allowed(p, inst, FP_REASSOC) &&
+           peephole_forward(p, inst, inner->id));
+}
+
+static bool
+strength_is_ordering(u32 opcode)
+{
+    return(opcode >= SpvOpFOrdLessThan && opcode <= SpvOpFUnordGreaterThanEqual);
+}
+
+// Squared form of one side of a comparison, 0 when that side does not allow it.
+// With emit false nothing is created, the call only checks.
+static u32
+strength_square(struct peephole *p, struct ir_inst *compare, u32 id, bool emit)
+{
+    u32 relax = FP_NAN_INF | FP_REASSOC;
+    struct ir_inst *def = ir_def(p->m, id);
+    f32 r;
+
+    if (strength_splat(p, id, &r)) {
+        if (r < 0.0f || !isfinite(r * r)) {
+            return(0);
+        }
+
+        return(emit ? ir_float_constant(p->m, def->type, r * r) : id);
+    }
+
+    if (!def || def->opcode != SpvOpExtInst || def->ops[0] != p->m->glsl_set || !peephole_allowed(p, def, relax)) {
+        return(0);
+    }
+
+    u32 v;
+
+    switch (def->ops[1]) {
+        case GLSLstd450Length: {
+            v = def->ops[2];
+        } break;
+
+        case GLSLstd450Distance: {
+            v = emit ? peephole_emit2(p, compare, SpvOpFSub, peephole_type(p, def->ops[2]), def->ops[2], def->ops[3]) : id;
+        } break;
+
+        default:
+        return(0);
+    }
+
+    if (!emit) {
+        return(id);
+    }
+
+    if (ir_is_vector_type(p->m, peephole_type(p, v))) {
+        return(peephole_emit2(p, compare, SpvOpDot, def->type, v, v));
+    }
+
+    return(peephole_emit2(p, compare, SpvOpFMul, def->type, v, v));
+}
+
+// length(x) < r -> dot(x, x) < r * r, likewise for distance() and the other orderings
+static bool
+strength_length_compare(struct peephole *p, struct ir_inst *inst)
+{
+    if (!strength_is_ordering(inst->opcode) || !peephole_allowed(p, inst, FP_NAN_INF | FP_REASSOC)) {
+        return(false);
+    }
+
+    u32 a = inst->ops[0];
+    u32 b = inst->ops[1];
+
+    if (!strength_square(p, inst, a, false) || !strength_square(p, inst, b, false) ||
+        (ir_is_constant(p->m, a) && ir_is_constant(p->m, b))) {
+        return(false);
+    }
+
+    a = strength_square(p, inst, a, true);
+    b = strength_square(p, inst, b, true);
+
+    peephole_rewrite2(p, inst, inst->opcode, a, b);
+
+    return(true);
+}
+
+static const struct peephole_rule strength_rules[] = {
+    { "pow-one",         SpvOpExtInst, strength_pow_one },
+    { "pow-two",         SpvOpExtInst, strength_pow_two },
+    { "pow-three",       SpvOpExtInst, strength_pow_three },
+    { "pow-half",        SpvOpExtInst, strength_pow_half },
+    { "pow-rsqrt",       SpvOpExtInst, strength_pow_rsqrt },
+    { "pow-recip",       SpvOpExtInst, strength_pow_recip },
+    { "exp2-log2",       SpvOpExtInst, strength_exp2_log2 },
+    { "normalize-twice", SpvOpExtInst, strength_normalize },
+    { "exp2-product",    SpvOpFMul,    strength_exp2_product },
+    { "fdiv-const",      SpvOpFDiv,    strength_fdiv_const },
+    { "length-compare",  SpvOpNop,     strength_length_compare },
+};
+
+#define STRENGTH_NRULES (sizeof(strength_rules) / sizeof(strength_rules[0]))
+
+static void
+strength_init(struct ir_module *m, u32 relax, struct peephole *p)
+{
+    peephole_init_rules(m, relax, "STRENGTH", strength_rules, STRENGTH_NRULES, p);
+}
@@ -0,0 +1,165 @@
+// Frame pacing against absolute deadlines. Every frame has a deadline one
+// period after the previous one, the pacer sleeps with clock_nanosleep until
+// shortly before it and spins the rest, so oversleeping by the scheduler does
+// not add up over frames. A frame that misses its deadline starts a new
+// schedule from now instead of rushing to catch up.
+//
+// Frame times, from one pacer_wait to the next, go into a ring of samples for
+// percentiles and jitter.
+
+#define PACER_SPIN_NSEC 200000ull
+#define PACER_SAMPLES 4096
+#define NSEC_PER_SEC 1000000000ull
+
+// How the swapchain presents, independent of the CPU pacing
+enum present_policy {
+    PRESENT_FIFO,       // vsync, never tears
+    PRESENT_MAILBOX,    // newest frame at vsync, never tears, lowest latency
+    PRESENT_IMMEDIATE,  // no vsync, tears
+};
+
+struct frame_pacer {
+    u64 period;    // in ns, 0 paces nothing
+    u64 deadline;
+    u64 last;
+    u64 frames;
+    u64 missed;
+    f64 samples[PACER_SAMPLES];  // frame times in ms
+    u32 nsamples;
+    u32 next;
+};
+
+static u64
+pacer_now(void)
+{
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return((u64) now.tv_sec * NSEC_PER_SEC + (u64) now.tv_nsec);
+}
+
+// Uncapped for a framerate of 0
+static void
+pacer_init(struct frame_pacer *p, u32 framerate)
+{
+    memset(p, 0x00, sizeof(struct frame_pacer));
+    
+    p->period = framerate ? NSEC_PER_SEC / framerate : 0;
+    p->last = pacer_now();
+    p->deadline = p->last;
+}
+
+static void
+pacer_sleep_until(u64 deadline)
+{
+    struct timespec until;
+    
+    until.tv_sec = deadline / NSEC_PER_SEC;
+    until.tv_nsec = deadline % NSEC_PER_SEC;
+    
+    // NOTE: an absolute deadline survives being interrupted, just sleep again
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR);
+}
+
+// Ends a frame, returns once the next one may start
+static void
+pacer_wait(struct frame_pacer *p)
+{
+    u64 now;
+    
+    if (p->period) {
+        p->deadline += p->period;
+        now = pacer_now();
+        
+        if (now >= p->deadline) {
+            p->deadline = now;
+            p->missed += 1;
+        } else {
+            if (p->deadline - now > PACER_SPIN_NSEC) {
+                pacer_sleep_until(p->deadline - PACER_SPIN_NSEC);
+            }
+            
+            while (pacer_now() < p->deadline);
+        }
+    }
+    
+    now = pacer_now();
+    
+    p->samples[p->next] = (f64) (now - p->last) / 1000000.0;
+    p->next = (p->next + 1) % PACER_SAMPLES;
+    p->nsamples += p->nsamples < PACER_SAMPLES;
+    p->frames += 1;
+    p->last = now;
+}
+
+static f64
+pacer_mean(struct frame_pacer *p)
+{
+    f64 sum = 0.0;
+    
+    for (u32 i = 0; i < p->nsamples; ++i) {
+        sum += p->samples[i];
+    }
+    
+    return(p->nsamples ? sum / p->nsamples : 0.0);
+}
+
+static s32
+pacer_compare(const void *a, const void *b)
+{
+    f64 x = *(const f64 *) a;
+    f64 y = *(const f64 *) b;
+    
+    return((x > y) - (x < y));
+}
+
+// Nearest rank, the smallest sample at or above percent of all samples: sorted[ceil(percent * count) - 1]
+static f64
+pacer_percentile(const f64 *sorted, u32 count, f64 percent)
+{
+    f64 exact = percent * count / 100.0;
+    u32 rank = (u32) exact;
+    
+    if (rank < exact) {
+        rank += 1;
+    }
+    
+    return(sorted[rank ? (rank < count ? rank - 1 : count - 1) : 0]);
+}
+
+// Over the last PACER_SAMPLES frames. Jitter is the mean difference between consecutive frame times.
+static void
+pacer_report(struct frame_pacer *p, FILE *out)
+{
+    f64 sorted[PACER_SAMPLES];
+    f64 mean = 0.0, jitter = 0.0;
+    u32 first = (p->next + PACER_SAMPLES - p->nsamples) % PACER_SAMPLES;
+    
+    if (!p->nsamples) {
+        return;
+    }
+    
+    for (u32 i = 0; i < p->nsamples; ++i) {
+        f64 t = p->samples[(first + i) % PACER_SAMPLES];
+        
+        sorted[i] = t;
+        mean += t;
+        
+        if (i) {
+            f64 d = t - p->samples[(first + i - 1) % PACER_SAMPLES];
+            jitter += d < 0.0 ? -d : d;
+        }
+    }
+    
+    mean /= p->nsamples;
+    jitter /= p->nsamples > 1 ? p->nsamples - 1 : 1;
+    
+    qsort(sorted, p->nsamples, sizeof(f64), pacer_compare);
+    
+    fprintf(out, "[PACE] %llu frames, %.1f fps, frame time mean %.3f ms, p50 %.3f ms, p95 %.3f ms, p99 %.3f ms, max %.3f ms, jitter %.3f ms, %llu missed\n",
+            (unsigned long long) p->frames, 1000.0 / mean, mean,
+            pacer_percentile(sorted, p->nsamples, 50.0), pacer_percentile(sorted, p->nsamples, 95.0),
+            pacer_percentile(sorted, p->nsamples, 99.0), sorted[p->nsamples - 1], jitter,
+            (unsigned long long) p->missed);
+}
@@ -0,0 +1,293 @@
+// Multithreaded command recording. The draw list is split into one slice per
+// worker, every worker owns a command pool and records its slice into
+// secondary command buffers, one per frame in flight and swapchain image, so
+// no two threads ever touch the same pool. The primaries only begin the
+// render pass and execute the secondaries, which is left to the main thread.
+//
+// The workers live as long as the renderer and wait for the next pass, a pass
+// is started by bumping the generation and done once every worker checked in.
+// A pass records every frame and image, or only the ones a frame is about to
+// submit.
+
+#define MAX_RECORD_THREADS 64
+#define RECORD_ALL UINT32_MAX
+
+struct record_jobs;
+
+struct record_worker {
+    struct record_jobs *jobs;
+    pthread_t thread;
+    VkCommandPool pool;
+    VkCommandBuffer *secondaries;  // per frame in flight and swapchain image
+    u32 first;                     // slice of the draw list
+    u32 count;
+    f64 msec;                      // of the last pass
+};
+
+struct record_jobs {
+    u32 threads;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    u32 generation;
+    u32 running;
+    u32 image;                     // of the pass, RECORD_ALL for every frame and image
+    u32 frame;
+    bool quit;
+    struct record_worker *workers;
+};
+
+static struct record_jobs record_jobs;
+
+static u32
+draw_count()
+{
+    if (!data.instances) {
+        return(1);
+    }
+    
+    return(data.draw_batch ? (data.instances + data.draw_batch - 1) / data.draw_batch : 1);
+}
+
+// Binds everything the draws need and records draws [first, first + count) of the draw list
+static void
+record_draws(VkCommandBuffer cmd, u32 frame, u32 first, u32 count)
+{
+    const VkBuffer buffers[2] = { data.vertex.buf, data.per_instance.buf };
+    const VkDeviceSize offsets[2] = { 0, frame * data.per_instance.stride };
+    const u32 uniform_offset = (u32) (frame * data.uniform.stride);
+    u32 batch = data.draw_batch ? data.draw_batch : data.instances;
+    VkViewport viewport;
+    VkRect2D scissor;
+    
+    viewport.height   = (f32) data.height;
+    viewport.width    = (f32) data.width;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    viewport.x        = 0;
+    viewport.y        = 0;
+    
+    scissor.extent.width  = data.width;
+    scissor.extent.height = data.height;
+    scissor.offset.x      = 0;
+    scissor.offset.y      = 0;
+    
+    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, data.pipeline);
+    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, data.pipeline_layout, 0, NUM_DESCRIPTOR_SETS, data.descriptor_set, 1, &uniform_offset);
+    vkCmdBindVertexBuffers(cmd, 0, data.instances ? 2 : 1, buffers, offsets);
+    vkCmdSetViewport(cmd, 0, NUM_VIEWPORTS, &viewport);
+    vkCmdSetScissor(cmd, 0, NUM_SCISSORS, &scissor);
+    
+    for (u32 d = first; d < first + count; ++d) {
+        if (data.instances) {
+            u32 beg = d * batch;
+            
+            vkCmdDraw(cmd, 12 * 3, data.instances - beg < batch ? data.instances - beg : batch, 0, beg);
+        } else {
+            vkCmdDraw(cmd, 12 * 3, 1, 0, 0);
+        }
+    }
+}
+
+static void
+record_secondary(VkCommandBuffer cmd, u32 image, u32 frame, u32 first, u32 count)
+{
+    VkCommandBufferInheritanceInfo inheritance;
+    VkCommandBufferBeginInfo begin;
+    
+    inheritance.sType                = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    inheritance.pNext                = NULL;
+    inheritance.renderPass           = data.render_pass;
+    inheritance.subpass              = 0;
+    inheritance.framebuffer          = data.framebuffers[image];
+    inheritance.occlusionQueryEnable = VK_FALSE;
+    inheritance.queryFlags           = 0;
+    inheritance.pipelineStatistics   = 0;
+    
+    begin.sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin.pNext            = NULL;
+    begin.flags            = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin.pInheritanceInfo = &inheritance;
+    
+    ASSERT_VK(vkBeginCommandBuffer(cmd, &begin));
+    record_draws(cmd, frame, first, count);
+    ASSERT_VK(vkEndCommandBuffer(cmd));
+}
+
+static void *
+record_worker(void *arg)
+{
+    struct record_worker *w = arg;
+    struct record_jobs *jobs = w->jobs;
+    u32 seen = 0;
+    
+    while (true) {
+        pthread_mutex_lock(&jobs->mutex);
+        
+        while (jobs->generation == seen && !jobs->quit) {
+            pthread_cond_wait(&jobs->start, &jobs->mutex);
+        }
+        
+        seen = jobs->generation;
+        
+        if (jobs->quit) {
+            pthread_mutex_unlock(&jobs->mutex);
+            break;
+        }
+        
+        u32 image = jobs->image;
+        u32 frame = jobs->frame;
+        
+        pthread_mutex_unlock(&jobs->mutex);
+        
+        u64 beg = pacer_now();
+        
+        if (image == RECORD_ALL) {
+            for (u32 f = 0; f < data.frames_in_flight; ++f) {
+                for (u32 i = 0; i < data.swapchain_image_count; ++i) {
+                    record_secondary(w->secondaries[f * data.swapchain_image_count + i], i, f, w->first, w->count);
+                }
+            }
+        } else {
+            record_secondary(w->secondaries[frame * data.swapchain_image_count + image], image, frame, w->first, w->count);
+        }
+        
+        w->msec = (f64) (pacer_now() - beg) / 1000000.0;
+        
+        pthread_mutex_lock(&jobs->mutex);
+        
+        if (--jobs->running == 0) {
+            pthread_cond_signal(&jobs->done);
+        }
+        
+        pthread_mutex_unlock(&jobs->mutex);
+    }
+    
+    return(NULL);
+}
+
+// Needs the swapchain images and frames in flight, the draw list is split evenly
+static void
+record_jobs_init(u32 threads)
+{
+    struct record_jobs *jobs = &record_jobs;
+    VkCommandPoolCreateInfo pool_info;
+    VkCommandBufferAllocateInfo cmd;
+    u32 draws = draw_count();
+    
+    memset(jobs, 0x00, sizeof(struct record_jobs));
+    
+    // NOTE: more threads than draws would record empty secondaries
+    jobs->threads = threads < draws ? threads : draws;
+    
+    pthread_mutex_init(&jobs->mutex, NULL);
+    pthread_cond_init(&jobs->start, NULL);
+    pthread_cond_init(&jobs->done, NULL);
+    
+    ASSERT(jobs->workers = calloc(jobs->threads, sizeof(struct record_worker)));
+    
+    pool_info.sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.pNext            = NULL;
+    pool_info.queueFamilyIndex = data.graphics_queue_family_index;
+    pool_info.flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    
+    cmd.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd.pNext              = NULL;
+    cmd.level              = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+    cmd.commandBufferCount = data.frames_in_flight * data.swapchain_image_count;
+    
+    for (u32 t = 0; t < jobs->threads; ++t) {
+        struct record_worker *w = &jobs->workers[t];
+        
+        w->jobs = jobs;
+        w->first = (u32) ((u64) draws * t / jobs->threads);
+        w->count = (u32) ((u64) draws * (t + 1) / jobs->threads) - w->first;
+        
+        ASSERT_VK(vkCreateCommandPool(data.device, &pool_info, NULL, &w->pool));
+        
+        cmd.commandPool = w->pool;
+        
+        ASSERT(w->secondaries = malloc(cmd.commandBufferCount * sizeof(VkCommandBuffer)));
+        ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, w->secondaries));
+        ASSERT(!pthread_create(&w->thread, NULL, record_worker, w));
+    }
+    
+    printf("[RECORD] %u draws on %u threads\n", draws, jobs->threads);
+}
+
+// Returns once every worker recorded its secondaries for the image and frame, or all of them with RECORD_ALL
+static void
+record_jobs_run(u32 image, u32 frame)
+{
+    struct record_jobs *jobs = &record_jobs;
+    
+    pthread_mutex_lock(&jobs->mutex);
+    
+    jobs->image = image;
+    jobs->frame = frame;
+    jobs->running = jobs->threads;
+    jobs->generation += 1;
+    pthread_cond_broadcast(&jobs->start);
+    
+    while (jobs->running) {
+        pthread_cond_wait(&jobs->done, &jobs->mutex);
+    }
+    
+    pthread_mutex_unlock(&jobs->mutex);
+}
+
+// The secondaries every primary for this frame and image executes, one per worker
+static u32
+record_jobs_secondaries(u32 image, u32 frame, VkCommandBuffer *secondaries)
+{
+    for (u32 t = 0; t < record_jobs.threads; ++t) {
+        secondaries[t] = record_jobs.workers[t].secondaries[frame * data.swapchain_image_count + image];
+    }
+    
+    return(record_jobs.threads);
+}
+
+static void
+record_jobs_report(FILE *out)
+{
+    if (record_jobs.threads) {
+        fprintf(out, "[RECORD] last pass per thread\n");
+    }
+    
+    for (u32 t = 0; t < record_jobs.threads; ++t) {
+        struct record_worker *w = &record_jobs.workers[t];
+        
+        fprintf(out, "    thread %2u: %u draws, %.3f ms\n", t, w->count, w->msec);
+    }
+}
+
+static void
+record_jobs_free()
+{
+    struct record_jobs *jobs = &record_jobs;
+    
+    if (!jobs->threads) {
+        return;
+    }
+    
+    pthread_mutex_lock(&jobs->mutex);
+    jobs->quit = true;
+    pthread_cond_broadcast(&jobs->start);
+    pthread_mutex_unlock(&jobs->mutex);
+    
+    for (u32 t = 0; t < jobs->threads; ++t) {
+        struct record_worker *w = &jobs->workers[t];
+        
+        pthread_join(w->thread, NULL);
+        vkFreeCommandBuffers(data.device, w->pool, data.frames_in_flight * data.swapchain_image_count, w->secondaries);
+        vkDestroyCommandPool(data.device, w->pool, NULL);
+        free(w->secondaries);
+    }
+    
+    pthread_mutex_destroy(&jobs->mutex);
+    pthread_cond_destroy(&jobs->start);
+    pthread_cond_destroy(&jobs->done);
+    free(jobs->workers);
+    
+    memset(jobs, 0x00, sizeof(struct record_jobs));
+}
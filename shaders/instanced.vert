@@ -0,0 +1,18 @@
+#version 400
+
+#extension GL_ARB_separate_shader_objects : enable
+#extension GL_ARB_shading_language_420pack : enable
+
+layout (std140, binding = 0) uniform bufferVals {
+    mat4 mvp;
+} myBufferVals;
+layout (location = 0) in vec4 pos;
+layout (location = 1) in vec4 inColor;
+layout (location = 2) in mat4 instanceModel;
+layout (location = 6) in vec4 instanceColor;
+layout (location = 0) out vec4 outColor;
+
+void main() {
+    outColor = inColor * instanceColor;
+    gl_Position = myBufferVals.mvp * (instanceModel * pos);
+}
\ No newline at end of file
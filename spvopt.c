@@ -0,0 +1,405 @@
+#include "common.h"
+
+#include <math.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "opt/spirv.h"
+#include "opt/ir.h"
+#include "opt/interp.h"
+#include "opt/profile.h"
+#include "opt/fpmode.h"
+#include "opt/peephole.h"
+#include "opt/strength.h"
+#include "opt/precision.h"
+#include "opt/cfg.h"
+#include "opt/liveness.h"
+#include "opt/licm.h"
+#include "opt/pressure.h"
+#include "opt/sroa.h"
+#include "opt/simplify.h"
+#include "opt/composite.h"
+#include "opt/dedup.h"
+#include "opt/pipeline.h"
+#include "opt/parallel.h"
+#include "opt/sha256.h"
+#include "opt/cache.h"
+
+#define DEFAULT_GRID_WIDTH 800
+#define DEFAULT_GRID_HEIGHT 600
+
+struct options {
+    const char *input;
+    const char *output;
+    const char *folded;
+    bool profile;
+    struct pipeline_options passes;
+    bool pressure;
+    u32 max_pressure;
+    bool check_layout;
+    const char *cache;
+    u64 cache_size;
+    u32 threads;
+    u32 grid_width;
+    u32 grid_height;
+};
+
+static void
+usage(void)
+{
+    printf("usage: spvopt [options] input.spv\n"
+           "    -o <file>         write the resulting module\n"
+           "    --profile         execute the module on the CPU and count dynamic instructions\n"
+           "    --grid <W>x<H>    invocation grid for --profile (default %dx%d)\n"
+           "    --folded <file>   write the profile as folded stacks for flame graphs\n"
+           "    -O                run every optimization pass\n"
+           "    --first-tier      only the single-sweep passes the viewer runs first on a reload\n"
+           "    --sroa            split local aggregates and promote local variables to SSA values\n"
+           "    --simplify        fold constant branches, merge blocks and flatten small selections\n"
+           "    --select-cost <n> most instructions a selection may execute unconditionally (default %d)\n"
+           "    --composite       collapse composite, extract and shuffle chains\n"
+           "    --peephole        algebraic simplification and multiply-add fusion\n"
+           "    --strength        cheaper forms of pow, exp2/log2, division by constants and length compares\n"
+           "    --licm            hoist loop-invariant instructions, logging every hoist\n"
+           "    --licm-pressure <n> register budget (scalars) that stops hoisting (default %d)\n"
+           "    --precision       relax color and normalized-vector chains to fp16\n"
+           "    --fp16            rewrite relaxed chains to Float16 when the module declares the capability\n"
+           "    --no-fma          never fuse multiply-add pairs into Fma\n"
+           "    --dedup           merge duplicate types and constants, remove unused globals and annotations\n"
+           "    --strict-ieee     only rewrites that keep IEEE results bit for bit\n"
+           "    --stats           print what every pass did\n"
+           "    --pressure        report live registers per entry point after optimizing\n"
+           "    --max-pressure <n> fail when an entry point needs more than n live scalar registers\n"
+           "    --check-layout    fail when the result breaks the logical layout of a module\n"
+           "    --cache <dir>     reuse optimized modules from a content-addressed cache directory\n"
+           "    --cache-size <n>  cache capacity in MiB, least recently used entries go first (default %llu)\n"
+           "    --threads <n>     optimize functions on n threads, 0 for every core (default 1)\n",
+           DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT, SIMPLIFY_DEFAULT_COST, LICM_DEFAULT_PRESSURE,
+           (unsigned long long) (CACHE_DEFAULT_CAPACITY >> 20));
+}
+
+static bool
+parse_options(s32 argc, char **argv, struct options *opts)
+{
+    opts->grid_width  = DEFAULT_GRID_WIDTH;
+    opts->grid_height = DEFAULT_GRID_HEIGHT;
+    opts->threads = 1;
+
+    pipeline_defaults(&opts->passes);
+
+    for (s32 i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(arg, "-o") && has_value) {
+            opts->output = argv[++i];
+        } else if (!strcmp(arg, "--profile")) {
+            opts->profile = true;
+        } else if (!strcmp(arg, "--grid") && has_value) {
+            if (sscanf(argv[++i], "%ux%u", &opts->grid_width, &opts->grid_height) != 2) {
+                return(false);
+            }
+        } else if (!strcmp(arg, "--folded") && has_value) {
+            opts->folded = argv[++i];
+            opts->profile = true;
+        } else if (!strcmp(arg, "-O")) {
+            pipeline_enable_all(&opts->passes);
+        } else if (!strcmp(arg, "--first-tier")) {
+            pipeline_enable_cheap(&opts->passes);
+        } else if (!strcmp(arg, "--sroa")) {
+            opts->passes.sroa = true;
+        } else if (!strcmp(arg, "--simplify")) {
+            opts->passes.simplify = true;
+        } else if (!strcmp(arg, "--select-cost") && has_value) {
+            opts->passes.simplify = true;
+            opts->passes.select_cost = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--composite")) {
+            opts->passes.composite = true;
+        } else if (!strcmp(arg, "--peephole")) {
+            opts->passes.peephole = true;
+        } else if (!strcmp(arg, "--strength")) {
+            opts->passes.strength = true;
+        } else if (!strcmp(arg, "--licm")) {
+            opts->passes.licm = true;
+        } else if (!strcmp(arg, "--licm-pressure") && has_value) {
+            opts->passes.licm = true;
+            opts->passes.licm_pressure = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--precision")) {
+            opts->passes.precision = true;
+        } else if (!strcmp(arg, "--fp16")) {
+            opts->passes.precision = true;
+            opts->passes.half = true;
+        } else if (!strcmp(arg, "--dedup")) {
+            opts->passes.dedup = true;
+        } else if (!strcmp(arg, "--strict-ieee")) {
+            opts->passes.strict = true;
+        } else if (!strcmp(arg, "--no-fma")) {
+            opts->passes.fma = false;
+        } else if (!strcmp(arg, "--stats")) {
+            opts->passes.stats = true;
+        } else if (!strcmp(arg, "--pressure")) {
+            opts->pressure = true;
+        } else if (!strcmp(arg, "--max-pressure") && has_value) {
+            opts->pressure = true;
+            opts->max_pressure = atoi(argv[++i]);
+        } else if (!strcmp(arg, "--check-layout")) {
+            opts->check_layout = true;
+        } else if (!strcmp(arg, "--cache") && has_value) {
+            opts->cache = argv[++i];
+        } else if (!strcmp(arg, "--cache-size") && has_value) {
+            opts->cache_size = (u64) atoi(argv[++i]) << 20;
+        } else if (!strcmp(arg, "--threads") && has_value) {
+            opts->threads = atoi(argv[++i]);
+        } else if (arg[0] != '-' && !opts->input) {
+            opts->input = arg;
+        } else {
+            return(false);
+        }
+    }
+
+    return(opts->input != NULL);
+}
+
+// Function frames of a calling context, outermost caller first
+static void
+profile_write_frames(struct ir_module *m, struct interp *it, u32 context, FILE *out)
+{
+    struct interp_context *c = &it->contexts[context];
+    const char *fname = ir_name(m, c->func->def->id);
+
+    if (c->parent != INTERP_NONE) {
+        profile_write_frames(m, it, c->parent, out);
+    }
+
+    fprintf(out, ";%s", fname ? fname : "?");
+}
+
+// Folded stacks ("frame;frame;frame count" per line), the input format of flamegraph.pl and speedscope.
+// A stack runs from the root through every caller down to the block and the source line.
+static void
+profile_write_folded(struct ir_module *m, struct interp *it, const char *root, FILE *out)
+{
+    for (u32 c = 0; c < it->ncontexts; ++c) {
+        struct ir_function *func = it->contexts[c].func;
+
+        for (u32 b = 0; b < func->nblocks; ++b) {
+            struct ir_block *block = func->blocks[b];
+            u64 count = it->contexts[c].counts[b];
+
+            if (!count) {
+                continue;
+            }
+
+            for (u32 i = 0; i < block->ninsts; ++i) {
+                struct ir_inst *inst = block->insts[i];
+                u32 repeats = 0;
+                bool seen = false;
+
+                // NOTE: one line per distinct stack, repeated opcodes on the same line are summed
+                for (u32 j = 0; j < block->ninsts; ++j) {
+                    struct ir_inst *other = block->insts[j];
+
+                    if (other->opcode == inst->opcode && other->line == inst->line && other->file == inst->file) {
+                        seen |= (j < i);
+                        repeats += 1;
+                    }
+                }
+
+                if (seen) {
+                    continue;
+                }
+
+                fprintf(out, "%s", root);
+                profile_write_frames(m, it, c, out);
+                fprintf(out, ";%%%d", block->label);
+
+                if (inst->line) {
+                    fprintf(out, ";%s:%d", profile_file_name(m, inst->file), inst->line);
+                }
+
+                fprintf(out, ";%s %" PRIu64 "\n", spv_op_name(inst->opcode), count * repeats);
+            }
+        }
+    }
+}
+
+static bool
+profile_module(struct ir_module *m, struct options *opts, const char *root)
+{
+    struct interp it;
+    struct profile p;
+
+    if (!profile_run(m, opts->grid_width, opts->grid_height, NULL, 0, &it, &p)) {
+        interp_free(&it);
+        return(false);
+    }
+
+    profile_report(m, &it, &p, stdout);
+
+    if (opts->folded) {
+        FILE *file = fopen(opts->folded, "w");
+
+        if (!file) {
+            printf("[ERROR] Could not open %s\n", opts->folded);
+            interp_free(&it);
+            return(false);
+        }
+
+        profile_write_folded(m, &it, root, file);
+        fclose(file);
+    }
+
+    interp_free(&it);
+
+    return(true);
+}
+
+// Whether the globals are in layout order and glsl_set names the GLSL.std.450 import, what is wrong goes to out
+static bool
+check_layout(struct ir_module *m, FILE *out)
+{
+    u32 glsl = 0;
+
+    for (u32 i = 0; i < m->nglobals; ++i) {
+        struct ir_inst *inst = m->globals[i];
+
+        if (i && ir_layout_section(inst->opcode) < ir_layout_section(m->globals[i - 1]->opcode)) {
+            fprintf(out, "[LAYOUT] %s after %s at global %u\n", spv_op_name(inst->opcode),
+                    spv_op_name(m->globals[i - 1]->opcode), i);
+            return(false);
+        }
+
+        if (inst->opcode == SpvOpExtInstImport && !strcmp((const char *) inst->ops, "GLSL.std.450")) {
+            glsl = inst->id;
+        }
+    }
+
+    if (glsl != m->glsl_set) {
+        fprintf(out, "[LAYOUT] GLSL.std.450 import is %%%u, the module says %%%u\n", glsl, m->glsl_set);
+        return(false);
+    }
+
+    return(true);
+}
+
+// Functions go to the thread pool unless a single thread was asked for
+static void
+optimize_module(struct ir_module *m, struct options *opts)
+{
+    struct parallel p;
+
+    if (opts->threads == 1) {
+        pipeline_run(m, &opts->passes, stdout);
+        return;
+    }
+
+    parallel_init(&p, opts->threads);
+    parallel_run(&p, m, &opts->passes, stdout);
+
+    if (opts->passes.stats) {
+        parallel_report(&p, stdout);
+    }
+
+    parallel_free(&p);
+}
+
+s32
+main(s32 argc, char **argv)
+{
+    struct options opts = { 0 };
+    struct shader_cache cache;
+    struct cache_entry entry = { 0 };
+    struct cache_key key;
+    struct ir_module m;
+    u32 *words;
+    u32 size;
+
+    if (!parse_options(argc, argv, &opts)) {
+        usage();
+        return(1);
+    }
+
+    if (!(words = get_binary(opts.input, &size))) {
+        return(1);
+    }
+
+    if (opts.cache) {
+        if (!cache_init(&cache, opts.cache, opts.cache_size)) {
+            return(1);
+        }
+
+        cache_key(words, size, &opts.passes, &key);
+        cache_lookup(&cache, &key, &entry);
+    }
+
+    // NOTE: on a hit the module is already optimized
+    if (!ir_parse(entry.map ? entry.words : words, entry.map ? entry.size : size, &m)) {
+        return(1);
+    }
+
+    free(words);
+
+    if (entry.map) {
+        cache_release(&entry);
+    } else {
+        optimize_module(&m, &opts);
+
+        if (opts.cache) {
+            words = ir_emit(&m, &size);
+            cache_store(&cache, &key, words, size);
+            free(words);
+        }
+    }
+
+    if (opts.cache && opts.passes.stats) {
+        cache_report(&cache, stdout);
+    }
+
+    if (opts.pressure) {
+        struct pressure p;
+
+        pressure_run(&m, &p);
+        pressure_report(&p, stdout);
+
+        if (opts.max_pressure && pressure_over_budget(&p, opts.max_pressure)) {
+            printf("[ERROR] %s: %u entry points above the budget of %u live scalar registers\n",
+                   opts.input, pressure_over_budget(&p, opts.max_pressure), opts.max_pressure);
+            pressure_free(&p);
+            return(1);
+        }
+
+        pressure_free(&p);
+    }
+
+    if (opts.check_layout && !check_layout(&m, stdout)) {
+        printf("[ERROR] %s: optimized module is out of layout order\n", opts.input);
+        return(1);
+    }
+
+    if (opts.profile && !profile_module(&m, &opts, opts.input)) {
+        return(1);
+    }
+
+    if (opts.output) {
+        FILE *file = fopen(opts.output, "wb");
+
+        if (!file) {
+            printf("[ERROR] Could not open %s\n", opts.output);
+            return(1);
+        }
+
+        words = ir_emit(&m, &size);
+        fwrite(words, sizeof(u32), size, file);
+        fclose(file);
+        free(words);
+    }
+
+    ir_free_module(&m);
+
+    return(0);
+}
@@ -0,0 +1,179 @@
+#include "common.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "opt/spirv.h"
+#include "opt/archive.h"
+#include "opt/archive_build.h"
+
+struct options {
+    const char *output;
+    const char *list;
+    bool dedup;
+    char **inputs;
+    u32 ninputs;
+};
+
+static void
+usage(void)
+{
+    printf("usage: spvpack [options] -o archive.spva input.spv...\n"
+           "       spvpack --list archive.spva\n"
+           "    -o <file>         write the archive, modules are named by their path as given\n"
+           "    --no-dedup        store a separate copy of every module, even identical ones\n"
+           "    --list <file>     print the index of an archive\n");
+}
+
+static bool
+parse_options(s32 argc, char **argv, struct options *opts)
+{
+    opts->dedup = true;
+
+    ASSERT(opts->inputs = malloc(argc * sizeof(char *)));
+
+    for (s32 i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (!strcmp(arg, "-o") && has_value) {
+            opts->output = argv[++i];
+        } else if (!strcmp(arg, "--list") && has_value) {
+            opts->list = argv[++i];
+        } else if (!strcmp(arg, "--no-dedup")) {
+            opts->dedup = false;
+        } else if (arg[0] != '-') {
+            opts->inputs[opts->ninputs++] = argv[i];
+        } else {
+            return(false);
+        }
+    }
+
+    return(opts->list || (opts->output && opts->ninputs));
+}
+
+static const char *
+model_name(u32 model)
+{
+    switch (model) {
+        case SpvExecutionModelVertex:    return("vertex");
+        case SpvExecutionModelFragment:  return("fragment");
+        case SpvExecutionModelGLCompute: return("compute");
+    }
+
+    return("other");
+}
+
+// Walks the instruction stream, which is all the checking a module needs to be
+// packed, and finds the first entry point. entry_point stays NULL without one.
+static bool
+read_module(const u32 *words, u32 size, u32 *model, const char **entry_point)
+{
+    *model = 0;
+    *entry_point = NULL;
+
+    if (size < SPV_HEADER_SIZE || words[0] != SPV_MAGIC) {
+        return(false);
+    }
+
+    for (u32 i = SPV_HEADER_SIZE; i < size;) {
+        u32 count = words[i] >> 16;
+
+        if (!count || i + count > size) {
+            return(false);
+        }
+
+        if ((words[i] & 0xFFFF) == SpvOpEntryPoint && count > 3 && !*entry_point) {
+            *model = words[i + 1];
+            *entry_point = (const char *) (words + i + 3);
+
+            if (!memchr(*entry_point, 0, (count - 3) * sizeof(u32))) {
+                return(false);
+            }
+        }
+
+        i += count;
+    }
+
+    return(true);
+}
+
+static s32
+list_archive(const char *path)
+{
+    struct shader_archive a;
+
+    if (!archive_open(&a, path)) {
+        printf("[ERROR] Could not open %s\n", path);
+        return(1);
+    }
+
+    printf("%s: %u modules, %u payload bytes\n", path, a.header->count, a.header->payloads_size);
+
+    for (u32 i = 0; i < a.header->count; ++i) {
+        const struct archive_entry *e = &a.entries[i];
+        const u32 *words;
+        u32 size;
+
+        // NOTE: looked up by name the way the viewer does, so a broken index shows up here
+        bool found = archive_find(&a, a.strings + e->name, &words, &size) && size && words[0] == SPV_MAGIC;
+
+        printf("    %016llx %8u %6u words  %-8s %-8s %s%s\n", (unsigned long long) e->hash, e->offset, e->size,
+               model_name(e->model), a.strings + e->entry_point, a.strings + e->name, found ? "" : "  (not found)");
+    }
+
+    archive_close(&a);
+
+    return(0);
+}
+
+s32
+main(s32 argc, char **argv)
+{
+    struct options opts = { 0 };
+    struct archive_builder b = { 0 };
+
+    if (!parse_options(argc, argv, &opts)) {
+        usage();
+        return(1);
+    }
+
+    if (opts.list) {
+        return(list_archive(opts.list));
+    }
+
+    b.dedup = opts.dedup;
+
+    for (u32 i = 0; i < opts.ninputs; ++i) {
+        const char *entry_point;
+        u32 model;
+        u32 *words;
+        u32 size;
+
+        if (!(words = get_binary(opts.inputs[i], &size))) {
+            return(1);
+        }
+
+        if (!read_module(words, size, &model, &entry_point)) {
+            printf("[ERROR] %s is not a valid SPIR-V module\n", opts.inputs[i]);
+            return(1);
+        }
+
+        archive_add(&b, opts.inputs[i], words, size, model, entry_point);
+
+        free(words);
+    }
+
+    if (!archive_write(&b, opts.output)) {
+        return(1);
+    }
+
+    printf("[PACK] %u modules, %u deduplicated, %u payload bytes in %s\n",
+           b.count, b.deduped, b.payloads_size * (u32) sizeof(u32), opts.output);
+
+    archive_builder_free(&b);
+    free(opts.inputs);
+
+    return(0);
+}
@@ -0,0 +1,226 @@
+// Frame profiling. CPU scopes are timed with the monotonic clock, GPU scopes
+// come from timestamp queries once their frame's fence signaled, so nothing
+// ever waits for a result. Every scope keeps a ring of its last durations for
+// percentiles. With tracing on every span is also kept as an event and
+// appended to a Chrome trace (chrome://tracing, Perfetto) on every flush.
+// The trace uses the JSON array format, whose closing bracket is optional,
+// so a run that is killed still leaves a trace that loads.
+
+#define TRACE_SAMPLES 1024
+#define TRACE_MAX_EVENTS (1u << 20)
+
+enum trace_scope {
+    TRACE_FENCE,
+    TRACE_ACQUIRE,
+    TRACE_UNIFORM,
+    TRACE_INSTANCES,
+    TRACE_UPLOAD,
+    TRACE_RECORD,
+    TRACE_SUBMIT,
+    TRACE_PRESENT,
+    TRACE_GPU_RENDER_PASS,
+    TRACE_SCOPES,
+};
+
+static const char *trace_scope_names[TRACE_SCOPES] = {
+    [TRACE_FENCE]           = "fence wait",
+    [TRACE_ACQUIRE]         = "acquire",
+    [TRACE_UNIFORM]         = "uniform update",
+    [TRACE_INSTANCES]       = "instance update",
+    [TRACE_UPLOAD]          = "upload",
+    [TRACE_RECORD]          = "record",
+    [TRACE_SUBMIT]          = "submit",
+    [TRACE_PRESENT]         = "present",
+    [TRACE_GPU_RENDER_PASS] = "render pass",
+};
+
+struct trace_event {
+    u64 beg;  // in ns on the CPU clock
+    u64 end;
+    u32 frame;
+    u8 scope;
+};
+
+struct trace_counter {
+    f64 samples[TRACE_SAMPLES];  // in ms
+    u32 nsamples;
+    u32 next;
+};
+
+struct trace {
+    bool events_on;
+    FILE *file;
+    const char *path;
+    struct trace_event *events;  // not flushed yet
+    u32 nevents;
+    u32 cap;
+    u32 written;
+    u32 dropped;
+    u64 origin;
+    u32 frame;
+    struct trace_counter counters[TRACE_SCOPES];
+};
+
+// Events are only kept when path is given and can be opened
+static void
+trace_init(struct trace *t, const char *path)
+{
+    memset(t, 0x00, sizeof(struct trace));
+    
+    t->origin = pacer_now();
+    
+    if (!path) {
+        return;
+    }
+    
+    if (!(t->file = fopen(path, "w"))) {
+        printf("[ERROR] Could not open %s\n", path);
+        return;
+    }
+    
+    t->events_on = true;
+    t->path = path;
+    
+    fprintf(t->file, "[\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"CPU\"}},\n");
+    fprintf(t->file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"GPU\"}}");
+    fflush(t->file);
+}
+
+static void
+trace_span(struct trace *t, enum trace_scope scope, u64 beg, u64 end, u32 frame)
+{
+    struct trace_counter *c = &t->counters[scope];
+    
+    c->samples[c->next] = (f64) (end - beg) / 1000000.0;
+    c->next = (c->next + 1) % TRACE_SAMPLES;
+    c->nsamples += c->nsamples < TRACE_SAMPLES;
+    
+    if (!t->events_on) {
+        return;
+    }
+    
+    if (t->written + t->nevents == TRACE_MAX_EVENTS) {
+        t->dropped += 1;
+        return;
+    }
+    
+    if (t->nevents == t->cap) {
+        t->cap = t->cap ? 2 * t->cap : 4096;
+        ASSERT(t->events = realloc(t->events, t->cap * sizeof(struct trace_event)));
+    }
+    
+    t->events[t->nevents].beg = beg;
+    t->events[t->nevents].end = end;
+    t->events[t->nevents].frame = frame;
+    t->events[t->nevents].scope = scope;
+    t->nevents += 1;
+}
+
+// Ends a CPU scope that started at beg, returns the end for the next scope to start from
+static u64
+trace_end(struct trace *t, enum trace_scope scope, u64 beg)
+{
+    u64 end = pacer_now();
+    
+    trace_span(t, scope, beg, end, t->frame);
+    
+    return(end);
+}
+
+// In ms, over the spans the counter still has
+static f64
+trace_mean(struct trace *t, enum trace_scope scope)
+{
+    struct trace_counter *c = &t->counters[scope];
+    f64 sum = 0.0;
+    
+    for (u32 i = 0; i < c->nsamples; ++i) {
+        sum += c->samples[i];
+    }
+    
+    return(c->nsamples ? sum / c->nsamples : 0.0);
+}
+
+// GPU spans go on their own track
+static bool
+trace_is_gpu(enum trace_scope scope)
+{
+    return(scope == TRACE_GPU_RENDER_PASS);
+}
+
+// Appends the events since the last flush and lets them go
+static void
+trace_flush(struct trace *t)
+{
+    if (!t->file) {
+        return;
+    }
+    
+    for (u32 i = 0; i < t->nevents; ++i) {
+        struct trace_event *e = &t->events[i];
+        
+        // NOTE: timestamps are in microseconds
+        fprintf(t->file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%u}}",
+                trace_scope_names[e->scope], trace_is_gpu(e->scope) ? 2 : 1,
+                (f64) (s64) (e->beg - t->origin) / 1000.0, (f64) (e->end - e->beg) / 1000.0, e->frame);
+    }
+    
+    fflush(t->file);
+    
+    t->written += t->nevents;
+    t->nevents = 0;
+}
+
+static void
+trace_close(struct trace *t)
+{
+    if (!t->file) {
+        return;
+    }
+    
+    trace_flush(t);
+    
+    fprintf(t->file, "\n]\n");
+    fclose(t->file);
+    t->file = NULL;
+    
+    printf("[TRACE] %u events written to %s", t->written, t->path);
+    
+    if (t->dropped) {
+        printf(", %u dropped past the limit", t->dropped);
+    }
+    
+    printf("\n");
+}
+
+// Over the last TRACE_SAMPLES spans of every scope
+static void
+trace_report(struct trace *t, FILE *out)
+{
+    f64 sorted[TRACE_SAMPLES];
+    
+    for (u32 s = 0; s < TRACE_SCOPES; ++s) {
+        struct trace_counter *c = &t->counters[s];
+        
+        if (!c->nsamples) {
+            continue;
+        }
+        
+        memcpy(sorted, c->samples, c->nsamples * sizeof(f64));
+        qsort(sorted, c->nsamples, sizeof(f64), pacer_compare);
+        
+        fprintf(out, "[TRACE] %-4s %-15s p50 %8.3f ms, p95 %8.3f ms, p99 %8.3f ms\n",
+                trace_is_gpu(s) ? "gpu" : "cpu", trace_scope_names[s],
+                pacer_percentile(sorted, c->nsamples, 50.0), pacer_percentile(sorted, c->nsamples, 95.0),
+                pacer_percentile(sorted, c->nsamples, 99.0));
+    }
+}
+
+static void
+trace_free(struct trace *t)
+{
+    trace_close(t);
+    free(t->events);
+    t->events = NULL;
+    t->nevents = t->cap = 0;
+}
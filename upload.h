@@ -0,0 +1,515 @@
+// Uploads to device-local buffers. Data goes through a staging ring, a host
+// visible buffer mapped for as long as the renderer runs, and from there into
+// the destination with vkCmdCopyBuffer. All copies of a frame are one batch,
+// one submission.
+//
+// Uploads are queued, not done on the spot: every frame upload_pump moves at
+// most UPLOAD_FRAME_BYTES of the queue into the ring, as far as the ring has
+// room, so a large mesh streams in over several frames and the frame never
+// waits for a transfer. Ring space comes back once the batch that used it
+// signaled its fence. upload_buffer hands out a ticket, upload_done tells
+// whether that upload landed.
+//
+// On the graphics queue a barrier orders the copies after the vertex input of
+// earlier frames and another makes them visible to vertex input.
+// With a transfer queue of another family the destination ranges change
+// owner: the transfer batch releases them and a small batch on the graphics
+// queue waits for the copies and acquires them. Either way every frame
+// submitted after a batch sees its data. A buffer the graphics queue already
+// acquired is first released there, after the frames reading the old data,
+// and acquired back by the transfer queue ahead of the copies.
+
+#define UPLOAD_RING_SIZE (32ull << 20)
+#define UPLOAD_FRAME_BYTES (8ull << 20)
+#define UPLOAD_BATCHES 8
+#define UPLOAD_ALIGNMENT 16ull
+
+#define UPLOAD_PUSH(arr, count, cap, item) {\
+    if ((count) == (cap)) {\
+        (cap) = (cap) ? (cap) * 2 : 8;\
+        ASSERT((arr) = realloc((arr), (cap) * sizeof(*(arr))));\
+    }\
+    (arr)[(count)++] = (item);\
+}
+
+// The source is read while the job streams, it has to stay valid until then
+struct upload_job {
+    VkBuffer dst;
+    VkDeviceSize offset;
+    const u8 *src;
+    VkDeviceSize size;
+    VkDeviceSize copied;
+};
+
+struct upload_batch {
+    VkCommandBuffer cmd;
+    VkCommandBuffer acquire;          // graphics side, with a transfer queue only
+    VkSemaphore copied;
+    VkFence fence;
+    VkCommandBuffer release;          // graphics side, re-uploaded buffers back to the transfer family
+    VkCommandBuffer reacquire;        // transfer side of the same
+    VkSemaphore released;
+    u64 end;                          // ring position after the batch
+    u64 streamed;                     // tickets complete once the batch is
+    bool pending;
+    VkBufferMemoryBarrier *barriers;  // ownership transfers, one per copy
+    u32 nbarriers;
+    u32 cap;
+    VkBufferMemoryBarrier *returns;   // whole buffers the graphics family gives back
+    u32 nreturns;
+    u32 returns_cap;
+};
+
+struct upload {
+    VkBuffer ring;
+    struct memory_allocation memory;
+    u64 head;                         // ring positions only grow, the offset is modulo UPLOAD_RING_SIZE
+    u64 tail;
+    VkCommandPool pool;               // on the transfer family
+    VkCommandPool acquire_pool;       // on the graphics family
+    struct upload_batch batches[UPLOAD_BATCHES];
+    u32 next;
+    struct upload_job *jobs;
+    u32 njobs;
+    u32 cap;
+    u32 first;                        // jobs before it are in the ring
+    u64 queued;                       // tickets, one per job
+    u64 streamed;                     // jobs completely in the ring
+    u64 done;                         // jobs whose last batch finished
+    VkBuffer *owned;                  // acquired by the graphics family
+    u32 nowned;
+    u32 owned_cap;
+    u64 bytes;
+    u64 submitted;
+    u64 starved;                      // frames that had jobs but no room
+};
+
+static struct upload upload;
+
+static bool
+upload_separate()
+{
+    return(data.transfer_queue_family_index != data.graphics_queue_family_index);
+}
+
+// Needs the allocator and the queues
+static void
+upload_init()
+{
+    VkBufferCreateInfo buf_info;
+    VkCommandPoolCreateInfo pool_info;
+    VkCommandBufferAllocateInfo cmd;
+    VkSemaphoreCreateInfo semaphore_info;
+    VkFenceCreateInfo fence_info;
+    
+    memset(&upload, 0x00, sizeof(struct upload));
+    
+    buf_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buf_info.pNext                 = NULL;
+    buf_info.usage                 = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    buf_info.size                  = UPLOAD_RING_SIZE;
+    buf_info.queueFamilyIndexCount = 0;
+    buf_info.pQueueFamilyIndices   = NULL;
+    buf_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
+    buf_info.flags                 = 0;
+    
+    ASSERT_VK(vkCreateBuffer(data.device, &buf_info, NULL, &upload.ring));
+    memory_bind_buffer(&data.allocator, upload.ring, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &upload.memory);
+    
+    pool_info.sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.pNext            = NULL;
+    pool_info.queueFamilyIndex = data.transfer_queue_family_index;
+    pool_info.flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    
+    ASSERT_VK(vkCreateCommandPool(data.device, &pool_info, NULL, &upload.pool));
+    
+    if (upload_separate()) {
+        pool_info.queueFamilyIndex = data.graphics_queue_family_index;
+        ASSERT_VK(vkCreateCommandPool(data.device, &pool_info, NULL, &upload.acquire_pool));
+    }
+    
+    cmd.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd.pNext              = NULL;
+    cmd.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd.commandBufferCount = 1;
+    
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = NULL;
+    semaphore_info.flags = 0;
+    
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.pNext = NULL;
+    fence_info.flags = 0;
+    
+    for (u32 i = 0; i < UPLOAD_BATCHES; ++i) {
+        struct upload_batch *b = &upload.batches[i];
+        
+        cmd.commandPool = upload.pool;
+        ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, &b->cmd));
+        ASSERT_VK(vkCreateFence(data.device, &fence_info, NULL, &b->fence));
+        
+        if (upload_separate()) {
+            ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, &b->reacquire));
+            cmd.commandPool = upload.acquire_pool;
+            ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, &b->acquire));
+            ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, &b->release));
+            ASSERT_VK(vkCreateSemaphore(data.device, &semaphore_info, NULL, &b->copied));
+            ASSERT_VK(vkCreateSemaphore(data.device, &semaphore_info, NULL, &b->released));
+        }
+    }
+    
+    printf("[UPLOAD] %llu MiB staging ring, %s\n", UPLOAD_RING_SIZE >> 20,
+           upload_separate() ? "copies on the transfer queue" : "copies on the graphics queue");
+}
+
+// Queues a copy of size bytes from src to dst at offset, dst needs TRANSFER_DST usage. Returns the ticket for upload_done.
+static u64
+upload_buffer(VkBuffer dst, VkDeviceSize offset, const void *src, VkDeviceSize size)
+{
+    struct upload_job job;
+    
+    job.dst = dst;
+    job.offset = offset;
+    job.src = src;
+    job.size = size;
+    job.copied = 0;
+    
+    UPLOAD_PUSH(upload.jobs, upload.njobs, upload.cap, job);
+    
+    // NOTE: jobs stream in the order they were queued, so tickets complete in order too
+    upload.queued += 1;
+    
+    return(upload.queued);
+}
+
+// Gives the ring space of every batch that finished back, never waits
+static void
+upload_retire()
+{
+    for (u32 i = 0; i < UPLOAD_BATCHES; ++i) {
+        struct upload_batch *b = &upload.batches[i];
+        
+        if (b->pending && vkGetFenceStatus(data.device, b->fence) == VK_SUCCESS) {
+            ASSERT_VK(vkResetFences(data.device, 1, &b->fence));
+            
+            // NOTE: batches finish in submission order, ring positions only grow
+            upload.tail = b->end > upload.tail ? b->end : upload.tail;
+            upload.done = b->streamed > upload.done ? b->streamed : upload.done;
+            b->pending = false;
+        }
+    }
+}
+
+// True once the upload's data is on the device and visible to every frame submitted from now on, never waits
+static bool
+upload_done(u64 ticket)
+{
+    upload_retire();
+    
+    return(ticket <= upload.done);
+}
+
+// A buffer the graphics family owns goes back to the transfer family before the batch writes it
+static void
+upload_reclaim(struct upload_batch *b, VkBuffer buffer)
+{
+    for (u32 i = 0; i < upload.nowned; ++i) {
+        if (upload.owned[i] == buffer) {
+            VkBufferMemoryBarrier barrier;
+            
+            barrier.sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.pNext               = NULL;
+            barrier.srcAccessMask       = 0;
+            barrier.dstAccessMask       = 0;
+            barrier.srcQueueFamilyIndex = data.graphics_queue_family_index;
+            barrier.dstQueueFamilyIndex = data.transfer_queue_family_index;
+            barrier.buffer              = buffer;
+            barrier.offset              = 0;
+            barrier.size                = VK_WHOLE_SIZE;
+            
+            UPLOAD_PUSH(b->returns, b->nreturns, b->returns_cap, barrier);
+            upload.owned[i] = upload.owned[--upload.nowned];
+            
+            return;
+        }
+    }
+}
+
+static void
+upload_submit(struct upload_batch *b)
+{
+    VkPipelineStageFlags wait_stage = VK_PIPELINE_STAGE_VERTEX_INPUT_BIT;
+    VkPipelineStageFlags copy_stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+    VkCommandBuffer transfer[2] = { b->cmd, VK_NULL_HANDLE };
+    VkCommandBufferBeginInfo begin;
+    VkMemoryBarrier barrier;
+    VkSubmitInfo submit_info;
+    
+    begin.sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin.pNext            = NULL;
+    begin.flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin.pInheritanceInfo = NULL;
+    
+    submit_info.sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext                = NULL;
+    submit_info.waitSemaphoreCount   = 0;
+    submit_info.pWaitSemaphores      = NULL;
+    submit_info.pWaitDstStageMask    = NULL;
+    submit_info.commandBufferCount   = 1;
+    submit_info.pCommandBuffers      = transfer;
+    submit_info.signalSemaphoreCount = 0;
+    submit_info.pSignalSemaphores    = NULL;
+    
+    if (!upload_separate()) {
+        barrier.sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        barrier.pNext         = NULL;
+        barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        barrier.dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+        
+        vkCmdPipelineBarrier(b->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+        ASSERT_VK(vkEndCommandBuffer(b->cmd));
+        ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, &submit_info, b->fence));
+        
+        return;
+    }
+    
+    // Re-uploads: released on the graphics queue after the frames that read the old data, acquired back ahead of the copies
+    if (b->nreturns) {
+        ASSERT_VK(vkBeginCommandBuffer(b->release, &begin));
+        vkCmdPipelineBarrier(b->release, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, b->nreturns, b->returns, 0, NULL);
+        ASSERT_VK(vkEndCommandBuffer(b->release));
+        
+        submit_info.pCommandBuffers      = &b->release;
+        submit_info.signalSemaphoreCount = 1;
+        submit_info.pSignalSemaphores    = &b->released;
+        
+        ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, &submit_info, VK_NULL_HANDLE));
+        
+        for (u32 i = 0; i < b->nreturns; ++i) {
+            b->returns[i].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        }
+        
+        ASSERT_VK(vkBeginCommandBuffer(b->reacquire, &begin));
+        vkCmdPipelineBarrier(b->reacquire, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, NULL, b->nreturns, b->returns, 0, NULL);
+        ASSERT_VK(vkEndCommandBuffer(b->reacquire));
+        
+        // NOTE: barriers order the whole submission, the acquire in its own command buffer still goes before the copies
+        transfer[0] = b->reacquire;
+        transfer[1] = b->cmd;
+        
+        submit_info.waitSemaphoreCount = 1;
+        submit_info.pWaitSemaphores    = &b->released;
+        submit_info.pWaitDstStageMask  = &copy_stage;
+        submit_info.commandBufferCount = 2;
+    }
+    
+    // Release on the transfer queue
+    for (u32 i = 0; i < b->nbarriers; ++i) {
+        b->barriers[i].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        b->barriers[i].dstAccessMask = 0;
+    }
+    
+    vkCmdPipelineBarrier(b->cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, NULL, b->nbarriers, b->barriers, 0, NULL);
+    ASSERT_VK(vkEndCommandBuffer(b->cmd));
+    
+    submit_info.pCommandBuffers      = transfer;
+    submit_info.signalSemaphoreCount = 1;
+    submit_info.pSignalSemaphores    = &b->copied;
+    
+    ASSERT_VK(vkQueueSubmit(data.transfer_queue, 1, &submit_info, VK_NULL_HANDLE));
+    
+    // Acquire on the graphics queue, the same barriers with the access on this side
+    for (u32 i = 0; i < b->nbarriers; ++i) {
+        b->barriers[i].srcAccessMask = 0;
+        b->barriers[i].dstAccessMask = VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_INDEX_READ_BIT;
+    }
+    
+    ASSERT_VK(vkBeginCommandBuffer(b->acquire, &begin));
+    vkCmdPipelineBarrier(b->acquire, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 0, NULL, b->nbarriers, b->barriers, 0, NULL);
+    ASSERT_VK(vkEndCommandBuffer(b->acquire));
+    
+    submit_info.waitSemaphoreCount   = 1;
+    submit_info.pWaitSemaphores      = &b->copied;
+    submit_info.pWaitDstStageMask    = &wait_stage;
+    submit_info.commandBufferCount   = 1;
+    submit_info.pCommandBuffers      = &b->acquire;
+    submit_info.signalSemaphoreCount = 0;
+    submit_info.pSignalSemaphores    = NULL;
+    
+    // NOTE: the fence goes with the acquire, it signals after the copies too
+    ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, &submit_info, b->fence));
+    
+    // The graphics family owns the destinations now, a later upload into one has to reclaim it
+    for (u32 i = 0; i < b->nbarriers; ++i) {
+        u32 k = 0;
+        
+        while (k < upload.nowned && upload.owned[k] != b->barriers[i].buffer) {
+            k += 1;
+        }
+        
+        if (k == upload.nowned) {
+            UPLOAD_PUSH(upload.owned, upload.nowned, upload.owned_cap, b->barriers[i].buffer);
+        }
+    }
+}
+
+// Once per frame before its submission, streams queued jobs into the ring
+static void
+upload_pump()
+{
+    struct upload_batch *b = &upload.batches[upload.next];
+    VkDeviceSize budget = UPLOAD_FRAME_BYTES;
+    VkCommandBufferBeginInfo begin;
+    bool recorded = false;
+    
+    upload_retire();
+    
+    if (upload.first == upload.njobs) {
+        upload.first = upload.njobs = 0;
+        return;
+    }
+    
+    if (b->pending || upload.head - upload.tail == UPLOAD_RING_SIZE) {
+        upload.starved += 1;
+        return;
+    }
+    
+    begin.sType            = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin.pNext            = NULL;
+    begin.flags            = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    begin.pInheritanceInfo = NULL;
+    
+    b->nbarriers = 0;
+    b->nreturns = 0;
+    
+    while (upload.first < upload.njobs && budget) {
+        struct upload_job *job = &upload.jobs[upload.first];
+        VkDeviceSize offset = upload.head % UPLOAD_RING_SIZE;
+        VkDeviceSize room = UPLOAD_RING_SIZE - (upload.head - upload.tail);
+        VkDeviceSize chunk = job->size - job->copied;
+        VkBufferCopy region;
+        
+        // NOTE: a chunk ends at the end of the ring, the next one starts over at its beginning
+        chunk = chunk < budget ? chunk : budget;
+        chunk = chunk < room ? chunk : room;
+        chunk = chunk < UPLOAD_RING_SIZE - offset ? chunk : UPLOAD_RING_SIZE - offset;
+        
+        if (!chunk) {
+            break;
+        }
+        
+        if (!recorded) {
+            ASSERT_VK(vkBeginCommandBuffer(b->cmd, &begin));
+            recorded = true;
+            
+            // NOTE: frames submitted earlier may still read a destination as vertex data, the copies wait for them
+            if (!upload_separate()) {
+                VkMemoryBarrier barrier;
+                
+                barrier.sType         = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                barrier.pNext         = NULL;
+                barrier.srcAccessMask = 0;
+                barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                
+                vkCmdPipelineBarrier(b->cmd, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, NULL, 0, NULL);
+            }
+        }
+        
+        memcpy(upload.memory.mapped + offset, job->src + job->copied, chunk);
+        
+        region.srcOffset = offset;
+        region.dstOffset = job->offset + job->copied;
+        region.size      = chunk;
+        
+        vkCmdCopyBuffer(b->cmd, upload.ring, job->dst, 1, &region);
+        
+        if (upload_separate()) {
+            VkBufferMemoryBarrier barrier;
+            
+            upload_reclaim(b, job->dst);
+            
+            barrier.sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+            barrier.pNext               = NULL;
+            barrier.srcAccessMask       = 0;
+            barrier.dstAccessMask       = 0;
+            barrier.srcQueueFamilyIndex = data.transfer_queue_family_index;
+            barrier.dstQueueFamilyIndex = data.graphics_queue_family_index;
+            barrier.buffer              = job->dst;
+            barrier.offset              = region.dstOffset;
+            barrier.size                = chunk;
+            
+            UPLOAD_PUSH(b->barriers, b->nbarriers, b->cap, barrier);
+        }
+        
+        // NOTE: head and tail stay aligned, so the room does too and the aligned chunk still fits
+        upload.head += (chunk + UPLOAD_ALIGNMENT - 1) & ~(UPLOAD_ALIGNMENT - 1);
+        upload.bytes += chunk;
+        budget -= chunk;
+        job->copied += chunk;
+        
+        if (job->copied == job->size) {
+            upload.first += 1;
+            upload.streamed += 1;
+        }
+    }
+    
+    if (!recorded) {
+        upload.starved += 1;
+        return;
+    }
+    
+    upload_submit(b);
+    
+    b->end = upload.head;
+    b->streamed = upload.streamed;
+    b->pending = true;
+    upload.submitted += 1;
+    upload.next = (upload.next + 1) % UPLOAD_BATCHES;
+}
+
+static void
+upload_report(FILE *out)
+{
+    fprintf(out, "[UPLOAD] %.2f MiB in %llu batches, %u jobs queued, ring full on %llu frames\n",
+            (f64) upload.bytes / (1 << 20), (unsigned long long) upload.submitted, upload.njobs - upload.first,
+            (unsigned long long) upload.starved);
+}
+
+static void
+upload_free()
+{
+    for (u32 i = 0; i < UPLOAD_BATCHES; ++i) {
+        struct upload_batch *b = &upload.batches[i];
+        
+        if (b->pending) {
+            ASSERT_VK(vkWaitForFences(data.device, 1, &b->fence, VK_TRUE, UINT64_MAX));
+        }
+        
+        vkDestroyFence(data.device, b->fence, NULL);
+        vkFreeCommandBuffers(data.device, upload.pool, 1, &b->cmd);
+        
+        if (upload_separate()) {
+            vkDestroySemaphore(data.device, b->copied, NULL);
+            vkDestroySemaphore(data.device, b->released, NULL);
+            vkFreeCommandBuffers(data.device, upload.pool, 1, &b->reacquire);
+            vkFreeCommandBuffers(data.device, upload.acquire_pool, 1, &b->acquire);
+            vkFreeCommandBuffers(data.device, upload.acquire_pool, 1, &b->release);
+        }
+        
+        free(b->barriers);
+        free(b->returns);
+    }
+    
+    vkDestroyCommandPool(data.device, upload.pool, NULL);
+    
+    if (upload_separate()) {
+        vkDestroyCommandPool(data.device, upload.acquire_pool, NULL);
+    }
+    
+    vkDestroyBuffer(data.device, upload.ring, NULL);
+    memory_free(&data.allocator, &upload.memory);
+    free(upload.jobs);
+    free(upload.owned);
+    
+    memset(&upload, 0x00, sizeof(struct upload));
+}
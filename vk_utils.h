@@ -1,37 +1,43 @@
-static u32 *
-get_binary(const char *filename, u32 *size)
+// A view into the shader archive when it has path, otherwise the file itself, which the caller frees through *owned
+static const u32 *
+get_shader(const char *path, bool archived, u32 *size, u32 **owned)
 {
-    FILE *file = fopen(filename, "rb");
+    const u32 *words;
     
-    if (!file) {
-        printf("[ERROR] File could not be opened\n");
-        return(NULL);
-    }
+    *owned = NULL;
     
-    fseek(file, 0L, SEEK_END);
-    *size = ftell(file);
-    rewind(file);
+    if (archived && archive_find(&shader_archive, path, &words, size)) {
+        return(words);
+    }
     
-    // NOTE: size % sizeof(u32) is always zero
-    u32 *buffer = (u32 *) malloc(*size);
-    fread((u8 *) buffer, *size, 1, file);
+    return(*owned = get_binary(path, size));
+}
+
+// First tier of a load: only the cheap passes that fit in the budget, optimize_worker runs the full pipeline after.
+// NULL when the module does not parse.
+static u32 *
+first_tier_optimize(const u32 *words, u32 *size)
+{
+    struct ir_module m;
+    u32 *optimized = NULL;
     
-    *size /= sizeof(u32);
+    if (ir_parse(words, *size, &m)) {
+        reload.passes = pipeline_run(&m, &first_tier_passes, NULL);
+        optimized = ir_emit(&m, size);
+    }
     
-    fclose(file);
+    ir_free_module(&m);
     
-    return(buffer);
+    return(optimized);
 }
 
-
 static void
-rebuild_fragment_shader()
+rebuild_fragment_shader(const u32 *fs_words, u32 fs_size)
 {
     VkShaderModuleCreateInfo module_create_info;
-    u32 *fs_words;
-    u32 fs_size;
     
-    fs_words = get_binary("shaders/sample.frag.spv", &fs_size);
+    // NOTE: a pipeline keeps what it needs from its modules, the old one can go
+    vkDestroyShaderModule(data.device, data.shader_stages[1].module, NULL);
     
     module_create_info.sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     module_create_info.pNext    = NULL;
@@ -42,13 +48,45 @@ rebuild_fragment_shader()
     ASSERT_VK(vkCreateShaderModule(data.device, &module_create_info, NULL, &data.shader_stages[1].module));
 }
 
+// Creates the fragment shader module, straight from the mapped cache entry when the fully optimized module is there
+static void
+load_fragment_shader()
+{
+    struct cache_entry entry;
+    struct cache_key key;
+    const u32 *fs_words;
+    u32 *file, *optimized = NULL;
+    u32 fs_size;
+    
+    ASSERT(fs_words = get_shader(FRAGMENT_SHADER, !fs_edited, &fs_size, &file));
+    
+    reload.cached = false;
+    
+    if (optimize_shaders) {
+        cache_key(fs_words, fs_size, &shader_passes, &key);
+        reload.cached = use_cache && cache_lookup(&shader_cache, &key, &entry);
+        
+        if (!reload.cached && (optimized = first_tier_optimize(fs_words, &fs_size))) {
+            fs_words = optimized;
+        }
+    }
+    
+    if (reload.cached) {
+        rebuild_fragment_shader(entry.words, entry.size);
+        cache_release(&entry);
+    } else {
+        rebuild_fragment_shader(fs_words, fs_size);
+    }
+    
+    free(optimized);
+    free(file);
+}
+
+// Writes the current frame's slot, draw_cube calls it once the frame's fence says the GPU is done reading it
 static void
-update_uniform_data(u32 mem_reqs_size)
+update_uniform_data()
 {
-    ASSERT_VK(vkMapMemory(data.device, data.uniform.mem, 0, mem_reqs_size, 0, (void **) &data.ubuffer_data));
-    memcpy(data.ubuffer_data, data.mvp, sizeof(data.mvp));
-    vkUnmapMemory(data.device, data.uniform.mem);
-    ASSERT_VK(vkBindBufferMemory(data.device, data.uniform.buf, data.uniform.mem, 0));
+    memcpy(data.ubuffer_data + data.current_frame * data.uniform.stride, data.mvp, sizeof(data.mvp));
 }
 
 static void
@@ -147,24 +185,10 @@ find_graphics_and_present_queues()
            data.graphics_queue_family_index != UINT32_MAX);
 }
 
-static bool
-memory_type_from_properties(u32 type_bits, VkFlags requirements_mask, u32 *type_index) {
-    for (u32 i = 0; i < data.memory_properties.memoryTypeCount; ++i) {
-        if ((type_bits & 1) == 1) {
-            if ((data.memory_properties.memoryTypes[i].propertyFlags & requirements_mask) == requirements_mask) {
-                *type_index = i;
-                return(true);
-            }
-        }
-        type_bits = type_bits >> 1;
-    }
-    return(false);
-}
-
 static void
 init_instance()
 {
-    u32 extension_count = 2;
+    u32 extension_count = data.headless ? 0 : 2;
     const char **instance_extension_names;
     VkApplicationInfo application_info;
     VkInstanceCreateInfo instance_create_info;
@@ -177,7 +201,7 @@ init_instance()
     application_info.engineVersion      = 1;
     application_info.apiVersion         = VK_API_VERSION_1_0;
     
-    ASSERT(instance_extension_names = malloc(extension_count * sizeof(char *)));
+    ASSERT(instance_extension_names = malloc(2 * sizeof(char *)));
     ASSERT(instance_extension_names[0] = strdup(VK_KHR_SURFACE_EXTENSION_NAME));
     ASSERT(instance_extension_names[1] = strdup(VK_KHR_XCB_SURFACE_EXTENSION_NAME));
     
@@ -217,7 +241,7 @@ init_surface()
     VkXcbSurfaceCreateInfoKHR surface_create_info;
     VkSurfaceFormatKHR *surf_formats;
     
-    create_xcb_window(800, 600); // this inits data.connection and data.window
+    create_xcb_window(WINDOW_WIDTH, WINDOW_HEIGHT); // this inits data.connection and data.window
     
     surface_create_info.sType      = VK_STRUCTURE_TYPE_XCB_SURFACE_CREATE_INFO_KHR;
     surface_create_info.pNext      = NULL;
@@ -238,26 +262,82 @@ init_surface()
     }
 }
 
+// Without a window there is nothing to present to, any graphics queue does
+static void
+init_headless()
+{
+    data.width = WINDOW_WIDTH;
+    data.height = WINDOW_HEIGHT;
+    data.format = VK_FORMAT_R8G8B8A8_UNORM;
+    data.graphics_queue_family_index = UINT32_MAX;
+    
+    for (u32 i = 0; i < data.queue_family_count; ++i) {
+        if (data.queue_properties[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            data.graphics_queue_family_index = i;
+            break;
+        }
+    }
+    
+    ASSERT(data.graphics_queue_family_index != UINT32_MAX);
+    data.present_queue_family_index = data.graphics_queue_family_index;
+    
+    printf("[HEADLESS] %s, %ux%u offscreen\n", data.gpu_props.deviceName, data.width, data.height);
+}
+
+// A family with transfer but without graphics, the DMA engine on discrete GPUs. Falls back to the graphics family.
+static void
+find_transfer_queue()
+{
+    data.transfer_queue_family_index = data.graphics_queue_family_index;
+    
+    if (!use_transfer_queue) {
+        return;
+    }
+    
+    for (u32 i = 0; i < data.queue_family_count; ++i) {
+        VkFlags flags = data.queue_properties[i].queueFlags;
+        
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            data.transfer_queue_family_index = i;
+            
+            // NOTE: transfer alone beats transfer and compute
+            if (!(flags & VK_QUEUE_COMPUTE_BIT)) {
+                break;
+            }
+        }
+    }
+    
+    if (!upload_separate()) {
+        printf("[UPLOAD] No queue family without graphics, uploading on the graphics queue\n");
+    }
+}
+
 static void
 init_device()
 {
-    u32 extension_count = 1;
+    u32 extension_count = data.headless ? 0 : 1;
     f32 queue_priorities[1] = { 0.0f };
-    VkDeviceQueueCreateInfo queue_info;
+    VkDeviceQueueCreateInfo queue_info[2];
+    
+    find_transfer_queue();
     
-    queue_info.sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_info.pNext            = NULL;
-    queue_info.queueCount       = 1;
-    queue_info.pQueuePriorities = queue_priorities;
-    queue_info.queueFamilyIndex = data.graphics_queue_family_index;
+    queue_info[0].sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queue_info[0].pNext            = NULL;
+    queue_info[0].flags            = 0;
+    queue_info[0].queueCount       = 1;
+    queue_info[0].pQueuePriorities = queue_priorities;
+    queue_info[0].queueFamilyIndex = data.graphics_queue_family_index;
     
-    ASSERT(data.device_extension_names = malloc(extension_count * sizeof(char *)));
+    queue_info[1] = queue_info[0];
+    queue_info[1].queueFamilyIndex = data.transfer_queue_family_index;
+    
+    ASSERT(data.device_extension_names = malloc(sizeof(char *)));
     ASSERT(data.device_extension_names[0] = strdup(VK_KHR_SWAPCHAIN_EXTENSION_NAME));
     
     data.device_info.sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
     data.device_info.pNext                   = NULL;
-    data.device_info.queueCreateInfoCount    = 1;
-    data.device_info.pQueueCreateInfos       = &queue_info;
+    data.device_info.queueCreateInfoCount    = upload_separate() ? 2 : 1;
+    data.device_info.pQueueCreateInfos       = queue_info;
     data.device_info.ppEnabledExtensionNames = data.device_extension_names;
     data.device_info.enabledExtensionCount   = extension_count;
     data.device_info.enabledLayerCount       = 0;
@@ -265,6 +345,8 @@ init_device()
     data.device_info.pEnabledFeatures        = NULL;
     
     ASSERT_VK(vkCreateDevice(data.gpus[0], &data.device_info, NULL, &data.device));
+    
+    memory_init(&data.allocator, data.device, &data.memory_properties, data.gpu_props.limits.bufferImageGranularity);
 }
 
 static void
@@ -306,9 +388,84 @@ init_command_buffer()
         } else {
             vkGetDeviceQueue(data.device, data.present_queue_family_index, 0, &data.present_queue);
         }
+        
+        if (upload_separate()) {
+            vkGetDeviceQueue(data.device, data.transfer_queue_family_index, 0, &data.transfer_queue);
+        } else {
+            data.transfer_queue = data.graphics_queue;
+        }
     } // End of init device queue
 }
 
+// A view per color image, swapchain or offscreen
+static void
+init_color_views()
+{
+    ASSERT(data.buffers = malloc(data.swapchain_image_count * sizeof(struct swapchain_buffer)));
+    
+    struct swapchain_buffer *sc_head = data.buffers;
+    
+    for (u32 i = 0; i < data.swapchain_image_count; ++i) {
+        VkImageViewCreateInfo color_image_view;
+        struct swapchain_buffer sc_buffer;
+        
+        data.buffers[i].image = data.swapchain_images[i];
+        
+        color_image_view.sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        color_image_view.pNext                           = NULL;
+        color_image_view.flags                           = 0;
+        color_image_view.image                           = data.buffers[i].image;
+        color_image_view.viewType                        = VK_IMAGE_VIEW_TYPE_2D;
+        color_image_view.format                          = data.format;
+        color_image_view.components.r                    = VK_COMPONENT_SWIZZLE_R;
+        color_image_view.components.g                    = VK_COMPONENT_SWIZZLE_G;
+        color_image_view.components.b                    = VK_COMPONENT_SWIZZLE_B;
+        color_image_view.components.a                    = VK_COMPONENT_SWIZZLE_A;
+        color_image_view.subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+        color_image_view.subresourceRange.baseMipLevel   = 0;
+        color_image_view.subresourceRange.levelCount     = 1;
+        color_image_view.subresourceRange.baseArrayLayer = 0;
+        color_image_view.subresourceRange.layerCount     = 1;
+        color_image_view.image                           = data.swapchain_images[i];
+        
+        sc_buffer.image = data.swapchain_images[i];
+        *sc_head++ = sc_buffer;
+        
+        ASSERT_VK(vkCreateImageView(data.device, &color_image_view, NULL, &data.buffers[i].view));
+    }
+}
+
+// The mode closest to the policy, FIFO is the fallback every device supports
+static VkPresentModeKHR
+choose_present_mode(VkPresentModeKHR *modes, u32 count, enum present_policy policy)
+{
+    const VkPresentModeKHR preferred[3][2] = {
+        [PRESENT_FIFO]      = { VK_PRESENT_MODE_FIFO_KHR,      VK_PRESENT_MODE_FIFO_KHR },
+        [PRESENT_MAILBOX]   = { VK_PRESENT_MODE_MAILBOX_KHR,   VK_PRESENT_MODE_IMMEDIATE_KHR },
+        [PRESENT_IMMEDIATE] = { VK_PRESENT_MODE_IMMEDIATE_KHR, VK_PRESENT_MODE_MAILBOX_KHR },
+    };
+    
+    for (u32 p = 0; p < 2; ++p) {
+        for (u32 i = 0; i < count; ++i) {
+            if (modes[i] == preferred[policy][p]) {
+                return(modes[i]);
+            }
+        }
+    }
+    
+    return(VK_PRESENT_MODE_FIFO_KHR);
+}
+
+static const char *
+present_mode_name(VkPresentModeKHR mode)
+{
+    switch (mode) {
+        case VK_PRESENT_MODE_MAILBOX_KHR:   return("mailbox");
+        case VK_PRESENT_MODE_IMMEDIATE_KHR: return("immediate");
+        default:                            return("fifo");
+    }
+}
+
 static void
 init_swapchain()
 {
@@ -380,7 +537,7 @@ init_swapchain()
     swapchain_create_info.preTransform          = pre_transform;
     swapchain_create_info.compositeAlpha        = composite_alpha;
     swapchain_create_info.imageArrayLayers      = 1;
-    swapchain_create_info.presentMode           = VK_PRESENT_MODE_FIFO_KHR;
+    swapchain_create_info.presentMode           = choose_present_mode(present_modes, present_mode_count, data.present_policy);
     swapchain_create_info.oldSwapchain          = VK_NULL_HANDLE;
     swapchain_create_info.clipped               = true;
     swapchain_create_info.imageColorSpace       = VK_COLORSPACE_SRGB_NONLINEAR_KHR;
@@ -396,53 +553,177 @@ init_swapchain()
     }
     
     ASSERT_VK(vkCreateSwapchainKHR(data.device, &swapchain_create_info, NULL, &data.swapchain));
+    
+    printf("[PRESENT] %s\n", present_mode_name(swapchain_create_info.presentMode));
+    free(present_modes);
+    
     ASSERT_VK(vkGetSwapchainImagesKHR(data.device, data.swapchain, &data.swapchain_image_count, NULL));
     ASSERT(data.swapchain_images = malloc(data.swapchain_image_count * sizeof(VkImage)));
     ASSERT_VK(vkGetSwapchainImagesKHR(data.device, data.swapchain, &data.swapchain_image_count, data.swapchain_images));
-    ASSERT(data.buffers = malloc(data.swapchain_image_count * sizeof(struct swapchain_buffer)));
     
-    struct swapchain_buffer *sc_head = data.buffers;
+    init_color_views();
+    data.current_buffer = 0;
+}
+
+// Stands in for the swapchain: one image per frame in flight, rendered to in turn
+static void
+init_offscreen_images()
+{
+    VkImageCreateInfo image_info;
+    
+    data.swapchain_image_count = data.frames_in_flight;
+    
+    ASSERT(data.swapchain_images = malloc(data.swapchain_image_count * sizeof(VkImage)));
+    ASSERT(data.offscreen_memory = malloc(data.swapchain_image_count * sizeof(struct memory_allocation)));
+    
+    image_info.sType                 = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.pNext                 = NULL;
+    image_info.flags                 = 0;
+    image_info.imageType             = VK_IMAGE_TYPE_2D;
+    image_info.format                = data.format;
+    image_info.extent.width          = data.width;
+    image_info.extent.height         = data.height;
+    image_info.extent.depth          = 1;
+    image_info.mipLevels             = 1;
+    image_info.arrayLayers           = 1;
+    image_info.samples               = NUM_SAMPLES;
+    image_info.tiling                = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage                 = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    image_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.queueFamilyIndexCount = 0;
+    image_info.pQueueFamilyIndices   = NULL;
+    image_info.initialLayout         = VK_IMAGE_LAYOUT_UNDEFINED;
     
     for (u32 i = 0; i < data.swapchain_image_count; ++i) {
-        VkImageViewCreateInfo color_image_view;
-        struct swapchain_buffer sc_buffer;
-        
-        data.buffers[i].image = data.swapchain_images[i];
-        
-        color_image_view.sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        color_image_view.pNext                           = NULL;
-        color_image_view.flags                           = 0;
-        color_image_view.image                           = data.buffers[i].image;
-        color_image_view.viewType                        = VK_IMAGE_VIEW_TYPE_2D;
-        color_image_view.format                          = data.format;
-        color_image_view.components.r                    = VK_COMPONENT_SWIZZLE_R;
-        color_image_view.components.g                    = VK_COMPONENT_SWIZZLE_G;
-        color_image_view.components.b                    = VK_COMPONENT_SWIZZLE_B;
-        color_image_view.components.a                    = VK_COMPONENT_SWIZZLE_A;
-        color_image_view.subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
-        color_image_view.subresourceRange.baseMipLevel   = 0;
-        color_image_view.subresourceRange.levelCount     = 1;
-        color_image_view.subresourceRange.baseArrayLayer = 0;
-        color_image_view.subresourceRange.layerCount     = 1;
-        color_image_view.image                           = data.swapchain_images[i];
-        
-        sc_buffer.image = data.swapchain_images[i];
-        *sc_head++ = sc_buffer;
-        
-        ASSERT_VK(vkCreateImageView(data.device, &color_image_view, NULL, &data.buffers[i].view));
+        ASSERT_VK(vkCreateImage(data.device, &image_info, NULL, &data.swapchain_images[i]));
+        memory_bind_image(&data.allocator, data.swapchain_images[i], false, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &data.offscreen_memory[i]);
     }
     
+    init_color_views();
     data.current_buffer = 0;
 }
 
+static void
+init_frames()
+{
+    VkCommandBufferAllocateInfo cmd;
+    VkSemaphoreCreateInfo semaphore_info;
+    VkFenceCreateInfo fence_info;
+    
+    cmd.sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    cmd.pNext              = NULL;
+    cmd.commandPool        = data.cbp;
+    cmd.level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    cmd.commandBufferCount = data.swapchain_image_count;
+    
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = NULL;
+    semaphore_info.flags = 0;
+    
+    // NOTE: created signaled, the first wait on a frame that never ran returns at once
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.pNext = NULL;
+    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    
+    // NOTE: one command buffer per image for every frame, each frame binds its own uniform slot
+    for (u32 i = 0; i < data.frames_in_flight; ++i) {
+        ASSERT(data.frames[i].command_buffers = malloc(data.swapchain_image_count * sizeof(VkCommandBuffer)));
+        ASSERT_VK(vkAllocateCommandBuffers(data.device, &cmd, data.frames[i].command_buffers));
+        
+        ASSERT_VK(vkCreateSemaphore(data.device, &semaphore_info, NULL, &data.frames[i].image_acquired));
+        ASSERT_VK(vkCreateSemaphore(data.device, &semaphore_info, NULL, &data.frames[i].render_complete));
+        ASSERT_VK(vkCreateFence(data.device, &fence_info, NULL, &data.frames[i].fence));
+    }
+    
+    // Per swapchain image, the fence of the frame that last rendered to it
+    ASSERT(data.image_fences = calloc(data.swapchain_image_count, sizeof(VkFence)));
+    
+    data.current_frame = 0;
+    data.commands_dirty = true;
+}
+
+// GPU scopes need timestamps on the graphics queue, without them only the CPU is traced
+static void
+init_timestamps()
+{
+    VkQueryPoolCreateInfo pool_info;
+    u32 bits = data.queue_properties[data.graphics_queue_family_index].timestampValidBits;
+    
+    if (!bits) {
+        printf("[TRACE] the graphics queue has no timestamps, GPU scopes are off\n");
+        return;
+    }
+    
+    pool_info.sType              = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.pNext              = NULL;
+    pool_info.flags              = 0;
+    pool_info.queryType          = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount         = 2 * data.frames_in_flight;
+    pool_info.pipelineStatistics = 0;
+    
+    ASSERT_VK(vkCreateQueryPool(data.device, &pool_info, NULL, &data.timestamp_pool));
+    
+    data.timestamp_mask = bits < 64 ? (1ull << bits) - 1 : ~0ull;
+    data.timestamp_period = data.gpu_props.limits.timestampPeriod;
+}
+
+// Only called once the frame's fence signaled, the results are there and reading them never stalls
+static void
+resolve_timestamps(struct frame *frame)
+{
+    u32 first = 2 * (u32) (frame - data.frames);
+    u64 ticks[2];
+    u64 beg, end;
+    
+    if (!frame->queries_pending) {
+        return;
+    }
+    
+    frame->queries_pending = false;
+    
+    if (vkGetQueryPoolResults(data.device, data.timestamp_pool, first, 2, sizeof(ticks), ticks, sizeof(u64), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+        return;
+    }
+    
+    // NOTE: the GPU clock has no relation to the CPU clock, the first render pass is placed at its submit and every later one relative to it
+    if (!data.cpu_origin) {
+        data.gpu_origin = ticks[0];
+        data.cpu_origin = frame->submitted;
+    }
+    
+    beg = data.cpu_origin + (u64) ((f64) ((ticks[0] - data.gpu_origin) & data.timestamp_mask) * data.timestamp_period);
+    end = beg + (u64) ((f64) ((ticks[1] - ticks[0]) & data.timestamp_mask) * data.timestamp_period);
+    
+    trace_span(&trace, TRACE_GPU_RENDER_PASS, beg, end, frame->traced_frame);
+}
+
+static void
+wait_fence(VkFence fence)
+{
+    VkResult res;
+    
+    do {
+        res = vkWaitForFences(data.device, 1, &fence, VK_TRUE, FENCE_TIMEOUT);
+    } while (res == VK_TIMEOUT);
+    
+    ASSERT_VK(res);
+}
+
+// Until the GPU is done with every frame that was submitted
+static void
+wait_frames_in_flight()
+{
+    for (u32 i = 0; i < data.frames_in_flight; ++i) {
+        wait_fence(data.frames[i].fence);
+    }
+}
+
 static void
 init_depth_buffer()
 {
     VkImageCreateInfo image_info;
     VkFormatProperties properties;
-    VkMemoryAllocateInfo mem_alloc;
     VkImageViewCreateInfo view_info;
-    VkMemoryRequirements mem_reqs;
     VkFormat depth_format;
     
     if (data.depth.format == VK_FORMAT_UNDEFINED) {
@@ -479,11 +760,6 @@ init_depth_buffer()
     image_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
     image_info.flags                 = 0;
     
-    mem_alloc.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    mem_alloc.pNext           = NULL;
-    mem_alloc.allocationSize  = 0;
-    mem_alloc.memoryTypeIndex = 0;
-    
     view_info.sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
     view_info.pNext                           = NULL;
     view_info.image                           = VK_NULL_HANDLE;
@@ -505,14 +781,7 @@ init_depth_buffer()
     }
     
     ASSERT_VK(vkCreateImage(data.device, &image_info, NULL, &data.depth.image));
-    
-    vkGetImageMemoryRequirements(data.device, data.depth.image, &mem_reqs);
-    
-    mem_alloc.allocationSize = mem_reqs.size;
-    
-    ASSERT(memory_type_from_properties(mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &mem_alloc.memoryTypeIndex));
-    ASSERT_VK(vkAllocateMemory(data.device, &mem_alloc, NULL, &data.depth.mem));
-    ASSERT_VK(vkBindImageMemory(data.device, data.depth.image, data.depth.mem, 0));
+    memory_bind_image(&data.allocator, data.depth.image, image_info.tiling == VK_IMAGE_TILING_LINEAR, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &data.depth.mem);
     
     view_info.image = data.depth.image;
     
@@ -520,11 +789,8 @@ init_depth_buffer()
 }
 
 static void
-init_uniform_buffer()
-{ 
-    VkBufferCreateInfo buf_info;
-    VkMemoryAllocateInfo alloc_info;
-    
+init_matrices()
+{
     vec3 eye    = { -5, 3, -10 };
     vec3 center = { 0, 0, 0 };
     vec3 up     = { 0, -1, 0 };
@@ -541,30 +807,40 @@ init_uniform_buffer()
     mat4x4_mul(data.mvp, data.clip, data.projection);
     mat4x4_mul(data.mvp, data.mvp, data.view);
     mat4x4_mul(data.mvp, data.mvp, data.model);
+}
+
+static void
+init_uniform_buffer()
+{ 
+    VkBufferCreateInfo buf_info;
+    VkDeviceSize alignment = data.gpu_props.limits.minUniformBufferOffsetAlignment;
+    
+    init_matrices();
+    
+    // NOTE: the alignment is a power of two
+    alignment = alignment ? alignment : 1;
+    data.uniform.stride = (sizeof(data.mvp) + alignment - 1) & ~(alignment - 1);
     
     buf_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     buf_info.pNext                 = NULL;
     buf_info.usage                 = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT;
-    buf_info.size                  = sizeof(data.mvp);
+    buf_info.size                  = data.uniform.stride * data.frames_in_flight;
     buf_info.queueFamilyIndexCount = 0;
     buf_info.pQueueFamilyIndices   = NULL;
     buf_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
     buf_info.flags                 = 0;
     
     ASSERT_VK(vkCreateBuffer(data.device, &buf_info, NULL, &data.uniform.buf));
+    memory_bind_buffer(&data.allocator, data.uniform.buf, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &data.uniform.mem);
     
-    vkGetBufferMemoryRequirements(data.device, data.uniform.buf, &data.umem_reqs);
-    
-    alloc_info.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.pNext           = NULL;
-    alloc_info.memoryTypeIndex = 0;
-    alloc_info.allocationSize  = data.umem_reqs.size;
-    
-    ASSERT(memory_type_from_properties(data.umem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &alloc_info.memoryTypeIndex));
-    ASSERT_VK(vkAllocateMemory(data.device, &alloc_info, NULL, &(data.uniform.mem)));
+    // NOTE: coherent memory, writes need no flush
+    data.ubuffer_data = data.uniform.mem.mapped;
     
-    update_uniform_data(data.umem_reqs.size);
+    for (u32 i = 0; i < data.frames_in_flight; ++i) {
+        memcpy(data.ubuffer_data + i * data.uniform.stride, data.mvp, sizeof(data.mvp));
+    }
     
+    // NOTE: the descriptor covers one slot, draw_cube picks the frame's with a dynamic offset
     data.uniform.buffer_info.buffer = data.uniform.buf;
     data.uniform.buffer_info.offset = 0;
     data.uniform.buffer_info.range  = sizeof(data.mvp);
@@ -578,7 +854,7 @@ init_pipeline_layout()
     VkPipelineLayoutCreateInfo pipeline_layout_create_info;
     
     layout_binding.binding            = 0;
-    layout_binding.descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    layout_binding.descriptorType     = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     layout_binding.descriptorCount    = 1;
     layout_binding.stageFlags         = VK_SHADER_STAGE_VERTEX_BIT;
     layout_binding.pImmutableSamplers = NULL;
@@ -617,7 +893,7 @@ init_render_pass()
     attachments[0].stencilLoadOp  = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
     attachments[0].initialLayout  = VK_IMAGE_LAYOUT_UNDEFINED;
-    attachments[0].finalLayout    = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    attachments[0].finalLayout    = data.headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
     attachments[0].flags          = 0;
     
     attachments[1].format         = data.depth.format;
@@ -663,11 +939,11 @@ static void
 init_shaders()
 {
     VkShaderModuleCreateInfo module_create_info;
-    u32 *vs_words, *fs_words;
-    u32 vs_size, fs_size;
+    const u32 *vs_words;
+    u32 *vs_file;
+    u32 vs_size;
     
-    vs_words = get_binary("shaders/sample.vert.spv", &vs_size);
-    fs_words = get_binary("shaders/sample.frag.spv", &fs_size);
+    ASSERT(vs_words = get_shader(data.instances ? INSTANCED_VERTEX_SHADER : VERTEX_SHADER, true, &vs_size, &vs_file));
     
     data.shader_stages[0].sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     data.shader_stages[0].pNext               = NULL;
@@ -683,6 +959,7 @@ init_shaders()
     module_create_info.pCode    = vs_words;
     
     ASSERT_VK(vkCreateShaderModule(data.device, &module_create_info, NULL, &data.shader_stages[0].module));
+    free(vs_file);
     
     data.shader_stages[1].sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
     data.shader_stages[1].pNext               = NULL;
@@ -690,14 +967,9 @@ init_shaders()
     data.shader_stages[1].flags               = 0;
     data.shader_stages[1].stage               = VK_SHADER_STAGE_FRAGMENT_BIT;
     data.shader_stages[1].pName               = "main";
+    data.shader_stages[1].module              = VK_NULL_HANDLE;
     
-    module_create_info.sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    module_create_info.pNext    = NULL;
-    module_create_info.flags    = 0;
-    module_create_info.codeSize = fs_size * sizeof(u32);
-    module_create_info.pCode    = fs_words;
-    
-    ASSERT_VK(vkCreateShaderModule(data.device, &module_create_info, NULL, &data.shader_stages[1].module));
+    load_fragment_shader();
 }
 
 static void
@@ -728,14 +1000,11 @@ init_framebuffers()
 static void
 init_vertex_buffer()
 {
-    u8 *vertex_data;
     VkBufferCreateInfo buf_info;
-    VkMemoryRequirements mem_reqs;
-    VkMemoryAllocateInfo alloc_info;
     
     buf_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     buf_info.pNext                 = NULL;
-    buf_info.usage                 = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    buf_info.usage                 = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
     buf_info.size                  = sizeof(g_vb_solid_face_colors_Data);
     buf_info.queueFamilyIndexCount = 0;
     buf_info.pQueueFamilyIndices   = NULL;
@@ -743,29 +1012,17 @@ init_vertex_buffer()
     buf_info.flags                 = 0;
     
     ASSERT_VK(vkCreateBuffer(data.device, &buf_info, NULL, &data.vertex.buf));
-    vkGetBufferMemoryRequirements(data.device, data.vertex.buf, &mem_reqs);
-    
-    alloc_info.sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.pNext           = NULL;
-    alloc_info.memoryTypeIndex = 0;
-    alloc_info.allocationSize  = mem_reqs.size;
+    memory_bind_buffer(&data.allocator, data.vertex.buf, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &data.vertex.mem);
     
-    ASSERT(memory_type_from_properties(mem_reqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &alloc_info.memoryTypeIndex));
-    
-    ASSERT_VK(vkAllocateMemory(data.device, &alloc_info, NULL, &(data.vertex.mem)));
-    
-    data.vertex.buffer_info.range  = mem_reqs.size;
+    data.vertex.buffer_info.range  = data.vertex.mem.size;
     data.vertex.buffer_info.offset = 0;
     
-    ASSERT_VK(vkMapMemory(data.device, data.vertex.mem, 0, mem_reqs.size, 0, (void **) &vertex_data));
+    // NOTE: streamed in before the first frame is submitted, the queue orders it ahead of the draws
+    data.vertex.upload = upload_buffer(data.vertex.buf, 0, g_vb_solid_face_colors_Data, sizeof(g_vb_solid_face_colors_Data));
     
-    memcpy(vertex_data, g_vb_solid_face_colors_Data, sizeof(g_vb_solid_face_colors_Data));
-    vkUnmapMemory(data.device, data.vertex.mem);
-    ASSERT_VK(vkBindBufferMemory(data.device, data.vertex.buf, data.vertex.mem, 0));
-    
-    data.vi_binding.binding   = 0;
-    data.vi_binding.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
-    data.vi_binding.stride    = sizeof(g_vb_solid_face_colors_Data[0]);
+    data.vi_bindings[0].binding   = 0;
+    data.vi_bindings[0].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+    data.vi_bindings[0].stride    = sizeof(g_vb_solid_face_colors_Data[0]);
     
     data.vi_attribs[0].binding  = 0;
     data.vi_attribs[0].location = 0;
@@ -778,6 +1035,155 @@ init_vertex_buffer()
     data.vi_attribs[1].offset   = 16;
 }
 
+// The instance ring is a single host visible allocation, one slot per frame in flight. It has to fit in
+// half of its heap and in maxMemoryAllocationSize, which a 1.0 instance cannot query, so the smallest
+// value the spec allows stands in for it.
+static u32
+max_instances()
+{
+    VkMemoryPropertyFlags flags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkDeviceSize limit = MAX_INSTANCE_ALLOCATION;
+    VkDeviceSize count;
+    
+    for (u32 i = 0; i < data.memory_properties.memoryTypeCount; ++i) {
+        if ((data.memory_properties.memoryTypes[i].propertyFlags & flags) == flags) {
+            VkDeviceSize heap = data.memory_properties.memoryHeaps[data.memory_properties.memoryTypes[i].heapIndex].size / 2;
+            limit = heap < limit ? heap : limit;
+            break;
+        }
+    }
+    
+    // NOTE: above MEMORY_BLOCK_SIZE the allocator rounds up to a power of two block
+    while (limit & (limit - 1)) {
+        limit &= limit - 1;
+    }
+    
+    count = limit / (sizeof(struct instance) * data.frames_in_flight);
+    
+    return(count > UINT32_MAX ? UINT32_MAX : (u32) count);
+}
+
+// The stress scene: instances on a cube grid that fits the single cube's place, each spinning at its own phase
+static void
+init_instance_buffer()
+{
+    VkBufferCreateInfo buf_info;
+    u32 side = 1;
+    
+    if (!data.instances) {
+        return;
+    }
+    
+    while ((u64) side * side * side < data.instances) {
+        side += 1;
+    }
+    
+    data.per_instance.stride = (VkDeviceSize) data.instances * sizeof(struct instance);
+    
+    buf_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buf_info.pNext                 = NULL;
+    buf_info.usage                 = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    buf_info.size                  = data.per_instance.stride * data.frames_in_flight;
+    buf_info.queueFamilyIndexCount = 0;
+    buf_info.pQueueFamilyIndices   = NULL;
+    buf_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
+    buf_info.flags                 = 0;
+    
+    ASSERT_VK(vkCreateBuffer(data.device, &buf_info, NULL, &data.per_instance.buf));
+    memory_bind_buffer(&data.allocator, data.per_instance.buf, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &data.per_instance.mem);
+    
+    // NOTE: mapped like the uniform ring, update_instances writes the current frame's slot
+    data.instance_data = (struct instance *) data.per_instance.mem.mapped;
+    ASSERT(data.instance_phases = malloc(2 * data.instances * sizeof(f32)));
+    
+    f32 cell = 4.0f / (f32) side;
+    f32 scale = 0.3f * cell;
+    
+    for (u32 i = 0; i < data.instances; ++i) {
+        struct instance inst;
+        u32 hash = i * 2654435761u;
+        
+        mat4x4_identity(inst.model);
+        inst.model[0][0] = inst.model[1][1] = inst.model[2][2] = scale;
+        inst.model[3][0] = -2.0f + cell * ((f32) (i % side) + 0.5f);
+        inst.model[3][1] = -2.0f + cell * ((f32) (i / side % side) + 0.5f);
+        inst.model[3][2] = -2.0f + cell * ((f32) (i / side / side) + 0.5f);
+        
+        inst.color[0] = 0.3f + 0.7f * (f32) ((hash >> 8) & 0xFF) / 255.0f;
+        inst.color[1] = 0.3f + 0.7f * (f32) ((hash >> 16) & 0xFF) / 255.0f;
+        inst.color[2] = 0.3f + 0.7f * (f32) ((hash >> 24) & 0xFF) / 255.0f;
+        inst.color[3] = 1.0f;
+        
+        // NOTE: colors and positions never change, every slot starts out complete
+        for (u32 f = 0; f < data.frames_in_flight; ++f) {
+            data.instance_data[f * data.instances + i] = inst;
+        }
+        
+        data.instance_phases[2 * i + 0] = cosf((f32) i * 0.1f);
+        data.instance_phases[2 * i + 1] = sinf((f32) i * 0.1f);
+    }
+    
+    data.vi_bindings[1].binding   = 1;
+    data.vi_bindings[1].inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+    data.vi_bindings[1].stride    = sizeof(struct instance);
+    
+    // NOTE: the model matrix takes four locations, one per column
+    for (u32 c = 0; c < 5; ++c) {
+        data.vi_attribs[2 + c].binding  = 1;
+        data.vi_attribs[2 + c].location = 2 + c;
+        data.vi_attribs[2 + c].format   = VK_FORMAT_R32G32B32A32_SFLOAT;
+        data.vi_attribs[2 + c].offset   = c * sizeof(vec4);
+    }
+    
+    printf("[SCENE] %u instances on a %u^3 grid, %.1f MiB of instance data per frame\n",
+           data.instances, side, (f64) data.per_instance.stride / (1 << 20));
+}
+
+// Rotates every instance about its own Y axis, only the upper 3x3 of its model matrix changes
+static void
+update_instances()
+{
+    struct instance *slot = data.instance_data + (u64) data.current_frame * data.instances;
+    f32 scale = slot[0].model[1][1];
+    f32 c = cosf(data.scene_time * 4.0f) * scale;
+    f32 s = sinf(data.scene_time * 4.0f) * scale;
+    
+    for (u32 i = 0; i < data.instances; ++i) {
+        // NOTE: the angle sum from the phase, no sine or cosine per instance
+        f32 pc = data.instance_phases[2 * i + 0];
+        f32 ps = data.instance_phases[2 * i + 1];
+        f32 rc = c * pc - s * ps;
+        f32 rs = s * pc + c * ps;
+        
+        slot[i].model[0][0] = rc;
+        slot[i].model[0][2] = -rs;
+        slot[i].model[2][0] = rs;
+        slot[i].model[2][2] = rc;
+    }
+}
+
+// Throughput over the frames the pacer still has samples of
+static void
+scene_report(FILE *out)
+{
+    f64 frame_msec = pacer_mean(&pacer);
+    f64 cpu_msec = 0.0;
+    
+    if (!data.instances || frame_msec <= 0.0) {
+        return;
+    }
+    
+    for (u32 s = 0; s < TRACE_SCOPES; ++s) {
+        if (s != TRACE_FENCE && s != TRACE_RECORD && !trace_is_gpu(s)) {
+            cpu_msec += trace_mean(&trace, s);
+        }
+    }
+    
+    fprintf(out, "[SCENE] %u instances, %.2f M instances/s, %.2f M vertices/s, %.3f ms frame, %.3f ms CPU per frame (%.3f ms instance update)\n",
+            data.instances, data.instances / frame_msec / 1000.0, 36.0 * data.instances / frame_msec / 1000.0,
+            frame_msec, cpu_msec, trace_mean(&trace, TRACE_INSTANCES));
+}
+
 static void
 init_descriptor_poolset()
 {
@@ -786,7 +1192,7 @@ init_descriptor_poolset()
     VkDescriptorSetAllocateInfo alloc_info[1];
     VkDescriptorPoolCreateInfo descriptor_pool;
     
-    type_count[0].type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    type_count[0].type            = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     type_count[0].descriptorCount = 1;
     
     descriptor_pool.sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
@@ -809,7 +1215,7 @@ init_descriptor_poolset()
     writes[0].pNext           = NULL;
     writes[0].dstSet          = data.descriptor_set[0];
     writes[0].descriptorCount = 1;
-    writes[0].descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    writes[0].descriptorType  = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     writes[0].pBufferInfo     = &data.uniform.buffer_info;
     writes[0].dstArrayElement = 0;
     writes[0].dstBinding      = 0;
@@ -847,9 +1253,9 @@ init_pipeline()
     vi.sType                           = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
     vi.pNext                           = NULL;
     vi.flags                           = 0;
-    vi.vertexBindingDescriptionCount   = 1;
-    vi.pVertexBindingDescriptions      = &data.vi_binding;
-    vi.vertexAttributeDescriptionCount = 2;
+    vi.vertexBindingDescriptionCount   = data.instances ? 2 : 1;
+    vi.pVertexBindingDescriptions      = data.vi_bindings;
+    vi.vertexAttributeDescriptionCount = data.instances ? NUM_VERT_ATTRIBUTES : 2;
     vi.pVertexAttributeDescriptions    = data.vi_attribs;
     
     ia.sType                  = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
@@ -958,20 +1364,26 @@ init_pipeline()
     ASSERT_VK(vkEndCommandBuffer(data.command_buffer));
 } // End of init pipeline
 
+// Only called between frames, the old pipeline goes once no frame in flight uses it
 static void
-draw_cube()
+rebuild_pipeline()
+{
+    VkPipeline old = data.pipeline;
+    
+    init_pipeline();
+    
+    wait_frames_in_flight();
+    vkDestroyPipeline(data.device, old, NULL);
+    
+    data.commands_dirty = true;
+}
+
+static void
+record_commands(VkCommandBuffer cmd, u32 image, u32 frame)
 {
-    VkSemaphore  image_acquired_semaphore;
-    VkSemaphoreCreateInfo  image_acquired_semaphore_create_info;
     VkRenderPassBeginInfo rp_begin;
-    VkFenceCreateInfo fence_info;
-    VkFence draw_fence;
-    VkPipelineStageFlags pipe_stage_flags;
-    VkPresentInfoKHR present;
     VkClearValue clear_values[2];
-    const VkDeviceSize offsets[1] = { 0 };
-    const VkCommandBuffer cmd_bufs[1] = { data.command_buffer };
-    VkSubmitInfo submit_info[1];
+    VkCommandBuffer secondaries[MAX_RECORD_THREADS];
     
     clear_values[0].color.float32[0]     = 0.0f;
     clear_values[0].color.float32[1]     = 0.0f;
@@ -980,17 +1392,10 @@ draw_cube()
     clear_values[1].depthStencil.depth   = 1.0f;
     clear_values[1].depthStencil.stencil = 0;
     
-    image_acquired_semaphore_create_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    image_acquired_semaphore_create_info.pNext = NULL;
-    image_acquired_semaphore_create_info.flags = 0;
-    
-    ASSERT_VK(vkCreateSemaphore(data.device, & image_acquired_semaphore_create_info, NULL, & image_acquired_semaphore));
-    ASSERT_VK(vkAcquireNextImageKHR(data.device, data.swapchain, UINT64_MAX,  image_acquired_semaphore, VK_NULL_HANDLE, &data.current_buffer));
-    
     rp_begin.sType                    = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
     rp_begin.pNext                    = NULL;
     rp_begin.renderPass               = data.render_pass;
-    rp_begin.framebuffer              = data.framebuffers[data.current_buffer];
+    rp_begin.framebuffer              = data.framebuffers[image];
     rp_begin.renderArea.offset.x      = 0;
     rp_begin.renderArea.offset.y      = 0;
     rp_begin.renderArea.extent.width  = data.width;
@@ -998,85 +1403,323 @@ draw_cube()
     rp_begin.clearValueCount          = 2;
     rp_begin.pClearValues             = clear_values;
     
-    ASSERT_VK(vkBeginCommandBuffer(data.command_buffer, &data.cmd_buf_info));
+    ASSERT_VK(vkBeginCommandBuffer(cmd, &data.cmd_buf_info));
     
-    vkCmdBeginRenderPass(data.command_buffer, &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
-    vkCmdBindPipeline(data.command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, data.pipeline);
-    vkCmdBindDescriptorSets(data.command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, data.pipeline_layout, 0, NUM_DESCRIPTOR_SETS, data.descriptor_set, 0, NULL);
-    vkCmdBindVertexBuffers(data.command_buffer, 0, 1, &data.vertex.buf, offsets);
+    if (data.timestamp_pool) {
+        vkCmdResetQueryPool(cmd, data.timestamp_pool, 2 * frame, 2);
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, data.timestamp_pool, 2 * frame);
+    }
     
-    data.viewport.height   = (f32) data.height;
-    data.viewport.width    = (f32) data.width;
-    data.viewport.minDepth = 0.0f;
-    data.viewport.maxDepth = 1.0f;
-    data.viewport.x        = 0;
-    data.viewport.y        = 0;
+    // NOTE: with record threads the draws are in their secondaries, otherwise inline
+    if (record_jobs.threads) {
+        vkCmdBeginRenderPass(cmd, &rp_begin, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+        vkCmdExecuteCommands(cmd, record_jobs_secondaries(image, frame, secondaries), secondaries);
+    } else {
+        vkCmdBeginRenderPass(cmd, &rp_begin, VK_SUBPASS_CONTENTS_INLINE);
+        record_draws(cmd, frame, 0, draw_count());
+    }
     
-    data.scissor.extent.width  = data.width;
-    data.scissor.extent.height = data.height;
-    data.scissor.offset.x      = 0;
-    data.scissor.offset.y      = 0;
+    vkCmdEndRenderPass(cmd);
     
-    vkCmdSetViewport(data.command_buffer, 0, NUM_VIEWPORTS, &data.viewport);
-    vkCmdSetScissor(data.command_buffer, 0, NUM_SCISSORS, &data.scissor);
+    if (data.timestamp_pool) {
+        vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, data.timestamp_pool, 2 * frame + 1);
+    }
     
-    vkCmdDraw(data.command_buffer, 12 * 3, 1, 0, 0);
-    vkCmdEndRenderPass(data.command_buffer);
+    ASSERT_VK(vkEndCommandBuffer(cmd));
+}
+
+// Re-records every command buffer once something they bake in changed (the pipeline, the framebuffers, the scene)
+static void
+record_all_commands()
+{
+    u64 beg = pacer_now();
     
-    ASSERT_VK(vkEndCommandBuffer(data.command_buffer));
+    // NOTE: a pending command buffer cannot be recorded
+    wait_frames_in_flight();
     
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.pNext = NULL;
-    fence_info.flags = 0;
+    if (record_jobs.threads) {
+        record_jobs_run(RECORD_ALL, RECORD_ALL);
+    }
+    
+    for (u32 f = 0; f < data.frames_in_flight; ++f) {
+        for (u32 i = 0; i < data.swapchain_image_count; ++i) {
+            record_commands(data.frames[f].command_buffers[i], i, f);
+        }
+    }
+    
+    data.commands_dirty = false;
+    beg = trace_end(&trace, TRACE_RECORD, beg) - beg;
+    
+    printf("[RECORD] %u command buffers in %.3f ms\n", data.frames_in_flight * data.swapchain_image_count, (f64) beg / 1000000.0);
+    record_jobs_report(stdout);
+}
+
+// Re-records the command buffer a frame is about to submit, only once the frame's fence signaled
+static void
+record_frame_commands(u32 image, u32 frame)
+{
+    if (record_jobs.threads) {
+        record_jobs_run(image, frame);
+    }
+    
+    record_commands(data.frames[frame].command_buffers[image], image, frame);
+}
+
+// Submits the prerecorded commands for the next frame in flight, the CPU only waits when that frame is still on the GPU
+static void
+draw_cube()
+{
+    struct frame *frame = &data.frames[data.current_frame];
+    VkCommandBuffer cmd;
+    VkPipelineStageFlags pipe_stage_flags;
+    VkPresentInfoKHR present;
+    VkSubmitInfo submit_info[1];
+    bool recorded = data.commands_dirty;
+    u64 t;
+    
+    if (data.commands_dirty) {
+        record_all_commands();
+    }
+    
+    t = pacer_now();
+    wait_fence(frame->fence);
+    t = trace_end(&trace, TRACE_FENCE, t);
+    
+    resolve_timestamps(frame);
+    
+    t = pacer_now();
+    update_uniform_data();
+    t = trace_end(&trace, TRACE_UNIFORM, t);
+    
+    if (data.instances) {
+        update_instances();
+        t = trace_end(&trace, TRACE_INSTANCES, t);
+    }
+    
+    upload_pump();
+    t = trace_end(&trace, TRACE_UPLOAD, t);
+    
+    if (data.headless) {
+        data.current_buffer = (data.current_buffer + 1) % data.swapchain_image_count;
+    } else {
+        ASSERT_VK(vkAcquireNextImageKHR(data.device, data.swapchain, UINT64_MAX, frame->image_acquired, VK_NULL_HANDLE, &data.current_buffer));
+    }
+    
+    t = trace_end(&trace, TRACE_ACQUIRE, t);
+    
+    // NOTE: the image can come back while an older frame still renders to it
+    if (data.image_fences[data.current_buffer] && data.image_fences[data.current_buffer] != frame->fence) {
+        wait_fence(data.image_fences[data.current_buffer]);
+        t = trace_end(&trace, TRACE_FENCE, t);
+    }
+    
+    data.image_fences[data.current_buffer] = frame->fence;
+    
+    // NOTE: the command buffer was last submitted with this frame's fence, the other frames keep running
+    if (record_every_frame && !recorded) {
+        record_frame_commands(data.current_buffer, data.current_frame);
+        t = trace_end(&trace, TRACE_RECORD, t);
+    }
+    
+    ASSERT_VK(vkResetFences(data.device, 1, &frame->fence));
     
-    vkCreateFence(data.device, &fence_info, NULL, &draw_fence);
+    cmd = frame->command_buffers[data.current_buffer];
     
     pipe_stage_flags = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
     
     submit_info[0].pNext                = NULL;
     submit_info[0].sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     submit_info[0].waitSemaphoreCount   = 1;
-    submit_info[0].pWaitSemaphores      = &image_acquired_semaphore; 
+    submit_info[0].pWaitSemaphores      = &frame->image_acquired;
     submit_info[0].pWaitDstStageMask    = &pipe_stage_flags;
     submit_info[0].commandBufferCount   = 1;
-    submit_info[0].pCommandBuffers      = cmd_bufs;
-    submit_info[0].signalSemaphoreCount = 0;
-    submit_info[0].pSignalSemaphores    = NULL;
+    submit_info[0].pCommandBuffers      = &cmd;
+    submit_info[0].signalSemaphoreCount = 1;
+    submit_info[0].pSignalSemaphores    = &frame->render_complete;
+    
+    // NOTE: offscreen nothing is acquired or presented, the fence alone orders the frames
+    if (data.headless) {
+        submit_info[0].waitSemaphoreCount   = 0;
+        submit_info[0].signalSemaphoreCount = 0;
+    }
+    
+    ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, submit_info, frame->fence));
     
-    ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, submit_info, draw_fence));
+    frame->submitted = t;
+    frame->traced_frame = trace.frame;
+    frame->queries_pending = data.timestamp_pool != VK_NULL_HANDLE;
+    t = trace_end(&trace, TRACE_SUBMIT, t);
     
     present.sType              = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
     present.pNext              = NULL;
     present.swapchainCount     = 1;
     present.pSwapchains        = &data.swapchain;
     present.pImageIndices      = &data.current_buffer;
-    present.pWaitSemaphores    = NULL;
-    present.waitSemaphoreCount = 0;
+    present.pWaitSemaphores    = &frame->render_complete;
+    present.waitSemaphoreCount = 1;
     present.pResults           = NULL;
     
-    {
-        VkResult res;
-        do {
-            res = vkWaitForFences(data.device, 1, &draw_fence, VK_TRUE, FENCE_TIMEOUT);
-        } while (res == VK_TIMEOUT);
-        ASSERT_VK(res);
+    if (!data.headless) {
+        ASSERT_VK(vkQueuePresentKHR(data.present_queue, &present));
+        trace_end(&trace, TRACE_PRESENT, t);
+    }
+    
+    data.current_frame = (data.current_frame + 1) % data.frames_in_flight;
+    trace.frame += 1;
+}
+
+// Copies the last rendered offscreen image to the host. PPM for a .ppm path, the raw RGBA8 rows otherwise.
+static bool
+readback_image(const char *path)
+{
+    VkBufferCreateInfo buf_info;
+    VkFenceCreateInfo fence_info;
+    VkBufferImageCopy region;
+    VkImageMemoryBarrier image_barrier;
+    VkBufferMemoryBarrier buffer_barrier;
+    VkSubmitInfo submit_info;
+    VkBuffer buffer;
+    struct memory_allocation memory;
+    VkFence fence;
+    const u8 *pixels;
+    u64 size = (u64) data.width * data.height * 4;
+    u32 length = strlen(path);
+    bool ppm = length > 4 && !strcmp(path + length - 4, ".ppm");
+    FILE *file;
+    
+    wait_frames_in_flight();
+    
+    // NOTE: frames submitted before the vertex data landed draw nothing of the cube
+    if (!upload_done(data.vertex.upload)) {
+        printf("[READBACK] vertex data still streaming, the image is incomplete\n");
+    }
+    
+    buf_info.sType                 = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    buf_info.pNext                 = NULL;
+    buf_info.usage                 = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    buf_info.size                  = size;
+    buf_info.queueFamilyIndexCount = 0;
+    buf_info.pQueueFamilyIndices   = NULL;
+    buf_info.sharingMode           = VK_SHARING_MODE_EXCLUSIVE;
+    buf_info.flags                 = 0;
+    
+    ASSERT_VK(vkCreateBuffer(data.device, &buf_info, NULL, &buffer));
+    memory_bind_buffer(&data.allocator, buffer, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memory);
+    
+    // NOTE: the render pass leaves the image in TRANSFER_SRC_OPTIMAL, the fence wait alone does not make its writes visible to the copy
+    image_barrier.sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    image_barrier.pNext                           = NULL;
+    image_barrier.srcAccessMask                   = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    image_barrier.dstAccessMask                   = VK_ACCESS_TRANSFER_READ_BIT;
+    image_barrier.oldLayout                       = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.newLayout                       = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    image_barrier.srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED;
+    image_barrier.image                           = data.swapchain_images[data.current_buffer];
+    image_barrier.subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+    image_barrier.subresourceRange.baseMipLevel   = 0;
+    image_barrier.subresourceRange.levelCount     = 1;
+    image_barrier.subresourceRange.baseArrayLayer = 0;
+    image_barrier.subresourceRange.layerCount     = 1;
+    
+    buffer_barrier.sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    buffer_barrier.pNext               = NULL;
+    buffer_barrier.srcAccessMask       = VK_ACCESS_TRANSFER_WRITE_BIT;
+    buffer_barrier.dstAccessMask       = VK_ACCESS_HOST_READ_BIT;
+    buffer_barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    buffer_barrier.buffer              = buffer;
+    buffer_barrier.offset              = 0;
+    buffer_barrier.size                = VK_WHOLE_SIZE;
+    
+    region.bufferOffset                    = 0;
+    region.bufferRowLength                 = 0;
+    region.bufferImageHeight               = 0;
+    region.imageSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel       = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount     = 1;
+    region.imageOffset.x                   = 0;
+    region.imageOffset.y                   = 0;
+    region.imageOffset.z                   = 0;
+    region.imageExtent.width               = data.width;
+    region.imageExtent.height              = data.height;
+    region.imageExtent.depth               = 1;
+    
+    ASSERT_VK(vkResetCommandBuffer(data.command_buffer, 0));
+    ASSERT_VK(vkBeginCommandBuffer(data.command_buffer, &data.cmd_buf_info));
+    vkCmdPipelineBarrier(data.command_buffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0, 0, NULL, 0, NULL, 1, &image_barrier);
+    vkCmdCopyImageToBuffer(data.command_buffer, data.swapchain_images[data.current_buffer], VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, buffer, 1, &region);
+    vkCmdPipelineBarrier(data.command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+                         0, 0, NULL, 1, &buffer_barrier, 0, NULL);
+    ASSERT_VK(vkEndCommandBuffer(data.command_buffer));
+    
+    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    fence_info.pNext = NULL;
+    fence_info.flags = 0;
+    
+    ASSERT_VK(vkCreateFence(data.device, &fence_info, NULL, &fence));
+    
+    submit_info.sType                = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext                = NULL;
+    submit_info.waitSemaphoreCount   = 0;
+    submit_info.pWaitSemaphores      = NULL;
+    submit_info.pWaitDstStageMask    = NULL;
+    submit_info.commandBufferCount   = 1;
+    submit_info.pCommandBuffers      = &data.command_buffer;
+    submit_info.signalSemaphoreCount = 0;
+    submit_info.pSignalSemaphores    = NULL;
+    
+    ASSERT_VK(vkQueueSubmit(data.graphics_queue, 1, &submit_info, fence));
+    wait_fence(fence);
+    vkDestroyFence(data.device, fence, NULL);
+    
+    pixels = memory.mapped;
+    
+    if ((file = fopen(path, "wb"))) {
+        if (ppm) {
+            fprintf(file, "P6\n%u %u\n255\n", data.width, data.height);
+            
+            for (u64 i = 0; i < size; i += 4) {
+                fwrite(pixels + i, 1, 3, file);
+            }
+        } else {
+            fwrite(pixels, 1, size, file);
+        }
+        
+        fclose(file);
+        printf("[READBACK] %ux%u %s written to %s\n", data.width, data.height, ppm ? "PPM" : "RGBA8", path);
+    } else {
+        printf("[ERROR] Could not open %s\n", path);
     }
     
-    ASSERT_VK(vkQueuePresentKHR(data.present_queue, &present));
+    vkDestroyBuffer(data.device, buffer, NULL);
+    memory_free(&data.allocator, &memory);
     
-    vkDestroySemaphore(data.device, image_acquired_semaphore, NULL);
-    vkDestroyFence(data.device, draw_fence, NULL);
+    return(file != NULL);
 }
 
 static void
 destroy()
 {
+    wait_frames_in_flight();
+    
+    record_jobs_free();
+    upload_free();
+    
     vkDestroyPipeline(data.device, data.pipeline, NULL);
     
     vkDestroyDescriptorPool(data.device, data.descriptor_pool, NULL);
     
     vkDestroyBuffer(data.device, data.vertex.buf, NULL);
-    vkFreeMemory(data.device, data.vertex.mem, NULL);
+    memory_free(&data.allocator, &data.vertex.mem);
+    
+    if (data.instances) {
+        vkDestroyBuffer(data.device, data.per_instance.buf, NULL);
+        memory_free(&data.allocator, &data.per_instance.mem);
+        free(data.instance_phases);
+    }
     
     for (u32 i = 0; i < data.swapchain_image_count; ++i) {
         vkDestroyFramebuffer(data.device, data.framebuffers[i], NULL);
@@ -1085,6 +1728,9 @@ destroy()
     vkDestroyShaderModule(data.device, data.shader_stages[0].module, NULL);
     vkDestroyShaderModule(data.device, data.shader_stages[1].module, NULL);
     
+    incremental_free(&fs_cache);
+    archive_close(&shader_archive);
+    
     vkDestroyRenderPass(data.device, data.render_pass, NULL);
     
     for (int i = 0; i < NUM_DESCRIPTOR_SETS; ++i) {
@@ -1094,27 +1740,56 @@ destroy()
     vkDestroyPipelineLayout(data.device, data.pipeline_layout, NULL);
     
     vkDestroyBuffer(data.device, data.uniform.buf, NULL);
-    vkFreeMemory(data.device, data.uniform.mem, NULL);
+    memory_free(&data.allocator, &data.uniform.mem);
     
     vkDestroyImageView(data.device, data.depth.view, NULL);
     vkDestroyImage(data.device, data.depth.image, NULL);
-    vkFreeMemory(data.device, data.depth.mem, NULL);
+    memory_free(&data.allocator, &data.depth.mem);
     
     for (u32 i = 0; i < data.swapchain_image_count; ++i) {
         vkDestroyImageView(data.device, data.buffers[i].view, NULL);
     }
     
-    vkDestroySwapchainKHR(data.device, data.swapchain, NULL);
+    if (data.headless) {
+        for (u32 i = 0; i < data.swapchain_image_count; ++i) {
+            vkDestroyImage(data.device, data.swapchain_images[i], NULL);
+            memory_free(&data.allocator, &data.offscreen_memory[i]);
+        }
+        
+        free(data.offscreen_memory);
+    } else {
+        vkDestroySwapchainKHR(data.device, data.swapchain, NULL);
+    }
+    
+    for (u32 i = 0; i < data.frames_in_flight; ++i) {
+        vkDestroySemaphore(data.device, data.frames[i].image_acquired, NULL);
+        vkDestroySemaphore(data.device, data.frames[i].render_complete, NULL);
+        vkDestroyFence(data.device, data.frames[i].fence, NULL);
+        vkFreeCommandBuffers(data.device, data.cbp, data.swapchain_image_count, data.frames[i].command_buffers);
+        free(data.frames[i].command_buffers);
+    }
+    
+    if (data.timestamp_pool) {
+        vkDestroyQueryPool(data.device, data.timestamp_pool, NULL);
+    }
+    
+    trace_free(&trace);
+    
+    free(data.image_fences);
     
     vkFreeCommandBuffers(data.device, data.cbp, 1, &data.command_buffer);
     vkDestroyCommandPool(data.device, data.cbp, NULL);
     
+    memory_destroy(&data.allocator);
+    
     vkDeviceWaitIdle(data.device);
     vkDestroyDevice(data.device, NULL);
     
-    vkDestroySurfaceKHR(data.instance, data.surface, NULL);
-    xcb_destroy_window(data.connection, data.window);
-    xcb_disconnect(data.connection);
+    if (!data.headless) {
+        vkDestroySurfaceKHR(data.instance, data.surface, NULL);
+        xcb_destroy_window(data.connection, data.window);
+        xcb_disconnect(data.connection);
+    }
     
     vkDestroyInstance(data.instance, NULL); 
 }